@@ -39,7 +39,8 @@ struct patch_t
 		patch[0] = 0;
 		bytes = 0;
 	}
-	unsigned char patch[20];
+	/* Room for a 14 byte absolute jump plus the tail of the instruction it overwrites */
+	unsigned char patch[32];
 	size_t bytes;
 };
 
@@ -53,52 +54,80 @@ inline void SetMemExec(void *address, size_t size)
 	SetMemAccess(address, size, SH_MEM_READ|SH_MEM_EXEC);
 }
 
+/* Writes a jmp rel32 into buffer, as it should appear at target */
+inline size_t WriteRelJump32(unsigned char *buffer, unsigned char *target, void *callback)
+{
+	buffer[0] = IA32_JMP_IMM32;
+	*(int32_t *)(&buffer[1]) = int32_t((unsigned char *)callback - (target + 5));
+
+	return 5;
+}
+
+/*
+ * Writes jmp [rip+0] followed by the address. push/ret would be shorter for addresses
+ * below 4GB, but the ret leaves the return stack buffer off by one for the whole call stack.
+ */
+inline size_t WriteAbsJump64(unsigned char *buffer, void *callback)
+{
+	buffer[0] = IA32_JMP_RM;
+	buffer[1] = ia32_modrm(MOD_MEM_REG, 4, REG_EBP);
+	*(int32_t *)(&buffer[2]) = 0;
+	*(uint64_t *)(&buffer[6]) = uint64_t(callback);
+
+	return 14;
+}
+
+/* Writes mov r11, imm64; jmp r11. Only valid where r11 is free, like at function entry */
+inline size_t WriteAbsJumpR11(unsigned char *buffer, void *callback)
+{
+	buffer[0] = X64_REX_PREFIX | 0x08 | (REG_R11 >> 3);
+	buffer[1] = IA32_MOV_REG_IMM + (REG_R11 & 7);
+	*(uint64_t *)(&buffer[2]) = uint64_t(callback);
+	buffer[10] = X64_REX_PREFIX | (REG_R11 >> 3);
+	buffer[11] = IA32_JMP_RM;
+	buffer[12] = ia32_modrm(MOD_REG, 4, REG_R11 & 7);
+
+	return 13;
+}
+
 inline void PatchRelJump32(unsigned char *target, void *callback)
 {
 	SetMemPatchable(target, 5);
-
-	target[0] = IA32_JMP_IMM32;
-	*(int32_t *)(&target[1]) = int32_t((unsigned char *)callback - (target + 5));
-	
+	WriteRelJump32(target, target, callback);
 	SetMemExec(target, 5);
 }
 
 inline void PatchAbsJump64(unsigned char *target, void *callback)
 {
-	int i = 0;
 	SetMemPatchable(target, 14);
-	
-	target[i++] = IA32_PUSH_IMM32;
-	*(int32_t *)(&target[i]) = int32_t(int64_t(callback));
-	i += 4;
-	if ((int64_t(callback) >> 32) != 0)
-	{
-		target[i++] = IA32_MOV_RM_IMM32;
-		target[i++] = ia32_modrm(MOD_DISP8, 0, REG_SIB);
-		target[i++] = ia32_sib(NOSCALE, REG_NOIDX, REG_ESP);
-		target[i++] = 0x04;
-		*(int32_t *)(&target[i]) = (int64_t(callback) >> 32);
-		i += 4;
-	}
-	target[i] = IA32_RET;
-	
+	WriteAbsJump64(target, callback);
 	SetMemExec(target, 14);	
 }
 
-inline void DoGatePatch(unsigned char *target, void *callback)
+/* Builds the jump from target to callback without writing it */
+inline void GenerateGatePatch(unsigned char *target, void *callback, patch_t *patch)
 {
 #if defined(_WIN64) || defined(__x86_64__)
-	int64_t diff = int64_t(target) - int64_t(callback) + 5;
-	int32_t upperBits = (diff >> 32);
-	if (upperBits == 0 || upperBits == -1)
-		PatchRelJump32(target, callback);
+	int64_t diff = int64_t(callback) - int64_t(target + 5);
+	if (diff == int32_t(diff))
+		patch->bytes = WriteRelJump32(patch->patch, target, callback);
 	else
-		PatchAbsJump64(target, callback);
+		patch->bytes = WriteAbsJumpR11(patch->patch, callback);
 #else
-	PatchRelJump32(target, callback);
+	patch->bytes = WriteRelJump32(patch->patch, target, callback);
 #endif
 }
 
+inline void DoGatePatch(unsigned char *target, void *callback)
+{
+	patch_t patch;
+	GenerateGatePatch(target, callback, &patch);
+
+	SetMemPatchable(target, patch.bytes);
+	memcpy(target, patch.patch, patch.bytes);
+	SetMemExec(target, patch.bytes);
+}
+
 inline void ApplyPatch(void *address, int offset, const patch_t *patch, patch_t *restore)
 {
 	SetMemPatchable(address, sizeof(patch->patch));
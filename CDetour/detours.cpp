@@ -30,7 +30,9 @@
 */
 
 #include "detours.h"
+#include "threadfreezer.h"
 #include <asm/asm.h>
+#include <stdio.h>
 
 CPageAlloc GenBuffer::ms_Allocator(16);
 
@@ -41,18 +43,43 @@ static inline void RelativeJump32(GenBuffer &codegen, void *target)
 }
 
 #if defined(_WIN64) || defined(__x86_64__)
-static inline bool IsShortJump(GenBuffer &codegen, void *target)
+/* Checks if a rel32 jump ending at from can reach target */
+static inline bool IsShortJump(const void *from, const void *target)
 {
-	int64_t diff = int64_t(target) - int64_t(codegen.GetData()) + codegen.get_outputpos() + 5;
-	int32_t upperBits = (diff >> 32);
-	return upperBits == 0 || upperBits == -1;
+	int64_t diff = int64_t(target) - int64_t(from);
+	return diff == int32_t(diff);
 }
 #endif
 
+/*
+ * Replaces code with a single locked store so that no thread can see a partial write.
+ * Only possible when the bytes lie within one aligned 8-byte block.
+ */
+static bool AtomicCodeWrite(unsigned char *address, const unsigned char *bytes, size_t length)
+{
+	uintptr_t offs = uintptr_t(address) & 7;
+	if (offs + length > 8)
+		return false;
+
+	uint64_t *block = (uint64_t *)(address - offs);
+	uint64_t oldValue, newValue;
+
+	SetMemPatchable(block, sizeof(*block));
+	do
+	{
+		oldValue = *(volatile uint64_t *)block;
+		newValue = oldValue;
+		memcpy((unsigned char *)&newValue + offs, bytes, length);
+	} while (!__sync_bool_compare_and_swap(block, oldValue, newValue));
+	SetMemExec(block, sizeof(*block));
+
+	return true;
+}
+
 static inline void AbsJump(GenBuffer &codegen, void *target)
 {
 #if defined(_WIN64) || defined(__x86_64__)
-	if (IsShortJump(codegen, target))
+	if (IsShortJump(codegen.GetData() + codegen.get_outputpos() + OP_JMP_SIZE, target))
 		RelativeJump32(codegen, target);
 	else
 		X64_Jump_Abs(&codegen, target);
@@ -82,8 +109,12 @@ CDetour::CDetour(void *callbackfunction, void **trampoline)
 {
 	enabled = false;
 	detoured = false;
+	live_mode = false;
+	pad_patched = false;
+	pad_installed = false;
 	detour_address = NULL;
 	detour_trampoline = NULL;
+	detour_gate = NULL;
 	this->detour_callback = callbackfunction;
 	this->trampoline = trampoline;
 }
@@ -105,7 +136,10 @@ bool CDetour::Init(void *addr)
 
 void CDetour::Destroy(bool undoPatch)
 {
+	/* The gate must be out before the trampoline that the callback calls is freed */
 	if (undoPatch)
+		DisableDetour();
+	else
 		detoured = false;
 
 	DeleteDetour();
@@ -129,32 +163,70 @@ bool CDetour::CreateDetour()
 		return false;
 	}
 	
+	unsigned char *start = (unsigned char *)detour_address;
+
+	/*
+	 * Keep the trampoline within rel32 range of the function, so it can jump back with a short
+	 * jump and relocated code doesn't have to be rewritten into longer forms. The relocated code
+	 * depends on its own address too, so the buffer must not move until everything is written:
+	 * the relocated bytes, the jump back and maybe a relay to the callback.
+	 */
+	codegen.SetNear(start);
+
+	int maxBytes = copy_bytes(start, NULL, X64_ABS_SIZE);
+	jitoffs_t maxSize = relocate_bound(start, maxBytes) + X64_ABS_SIZE * 2;
+	codegen.reserve(maxSize);
+
 	int requiredSize = OP_JMP_SIZE;
-	
+	bool useRelay = false;
+
+	detour_gate = detour_callback;
+
 #if defined(_WIN64) || defined(__x86_64__)
-	if (!IsShortJump(codegen, detour_address))
-		requiredSize = X64_ABS_SIZE;
+	/* If the callback is too far away, the gate can still be short by going through a relay next to the trampoline */
+	if (!IsShortJump(start + OP_JMP_SIZE, detour_callback))
+	{
+		if (IsShortJump(start + OP_JMP_SIZE, codegen.GetData()) && IsShortJump(start + OP_JMP_SIZE, codegen.GetData() + maxSize))
+			useRelay = true;
+		else
+			requiredSize = X64_ABS_SIZE;
+	}
 #endif
 	
 	/*
 	 * Determine how many bytes to save from target function.
 	 * We want 5 for our detour jmp, but it could require more.
 	 */
-	detour_restore.bytes = copy_bytes((unsigned char *)detour_address, NULL, requiredSize);
+	detour_restore.bytes = copy_bytes(start, NULL, requiredSize);
 	
 	/* First, save restore bits */
-	memcpy(detour_restore.patch, (unsigned char *)detour_address, detour_restore.bytes);
+	memcpy(detour_restore.patch, start, detour_restore.bytes);
 	
 	/* Patch old bytes in */
-	codegen.alloc(detour_restore.bytes);
-	copy_bytes((unsigned char *)detour_address, codegen.GetData(), detour_restore.bytes);
+	memset(detour_offsets, 0xFF, sizeof(detour_offsets));
+	int written = relocate_code(start, detour_restore.bytes, codegen.GetWritableData(), codegen.GetData(), detour_offsets);
+	if (written < 0)
+	{
+		printf("Failed to relocate the first %d bytes of the function at %p\n", (int)detour_restore.bytes, detour_address);
+		codegen.clear();
+		return false;
+	}
+
+	codegen.alloc(written);
 	
 	/* Return to the original function */
-	AbsJump(codegen, (unsigned char *)detour_address + detour_restore.bytes);
+	AbsJump(codegen, start + detour_restore.bytes);
+
+	if (useRelay)
+	{
+		detour_gate = codegen.GetData() + codegen.get_outputpos();
+		X64_Jump_Abs_R11(&codegen, detour_callback);
+	}
 
 	codegen.SetRE();
 
-	*trampoline = codegen.GetData();
+	detour_trampoline = codegen.GetData();
+	*trampoline = detour_trampoline;
 
 	return true;
 }
@@ -178,8 +250,8 @@ void CDetour::EnableDetour()
 {
 	if (!detoured)
 	{
-		DoGatePatch((unsigned char *)detour_address, detour_callback);
-		detoured = true;
+		CDetour *detour = this;
+		CDetourManager::EnableDetours(&detour, 1);
 	}
 }
 
@@ -187,8 +259,244 @@ void CDetour::DisableDetour()
 {
 	if (detoured)
 	{
-		/* Remove the patch */
-		ApplyPatch(detour_address, 0, &detour_restore, NULL);
+		CDetour *detour = this;
+		CDetourManager::DisableDetours(&detour, 1);
+	}
+}
+
+void CDetour::SetLiveMode(bool live)
+{
+	live_mode = live;
+}
+
+bool CDetour::IsLiveMode()
+{
+	return live_mode;
+}
+
+bool CDetour::EnableLive()
+{
+	unsigned char *target = (unsigned char *)detour_address;
+	patch_t gate;
+
+	GenerateGatePatch(target, detour_gate, &gate);
+
+	/* No thread can be stopped in the middle of the gate if the first instruction covers all of it */
+	if (copy_bytes(target, NULL, 1) >= (int)gate.bytes && AtomicCodeWrite(target, gate.patch, gate.bytes))
+	{
+		detoured = true;
+		return true;
+	}
+
+	if (EnableHotPatch())
+	{
+		pad_patched = true;
+		detoured = true;
+		return true;
+	}
+
+	/*
+	 * Otherwise stop everything else while the full gate is written. Nothing here may allocate
+	 * memory, since a stopped thread could be holding the malloc lock.
+	 */
+	CThreadFreezer freezer;
+	if (!freezer.Freeze())
+		return false;
+
+	SetMemPatchable(target, gate.bytes);
+	memcpy(target, gate.patch, gate.bytes);
+	SetMemExec(target, gate.bytes);
+
+	/* Threads stopped inside the overwritten prologue continue from the same instruction in the trampoline */
+	IPFixup fixups[sizeof(detour_restore.patch)];
+	size_t count = 0;
+	for (size_t i = 1; i < detour_restore.bytes; i++)
+	{
+		if (detour_offsets[i] == 0xFF)
+			continue;
+
+		fixups[count].start = uintptr_t(target) + i;
+		fixups[count].size = 1;
+		fixups[count].target = uintptr_t(detour_trampoline) + detour_offsets[i];
+		count++;
+	}
+	freezer.Thaw(fixups, count);
+
+	detoured = true;
+	return true;
+}
+
+bool CDetour::EnableHotPatch()
+{
+	unsigned char *target = (unsigned char *)detour_address;
+	unsigned char *pad = target - OP_JMP_SIZE;
+
+	/* Don't touch the previous page, which might not be mapped */
+	if ((uintptr_t(target) & (PAGESIZE - 1)) < OP_JMP_SIZE)
+		return false;
+
+	/* The short jump must replace exactly one whole instruction */
+	if (copy_bytes(target, NULL, 1) < 2)
+		return false;
+
+#if defined(_WIN64) || defined(__x86_64__)
+	if (!IsShortJump(pad + OP_JMP_SIZE, detour_gate))
+		return false;
+#endif
+
+	if (!pad_installed)
+	{
+		for (int i = 0; i < OP_JMP_SIZE; i++)
+		{
+			if (pad[i] != IA32_INT3 && pad[i] != IA32_NOP)
+				return false;
+		}
+	}
+
+	/* Check this before writing the pad, since it can't be undone */
+	if ((uintptr_t(target) & 7) == 7)
+		return false;
+
+	if (!pad_installed)
+	{
+		/* Nothing executes the padding, so the long jump can be written normally */
+		patch_t jump;
+		jump.bytes = WriteRelJump32(jump.patch, pad, detour_gate);
+
+		SetMemPatchable(pad, jump.bytes);
+		memcpy(pad, jump.patch, jump.bytes);
+		SetMemExec(pad, jump.bytes);
+
+		pad_installed = true;
+	}
+
+	const unsigned char shortJump[2] = {IA32_JMP_IMM8, (unsigned char)-(OP_JMP_SIZE + 2)};
+	return AtomicCodeWrite(target, shortJump, sizeof(shortJump));
+}
+
+bool CDetour::DisableLive()
+{
+	unsigned char *target = (unsigned char *)detour_address;
+
+	/* The jump in the padding is left in place, since it is harmless */
+	if (pad_patched)
+	{
+		if (!AtomicCodeWrite(target, detour_restore.patch, 2))
+			return false;
+
+		pad_patched = false;
 		detoured = false;
+		return true;
 	}
+
+	patch_t gate;
+	GenerateGatePatch(target, detour_gate, &gate);
+
+	/*
+	 * Threads in the trampoline are unaffected, since it stays valid. A rel32 gate is a single
+	 * instruction, so a thread can only be at its start, where the restored prologue is correct.
+	 */
+	if (!AtomicCodeWrite(target, detour_restore.patch, gate.bytes))
+	{
+		CThreadFreezer freezer;
+		if (!freezer.Freeze())
+			return false;
+
+		SetMemPatchable(target, detour_restore.bytes);
+		memcpy(target, detour_restore.patch, detour_restore.bytes);
+		SetMemExec(target, detour_restore.bytes);
+
+		/*
+		 * The r11 gate is mov r11, imm64 followed by jmp r11. A thread stopped on the jmp already
+		 * has the gate address in r11 and would otherwise resume in the middle of the prologue, so
+		 * send it straight to the gate.
+		 */
+		IPFixup fixup;
+		fixup.start = uintptr_t(target) + 10;
+		fixup.size = 1;
+		fixup.target = uintptr_t(detour_gate);
+		freezer.Thaw(&fixup, gate.bytes > OP_JMP_SIZE ? 1 : 0);
+	}
+
+	detoured = false;
+	return true;
+}
+
+bool CDetourManager::EnableDetours(CDetour **detours, size_t count)
+{
+	CCodePatchLock lock;
+	CPatchTransaction txn;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		CDetour *detour = detours[i];
+		if (!detour || detour->detoured || detour->live_mode)
+			continue;
+
+		patch_t gate;
+		GenerateGatePatch((unsigned char *)detour->detour_address, detour->detour_gate, &gate);
+
+		if (!txn.AddPatch(detour->detour_address, &gate))
+			return false;
+	}
+
+	if (!txn.Commit())
+		return false;
+
+	bool success = true;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		CDetour *detour = detours[i];
+		if (!detour || detour->detoured)
+			continue;
+
+		if (!detour->live_mode)
+			detour->detoured = true;
+		else if (!detour->EnableLive())
+			success = false;
+	}
+
+	return success;
+}
+
+bool CDetourManager::DisableDetours(CDetour **detours, size_t count)
+{
+	CCodePatchLock lock;
+	CPatchTransaction txn;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		CDetour *detour = detours[i];
+		if (!detour || !detour->detoured || detour->live_mode)
+			continue;
+
+		/* Remove the patch */
+		if (!txn.AddPatch(detour->detour_address, &detour->detour_restore))
+			return false;
+	}
+
+	if (!txn.Commit())
+		return false;
+
+	bool success = true;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		CDetour *detour = detours[i];
+		if (!detour || !detour->detoured)
+			continue;
+
+		if (!detour->live_mode)
+		{
+			detour->detoured = false;
+			detour->pad_patched = false;
+		}
+		else if (!detour->DisableLive())
+		{
+			success = false;
+		}
+	}
+
+	return success;
 }
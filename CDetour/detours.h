@@ -32,6 +32,7 @@
 
 #include <sh_include.h>
 #include "detourhelpers.h"
+#include "patchtxn.h"
 
 /**
  * CDetours class for SourceMod Extensions by pRED*
@@ -141,9 +142,27 @@ public:
 	void EnableDetour();
 	void DisableDetour();
 
+	/**
+	 * In live mode, enabling and disabling is safe while other threads may be running the
+	 * detoured function. The cheapest of these methods is used:
+	 *
+	 * 1. If the whole gate fits in one aligned 8-byte block and the first instruction covers all
+	 *    of it, the gate is written with a single atomic store.
+	 * 2. If there are at least 5 bytes of int3/nop padding before the function, a long jump is
+	 *    written there and a 2-byte short jump to it is stored atomically over the first instruction.
+	 * 3. Otherwise all other threads are stopped while the gate is written, and any that stopped
+	 *    inside the overwritten prologue are moved to the same place in the trampoline.
+	 */
+	void SetLiveMode(bool live);
+	bool IsLiveMode();
+
 	void *GetTargetAddr();
 	void SetTargetAddr(void *addr);
 
+	/**
+	 * Takes the gate out, frees the trampoline and deletes the detour. undoPatch can only be
+	 * false if the function's code is already gone, e.g. its library has been unloaded.
+	 */
 	void Destroy(bool undoPatch = true);
 
 	friend class CDetourManager;
@@ -158,16 +177,29 @@ private:
 	bool CreateDetour();
 	void DeleteDetour();
 
+	bool EnableLive();
+	bool EnableHotPatch();
+	bool DisableLive();
+
 	bool enabled;
 	bool detoured;
+	bool live_mode;
+	/* Detour is enabled by a short jump into the padding before the function */
+	bool pad_patched;
+	/* Padding before the function holds a jump to the callback */
+	bool pad_installed;
 
 	patch_t detour_restore;
+	/* Trampoline offset of each instruction start in detour_restore, 0xFF elsewhere */
+	unsigned char detour_offsets[sizeof(patch_t::patch) + 1];
 	/* Address of the detoured function */
 	void *detour_address;
 	/* Address of the allocated trampoline function */
 	void *detour_trampoline;
 	/* Address of the callback handler */
 	void *detour_callback;
+	/* Where the gate jumps to, either the callback or a relay to it */
+	void *detour_gate;
 	/* The function pointer used to call our trampoline */
 	void **trampoline;
 	
@@ -229,6 +261,18 @@ public:
 	 */
 	static CDetour *CreateDetour(void *callbackfunction, void **trampoline, void *addr);
 
+	/**
+	 * Enables or disables a group of detours with a single patch transaction.
+	 * If any patch fails, none of the detours are changed. Detours in live mode
+	 * are patched one at a time once the rest have been committed.
+	 *
+	 * @param detours					Array of detours. NULL entries are skipped.
+	 * @param count						Number of entries in the array.
+	 * @return							True on success, false otherwise.
+	 */
+	static bool EnableDetours(CDetour **detours, size_t count);
+	static bool DisableDetours(CDetour **detours, size_t count);
+
 	friend class CDetour;
 };
 
@@ -0,0 +1,680 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dispatcher.h"
+#include "stubgen.h"
+#include "threadfreezer.h"
+#include "vtablehook.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Calls through dispatchers that a thread can have pending post hooks for at once */
+#define DISPATCH_MAX_DEPTH		32
+
+/* Hook lists one thread can be reading at once, i.e. hooks recursing into hooked functions */
+#define DISPATCH_MAX_READERS	16
+
+struct DetourHook
+{
+	DetourCallback pre;
+	DetourCallback post;
+	void *param;
+	int id;
+};
+
+struct DetourHookList
+{
+	size_t count;
+	bool hasPost;
+	bool reading;				/* Scratch for CDetourDispatcher::Reclaim */
+	DetourHook hooks[1];
+};
+
+struct DispatchFrame
+{
+	CDetourDispatcher *dispatcher;
+	DetourContext ctx;
+};
+
+/*
+ * Per-thread dispatch state. Records are never freed, only handed to a new thread once the
+ * one using them exits, so Reclaim can walk the list while other threads are stopped.
+ */
+struct DispatchThread
+{
+	DispatchThread *next;
+	volatile bool inUse;
+	DetourHookList *volatile reading[DISPATCH_MAX_READERS];
+	volatile size_t readers;
+	size_t depth;
+	DispatchFrame frames[DISPATCH_MAX_DEPTH];
+};
+
+/*
+ * Dispatchers by hooked address, or by vtable entry for those hooking one. Open addressing with
+ * linear probing, kept at most half full.
+ */
+struct DispatcherEntry
+{
+	const void *key;
+	CDetourDispatcher *dispatcher;
+};
+
+static DispatcherEntry *g_Dispatchers = NULL;
+static size_t g_DispatcherCount = 0;
+static size_t g_DispatcherMask = 0;
+static pthread_mutex_t g_DispatchLock = PTHREAD_MUTEX_INITIALIZER;
+static int g_NextHookId = 0;
+
+static pthread_once_t g_ThreadKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ThreadKey;
+static pthread_mutex_t g_ThreadLock = PTHREAD_MUTEX_INITIALIZER;
+static DispatchThread *volatile g_Threads = NULL;
+
+static inline size_t HashKey(const void *key)
+{
+	uintptr_t value = reinterpret_cast<uintptr_t>(key);
+
+	/* Functions and vtables are aligned, so mix the high bits down */
+	value ^= value >> 16;
+	value *= 0x45D9F3B;
+	value ^= value >> 16;
+
+	return value;
+}
+
+static CDetourDispatcher *LookupDispatcher(const void *key)
+{
+	if (!g_Dispatchers)
+		return NULL;
+
+	for (size_t i = HashKey(key) & g_DispatcherMask; g_Dispatchers[i].key; i = (i + 1) & g_DispatcherMask)
+	{
+		if (g_Dispatchers[i].key == key)
+			return g_Dispatchers[i].dispatcher;
+	}
+
+	return NULL;
+}
+
+static bool InsertDispatcher(const void *key, CDetourDispatcher *dispatcher)
+{
+	if ((g_DispatcherCount + 1) * 2 > g_DispatcherMask + 1)
+	{
+		size_t size = g_Dispatchers ? (g_DispatcherMask + 1) * 2 : 16;
+		DispatcherEntry *entries = reinterpret_cast<DispatcherEntry *>(calloc(size, sizeof(DispatcherEntry)));
+		if (!entries)
+			return false;
+
+		DispatcherEntry *old = g_Dispatchers;
+		size_t oldSize = old ? g_DispatcherMask + 1 : 0;
+
+		g_Dispatchers = entries;
+		g_DispatcherMask = size - 1;
+
+		for (size_t i = 0; i < oldSize; i++)
+		{
+			if (!old[i].key)
+				continue;
+
+			size_t j = HashKey(old[i].key) & g_DispatcherMask;
+			while (g_Dispatchers[j].key)
+				j = (j + 1) & g_DispatcherMask;
+			g_Dispatchers[j] = old[i];
+		}
+
+		free(old);
+	}
+
+	size_t i = HashKey(key) & g_DispatcherMask;
+	while (g_Dispatchers[i].key)
+		i = (i + 1) & g_DispatcherMask;
+
+	g_Dispatchers[i].key = key;
+	g_Dispatchers[i].dispatcher = dispatcher;
+	g_DispatcherCount++;
+
+	return true;
+}
+
+static void RemoveDispatcher(const void *key)
+{
+	size_t i = HashKey(key) & g_DispatcherMask;
+
+	while (g_Dispatchers[i].key != key)
+	{
+		if (!g_Dispatchers[i].key)
+			return;
+		i = (i + 1) & g_DispatcherMask;
+	}
+
+	/* Move later entries of the same run back, so lookups never stop at the hole */
+	for (size_t j = (i + 1) & g_DispatcherMask; g_Dispatchers[j].key; j = (j + 1) & g_DispatcherMask)
+	{
+		size_t home = HashKey(g_Dispatchers[j].key) & g_DispatcherMask;
+
+		if (((j - home) & g_DispatcherMask) >= ((j - i) & g_DispatcherMask))
+		{
+			g_Dispatchers[i] = g_Dispatchers[j];
+			i = j;
+		}
+	}
+
+	g_Dispatchers[i].key = NULL;
+	g_Dispatchers[i].dispatcher = NULL;
+	g_DispatcherCount--;
+}
+
+static void ReleaseThread(void *value)
+{
+	DispatchThread *thread = reinterpret_cast<DispatchThread *>(value);
+
+	thread->readers = 0;
+	thread->depth = 0;
+	thread->inUse = false;
+}
+
+static void CreateThreadKey()
+{
+	pthread_key_create(&g_ThreadKey, ReleaseThread);
+}
+
+static DispatchThread *GetThread()
+{
+	DispatchThread *thread = reinterpret_cast<DispatchThread *>(pthread_getspecific(g_ThreadKey));
+	if (thread)
+		return thread;
+
+	pthread_mutex_lock(&g_ThreadLock);
+
+	for (thread = g_Threads; thread; thread = thread->next)
+	{
+		if (!thread->inUse)
+			break;
+	}
+
+	if (!thread)
+	{
+		thread = reinterpret_cast<DispatchThread *>(calloc(1, sizeof(DispatchThread)));
+		if (thread)
+		{
+			thread->next = g_Threads;
+			g_Threads = thread;
+		}
+	}
+
+	if (thread)
+	{
+		thread->inUse = true;
+		pthread_setspecific(g_ThreadKey, thread);
+	}
+
+	pthread_mutex_unlock(&g_ThreadLock);
+
+	return thread;
+}
+
+/*
+ * Publishes which hook list this thread is about to use, then checks that it is still current.
+ * Only a compiler barrier is needed: Reclaim looks at the slots with this thread stopped, which
+ * makes its stores visible, and a list replaced before that is seen again by the recheck.
+ */
+static inline DetourHookList *BeginRead(DispatchThread *thread, DetourHookList *volatile *current)
+{
+	size_t slot = thread->readers;
+	DetourHookList *hooks;
+
+	if (slot == DISPATCH_MAX_READERS)
+		return NULL;
+
+	do
+	{
+		hooks = *current;
+		if (!hooks)
+			return NULL;
+
+		thread->reading[slot] = hooks;
+		thread->readers = slot + 1;
+		__asm__ __volatile__("" ::: "memory");
+	} while (*current != hooks);
+
+	return hooks;
+}
+
+static inline void EndRead(DispatchThread *thread)
+{
+	thread->readers--;
+}
+
+static inline void RunHooks(const DetourHookList *hooks, DetourContext *ctx, bool post)
+{
+	for (size_t i = 0; i < hooks->count; i++)
+	{
+		const DetourHook &hook = hooks->hooks[i];
+		DetourCallback callback = post ? hook.post : hook.pre;
+
+		if (callback)
+		{
+			DetourResult result = callback(ctx, hook.param);
+			if (result > ctx->status)
+				ctx->status = result;
+		}
+	}
+}
+
+static bool PushFrame(DispatchThread *thread, CDetourDispatcher *dispatcher, const DetourContext *ctx)
+{
+	/* Anything deeper than this call was left without returning through the entry stub */
+	while (thread->depth && thread->frames[thread->depth - 1].ctx.stack < ctx->stack)
+		thread->depth--;
+
+	if (thread->depth == DISPATCH_MAX_DEPTH)
+		return false;
+
+	DispatchFrame &frame = thread->frames[thread->depth++];
+	frame.dispatcher = dispatcher;
+	frame.ctx = *ctx;
+
+	return true;
+}
+
+static DetourHookList *AllocHookList(size_t count)
+{
+	size_t size = offsetof(DetourHookList, hooks) + count * sizeof(DetourHook);
+	DetourHookList *hooks = reinterpret_cast<DetourHookList *>(malloc(size));
+
+	if (hooks)
+	{
+		hooks->count = count;
+		hooks->hasPost = false;
+		hooks->reading = false;
+	}
+
+	return hooks;
+}
+
+CDetourDispatcher::CDetourDispatcher(void *addr, void **slot, unsigned int flags) : m_Address(addr),
+	m_Flags(flags), m_Original(NULL), m_Hooks(NULL), m_Detour(NULL), m_Slot(slot), m_VTableHook(NULL)
+{
+}
+
+CDetourDispatcher::~CDetourDispatcher()
+{
+	if (m_Detour)
+	{
+		m_Detour->DisableDetour();
+		m_Detour->Destroy();
+	}
+
+	if (m_VTableHook)
+		m_VTableHook->Destroy();
+
+	free(m_Hooks);
+
+	for (size_t i = 0; i < m_Retired.length(); i++)
+		free(m_Retired[i]);
+}
+
+bool CDetourDispatcher::Init()
+{
+	GenBuffer *jit = &m_Entry;
+
+	GenerateEntryStub(jit, DispatchPre, DispatchPost, this, &m_Original, (m_Flags & Dispatch_FloatReturn) != 0);
+
+	if (!jit->GetData())
+		return false;
+
+	jit->SetRE();
+
+	/* Nothing is hooked yet */
+	SetEntryStubBypass(jit, true);
+
+	if (m_Slot)
+	{
+		m_VTableHook = CVTableHook::CreateSlotHook(m_Slot, 0, jit->GetData(), &m_Original);
+		return m_VTableHook && m_VTableHook->Enable();
+	}
+
+	m_Detour = CDetourManager::CreateDetour(jit->GetData(), &m_Original, m_Address);
+	if (!m_Detour)
+		return false;
+
+	m_Detour->EnableDetour();
+
+	return true;
+}
+
+/* Must be called with g_DispatchLock held, which it releases */
+CDetourDispatcher *CDetourDispatcher::Create(void *addr, void **slot, unsigned int flags)
+{
+	CDetourDispatcher *dispatcher = new CDetourDispatcher(addr, slot, flags);
+	if (!dispatcher->Init() || !InsertDispatcher(dispatcher->GetKey(), dispatcher))
+	{
+		pthread_mutex_unlock(&g_DispatchLock);
+		printf("Failed to create dispatcher for function at %p\n", addr);
+		delete dispatcher;
+		return NULL;
+	}
+
+	pthread_mutex_unlock(&g_DispatchLock);
+
+	return dispatcher;
+}
+
+CDetourDispatcher *CDetourDispatcher::Attach(void *addr, unsigned int flags)
+{
+	pthread_once(&g_ThreadKeyOnce, CreateThreadKey);
+	pthread_mutex_lock(&g_DispatchLock);
+
+	CDetourDispatcher *dispatcher = LookupDispatcher(addr);
+	if (dispatcher)
+	{
+		pthread_mutex_unlock(&g_DispatchLock);
+
+		if (dispatcher->m_Flags != flags)
+		{
+			printf("Function at %p is already dispatched with different flags\n", addr);
+			return NULL;
+		}
+
+		return dispatcher;
+	}
+
+	return Create(addr, NULL, flags);
+}
+
+CDetourDispatcher *CDetourDispatcher::AttachVTable(void **vtable, int index, unsigned int flags)
+{
+	void **slot = &vtable[index];
+
+	pthread_once(&g_ThreadKeyOnce, CreateThreadKey);
+	pthread_mutex_lock(&g_DispatchLock);
+
+	CDetourDispatcher *dispatcher = LookupDispatcher(slot);
+	if (dispatcher)
+	{
+		pthread_mutex_unlock(&g_DispatchLock);
+
+		if (dispatcher->m_Flags != flags)
+		{
+			printf("Vtable entry at %p is already dispatched with different flags\n", slot);
+			return NULL;
+		}
+
+		return dispatcher;
+	}
+
+	return Create(*slot, slot, flags);
+}
+
+CDetourDispatcher *CDetourDispatcher::Find(void *addr)
+{
+	pthread_mutex_lock(&g_DispatchLock);
+	CDetourDispatcher *found = LookupDispatcher(addr);
+	pthread_mutex_unlock(&g_DispatchLock);
+
+	return found;
+}
+
+int CDetourDispatcher::AddHook(DetourCallback pre, DetourCallback post, void *param)
+{
+	if (!pre && !post)
+		return 0;
+
+	pthread_mutex_lock(&g_DispatchLock);
+
+	DetourHookList *old = m_Hooks;
+	size_t count = old ? old->count : 0;
+	DetourHookList *hooks = AllocHookList(count + 1);
+
+	if (!hooks)
+	{
+		pthread_mutex_unlock(&g_DispatchLock);
+		return 0;
+	}
+
+	if (old)
+	{
+		memcpy(hooks->hooks, old->hooks, count * sizeof(DetourHook));
+		hooks->hasPost = old->hasPost;
+	}
+
+	DetourHook &hook = hooks->hooks[count];
+	hook.pre = pre;
+	hook.post = post;
+	hook.param = param;
+	hook.id = ++g_NextHookId;
+	hooks->hasPost |= post != NULL;
+
+	int id = hook.id;
+	SwapHooks(hooks);
+
+	pthread_mutex_unlock(&g_DispatchLock);
+
+	return id;
+}
+
+bool CDetourDispatcher::RemoveHook(int id)
+{
+	pthread_mutex_lock(&g_DispatchLock);
+
+	DetourHookList *old = m_Hooks;
+	size_t count = old ? old->count : 0;
+	size_t index;
+
+	for (index = 0; index < count; index++)
+	{
+		if (old->hooks[index].id == id)
+			break;
+	}
+
+	if (index == count)
+	{
+		pthread_mutex_unlock(&g_DispatchLock);
+		return false;
+	}
+
+	DetourHookList *hooks = NULL;
+
+	if (count > 1)
+	{
+		hooks = AllocHookList(count - 1);
+		if (!hooks)
+		{
+			pthread_mutex_unlock(&g_DispatchLock);
+			return false;
+		}
+
+		for (size_t i = 0, j = 0; i < count; i++)
+		{
+			if (i == index)
+				continue;
+
+			hooks->hooks[j++] = old->hooks[i];
+			hooks->hasPost |= old->hooks[i].post != NULL;
+		}
+	}
+
+	SwapHooks(hooks);
+
+	pthread_mutex_unlock(&g_DispatchLock);
+
+	return true;
+}
+
+size_t CDetourDispatcher::GetHookCount()
+{
+	DetourHookList *hooks = m_Hooks;
+	return hooks ? hooks->count : 0;
+}
+
+void *CDetourDispatcher::GetOriginal()
+{
+	return m_Original;
+}
+
+void *CDetourDispatcher::GetTargetAddr()
+{
+	return m_Address;
+}
+
+void CDetourDispatcher::Destroy()
+{
+	pthread_mutex_lock(&g_DispatchLock);
+	RemoveDispatcher(GetKey());
+	pthread_mutex_unlock(&g_DispatchLock);
+
+	delete this;
+}
+
+void CDetourDispatcher::SwapHooks(DetourHookList *hooks)
+{
+	DetourHookList *old = __sync_lock_test_and_set(&m_Hooks, hooks);
+
+	/* Without hooks, calls go straight to the original */
+	if (!hooks || !old)
+		SetEntryStubBypass(&m_Entry, !hooks);
+
+	if (old)
+		m_Retired.append(old);
+
+	Reclaim();
+}
+
+/*
+ * Frees replaced hook lists that no thread is reading. Lists still in use stay retired until
+ * the next change.
+ */
+void CDetourDispatcher::Reclaim()
+{
+	if (m_Retired.empty())
+		return;
+
+	CThreadFreezer freezer;
+	if (!freezer.Freeze())
+		return;
+
+	/* Nothing may be allocated or freed until the other threads run again */
+	for (size_t n = 0; n < m_Retired.length(); n++)
+	{
+		DetourHookList *hooks = m_Retired[n];
+		hooks->reading = false;
+
+		for (DispatchThread *thread = g_Threads; thread && !hooks->reading; thread = thread->next)
+		{
+			for (size_t i = 0; i < thread->readers; i++)
+			{
+				if (thread->reading[i] == hooks)
+				{
+					hooks->reading = true;
+					break;
+				}
+			}
+		}
+	}
+
+	freezer.Thaw();
+
+	size_t kept = 0;
+	for (size_t n = 0; n < m_Retired.length(); n++)
+	{
+		if (m_Retired[n]->reading)
+			m_Retired[kept++] = m_Retired[n];
+		else
+			free(m_Retired[n]);
+	}
+
+	while (m_Retired.length() > kept)
+		m_Retired.pop();
+}
+
+int CDetourDispatcher::DispatchPre(void *param, DetourContext *ctx)
+{
+	CDetourDispatcher *dispatcher = reinterpret_cast<CDetourDispatcher *>(param);
+	DispatchThread *thread = GetThread();
+	if (!thread)
+		return Stub_Original;
+
+	DetourHookList *hooks = BeginRead(thread, &dispatcher->m_Hooks);
+	if (!hooks)
+		return Stub_Original;
+
+	int action = Stub_Original;
+
+	ctx->status = Detour_Ignored;
+	memset(&ctx->ret, 0, sizeof(ctx->ret));
+
+	RunHooks(hooks, ctx, false);
+
+	if (ctx->status == Detour_Supercede)
+	{
+		ctx->origRet = ctx->ret;
+		if (hooks->hasPost)
+			RunHooks(hooks, ctx, true);
+		action = Stub_Supercede;
+	}
+	else if ((hooks->hasPost || ctx->status == Detour_Override) && PushFrame(thread, dispatcher, ctx))
+	{
+		action = Stub_Return;
+	}
+
+	EndRead(thread);
+
+	return action;
+}
+
+void *CDetourDispatcher::DispatchPost(DetourReturn *regs, uintptr_t *sp)
+{
+	DispatchThread *thread = reinterpret_cast<DispatchThread *>(pthread_getspecific(g_ThreadKey));
+
+	if (!thread || !thread->depth)
+	{
+		printf("Dispatcher returned from a call with none pending\n");
+		abort();
+	}
+
+	/* Skip calls that were left by longjmp or an exception */
+	while (thread->depth > 1 && thread->frames[thread->depth - 1].ctx.stack < sp - STUB_POP_SLACK)
+		thread->depth--;
+
+	DispatchFrame *frame = &thread->frames[thread->depth - 1];
+	DetourContext *ctx = &frame->ctx;
+
+	ctx->origRet = *regs;
+	if (ctx->status < Detour_Override)
+		ctx->ret = *regs;
+
+	DetourHookList *hooks = BeginRead(thread, &frame->dispatcher->m_Hooks);
+	if (hooks)
+	{
+		if (hooks->hasPost)
+			RunHooks(hooks, ctx, true);
+		EndRead(thread);
+	}
+
+	*regs = ctx->ret;
+	thread->depth--;
+
+	return ctx->returnAddress;
+}
@@ -0,0 +1,368 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef _INCLUDE_SRCDS_OSX_DISPATCHER_H_
+#define _INCLUDE_SRCDS_OSX_DISPATCHER_H_
+
+#include "detours.h"
+#include "am-vector.h"
+
+enum DetourResult
+{
+	Detour_Ignored = 0,		/* Hook did nothing that matters */
+	Detour_Override,		/* Call the original, but return ctx->ret instead of its value */
+	Detour_Supercede		/* Skip the original and return ctx->ret */
+};
+
+/* Return value registers */
+struct DetourReturn
+{
+#if defined(__x86_64__)
+	uint64_t gpr[2];		/* rax, rdx */
+	uint64_t xmm[2][2];		/* xmm0, xmm1 */
+#else
+	uint32_t gpr[2];		/* eax, edx */
+	double fpu;				/* st0, only kept for dispatchers created with Dispatch_FloatReturn */
+#endif
+};
+
+/**
+ * State of one call through a dispatcher, as seen by its hooks.
+ *
+ * Pre hooks may change the arguments, which the original then receives. Any hook returning
+ * Detour_Override or Detour_Supercede must also set ret.
+ */
+struct DetourContext
+{
+#if defined(__x86_64__)
+	uint64_t gpr[8];		/* rdi, rsi, rdx, rcx, r8, r9, then rax and r10 */
+	uint64_t xmm[8][2];		/* xmm0-xmm7 */
+#else
+	uint32_t gpr[3];		/* eax, ecx, edx */
+#endif
+	uintptr_t *stack;		/* First argument passed on the stack */
+	void *returnAddress;
+	DetourReturn ret;		/* What will be returned */
+	DetourReturn origRet;	/* What the original returned, only valid in post hooks */
+	DetourResult status;	/* Highest result returned by a hook so far */
+
+	/* Integer or pointer argument by position, counting this for member functions */
+	uintptr_t GetArg(size_t index) const
+	{
+#if defined(__x86_64__)
+		if (index < 6)
+			return gpr[index];
+		return stack[index - 6];
+#else
+		return stack[index];
+#endif
+	}
+
+	void SetArg(size_t index, uintptr_t value)
+	{
+#if defined(__x86_64__)
+		if (index < 6)
+			gpr[index] = value;
+		else
+			stack[index - 6] = value;
+#else
+		stack[index] = value;
+#endif
+	}
+};
+
+/* Class of an eightbyte of a structure passed by value, as the System V AMD64 ABI defines it */
+enum DetourArgClass
+{
+	ArgClass_Integer = 0,	/* Passed in a general purpose register */
+	ArgClass_SSE			/* Passed in the low half of an xmm register */
+};
+
+/**
+ * Walks the arguments of a call in order, for hooks that know the prototype.
+ *
+ * On x86-64 this follows the System V AMD64 ABI: integer and pointer arguments take the next of
+ * rdi, rsi, rdx, rcx, r8 and r9, float and double arguments the next of xmm0-xmm7, and arguments
+ * left without a register go on the stack in order, 8 bytes each. Structures of up to 16 bytes
+ * are passed as one or two of those eightbytes and are read with NextStruct, or NextPair when
+ * both are integers. Either all of a structure's eightbytes get registers or none do, so a
+ * structure that doesn't fit goes on the stack whole, and later arguments can still take the
+ * registers it left. Larger structures are copied onto the stack and read with NextMemory,
+ * while objects that can't be copied trivially are passed as a pointer.
+ *
+ * On x86-32 every argument is on the stack, and doubles take two slots.
+ *
+ * Functions returning a structure in memory take a pointer to it before any other argument,
+ * this included, and return that pointer. A hook superseding such a function writes to
+ * GetReturnBuffer() and sets ret.gpr[0] to it.
+ */
+class DetourArgs
+{
+public:
+	DetourArgs(DetourContext *ctx, bool memoryReturn = false) : m_Ctx(ctx), m_Gpr(0), m_Xmm(0), m_Stack(0),
+		m_ReturnBuffer(NULL)
+	{
+		if (memoryReturn)
+			m_ReturnBuffer = reinterpret_cast<void *>(*NextInt());
+	}
+
+	/* Integer or pointer argument */
+	uintptr_t *NextInt()
+	{
+#if defined(__x86_64__)
+		if (m_Gpr < 6)
+			return &m_Ctx->gpr[m_Gpr++];
+#endif
+		return &m_Ctx->stack[m_Stack++];
+	}
+
+	double *NextDouble()
+	{
+#if defined(__x86_64__)
+		if (m_Xmm < 8)
+			return reinterpret_cast<double *>(m_Ctx->xmm[m_Xmm++]);
+#endif
+		return reinterpret_cast<double *>(NextMemory(sizeof(double)));
+	}
+
+	float *NextFloat()
+	{
+#if defined(__x86_64__)
+		if (m_Xmm < 8)
+			return reinterpret_cast<float *>(m_Ctx->xmm[m_Xmm++]);
+#endif
+		return reinterpret_cast<float *>(NextMemory(sizeof(float)));
+	}
+
+	/* Structure of two integer eightbytes, or __int128. Returns both, which are always adjacent */
+	uintptr_t *NextPair(size_t align = sizeof(uintptr_t))
+	{
+#if defined(__x86_64__)
+		if (m_Gpr + 2 <= 6)
+		{
+			uintptr_t *arg = &m_Ctx->gpr[m_Gpr];
+			m_Gpr += 2;
+			return arg;
+		}
+#endif
+		return reinterpret_cast<uintptr_t *>(NextMemory(2 * sizeof(uint64_t), align));
+	}
+
+	/**
+	 * Structure passed by value, given the class of each of its eightbytes.
+	 *
+	 * @param size		Size of the structure.
+	 * @param classes	Class of each eightbyte, only read for structures of up to 16 bytes.
+	 * @param parts		Receives where each eightbyte is. On the stack they are adjacent, so
+	 *					parts[0] points to the whole structure.
+	 * @param align		Alignment of the structure.
+	 * @return			True if it was passed in registers.
+	 */
+	bool NextStruct(size_t size, const DetourArgClass *classes, void **parts,
+		size_t align = sizeof(uintptr_t))
+	{
+		size_t count = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+#if defined(__x86_64__)
+		if (count <= 2)
+		{
+			size_t gprs = 0, xmms = 0;
+			for (size_t i = 0; i < count; i++)
+			{
+				if (classes[i] == ArgClass_SSE)
+					xmms++;
+				else
+					gprs++;
+			}
+
+			if (m_Gpr + gprs <= 6 && m_Xmm + xmms <= 8)
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					if (classes[i] == ArgClass_SSE)
+						parts[i] = m_Ctx->xmm[m_Xmm++];
+					else
+						parts[i] = &m_Ctx->gpr[m_Gpr++];
+				}
+				return true;
+			}
+		}
+#endif
+
+		unsigned char *arg = reinterpret_cast<unsigned char *>(NextMemory(size, align));
+		for (size_t i = 0; i < count && i < 2; i++)
+			parts[i] = arg + i * sizeof(uint64_t);
+		return false;
+	}
+
+	/* Structure copied onto the stack, with 16-byte aligned ones starting on an even slot */
+	void *NextMemory(size_t size, size_t align = sizeof(uintptr_t))
+	{
+		size_t slots = (size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+		size_t alignSlots = align / sizeof(uintptr_t);
+
+		if (alignSlots > 1)
+		{
+			uintptr_t addr = reinterpret_cast<uintptr_t>(&m_Ctx->stack[m_Stack]);
+			m_Stack += ((align - addr % align) % align) / sizeof(uintptr_t);
+		}
+
+		void *arg = &m_Ctx->stack[m_Stack];
+		m_Stack += slots;
+
+		return arg;
+	}
+
+	void *GetReturnBuffer()
+	{
+		return m_ReturnBuffer;
+	}
+private:
+	DetourContext *m_Ctx;
+	size_t m_Gpr;
+	size_t m_Xmm;
+	size_t m_Stack;
+	void *m_ReturnBuffer;
+};
+
+typedef DetourResult (*DetourCallback)(DetourContext *ctx, void *param);
+
+/* Flags for CDetourDispatcher::Attach */
+enum
+{
+	Dispatch_FloatReturn = (1<<0)	/* Function returns on the x87 stack (x86-32 float/double) */
+};
+
+struct DetourHookList;
+class CVTableHook;
+
+/**
+ * Lets any number of pre and post hooks share one detour.
+ *
+ * Each hooked address gets one CDetour whose callback is a generated entry stub. The stub
+ * saves the argument registers into a DetourContext and runs the pre hooks, then either jumps
+ * to the trampoline with the caller's stack untouched or returns the hooks' value right away.
+ * When there are post hooks, the stub pops the return address and calls the original in its
+ * place, so neither the prototype nor the size of the stack arguments needs to be known. The
+ * real return addresses are kept on a small per-thread stack.
+ *
+ * While there are no hooks, the entry stub is bypassed and calls jump straight to the original.
+ *
+ * Hooks are kept in an immutable array that is replaced with a single pointer swap whenever
+ * one is added or removed, so calls never take a lock. Replaced arrays are freed once no
+ * thread is still reading them, which is checked with all other threads stopped.
+ *
+ * Virtual functions can be dispatched from their vtable entry instead, which leaves the code and
+ * any direct calls alone. The same entry stub is used, so nothing about the prototype is needed
+ * either, and the hooks read the arguments with DetourArgs.
+ *
+ * Post hooks rely on the original returning normally: functions that are left by longjmp or
+ * an exception lose their post hooks, which are discarded the next time the thread gets here.
+ */
+class CDetourDispatcher
+{
+public:
+	/**
+	 * Returns the dispatcher hooking addr, creating and enabling it if needed.
+	 *
+	 * @param addr		Address of the function.
+	 * @param flags		Dispatch_* flags, which must match if the dispatcher already exists.
+	 * @return			Dispatcher, or NULL if the function could not be detoured.
+	 */
+	static CDetourDispatcher *Attach(void *addr, unsigned int flags = 0);
+
+	/**
+	 * Returns the dispatcher hooking an entry of a vtable, creating and enabling it if needed.
+	 * Like CVTableHook::CreateSlotHook, this affects every object using the vtable.
+	 *
+	 * @param vtable	Vtable, as found at the start of an object.
+	 * @param index		Index of the entry.
+	 * @param flags		Dispatch_* flags, which must match if the dispatcher already exists.
+	 * @return			Dispatcher, or NULL if the entry could not be hooked.
+	 */
+	static CDetourDispatcher *AttachVTable(void **vtable, int index, unsigned int flags = 0);
+
+	/**
+	 * Finds the dispatcher detouring addr, if any.
+	 */
+	static CDetourDispatcher *Find(void *addr);
+public:
+	/**
+	 * Adds a hook, which runs after those already added.
+	 *
+	 * @param pre		Called before the original, or NULL.
+	 * @param post		Called after the original, or NULL.
+	 * @param param		Passed to both callbacks.
+	 * @return			Id for RemoveHook, or 0 on failure.
+	 */
+	int AddHook(DetourCallback pre, DetourCallback post, void *param = NULL);
+
+	bool RemoveHook(int id);
+
+	size_t GetHookCount();
+
+	/* Calls this to run the function without any hooks */
+	void *GetOriginal();
+
+	/* Function being hooked, which for a vtable entry is what the entry held */
+	void *GetTargetAddr();
+
+	/**
+	 * Removes the detour and frees the dispatcher. Like CDetour::Destroy, nothing may still be
+	 * running through it.
+	 */
+	void Destroy();
+private:
+	CDetourDispatcher(void *addr, void **slot, unsigned int flags);
+	~CDetourDispatcher();
+
+	static CDetourDispatcher *Create(void *addr, void **slot, unsigned int flags);
+
+	/* Vtable entries are data and functions are code, so the two never clash */
+	const void *GetKey()
+	{
+		return m_Slot ? reinterpret_cast<const void *>(m_Slot) : m_Address;
+	}
+
+	bool Init();
+	void SwapHooks(DetourHookList *hooks);
+	void Reclaim();
+public:
+	/* Called from the generated stubs */
+	static int DispatchPre(void *dispatcher, DetourContext *ctx);
+	static void *DispatchPost(DetourReturn *regs, uintptr_t *sp);
+private:
+	void *m_Address;
+	unsigned int m_Flags;
+	/* Set to the trampoline by CDetour, the entry stub jumps through it */
+	void *m_Original;
+	DetourHookList *volatile m_Hooks;
+	ke::Vector<DetourHookList *> m_Retired;
+	CDetour *m_Detour;
+	/* Only for vtable entries */
+	void **m_Slot;
+	CVTableHook *m_VTableHook;
+	GenBuffer m_Entry;
+};
+
+#endif // _INCLUDE_SRCDS_OSX_DISPATCHER_H_
@@ -0,0 +1,183 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "patchtxn.h"
+#include "threadfreezer.h"
+
+CPatchTransaction::CPatchTransaction()
+{
+}
+
+CPatchTransaction::~CPatchTransaction()
+{
+	Clear();
+}
+
+bool CPatchTransaction::AddPatch(void *address, const void *bytes, size_t length, patch_t *restore, int finalAccess)
+{
+	PendingPatch patch;
+
+	if (!address || length == 0 || length > sizeof(patch.bytes))
+		return false;
+
+	patch.address = (unsigned char *)address;
+	patch.length = length;
+	patch.restore = restore;
+	patch.access = finalAccess;
+	memcpy(patch.bytes, bytes, length);
+
+	/* Find where the patch goes, the queued patches don't overlap so only its neighbours can */
+	size_t low = 0, high = m_Patches.length();
+	while (low < high)
+	{
+		size_t mid = (low + high) / 2;
+		if (m_Patches[mid].address < patch.address)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	/* Overlapping patches would make the saved original bytes meaningless */
+	if (low > 0 && m_Patches[low - 1].address + m_Patches[low - 1].length > patch.address)
+		return false;
+	if (low < m_Patches.length() && m_Patches[low].address < patch.address + length)
+		return false;
+
+	return m_Patches.insert(low, patch);
+}
+
+bool CPatchTransaction::AddPatch(void *address, const patch_t *patch, patch_t *restore, int finalAccess)
+{
+	return AddPatch(address, patch->patch, patch->bytes, restore, finalAccess);
+}
+
+size_t CPatchTransaction::GetPatchCount() const
+{
+	return m_Patches.length();
+}
+
+void CPatchTransaction::Clear()
+{
+	m_Patches.clear();
+}
+
+bool CPatchTransaction::BuildPageRuns(RunList &runs)
+{
+	PageRun run;
+	bool haveRun = false;
+
+	/* Patches are sorted by address, so each one either extends the current run or starts a new one */
+	for (PendingPatch *iter = m_Patches.begin(); iter != m_Patches.end(); ++iter)
+	{
+		unsigned char *start = (unsigned char *)SH_LALIGN(iter->address);
+		unsigned char *end = (unsigned char *)SH_LALIGN(iter->address + iter->length - 1) + PAGESIZE;
+
+		if (haveRun && start <= run.start + run.size)
+		{
+			if (end > run.start + run.size)
+				run.size = end - run.start;
+			run.access |= iter->access;
+			continue;
+		}
+
+		if (haveRun && !runs.append(run))
+			return false;
+
+		run.start = start;
+		run.size = end - start;
+		run.access = iter->access;
+		haveRun = true;
+	}
+
+	return !haveRun || runs.append(run);
+}
+
+void CPatchTransaction::WritePatches(bool original)
+{
+	for (PendingPatch *iter = m_Patches.begin(); iter != m_Patches.end(); ++iter)
+		memcpy(iter->address, original ? iter->original : iter->bytes, iter->length);
+}
+
+bool CPatchTransaction::Commit()
+{
+	RunList runs;
+	PageRun *iter, *undo;
+
+	if (m_Patches.empty())
+		return true;
+
+	CCodePatchLock lock;
+
+	if (!BuildPageRuns(runs))
+	{
+		Clear();
+		return false;
+	}
+
+	/* Make everything writable first so that nothing is written unless it can all be written */
+	for (iter = runs.begin(); iter != runs.end(); ++iter)
+	{
+		if (!SetMemAccess(iter->start, iter->size, SH_MEM_READ|SH_MEM_WRITE|SH_MEM_EXEC))
+		{
+			for (undo = runs.begin(); undo != iter; ++undo)
+				SetMemAccess(undo->start, undo->size, undo->access);
+
+			Clear();
+			return false;
+		}
+	}
+
+	for (PendingPatch *p = m_Patches.begin(); p != m_Patches.end(); ++p)
+		memcpy(p->original, p->address, p->length);
+
+	WritePatches(false);
+
+	for (iter = runs.begin(); iter != runs.end(); ++iter)
+	{
+		if (!SetMemAccess(iter->start, iter->size, iter->access))
+		{
+			/* Put the original code back, making any runs that were already restored writable again */
+			for (undo = runs.begin(); undo != iter; ++undo)
+				SetMemAccess(undo->start, undo->size, SH_MEM_READ|SH_MEM_WRITE|SH_MEM_EXEC);
+
+			WritePatches(true);
+
+			for (undo = runs.begin(); undo != runs.end(); ++undo)
+				SetMemAccess(undo->start, undo->size, undo->access);
+
+			Clear();
+			return false;
+		}
+	}
+
+	for (PendingPatch *p = m_Patches.begin(); p != m_Patches.end(); ++p)
+	{
+		if (p->restore)
+		{
+			memcpy(p->restore->patch, p->original, p->length);
+			p->restore->bytes = p->length;
+		}
+	}
+
+	Clear();
+	return true;
+}
@@ -0,0 +1,104 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef _INCLUDE_SRCDS_OSX_PATCHTXN_H_
+#define _INCLUDE_SRCDS_OSX_PATCHTXN_H_
+
+#include <sh_include.h>
+#include "detourhelpers.h"
+#include "am-vector.h"
+
+/**
+ * Groups a set of code patches so that they are written together.
+ *
+ * Patches are sorted and merged into runs of adjacent pages. On commit each run is made writable
+ * once, every patch is written, and each run is then set back to its final protection once. This
+ * is two mprotect() calls per run rather than two per patch.
+ *
+ * Commit() is all or nothing: if any protection change fails, every patch already written is
+ * reverted and the memory is left as it was.
+ */
+class CPatchTransaction
+{
+public:
+	CPatchTransaction();
+	~CPatchTransaction();
+public:
+	/**
+	 * Queues bytes to be written to the given address.
+	 *
+	 * @param address		Address to patch.
+	 * @param bytes			Bytes to write (copied).
+	 * @param length		Number of bytes, no more than sizeof(patch_t::patch).
+	 * @param restore		Optional, receives the original bytes when the transaction commits.
+	 * @param finalAccess	Protection to leave the pages with once the patch has been written.
+	 * @return				False if the patch is too large or overlaps one already queued.
+	 */
+	bool AddPatch(void *address, const void *bytes, size_t length, patch_t *restore = NULL,
+	              int finalAccess = SH_MEM_READ|SH_MEM_EXEC);
+
+	/**
+	 * Queues a previously saved patch_t, e.g. to undo an earlier patch.
+	 */
+	bool AddPatch(void *address, const patch_t *patch, patch_t *restore = NULL,
+	              int finalAccess = SH_MEM_READ|SH_MEM_EXEC);
+
+	/**
+	 * Writes all queued patches. The queue is emptied whether or not this succeeds.
+	 */
+	bool Commit();
+
+	/**
+	 * Discards all queued patches without writing them.
+	 */
+	void Clear();
+
+	size_t GetPatchCount() const;
+private:
+	struct PendingPatch
+	{
+		unsigned char *address;
+		size_t length;
+		unsigned char bytes[sizeof(patch_t::patch)];
+		unsigned char original[sizeof(patch_t::patch)];
+		patch_t *restore;
+		int access;
+	};
+
+	struct PageRun
+	{
+		unsigned char *start;
+		size_t size;
+		int access;
+	};
+
+	/* Sorted by address */
+	typedef ke::Vector<PendingPatch> PatchList;
+	typedef ke::Vector<PageRun> RunList;
+
+	bool BuildPageRuns(RunList &runs);
+	void WritePatches(bool original);
+private:
+	PatchList m_Patches;
+};
+
+#endif // _INCLUDE_SRCDS_OSX_PATCHTXN_H_
@@ -0,0 +1,723 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "profiler.h"
+#include "stubgen.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Calls a thread can have in progress through profiled functions at once */
+#define PROFILE_MAX_DEPTH		64
+
+#define PROFILE_CACHE_LINE		64
+
+/* Placed in the thread key while a thread's record is being set up */
+#define PROFILE_THREAD_SETUP	reinterpret_cast<ProfileThread *>(1)
+
+struct ProfileProbe
+{
+	char *name;
+	void *address;
+	void *original;
+	CDetour *detour;
+	/* Calls into ProfileEnter and ProfileExit, for whatever the timed stub can't handle */
+	GenBuffer entry;
+	/* Times calls with its own TSC reads, empty if there is no thread slot to use */
+	GenBuffer timed;
+};
+
+struct ProfileFrame
+{
+	int probe;
+	uintptr_t *stack;
+	void *returnAddress;
+	uint64_t start;
+};
+
+/*
+ * Per-thread counts and calls in progress. Like the dispatcher's, records are never freed, only
+ * handed to a new thread once the one using them exits, so counts of exited threads are kept.
+ */
+struct ProfileThread
+{
+	ProfileThread *next;
+	volatile bool inUse;
+	/* Set while the record allocates, so that a profiled allocator is not counted */
+	bool busy;
+	size_t depth;
+	ProfileFrame frames[PROFILE_MAX_DEPTH];
+	ProfileStats *volatile stats[PROFILE_MAX_PROBES];
+};
+
+static ProfileProbe *g_Probes[PROFILE_MAX_PROBES];
+static volatile int g_ProbeCount = 0;
+static pthread_mutex_t g_ProbeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t g_ThreadKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ThreadKey;
+static pthread_mutex_t g_ThreadLock = PTHREAD_MUTEX_INITIALIZER;
+static ProfileThread *volatile g_Threads = NULL;
+
+#if defined(__x86_64__)
+/*
+ * Where generated code finds the calling thread's ProfileThread, with a segment override:
+ * Mac OS X keeps thread specific data at gs, and on Linux it is a static TLS variable at fs.
+ */
+static jit_uint8_t g_SlotSegment = 0;	/* 0 if neither could be found */
+static jit_int32_t g_SlotOffset = 0;
+
+#if defined(__linux__)
+static __thread ProfileThread *t_Thread __attribute__((tls_model("initial-exec")));
+#endif
+
+/* The timed stub finds a frame with a shift */
+static_assert(sizeof(ProfileFrame) == 32, "ProfileFrame must be 32 bytes");
+static_assert(PROFILE_MAX_DEPTH < 128 && PROFILE_BUCKETS < 128, "Compared as 8-bit immediates");
+#endif
+
+static inline uint64_t ReadTSC()
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t(hi) << 32) | lo;
+}
+
+static inline size_t Log2(uint64_t value)
+{
+	size_t bucket = 0;
+
+#if defined(__x86_64__)
+	if (value)
+		bucket = 63 - __builtin_clzll(value);
+#else
+	uint32_t hi = uint32_t(value >> 32);
+	if (hi)
+		bucket = 63 - __builtin_clz(hi);
+	else if (value)
+		bucket = 31 - __builtin_clz(uint32_t(value));
+#endif
+
+	return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+static inline void SetThread(ProfileThread *thread)
+{
+	pthread_setspecific(g_ThreadKey, thread);
+#if defined(__x86_64__) && defined(__linux__)
+	t_Thread = thread;
+#endif
+}
+
+static void ReleaseThread(void *value)
+{
+	ProfileThread *thread = reinterpret_cast<ProfileThread *>(value);
+
+#if defined(__x86_64__) && defined(__linux__)
+	/* The record can go to another thread now */
+	t_Thread = NULL;
+#endif
+
+	if (thread == PROFILE_THREAD_SETUP)
+		return;
+
+	thread->depth = 0;
+	thread->busy = false;
+	thread->inUse = false;
+}
+
+#if defined(__x86_64__)
+/* Checks that generated code would read value from the thread slot at segment:offset */
+static bool ReadsThreadSlot(jit_uint8_t segment, intptr_t offset, void *value)
+{
+	void *read;
+
+	if (offset != jit_int32_t(offset))
+		return false;
+
+#if defined(__APPLE__)
+	if (segment != 0x65)
+		return false;
+	__asm__ __volatile__("movq %%gs:(%1), %0" : "=r" (read) : "r" (offset));
+#elif defined(__linux__)
+	if (segment != 0x64)
+		return false;
+	__asm__ __volatile__("movq %%fs:(%1), %0" : "=r" (read) : "r" (offset));
+#else
+	return false;
+#endif
+
+	return read == value;
+}
+
+static void FindThreadSlot()
+{
+	void *marker = &g_SlotOffset;
+
+#if defined(__APPLE__)
+	/* The key's slot is either at the base of gs, or after the start of the thread on older releases */
+	const intptr_t offsets[] = {intptr_t(g_ThreadKey * sizeof(void *)), intptr_t(0x60 + g_ThreadKey * sizeof(void *))};
+	void *saved = pthread_getspecific(g_ThreadKey);
+
+	pthread_setspecific(g_ThreadKey, marker);
+	for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+	{
+		if (ReadsThreadSlot(0x65, offsets[i], marker))
+		{
+			g_SlotSegment = 0x65;
+			g_SlotOffset = jit_int32_t(offsets[i]);
+			break;
+		}
+	}
+	pthread_setspecific(g_ThreadKey, saved);
+#elif defined(__linux__)
+	/* fs:0 points at the thread control block, and static TLS is at a fixed offset from it */
+	uintptr_t base;
+	__asm__ __volatile__("movq %%fs:0, %0" : "=r" (base));
+
+	intptr_t offset = intptr_t(uintptr_t(&t_Thread) - base);
+	ProfileThread *saved = t_Thread;
+
+	t_Thread = reinterpret_cast<ProfileThread *>(marker);
+	if (ReadsThreadSlot(0x64, offset, marker))
+	{
+		g_SlotSegment = 0x64;
+		g_SlotOffset = jit_int32_t(offset);
+	}
+	t_Thread = saved;
+#endif
+}
+#endif
+
+static void CreateThreadKey()
+{
+	pthread_key_create(&g_ThreadKey, ReleaseThread);
+#if defined(__x86_64__)
+	FindThreadSlot();
+#endif
+}
+
+static ProfileThread *GetThread()
+{
+	ProfileThread *thread = reinterpret_cast<ProfileThread *>(pthread_getspecific(g_ThreadKey));
+	if (thread)
+		return thread == PROFILE_THREAD_SETUP ? NULL : thread;
+
+	/* Anything profiled that gets called from here is ignored */
+	SetThread(PROFILE_THREAD_SETUP);
+	pthread_mutex_lock(&g_ThreadLock);
+
+	for (thread = g_Threads; thread; thread = thread->next)
+	{
+		if (!thread->inUse)
+			break;
+	}
+
+	if (!thread)
+	{
+		thread = reinterpret_cast<ProfileThread *>(calloc(1, sizeof(ProfileThread)));
+		if (thread)
+		{
+			thread->next = g_Threads;
+			g_Threads = thread;
+		}
+	}
+
+	if (thread)
+		thread->inUse = true;
+
+	pthread_mutex_unlock(&g_ThreadLock);
+	SetThread(thread);
+
+	return thread;
+}
+
+static ProfileStats *AllocStats()
+{
+	void *stats;
+	size_t size = (sizeof(ProfileStats) + PROFILE_CACHE_LINE - 1) & ~(PROFILE_CACHE_LINE - 1);
+
+	if (posix_memalign(&stats, PROFILE_CACHE_LINE, size) != 0)
+		return NULL;
+
+	memset(stats, 0, size);
+
+	return reinterpret_cast<ProfileStats *>(stats);
+}
+
+#if defined(__x86_64__)
+#define EMIT(jit, bytes)	EmitBytes(jit, bytes, sizeof(bytes) - 1)
+
+static void EmitBytes(GenBuffer *jit, const char *bytes, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		jit->write_ubyte(jit_uint8_t(bytes[i]));
+}
+
+/* mov r11, <segment>:[slot] */
+static void EmitLoadThread(GenBuffer *jit)
+{
+	jit->write_ubyte(g_SlotSegment);
+	jit->write_ubyte(0x4C);
+	jit->write_ubyte(IA32_MOV_REG_RM);
+	jit->write_ubyte(ia32_modrm(MOD_MEM_REG, REG_R11 & 7, REG_SIB));
+	jit->write_ubyte(ia32_sib(NOSCALE, REG_NOIDX, REG_IMM_BASE));
+	jit->write_int32(g_SlotOffset);
+}
+
+/* op reg, [r11+disp32] or op [r11+disp32], reg, for a ProfileThread field */
+static void EmitThreadField(GenBuffer *jit, jit_uint8_t op, jit_uint8_t reg, jit_int32_t disp)
+{
+	jit->write_ubyte(0x49);
+	jit->write_ubyte(op);
+	jit->write_ubyte(ia32_modrm(MOD_DISP32, reg, REG_R11 & 7));
+	jit->write_int32(disp);
+}
+
+/* Turns the frame index in reg into the address of the frame at disp in the ProfileThread at r11 */
+static void EmitFrameAddress(GenBuffer *jit, jit_uint8_t reg, jit_int32_t disp)
+{
+	/* shl reg, 5 */
+	jit->write_ubyte(0x48);
+	jit->write_ubyte(0xC1);
+	jit->write_ubyte(ia32_modrm(MOD_REG, 4, reg));
+	jit->write_ubyte(5);
+
+	/* lea reg, [r11+reg+disp32] */
+	jit->write_ubyte(0x49);
+	jit->write_ubyte(IA32_LEA_REG_MEM);
+	jit->write_ubyte(ia32_modrm(MOD_DISP32, reg, REG_SIB));
+	jit->write_ubyte(ia32_sib(NOSCALE, reg, REG_R11 & 7));
+	jit->write_int32(disp);
+}
+
+/* rdtsc, with the whole count left in rax or rdx */
+static void EmitReadTSC(GenBuffer *jit, bool intoRdx)
+{
+	EMIT(jit, "\x0F\x31");					/* rdtsc */
+	EMIT(jit, "\x48\xC1\xE2\x20");			/* shl rdx, 32 */
+	if (intoRdx)
+		EMIT(jit, "\x48\x09\xC2");			/* or rdx, rax */
+	else
+		EMIT(jit, "\x48\x09\xD0");			/* or rax, rdx */
+}
+
+/* mov r11, value */
+static void EmitLoadR11(GenBuffer *jit, const void *value)
+{
+	EMIT(jit, "\x49\xBB");
+	jit->write_uint64(jit_uint64_t(value));
+}
+
+/*
+ * Generates a stub that times calls with its own TSC reads and counts them without calling out,
+ * so that little is left on top of the two reads. Like the entry stub,
+ * it calls the original in place of the caller. At entry only r11 is free, so rax and rdx, which
+ * rdtsc clobbers, are saved around it. After the original returns, everything but the return
+ * registers is free.
+ *
+ * Anything unusual goes to the entry stub's handlers instead: a thread without a record yet,
+ * frames left behind by longjmp and a probe's first call on a thread, which allocates its counts.
+ */
+static void GenerateTimedStub(GenBuffer *jit, int index, void **original, void *entry)
+{
+	const jit_int32_t depth = offsetof(ProfileThread, depth);
+	const jit_int32_t frames = offsetof(ProfileThread, frames);
+
+	EmitLoadThread(jit);
+	EMIT(jit, "\x49\x83\xFB\x01");			/* cmp r11, PROFILE_THREAD_SETUP */
+	jitoffs_t noThread = IA32_Jump_Cond_Imm32(jit, CC_BE, 0);
+
+	EMIT(jit, "\x50\x52");					/* push rax; push rdx */
+
+	/* cmp byte [r11+busy], 0 */
+	EMIT(jit, "\x41\x80");
+	jit->write_ubyte(ia32_modrm(MOD_DISP32, 7, REG_R11 & 7));
+	jit->write_int32(offsetof(ProfileThread, busy));
+	jit->write_ubyte(0);
+	jitoffs_t busy = IA32_Jump_Cond_Imm32(jit, CC_NE, 0);
+
+	EmitThreadField(jit, IA32_MOV_REG_RM, REG_RAX, depth);
+	EMIT(jit, "\x48\x83\xF8");				/* cmp rax, PROFILE_MAX_DEPTH */
+	jit->write_ubyte(PROFILE_MAX_DEPTH);
+	jitoffs_t full = IA32_Jump_Cond_Imm32(jit, CC_AE, 0);
+	EMIT(jit, "\x48\x85\xC0");				/* test rax, rax */
+	jitoffs_t empty = IA32_Jump_Cond_Imm32(jit, CC_Z, 0);
+
+	/* Is the last frame deeper than this call, i.e. was it left without returning? */
+	EMIT(jit, "\x48\x89\xC2");				/* mov rdx, rax */
+	EmitFrameAddress(jit, REG_RDX, frames - jit_int32_t(sizeof(ProfileFrame)) + offsetof(ProfileFrame, stack));
+	EMIT(jit, "\x48\x8B\x12");				/* mov rdx, [rdx] */
+	EMIT(jit, "\x48\x29\xE2");				/* sub rdx, rsp */
+	EMIT(jit, "\x48\x83\xFA\x18");			/* cmp rdx, 24 (the stack past the return address) */
+	jitoffs_t stale = IA32_Jump_Cond_Imm32(jit, CC_L, 0);
+
+	/* Push a frame */
+	IA32_Send_Jump32_Here(jit, empty);
+	EMIT(jit, "\x48\x89\xC2");				/* mov rdx, rax */
+	EmitFrameAddress(jit, REG_RDX, frames);
+	EMIT(jit, "\x48\xFF\xC0");				/* inc rax */
+	EmitThreadField(jit, IA32_MOV_RM_REG, REG_RAX, depth);
+	EMIT(jit, "\xC7\x42");					/* mov dword [rdx+probe], index */
+	jit->write_ubyte(offsetof(ProfileFrame, probe));
+	jit->write_int32(index);
+	EMIT(jit, "\x48\x8D\x44\x24\x18");		/* lea rax, [rsp+24] */
+	EMIT(jit, "\x48\x89\x42");				/* mov [rdx+stack], rax */
+	jit->write_ubyte(offsetof(ProfileFrame, stack));
+	EMIT(jit, "\x48\x8B\x44\x24\x10");		/* mov rax, [rsp+16] */
+	EMIT(jit, "\x48\x89\x42");				/* mov [rdx+returnAddress], rax */
+	jit->write_ubyte(offsetof(ProfileFrame, returnAddress));
+	EMIT(jit, "\x49\x89\xD3");				/* mov r11, rdx */
+	EmitReadTSC(jit, false);
+	EMIT(jit, "\x49\x89\x43");				/* mov [r11+start], rax */
+	jit->write_ubyte(offsetof(ProfileFrame, start));
+	EMIT(jit, "\x5A\x58");					/* pop rdx; pop rax */
+
+	/* Call the original in place of the caller */
+	EMIT(jit, "\x48\x83\xC4\x08");			/* add rsp, 8 */
+	EmitLoadR11(jit, original);
+	EMIT(jit, "\x41\xFF\x13");				/* call [r11] */
+
+	/* The original has returned, rsp is just past where the return address was */
+	EMIT(jit, "\x50\x52");					/* push rax; push rdx */
+	EmitReadTSC(jit, true);
+	EmitLoadThread(jit);
+	EmitThreadField(jit, IA32_MOV_REG_RM, REG_RAX, depth);
+	EMIT(jit, "\x48\x85\xC0");				/* test rax, rax */
+	jitoffs_t noFrame = IA32_Jump_Cond_Imm32(jit, CC_Z, 0);
+	EMIT(jit, "\x48\xFF\xC8");				/* dec rax */
+	EMIT(jit, "\x48\x89\xC1");				/* mov rcx, rax */
+	EmitFrameAddress(jit, REG_RCX, frames);
+	EMIT(jit, "\x48\x8D\x74\x24\x10");		/* lea rsi, [rsp+16] */
+	EMIT(jit, "\x48\x39\x71");				/* cmp [rcx+stack], rsi */
+	jit->write_ubyte(offsetof(ProfileFrame, stack));
+	jitoffs_t mismatch = IA32_Jump_Cond_Imm32(jit, CC_NE, 0);
+	EMIT(jit, "\x8B\x79");					/* mov edi, [rcx+probe] */
+	jit->write_ubyte(offsetof(ProfileFrame, probe));
+	EMIT(jit, "\x49\x8B\xBC\xFB");			/* mov rdi, [r11+rdi*8+stats] */
+	jit->write_int32(offsetof(ProfileThread, stats));
+	EMIT(jit, "\x48\x85\xFF");				/* test rdi, rdi */
+	jitoffs_t noStats = IA32_Jump_Cond_Imm32(jit, CC_Z, 0);
+
+	/* Pop the frame and count the call */
+	EmitThreadField(jit, IA32_MOV_RM_REG, REG_RAX, depth);
+	EMIT(jit, "\x48\x2B\x51");				/* sub rdx, [rcx+start] */
+	jit->write_ubyte(offsetof(ProfileFrame, start));
+	EMIT(jit, "\x48\xFF\x47");				/* inc qword [rdi+calls] */
+	jit->write_ubyte(offsetof(ProfileStats, calls));
+	EMIT(jit, "\x48\x01\x57");				/* add [rdi+cycles], rdx */
+	jit->write_ubyte(offsetof(ProfileStats, cycles));
+	EMIT(jit, "\x48\x0F\xBD\xD2");			/* bsr rdx, rdx */
+	EMIT(jit, "\x75\x02");					/* jnz +2 */
+	EMIT(jit, "\x31\xD2");					/* xor edx, edx */
+	EMIT(jit, "\x48\x83\xFA");				/* cmp rdx, PROFILE_BUCKETS - 1 */
+	jit->write_ubyte(PROFILE_BUCKETS - 1);
+	EMIT(jit, "\x76\x05");					/* jbe +5 */
+	jit->write_ubyte(0xBA);					/* mov edx, PROFILE_BUCKETS - 1 */
+	jit->write_int32(PROFILE_BUCKETS - 1);
+	EMIT(jit, "\x48\xFF\x44\xD7");			/* inc qword [rdi+rdx*8+histogram] */
+	jit->write_ubyte(offsetof(ProfileStats, histogram));
+	EMIT(jit, "\x48\x8B\x49");				/* mov rcx, [rcx+returnAddress] */
+	jit->write_ubyte(offsetof(ProfileFrame, returnAddress));
+	EMIT(jit, "\x5A\x58");					/* pop rdx; pop rax */
+	EMIT(jit, "\x51\xC3");					/* push rcx; ret */
+
+	/* ProfileExit drops frames left by longjmp and allocates counts */
+	IA32_Send_Jump32_Here(jit, noFrame);
+	IA32_Send_Jump32_Here(jit, mismatch);
+	IA32_Send_Jump32_Here(jit, noStats);
+	EMIT(jit, "\x5A\x58");					/* pop rdx; pop rax */
+	EmitStubExit(jit, CProfiler::ProfileExit, false);
+
+	/* Not timed, straight to the original */
+	IA32_Send_Jump32_Here(jit, busy);
+	IA32_Send_Jump32_Here(jit, full);
+	EMIT(jit, "\x5A\x58");					/* pop rdx; pop rax */
+	EmitLoadR11(jit, original);
+	EMIT(jit, "\x41\xFF\x23");				/* jmp [r11] */
+
+	/* ProfileEnter sets up the thread or drops frames left by longjmp */
+	IA32_Send_Jump32_Here(jit, stale);
+	EMIT(jit, "\x5A\x58");					/* pop rdx; pop rax */
+	IA32_Send_Jump32_Here(jit, noThread);
+	EmitLoadR11(jit, entry);
+	EMIT(jit, "\x41\xFF\xE3");				/* jmp r11 */
+}
+#endif
+
+int CProfiler::Add(const char *name, void *addr)
+{
+	pthread_once(&g_ThreadKeyOnce, CreateThreadKey);
+	pthread_mutex_lock(&g_ProbeLock);
+
+	int index = g_ProbeCount;
+
+	for (int i = 0; i < index; i++)
+	{
+		if (g_Probes[i]->address == addr)
+		{
+			pthread_mutex_unlock(&g_ProbeLock);
+			return i;
+		}
+	}
+
+	if (index == PROFILE_MAX_PROBES)
+	{
+		pthread_mutex_unlock(&g_ProbeLock);
+		printf("Cannot profile %s, already profiling %d functions\n", name, PROFILE_MAX_PROBES);
+		return -1;
+	}
+
+	ProfileProbe *probe = new ProfileProbe;
+	probe->name = strdup(name);
+	probe->address = addr;
+	probe->original = NULL;
+	probe->detour = NULL;
+
+	/* The x87 stack is left alone, so float returns on x86-32 pass straight through */
+	GenerateEntryStub(&probe->entry, ProfileEnter, ProfileExit, reinterpret_cast<void *>(intptr_t(index)),
+	                  &probe->original, false);
+
+	void *callback = probe->entry.GetData();
+
+#if defined(__x86_64__)
+	if (callback && g_SlotSegment)
+	{
+		GenerateTimedStub(&probe->timed, index, &probe->original, callback);
+		if (probe->timed.GetData())
+		{
+			probe->timed.SetRE();
+			callback = probe->timed.GetData();
+		}
+	}
+#endif
+
+	if (callback)
+	{
+		probe->entry.SetRE();
+		probe->detour = CDetourManager::CreateDetour(callback, &probe->original, addr);
+	}
+
+	if (!probe->detour)
+	{
+		pthread_mutex_unlock(&g_ProbeLock);
+		printf("Failed to create profiling detour for %s\n", name);
+		free(probe->name);
+		delete probe;
+		return -1;
+	}
+
+	/* Other threads may already be running the function */
+	probe->detour->SetLiveMode(true);
+	probe->detour->EnableDetour();
+
+	g_Probes[index] = probe;
+	g_ProbeCount = index + 1;
+
+	pthread_mutex_unlock(&g_ProbeLock);
+
+	return index;
+}
+
+int CProfiler::Find(void *addr)
+{
+	int count = g_ProbeCount;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (g_Probes[i]->address == addr)
+			return i;
+	}
+
+	return -1;
+}
+
+int CProfiler::GetCount()
+{
+	return g_ProbeCount;
+}
+
+const char *CProfiler::GetName(int index)
+{
+	if (index < 0 || index >= g_ProbeCount)
+		return NULL;
+
+	return g_Probes[index]->name;
+}
+
+bool CProfiler::GetStats(int index, ProfileStats &stats)
+{
+	if (index < 0 || index >= g_ProbeCount)
+		return false;
+
+	memset(&stats, 0, sizeof(stats));
+
+	for (ProfileThread *thread = g_Threads; thread; thread = thread->next)
+	{
+		const ProfileStats *counts = thread->stats[index];
+		if (!counts)
+			continue;
+
+		stats.calls += counts->calls;
+		stats.cycles += counts->cycles;
+		for (size_t i = 0; i < PROFILE_BUCKETS; i++)
+			stats.histogram[i] += counts->histogram[i];
+	}
+
+	return true;
+}
+
+void CProfiler::Reset()
+{
+	int count = g_ProbeCount;
+
+	for (ProfileThread *thread = g_Threads; thread; thread = thread->next)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (thread->stats[i])
+				memset(thread->stats[i], 0, sizeof(ProfileStats));
+		}
+	}
+}
+
+void CProfiler::Report(FILE *fp)
+{
+	int count = g_ProbeCount;
+	ProfileStats stats;
+
+	fprintf(fp, "%-48s %12s %16s %12s\n", "Function", "Calls", "Ticks", "Avg ticks");
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!GetStats(i, stats) || !stats.calls)
+			continue;
+
+		fprintf(fp, "%-48s %12llu %16llu %12llu\n", g_Probes[i]->name, (unsigned long long)stats.calls,
+		        (unsigned long long)stats.cycles, (unsigned long long)(stats.cycles / stats.calls));
+
+		/* Only the buckets that were hit, as 2^n: calls */
+		fprintf(fp, "   ");
+		for (size_t j = 0; j < PROFILE_BUCKETS; j++)
+		{
+			if (stats.histogram[j])
+				fprintf(fp, " 2^%zu: %llu", j, (unsigned long long)stats.histogram[j]);
+		}
+		fprintf(fp, "\n");
+	}
+
+	fflush(fp);
+}
+
+void CProfiler::RemoveAll()
+{
+	pthread_mutex_lock(&g_ProbeLock);
+
+	int count = g_ProbeCount;
+	g_ProbeCount = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		ProfileProbe *probe = g_Probes[i];
+
+		/*
+		 * Other threads can still be inside a stub or the trampoline, or have a stub's return
+		 * address on their stack, so the code is left where it is. It is only ever freed by
+		 * process exit.
+		 */
+		probe->detour->DisableDetour();
+		g_Probes[i] = NULL;
+	}
+
+	/* Counts would otherwise be added to whatever is profiled next at the same index */
+	for (ProfileThread *thread = g_Threads; thread; thread = thread->next)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (thread->stats[i])
+				memset(thread->stats[i], 0, sizeof(ProfileStats));
+		}
+	}
+
+	pthread_mutex_unlock(&g_ProbeLock);
+}
+
+int CProfiler::ProfileEnter(void *probe, DetourContext *ctx)
+{
+	ProfileThread *thread = GetThread();
+	if (!thread || thread->busy)
+		return Stub_Original;
+
+	/* Anything deeper than this call was left without returning through its entry stub */
+	while (thread->depth && thread->frames[thread->depth - 1].stack < ctx->stack)
+		thread->depth--;
+
+	if (thread->depth == PROFILE_MAX_DEPTH)
+		return Stub_Original;
+
+	ProfileFrame &frame = thread->frames[thread->depth++];
+	frame.probe = int(intptr_t(probe));
+	frame.stack = ctx->stack;
+	frame.returnAddress = ctx->returnAddress;
+	frame.start = ReadTSC();
+
+	return Stub_Return;
+}
+
+void *CProfiler::ProfileExit(DetourReturn *regs, uintptr_t *sp)
+{
+	uint64_t end = ReadTSC();
+	ProfileThread *thread = reinterpret_cast<ProfileThread *>(pthread_getspecific(g_ThreadKey));
+
+	if (!thread || thread == PROFILE_THREAD_SETUP || !thread->depth)
+	{
+		printf("Profiled function returned with no call pending\n");
+		abort();
+	}
+
+	/* Skip calls that were left by longjmp or an exception */
+	while (thread->depth > 1 && thread->frames[thread->depth - 1].stack < sp - STUB_POP_SLACK)
+		thread->depth--;
+
+	/* Copied first, since allocating below can run other profiled functions */
+	ProfileFrame frame = thread->frames[--thread->depth];
+	ProfileStats *stats = thread->stats[frame.probe];
+
+	if (!stats)
+	{
+		thread->busy = true;
+		stats = AllocStats();
+		thread->stats[frame.probe] = stats;
+		thread->busy = false;
+
+		if (!stats)
+			return frame.returnAddress;
+	}
+
+	uint64_t ticks = end - frame.start;
+
+	stats->calls++;
+	stats->cycles += ticks;
+	stats->histogram[Log2(ticks)]++;
+
+	return frame.returnAddress;
+}
@@ -0,0 +1,95 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_PROFILER_H_
+#define _INCLUDE_SRCDS_OSX_PROFILER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Functions that can be profiled at once */
+#define PROFILE_MAX_PROBES		256
+
+/* Histogram buckets, the last one counting everything longer */
+#define PROFILE_BUCKETS			40
+
+/* Counts for one profiled function, summed over all threads */
+struct ProfileStats
+{
+	uint64_t calls;
+	uint64_t cycles;						/* TSC ticks, including callees */
+	uint64_t histogram[PROFILE_BUCKETS];	/* Calls by floor(log2(ticks)) */
+};
+
+struct DetourContext;
+struct DetourReturn;
+
+/**
+ * Counts calls to arbitrary functions and how long they take, without knowing their prototypes.
+ *
+ * Each function gets a live-mode detour whose callback is a generated stub. The stub reads the
+ * TSC, calls the function in place of its caller and reads the TSC again once it returns. On
+ * x86-64 the stub finds the thread's counts through the TLS slot itself and only calls out for
+ * a thread's first call or one left by longjmp; elsewhere it goes through a generic entry stub.
+ *
+ * Counts go into per-thread blocks aligned to cache lines, so threads never write to the same
+ * line. They are only summed when asked for, which means stats read while threads are running
+ * can be slightly behind.
+ *
+ * Like the dispatcher, calls left by longjmp or an exception are not counted.
+ */
+class CProfiler
+{
+public:
+	/**
+	 * Starts profiling a function.
+	 *
+	 * @param name		Name to report the function under.
+	 * @param addr		Address of the function.
+	 * @return			Index of the function, or -1 on failure.
+	 */
+	static int Add(const char *name, void *addr);
+
+	/* Index of the function at addr, or -1 if it is not profiled */
+	static int Find(void *addr);
+
+	static int GetCount();
+	static const char *GetName(int index);
+	static bool GetStats(int index, ProfileStats &stats);
+
+	/* Zeroes all counts */
+	static void Reset();
+
+	/* Prints the counts of every function that has been called */
+	static void Report(FILE *fp);
+
+	/**
+	 * Removes every detour. The stubs and trampolines are never freed, since threads may still
+	 * be running them, so calls that are still in progress return normally.
+	 */
+	static void RemoveAll();
+public:
+	/* Called from the generated stubs */
+	static int ProfileEnter(void *probe, DetourContext *ctx);
+	static void *ProfileExit(DetourReturn *regs, uintptr_t *sp);
+};
+
+#endif // _INCLUDE_SRCDS_OSX_PROFILER_H_
@@ -0,0 +1,192 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "registry.h"
+#include "am-vector.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct RegisteredHook
+{
+	CDetour *detour;
+	CVTableHook *vtable;
+	void **trampoline;
+	CDetour **handle;
+};
+
+typedef ke::Vector<RegisteredHook> HookVector;
+
+/* Installed hooks in install order */
+static HookVector g_Hooks;
+static pthread_mutex_t g_RegistryLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Takes hooks out, most recently installed first */
+static void DestroyHooks(RegisteredHook *hooks, size_t count)
+{
+	CDetour **detours = (CDetour **)malloc((count ? count : 1) * sizeof(CDetour *));
+
+	/* Unpatch everything in one pass first rather than one detour at a time in Destroy() */
+	if (detours)
+	{
+		for (size_t i = 0; i < count; i++)
+			detours[i] = hooks[i].detour;
+
+		CDetourManager::DisableDetours(detours, count);
+		free(detours);
+	}
+
+	for (size_t i = count; i-- > 0;)
+	{
+		if (hooks[i].handle)
+			*hooks[i].handle = NULL;
+
+		if (hooks[i].detour)
+			hooks[i].detour->Destroy();
+
+		if (hooks[i].vtable)
+			hooks[i].vtable->Destroy();
+	}
+}
+
+static bool CreateHook(const DetourSpec &spec, void *address, RegisteredHook &hook)
+{
+	switch (spec.kind)
+	{
+	case Detour_Inline:
+		hook.detour = CDetourManager::CreateDetour(spec.callback, spec.trampoline, address);
+		return hook.detour != NULL;
+	case Detour_VTableSlot:
+		hook.vtable = CVTableHook::CreateSlotHook((void **)address, spec.index, spec.callback, spec.trampoline);
+		return hook.vtable != NULL;
+	case Detour_VTableInstance:
+		hook.vtable = CVTableHook::CreateInstanceHook(address, spec.index, spec.count, spec.callback, spec.trampoline);
+		return hook.vtable != NULL;
+	}
+
+	return false;
+}
+
+bool CDetourRegistry::Install(const DetourSpec *specs, size_t count)
+{
+	RegisteredHook *hooks = (RegisteredHook *)calloc(count ? count : 1, sizeof(RegisteredHook));
+	CDetour **detours = (CDetour **)calloc(count ? count : 1, sizeof(CDetour *));
+	size_t created = 0;
+	bool success = hooks && detours;
+
+	for (size_t i = 0; success && i < count; i++)
+	{
+		const DetourSpec &spec = specs[i];
+		void *address = spec.address;
+
+		if (!address && spec.resolver)
+			address = spec.resolver(spec.param);
+
+		RegisteredHook &hook = hooks[created];
+		hook.trampoline = spec.trampoline;
+		hook.handle = spec.handle;
+
+		if (address && CreateHook(spec, address, hook))
+		{
+			detours[created++] = hook.detour;
+			continue;
+		}
+
+		if (spec.required)
+		{
+			printf("Failed to create detour for %s\n", spec.name);
+			success = false;
+			break;
+		}
+
+		printf("Warning: Unable to detour %s\n", spec.name);
+	}
+
+	/* Install everything at once so that each page only has its protection changed once */
+	if (success && !CDetourManager::EnableDetours(detours, created))
+		success = false;
+
+	for (size_t i = 0; success && i < created; i++)
+	{
+		if (hooks[i].vtable && !hooks[i].vtable->Enable())
+			success = false;
+	}
+
+	pthread_mutex_lock(&g_RegistryLock);
+
+	if (success && g_Hooks.ensure(g_Hooks.length() + created))
+	{
+		for (size_t i = 0; i < created; i++)
+		{
+			g_Hooks.append(hooks[i]);
+
+			if (hooks[i].handle)
+				*hooks[i].handle = hooks[i].detour;
+		}
+	}
+	else
+	{
+		success = false;
+	}
+
+	pthread_mutex_unlock(&g_RegistryLock);
+
+	if (!success && hooks)
+		DestroyHooks(hooks, created);
+
+	free(hooks);
+	free(detours);
+	return success;
+}
+
+void CDetourRegistry::Remove(void **trampoline)
+{
+	pthread_mutex_lock(&g_RegistryLock);
+
+	for (size_t i = 0; trampoline && i < g_Hooks.length(); i++)
+	{
+		if (g_Hooks[i].trampoline != trampoline)
+			continue;
+
+		RegisteredHook hook = g_Hooks[i];
+
+		/* Keep the install order for RemoveAll() */
+		g_Hooks.remove(i);
+
+		pthread_mutex_unlock(&g_RegistryLock);
+
+		DestroyHooks(&hook, 1);
+		return;
+	}
+
+	pthread_mutex_unlock(&g_RegistryLock);
+}
+
+void CDetourRegistry::RemoveAll()
+{
+	pthread_mutex_lock(&g_RegistryLock);
+
+	HookVector hooks(ke::Move(g_Hooks));
+
+	pthread_mutex_unlock(&g_RegistryLock);
+
+	DestroyHooks(hooks.buffer(), hooks.length());
+}
@@ -0,0 +1,104 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_REGISTRY_H_
+#define _INCLUDE_SRCDS_OSX_REGISTRY_H_
+
+#include "detours.h"
+#include "vtablehook.h"
+
+/* Looks up the address of a function when its group is installed */
+typedef void *(*DetourResolver)(void *param);
+
+enum DetourKind
+{
+	Detour_Inline = 0,		/* Patch the function itself */
+	Detour_VTableSlot,		/* address is a vtable, replace one of its entries */
+	Detour_VTableInstance	/* address is an object, give it a copy of its vtable with one entry replaced */
+};
+
+/**
+ * One entry in a table of detours.
+ *
+ * The function, vtable or object is taken from address, or from the resolver if address is NULL.
+ * A required entry that can't be resolved or hooked fails the whole group. An optional one is
+ * only warned about.
+ */
+struct DetourSpec
+{
+	const char *name;			/* Used in messages */
+	void *callback;
+	void **trampoline;
+	void *address;
+	DetourResolver resolver;
+	void *param;				/* Passed to the resolver */
+	bool required;
+	CDetour **handle;			/* If not NULL, receives an inline detour while it is installed */
+	DetourKind kind;
+	int index;					/* Vtable entry to replace */
+	int count;					/* Vtable entries to copy for an instance hook */
+};
+
+#define DETOUR_SPEC_MEMBER(name, label, addr, required, handle) \
+	{label, GET_MEMBER_CALLBACK(name), GET_MEMBER_TRAMPOLINE(name), addr, NULL, NULL, required, handle}
+#define DETOUR_SPEC_STATIC(name, label, addr, required, handle) \
+	{label, GET_STATIC_CALLBACK(name), GET_STATIC_TRAMPOLINE(name), addr, NULL, NULL, required, handle}
+#define DETOUR_SPEC_STATIC_LAZY(name, label, resolver, param, required, handle) \
+	{label, GET_STATIC_CALLBACK(name), GET_STATIC_TRAMPOLINE(name), NULL, resolver, param, required, handle}
+#define DETOUR_SPEC_VTABLE(name, label, vtable, index, required) \
+	{label, GET_MEMBER_CALLBACK(name), GET_MEMBER_TRAMPOLINE(name), vtable, NULL, NULL, required, NULL, \
+	 Detour_VTableSlot, index, 0}
+#define DETOUR_SPEC_INSTANCE(name, label, instance, index, count, required) \
+	{label, GET_MEMBER_CALLBACK(name), GET_MEMBER_TRAMPOLINE(name), instance, NULL, NULL, required, NULL, \
+	 Detour_VTableInstance, index, count}
+
+/**
+ * Keeps track of every detour installed from a table, so they can all be removed together.
+ *
+ * A table is installed as one group. Every detour in it is created before any of them is enabled,
+ * and then the inline ones are all enabled with one patch transaction, followed by the vtable
+ * hooks. If anything fails on the way, the detours created so far are destroyed and none of the
+ * group is left installed.
+ */
+class CDetourRegistry
+{
+public:
+	/**
+	 * Creates and enables a group of detours.
+	 *
+	 * @param specs			Table of detours.
+	 * @param count			Number of entries in the table.
+	 * @return				True on success, false otherwise.
+	 */
+	static bool Install(const DetourSpec *specs, size_t count);
+
+	/**
+	 * Removes the installed detour that calls its original through trampoline, e.g.
+	 * GET_MEMBER_TRAMPOLINE(name). This may be called from the detour's own callback, once it no
+	 * longer needs the original.
+	 */
+	static void Remove(void **trampoline);
+
+	/* Removes every installed detour, most recently installed first */
+	static void RemoveAll();
+};
+
+#endif // _INCLUDE_SRCDS_OSX_REGISTRY_H_
@@ -0,0 +1,317 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_STATICHOOK_H_
+#define _INCLUDE_SRCDS_OSX_STATICHOOK_H_
+
+#include "dispatcher.h"
+#include "registry.h"
+#include <new>
+
+/* Hooks one StaticHook can have at once */
+#define STATICHOOK_MAX_HOOKS	8
+
+/**
+ * Pre and post hooks on a virtual function whose prototype is known at build time.
+ *
+ * This does what CDetourDispatcher does, except that the compiler generates the dispatch for
+ * the given member function type. The vtable entry points straight at it, so nothing is
+ * generated at run time and no executable memory is allocated. Hooks get typed arguments
+ * instead of a DetourContext.
+ *
+ * Each hook site needs a type of its own, declared with STATICHOOK_DECL, since the state is
+ * kept in static members:
+ *
+ *   STATICHOOK_DECL(SetShaderAPIHook, void (CMaterialSystem::*)(const char *));
+ *
+ *   DetourResult OnSetShaderAPI(CMaterialSystem *self, StaticHookReturn<void> *ret, const char *&name) { ... }
+ *
+ *   DetourSpec spec = DETOUR_SPEC_STATICHOOK(SetShaderAPIHook, "SetShaderAPI", vtable, 10, true);
+ *   CDetourRegistry::Install(&spec, 1);
+ *   SetShaderAPIHook::AddHook(OnSetShaderAPI, NULL);
+ *
+ * Pre hooks may change the arguments, and post hooks see what will be returned in ret->Get().
+ * A hook returning Detour_Override or Detour_Supercede must call ret->Set().
+ *
+ * Hooks are read without a lock. A slot freed by RemoveHook may be reused by the next AddHook
+ * while another thread is still calling through it, so that thread could run the new post hook
+ * without its pre hook.
+ */
+template <typename Tag, typename Func>
+class StaticHook;
+
+/**
+ * What a StaticHook will return. Nothing is constructed until the original returns or a hook
+ * sets a value, so the return type needs no default constructor.
+ */
+template <typename R>
+class StaticHookReturn
+{
+public:
+	StaticHookReturn() : m_Set(false)
+	{
+	}
+
+	~StaticHookReturn()
+	{
+		if (m_Set)
+			Get()->~R();
+	}
+
+	/* Value that will be returned, or NULL if there is none yet */
+	R *Get()
+	{
+		return m_Set ? reinterpret_cast<R *>(m_Storage) : NULL;
+	}
+
+	void Set(const R &value)
+	{
+		if (m_Set)
+			Get()->~R();
+
+		new (m_Storage) R(value);
+		m_Set = true;
+	}
+
+	template <typename F>
+	void Store(F call)
+	{
+		if (m_Set)
+			Get()->~R();
+
+		new (m_Storage) R(call());
+		m_Set = true;
+	}
+
+	R Return()
+	{
+		return static_cast<R &&>(*Get());
+	}
+private:
+	StaticHookReturn(const StaticHookReturn &);
+	StaticHookReturn &operator=(const StaticHookReturn &);
+private:
+	alignas(R) unsigned char m_Storage[sizeof(R)];
+	bool m_Set;
+};
+
+/* A reference is kept as a pointer to what it refers to */
+template <typename R>
+class StaticHookReturn<R &>
+{
+public:
+	StaticHookReturn() : m_Value(NULL)
+	{
+	}
+
+	R *Get()
+	{
+		return m_Value;
+	}
+
+	void Set(R &value)
+	{
+		m_Value = &value;
+	}
+
+	template <typename F>
+	void Store(F call)
+	{
+		m_Value = &call();
+	}
+
+	R &Return()
+	{
+		return *m_Value;
+	}
+private:
+	R *m_Value;
+};
+
+template <>
+class StaticHookReturn<void>
+{
+public:
+	void *Get()
+	{
+		return NULL;
+	}
+
+	template <typename F>
+	void Store(F call)
+	{
+		call();
+	}
+
+	void Return()
+	{
+	}
+};
+
+template <typename Tag, typename R, typename C, typename... Args>
+class StaticHook<Tag, R (C::*)(Args...)>
+{
+	typedef StaticHookReturn<R> Return;
+public:
+	typedef DetourResult (*Hook)(C *self, Return *ret, Args &... args);
+
+	/**
+	 * Adds a hook, which runs after those already added.
+	 *
+	 * @param pre		Called before the original, or NULL.
+	 * @param post		Called after the original, or NULL.
+	 * @return			True on success, false if there is no room left.
+	 */
+	static bool AddHook(Hook pre, Hook post)
+	{
+		if (!pre && !post)
+			return false;
+
+		for (size_t i = 0; i < STATICHOOK_MAX_HOOKS; i++)
+		{
+			Entry &entry = ms_Hooks[i];
+			if (entry.pre || entry.post)
+				continue;
+
+			/* Readers check pre first, so it is written last */
+			entry.post = post;
+			__sync_synchronize();
+			entry.pre = pre;
+
+			if (i >= ms_Count)
+			{
+				__sync_synchronize();
+				ms_Count = i + 1;
+			}
+
+			return true;
+		}
+
+		return false;
+	}
+
+	static bool RemoveHook(Hook pre, Hook post)
+	{
+		for (size_t i = 0; i < ms_Count; i++)
+		{
+			Entry &entry = ms_Hooks[i];
+			if (entry.pre != pre || entry.post != post)
+				continue;
+
+			entry.pre = NULL;
+			entry.post = NULL;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	/* Calls the function without any hooks */
+	static R CallOriginal(C *self, Args... args)
+	{
+		return (self->*ms_Original)(args...);
+	}
+
+	static void *GetCallback()
+	{
+		return GetCodeAddress(&Thunk::Call);
+	}
+
+	static void **GetTrampoline()
+	{
+		return reinterpret_cast<void **>(&ms_Original);
+	}
+private:
+	struct Entry
+	{
+		Hook volatile pre;
+		Hook volatile post;
+	};
+
+	/* Put in the vtable, so that this is the object */
+	class Thunk
+	{
+	public:
+		R Call(Args... args)
+		{
+			return Dispatch(reinterpret_cast<C *>(this), args...);
+		}
+	};
+
+	static R Dispatch(C *self, Args... args)
+	{
+		size_t count = ms_Count;
+		if (!count)
+			return (self->*ms_Original)(args...);
+
+		Return ret;
+		DetourResult status = Detour_Ignored;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			Hook pre = ms_Hooks[i].pre;
+			if (pre)
+			{
+				DetourResult result = pre(self, &ret, args...);
+				if (result > status)
+					status = result;
+			}
+		}
+
+		if (status == Detour_Override)
+			(self->*ms_Original)(args...);
+		else if (status != Detour_Supercede)
+			ret.Store([&]() -> R { return (self->*ms_Original)(args...); });
+
+		for (size_t i = 0; i < count; i++)
+		{
+			Hook post = ms_Hooks[i].post;
+			if (post)
+				post(self, &ret, args...);
+		}
+
+		return ret.Return();
+	}
+private:
+	static R (C::*ms_Original)(Args...);
+	static Entry ms_Hooks[STATICHOOK_MAX_HOOKS];
+	static volatile size_t ms_Count;
+};
+
+template <typename Tag, typename R, typename C, typename... Args>
+R (C::*StaticHook<Tag, R (C::*)(Args...)>::ms_Original)(Args...) = NULL;
+
+template <typename Tag, typename R, typename C, typename... Args>
+typename StaticHook<Tag, R (C::*)(Args...)>::Entry StaticHook<Tag, R (C::*)(Args...)>::ms_Hooks[STATICHOOK_MAX_HOOKS];
+
+template <typename Tag, typename R, typename C, typename... Args>
+volatile size_t StaticHook<Tag, R (C::*)(Args...)>::ms_Count = 0;
+
+#define STATICHOOK_DECL(name, func) \
+	struct name##Tag; \
+	typedef StaticHook<name##Tag, func> name
+
+#define DETOUR_SPEC_STATICHOOK(name, label, vtable, index, required) \
+	{label, name::GetCallback(), name::GetTrampoline(), vtable, NULL, NULL, required, NULL, \
+	 Detour_VTableSlot, index, 0}
+
+#endif // _INCLUDE_SRCDS_OSX_STATICHOOK_H_
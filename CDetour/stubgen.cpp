@@ -0,0 +1,541 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stubgen.h"
+#include "threadfreezer.h"
+#include <pthread.h>
+#include <stddef.h>
+
+#if defined(__x86_64__)
+/* Registers saved in DetourContext::gpr, in order */
+static const jit_uint8_t kContextRegs[] = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9, REG_RAX, REG_R10};
+#define STUB_XMM_COUNT	8
+
+/* Stack space needed below the return address so that calls from the stubs are aligned */
+#define STUB_CALL_ARGS	0
+#else
+static const jit_uint8_t kContextRegs[] = {REG_EAX, REG_ECX, REG_EDX};
+#define STUB_CALL_ARGS	8
+#endif
+
+/* Leaves room for the StubTarget a shared entry stub was given, right after the context */
+#define STUB_ENTRY_FRAME \
+	(((sizeof(DetourContext) + 2 * sizeof(void *) + STUB_CALL_ARGS + 15) & ~15) - sizeof(void *) - STUB_CALL_ARGS)
+#define STUB_TARGET_SLOT	sizeof(DetourContext)
+#define STUB_EXIT_FRAME \
+	(((sizeof(DetourReturn) + STUB_CALL_ARGS + 15) & ~15) - STUB_CALL_ARGS)
+
+/*
+ * Every entry stub starts by jumping through a gate pointer kept at STUB_GATE_OFFSET. It holds
+ * either the address at STUB_HOME_OFFSET, where the stub goes on from, or the one at
+ * STUB_BYPASS_OFFSET, which jumps straight to the original.
+ */
+#define STUB_GATE_OFFSET	24
+#define STUB_HOME_OFFSET	(STUB_GATE_OFFSET + sizeof(void *))
+#define STUB_BYPASS_OFFSET	(STUB_HOME_OFFSET + sizeof(void *))
+#define STUB_BODY_OFFSET	(STUB_BYPASS_OFFSET + sizeof(void *))
+
+/* Handlers whose entry stubs are shared */
+#define STUB_MAX_SHARED		8
+
+/* Per-function data that a thunk hands to a shared entry stub in r11 */
+struct StubTarget
+{
+	void *param;
+	void **original;
+};
+
+struct SharedStub
+{
+	StubEntryHandler handler;
+	StubExitHandler exitHandler;
+	GenBuffer *body;
+};
+
+static SharedStub g_SharedStubs[STUB_MAX_SHARED];
+static size_t g_SharedStubCount = 0;
+static GenBuffer *g_SharedBypass = NULL;
+static pthread_mutex_t g_SharedStubLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Registers are numbered as in sh_include.h, so r8-r15 get a REX prefix.
+ */
+
+static inline void EmitRex(GenBuffer *jit, bool wide, jit_uint8_t reg, jit_uint8_t base)
+{
+#if defined(__x86_64__)
+	if (wide || reg > 7 || base > 7)
+		X64_Emit_Rex(jit, wide, reg, 0, base);
+#endif
+}
+
+/* ModRM (and SIB) for [base+disp] */
+static void EmitMem(GenBuffer *jit, jit_uint8_t reg, jit_uint8_t base, jit_int32_t disp)
+{
+	jit_uint8_t mode;
+
+	if (disp == 0 && (base & 7) != REG_EBP)
+		mode = MOD_MEM_REG;
+	else if (disp == jit_int8_t(disp))
+		mode = MOD_DISP8;
+	else
+		mode = MOD_DISP32;
+
+	jit->write_ubyte(ia32_modrm(mode, reg & 7, base & 7));
+	if ((base & 7) == REG_ESP)
+		jit->write_ubyte(ia32_sib(NOSCALE, REG_NOIDX, REG_ESP));
+
+	if (mode == MOD_DISP8)
+		jit->write_byte(jit_int8_t(disp));
+	else if (mode == MOD_DISP32)
+		jit->write_int32(disp);
+}
+
+/* mov [base+disp], reg */
+static void StoreReg(GenBuffer *jit, jit_uint8_t base, jit_int32_t disp, jit_uint8_t reg)
+{
+	EmitRex(jit, sizeof(void *) == 8, reg, base);
+	jit->write_ubyte(IA32_MOV_RM_REG);
+	EmitMem(jit, reg, base, disp);
+}
+
+/* mov reg, [base+disp] */
+static void LoadReg(GenBuffer *jit, jit_uint8_t reg, jit_uint8_t base, jit_int32_t disp)
+{
+	EmitRex(jit, sizeof(void *) == 8, reg, base);
+	jit->write_ubyte(IA32_MOV_REG_RM);
+	EmitMem(jit, reg, base, disp);
+}
+
+/* lea reg, [base+disp] */
+static void LeaReg(GenBuffer *jit, jit_uint8_t reg, jit_uint8_t base, jit_int32_t disp)
+{
+	EmitRex(jit, sizeof(void *) == 8, reg, base);
+	jit->write_ubyte(IA32_LEA_REG_MEM);
+	EmitMem(jit, reg, base, disp);
+}
+
+/* mov dest, src */
+static void MovReg(GenBuffer *jit, jit_uint8_t dest, jit_uint8_t src)
+{
+	EmitRex(jit, sizeof(void *) == 8, src, dest);
+	jit->write_ubyte(IA32_MOV_RM_REG);
+	jit->write_ubyte(ia32_modrm(MOD_REG, src & 7, dest & 7));
+}
+
+static void MovImm(GenBuffer *jit, jit_uint8_t reg, const void *value)
+{
+#if defined(__x86_64__)
+	X64_Mov_Reg_Imm64(jit, reg, jit_int64_t(value));
+#else
+	IA32_Mov_Reg_Imm32(jit, reg, jit_int32_t(value));
+#endif
+}
+
+/* add/sub esp, value */
+static void AdjustStack(GenBuffer *jit, jit_int32_t value)
+{
+	EmitRex(jit, sizeof(void *) == 8, 0, REG_ESP);
+	if (value > 0)
+		IA32_Add_Rm_Imm32(jit, REG_ESP, value, MOD_REG);
+	else
+		IA32_Sub_Rm_Imm32(jit, REG_ESP, -value, MOD_REG);
+}
+
+#if defined(__x86_64__)
+/* movdqu [base+disp], xmm */
+static void StoreXmm(GenBuffer *jit, jit_uint8_t base, jit_int32_t disp, jit_uint8_t xmm)
+{
+	jit->write_ubyte(0xF3);
+	EmitRex(jit, false, xmm, base);
+	jit->write_ubyte(0x0F);
+	jit->write_ubyte(0x7F);
+	EmitMem(jit, xmm, base, disp);
+}
+
+/* movdqu xmm, [base+disp] */
+static void LoadXmm(GenBuffer *jit, jit_uint8_t xmm, jit_uint8_t base, jit_int32_t disp)
+{
+	jit->write_ubyte(0xF3);
+	EmitRex(jit, false, xmm, base);
+	jit->write_ubyte(0x0F);
+	jit->write_ubyte(0x6F);
+	EmitMem(jit, xmm, base, disp);
+}
+#else
+/* fld/fstp qword [base+disp] */
+static void FpuMem64(GenBuffer *jit, bool store, jit_uint8_t base, jit_int32_t disp)
+{
+	jit->write_ubyte(store ? IA32_FSTP_MEM64 : IA32_FLD_MEM64);
+	EmitMem(jit, store ? 3 : 0, base, disp);
+}
+#endif
+
+/* Saves or restores the return value registers at [esp+disp] */
+static void SaveReturn(GenBuffer *jit, jit_int32_t disp, bool restore, bool fpu)
+{
+	const jit_uint8_t regs[] = {REG_EAX, REG_EDX};
+
+	for (size_t i = 0; i < 2; i++)
+	{
+		jit_int32_t offs = disp + offsetof(DetourReturn, gpr) + i * sizeof(void *);
+		if (restore)
+			LoadReg(jit, regs[i], REG_ESP, offs);
+		else
+			StoreReg(jit, REG_ESP, offs, regs[i]);
+	}
+
+#if defined(__x86_64__)
+	for (jit_uint8_t i = 0; i < 2; i++)
+	{
+		jit_int32_t offs = disp + offsetof(DetourReturn, xmm) + i * 16;
+		if (restore)
+			LoadXmm(jit, i, REG_ESP, offs);
+		else
+			StoreXmm(jit, REG_ESP, offs, i);
+	}
+#else
+	if (fpu)
+		FpuMem64(jit, !restore, REG_ESP, disp + offsetof(DetourReturn, fpu));
+#endif
+}
+
+/* Saves or restores the registers kept in the DetourContext at [esp] */
+static void SaveContext(GenBuffer *jit, bool restore)
+{
+#if defined(__x86_64__)
+	for (jit_uint8_t i = 0; i < STUB_XMM_COUNT; i++)
+	{
+		jit_int32_t offs = offsetof(DetourContext, xmm) + i * 16;
+		if (restore)
+			LoadXmm(jit, i, REG_RSP, offs);
+		else
+			StoreXmm(jit, REG_RSP, offs, i);
+	}
+#endif
+
+	for (size_t i = 0; i < sizeof(kContextRegs); i++)
+	{
+		jit_int32_t offs = offsetof(DetourContext, gpr) + i * sizeof(void *);
+		if (restore)
+			LoadReg(jit, kContextRegs[i], REG_ESP, offs);
+		else
+			StoreReg(jit, REG_ESP, offs, kContextRegs[i]);
+	}
+}
+
+#if defined(__x86_64__)
+/* Points r11 at the trampoline address of a shared stub's StubTarget, while the frame is still there */
+static void LoadSharedOriginal(GenBuffer *jit)
+{
+	LoadReg(jit, REG_R11, REG_RSP, STUB_TARGET_SLOT);
+	LoadReg(jit, REG_R11, REG_R11, offsetof(StubTarget, original));
+}
+#endif
+
+/* call/jmp [original], or [r11] if original is NULL */
+static void BranchIndirect(GenBuffer *jit, bool call, void **original)
+{
+	jit_uint8_t op = call ? 2 : 4;
+
+#if defined(__x86_64__)
+	/* r11 is free at function entry and once a function has returned */
+	if (original)
+		MovImm(jit, REG_R11, original);
+	EmitRex(jit, false, 0, REG_R11);
+	jit->write_ubyte(IA32_JMP_RM);
+	jit->write_ubyte(ia32_modrm(MOD_MEM_REG, op, REG_R11 & 7));
+#else
+	jit->write_ubyte(IA32_JMP_RM);
+	jit->write_ubyte(ia32_modrm(MOD_MEM_REG, op, REG_IMM_BASE));
+	jit->write_int32(jit_int32_t(original));
+#endif
+}
+
+/*
+ * Runs once the original has returned to the stub: calls handler(regs, sp) and returns to the
+ * address it hands back. A push/ret pair keeps the return stack buffer in sync, since the
+ * caller's call is still the top entry.
+ */
+static void EmitExit(GenBuffer *jit, StubExitHandler handler, bool fpuReturn)
+{
+	const jit_int32_t frame = STUB_EXIT_FRAME;
+#if defined(__x86_64__)
+	const jit_uint8_t target = REG_R11;
+#else
+	const jit_uint8_t target = REG_ECX;
+#endif
+
+	AdjustStack(jit, -frame);
+	SaveReturn(jit, 0, false, fpuReturn);
+
+#if defined(__x86_64__)
+	LeaReg(jit, REG_RDI, REG_RSP, 0);
+	LeaReg(jit, REG_RSI, REG_RSP, frame);
+#else
+	LeaReg(jit, REG_EAX, REG_ESP, frame);
+	IA32_Push_Reg(jit, REG_EAX);
+	LeaReg(jit, REG_EAX, REG_ESP, 4);
+	IA32_Push_Reg(jit, REG_EAX);
+#endif
+	MovImm(jit, REG_EAX, reinterpret_cast<void *>(handler));
+	IA32_Call_Reg(jit, REG_EAX);
+#if !defined(__x86_64__)
+	AdjustStack(jit, STUB_CALL_ARGS);
+#endif
+
+	MovReg(jit, target, REG_EAX);
+	SaveReturn(jit, 0, true, fpuReturn);
+	AdjustStack(jit, frame);
+	EmitRex(jit, false, 0, target);
+	IA32_Push_Reg(jit, target & 7);
+	IA32_Return(jit);
+}
+
+/*
+ * Emits the part of an entry stub that does the work. A shared stub (original == NULL) is entered
+ * with r11 pointing at a StubTarget and takes param and the trampoline from there.
+ */
+static void EmitEntry(GenBuffer *jit, StubEntryHandler handler, StubExitHandler exitHandler, void *param,
+                      void **original, bool fpuReturn)
+{
+	const jit_int32_t frame = STUB_ENTRY_FRAME;
+	const jit_int32_t retSlot = frame;
+
+	AdjustStack(jit, -frame);
+	SaveContext(jit, false);
+#if defined(__x86_64__)
+	if (!original)
+		StoreReg(jit, REG_RSP, STUB_TARGET_SLOT, REG_R11);
+#endif
+
+	LeaReg(jit, REG_EAX, REG_ESP, retSlot + sizeof(void *));
+	StoreReg(jit, REG_ESP, offsetof(DetourContext, stack), REG_EAX);
+	LoadReg(jit, REG_EAX, REG_ESP, retSlot);
+	StoreReg(jit, REG_ESP, offsetof(DetourContext, returnAddress), REG_EAX);
+
+	/* handler(param, ctx) */
+#if defined(__x86_64__)
+	if (original)
+		MovImm(jit, REG_RDI, param);
+	else
+		LoadReg(jit, REG_RDI, REG_R11, offsetof(StubTarget, param));
+	LeaReg(jit, REG_RSI, REG_RSP, 0);
+#else
+	IA32_Push_Reg(jit, REG_ESP);
+	IA32_Push_Imm32(jit, jit_int32_t(param));
+#endif
+	MovImm(jit, REG_EAX, reinterpret_cast<void *>(handler));
+	IA32_Call_Reg(jit, REG_EAX);
+#if !defined(__x86_64__)
+	AdjustStack(jit, STUB_CALL_ARGS);
+#endif
+
+	IA32_Cmp_Rm_Imm8(jit, MOD_REG, REG_EAX, Stub_Supercede);
+	jitoffs_t supercede = IA32_Jump_Cond_Imm32(jit, CC_E, 0);
+	IA32_Cmp_Rm_Imm8(jit, MOD_REG, REG_EAX, Stub_Return);
+	jitoffs_t jumpOriginal = IA32_Jump_Cond_Imm32(jit, CC_NE, 0);
+
+	/*
+	 * Call the original in place of the caller: with the return address popped, the arguments
+	 * are where it expects them without knowing how many there are.
+	 */
+	SaveContext(jit, true);
+#if defined(__x86_64__)
+	if (!original)
+		LoadSharedOriginal(jit);
+#endif
+	AdjustStack(jit, frame + sizeof(void *));
+	BranchIndirect(jit, true, original);
+	EmitExit(jit, exitHandler, fpuReturn);
+
+	/* Restore the (possibly changed) arguments and run the original */
+	IA32_Send_Jump32_Here(jit, jumpOriginal);
+	SaveContext(jit, true);
+#if defined(__x86_64__)
+	if (!original)
+		LoadSharedOriginal(jit);
+#endif
+	AdjustStack(jit, frame);
+	BranchIndirect(jit, false, original);
+
+	/* Return the handler's value */
+	IA32_Send_Jump32_Here(jit, supercede);
+	SaveReturn(jit, offsetof(DetourContext, ret), true, fpuReturn);
+	AdjustStack(jit, frame);
+	IA32_Return(jit);
+}
+
+#if defined(__x86_64__)
+/*
+ * Returns the entry stub shared by everything using these handlers, generating it the first time.
+ * Their bypass, which only needs the StubTarget, is shared by all of them.
+ */
+static void *GetSharedStub(StubEntryHandler handler, StubExitHandler exitHandler)
+{
+	void *body = NULL;
+
+	pthread_mutex_lock(&g_SharedStubLock);
+
+	for (size_t i = 0; i < g_SharedStubCount; i++)
+	{
+		if (g_SharedStubs[i].handler == handler && g_SharedStubs[i].exitHandler == exitHandler)
+		{
+			body = g_SharedStubs[i].body->GetData();
+			break;
+		}
+	}
+
+	if (!g_SharedBypass)
+	{
+		/* Never freed either, like the stubs */
+		GenBuffer *jit = new GenBuffer();
+		LoadReg(jit, REG_R11, REG_R11, offsetof(StubTarget, original));
+		BranchIndirect(jit, false, NULL);
+
+		if (jit->GetData())
+		{
+			jit->SetRE();
+			g_SharedBypass = jit;
+		}
+		else
+		{
+			delete jit;
+		}
+	}
+
+	if (!body && g_SharedBypass && g_SharedStubCount < STUB_MAX_SHARED)
+	{
+		/* Never freed, the thunks of any remaining stubs jump here */
+		GenBuffer *jit = new GenBuffer();
+		EmitEntry(jit, handler, exitHandler, NULL, NULL, false);
+
+		if (jit->GetData())
+		{
+			jit->SetRE();
+
+			SharedStub &stub = g_SharedStubs[g_SharedStubCount++];
+			stub.handler = handler;
+			stub.exitHandler = exitHandler;
+			stub.body = jit;
+			body = jit->GetData();
+		}
+		else
+		{
+			delete jit;
+		}
+	}
+
+	pthread_mutex_unlock(&g_SharedStubLock);
+
+	return body;
+}
+#endif
+
+/* jmp [gate], followed by the bypass of a stub that isn't shared and padding up to the gate */
+static void EmitGate(GenBuffer *jit, void **original)
+{
+	jitoffs_t start = jit->get_outputpos();
+
+	jit->write_ubyte(IA32_JMP_RM);
+#if defined(__x86_64__)
+	jit->write_ubyte(ia32_modrm(MOD_MEM_REG, 4, REG_EBP));
+	jit->write_int32(STUB_GATE_OFFSET - (start + 6));
+#else
+	/* Absolute, so it is fixed up once the buffer has stopped moving */
+	jit->write_ubyte(ia32_modrm(MOD_MEM_REG, 4, REG_IMM_BASE));
+	jit->write_int32(0);
+#endif
+
+	if (original)
+		BranchIndirect(jit, false, original);
+
+	while (jit->get_outputpos() < STUB_GATE_OFFSET)
+		jit->write_ubyte(IA32_INT3);
+}
+
+void GenerateEntryStub(GenBuffer *jit, StubEntryHandler handler, StubExitHandler exitHandler, void *param,
+                       void **original, bool fpuReturn)
+{
+#if defined(__x86_64__)
+	void *body = GetSharedStub(handler, exitHandler);
+	if (body)
+	{
+		/* lea r11, [rip+target] */
+		jit->write_ubyte(0x4C);
+		jit->write_ubyte(IA32_LEA_REG_MEM);
+		jit->write_ubyte(ia32_modrm(MOD_MEM_REG, REG_R11 & 7, REG_EBP));
+		jit->write_int32(STUB_BODY_OFFSET - 7);
+		EmitGate(jit, NULL);
+
+		jit->write_uint64(jit_uint64_t(body));
+		jit->write_uint64(jit_uint64_t(body));
+		jit->write_uint64(jit_uint64_t(g_SharedBypass->GetData()));
+
+		StubTarget target = {param, original};
+		jit->push(target);
+		return;
+	}
+#endif
+
+	EmitGate(jit, original);
+	jit->push(static_cast<void *>(NULL));
+	jit->push(static_cast<void *>(NULL));
+	jit->push(static_cast<void *>(NULL));
+	EmitEntry(jit, handler, exitHandler, param, original, fpuReturn);
+
+	if (!jit->GetData())
+		return;
+
+	unsigned char *home = jit->GetData() + STUB_BODY_OFFSET;
+	jit->rewrite(STUB_GATE_OFFSET, home);
+	jit->rewrite(STUB_HOME_OFFSET, home);
+	jit->rewrite(STUB_BYPASS_OFFSET, jit->GetData() + 6);
+#if !defined(__x86_64__)
+	jit->rewrite(2, jit->GetData() + STUB_GATE_OFFSET);
+#endif
+}
+
+void EmitStubExit(GenBuffer *jit, StubExitHandler handler, bool fpuReturn)
+{
+	EmitExit(jit, handler, fpuReturn);
+}
+
+void SetEntryStubBypass(GenBuffer *jit, bool bypass)
+{
+	unsigned char *gate = jit->GetData() + STUB_GATE_OFFSET;
+	void **write = reinterpret_cast<void **>(jit->GetWritableData() + STUB_GATE_OFFSET);
+	void *target = bypass ? write[2] : write[1];
+
+	/* The page stays executable in case the stub is running, unless it has a writable view */
+	bool patchable = jit->GetWritableData() == jit->GetData();
+	if (patchable)
+	{
+		CCodePatchLock lock;
+		SetMemPatchable(gate, sizeof(void *));
+		*reinterpret_cast<void *volatile *>(write) = target;
+		SetMemExec(gate, sizeof(void *));
+	}
+	else
+	{
+		*reinterpret_cast<void *volatile *>(write) = target;
+	}
+}
@@ -0,0 +1,89 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_STUBGEN_H_
+#define _INCLUDE_SRCDS_OSX_STUBGEN_H_
+
+#include "dispatcher.h"
+
+/*
+ * Generated stubs shared by detours that need to see a call from both ends, without knowing
+ * the function's prototype.
+ */
+
+/* What an entry stub does once its handler returns */
+enum StubAction
+{
+	Stub_Original = 0,		/* Jump to the original with nothing else to do */
+	Stub_Return,			/* Call the original, then the exit handler */
+	Stub_Supercede			/* Return ctx->ret without calling the original */
+};
+
+/* Called by an entry stub, returns a StubAction */
+typedef int (*StubEntryHandler)(void *param, DetourContext *ctx);
+
+/* Called once the original returns, with sp just past the return address. Returns where to go next */
+typedef void *(*StubExitHandler)(DetourReturn *regs, uintptr_t *sp);
+
+/**
+ * Generates a detour callback that saves the argument registers into a DetourContext on the
+ * stack and calls handler(param, ctx). Registers changed through ctx are passed on to the original.
+ *
+ * For Stub_Return the stub pops the return address and calls the original itself, so the
+ * handler has to keep ctx->returnAddress for the exit handler to hand back. Calling rather than
+ * swapping the return address means the original's return is predicted correctly.
+ *
+ * On x86-64 the stub itself is shared by every caller passing the same handlers, and jit only
+ * gets a 64-byte thunk that jumps there with param and original: lea r11 and jmp [gate] padded
+ * to 24 bytes, the gate, home and bypass pointers, then the 16-byte StubTarget.
+ *
+ * @param jit			Buffer to generate into.
+ * @param handler		Handler to call on entry.
+ * @param exitHandler	Handler to call after the original for Stub_Return.
+ * @param param			First argument to the entry handler.
+ * @param original		Holds the trampoline address, read on every call.
+ * @param fpuReturn		Whether the return value is also kept in st0 (x86-32 only).
+ */
+void GenerateEntryStub(GenBuffer *jit, StubEntryHandler handler, StubExitHandler exitHandler, void *param,
+                       void **original, bool fpuReturn);
+
+/**
+ * Emits the code a stub runs once the original has returned to it, with the stack as the original
+ * left it: calls handler(regs, sp) and goes on to the address it returns.
+ */
+void EmitStubExit(GenBuffer *jit, StubExitHandler handler, bool fpuReturn);
+
+/**
+ * Makes an entry stub from GenerateEntryStub jump straight to the original without saving
+ * anything or calling its handler, or go back to normal. Takes effect for new calls with a single
+ * pointer store.
+ */
+void SetEntryStubBypass(GenBuffer *jit, bool bypass);
+
+#if defined(__x86_64__)
+/* Exit handlers never see a callee pop its arguments */
+#define STUB_POP_SLACK		0
+#else
+/* Functions returning structures in memory pop the hidden pointer on return */
+#define STUB_POP_SLACK		1
+#endif
+
+#endif // _INCLUDE_SRCDS_OSX_STUBGEN_H_
@@ -0,0 +1,361 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "threadfreezer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#elif defined(__linux__)
+#include <dirent.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+static pthread_once_t g_PatchLockOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_PatchLock;
+
+static void InitPatchLock()
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&g_PatchLock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+CCodePatchLock::CCodePatchLock()
+{
+	Acquire();
+}
+
+CCodePatchLock::~CCodePatchLock()
+{
+	Release();
+}
+
+void CCodePatchLock::Acquire()
+{
+	pthread_once(&g_PatchLockOnce, InitPatchLock);
+	pthread_mutex_lock(&g_PatchLock);
+}
+
+void CCodePatchLock::Release()
+{
+	pthread_mutex_unlock(&g_PatchLock);
+}
+
+static uintptr_t FixupIP(uintptr_t ip, const IPFixup *fixups, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (ip >= fixups[i].start && ip < fixups[i].start + fixups[i].size)
+			return fixups[i].target + (ip - fixups[i].start);
+	}
+
+	return ip;
+}
+
+#if defined(__linux__)
+#define FREEZE_SIGNAL		(SIGRTMIN + 4)
+#define FREEZE_TIMEOUT_MS	1000
+#define FREEZE_MAX_THREADS	1024
+
+static volatile int g_FrozenThreads;
+static volatile int g_ReleasedThreads;
+static volatile bool g_Release;
+static const IPFixup *volatile g_Fixups;
+static volatile size_t g_FixupCount;
+
+static void FreezeHandler(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = (ucontext_t *)context;
+
+	__sync_fetch_and_add(&g_FrozenThreads, 1);
+
+	while (!g_Release)
+		sched_yield();
+
+#if defined(__x86_64__)
+	greg_t &ip = uc->uc_mcontext.gregs[REG_RIP];
+#else
+	greg_t &ip = uc->uc_mcontext.gregs[REG_EIP];
+#endif
+	ip = (greg_t)FixupIP((uintptr_t)ip, g_Fixups, g_FixupCount);
+
+	__sync_fetch_and_add(&g_ReleasedThreads, 1);
+}
+
+static bool WaitForCount(volatile int *counter, int expected)
+{
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (*counter < expected)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 > FREEZE_TIMEOUT_MS)
+			return false;
+
+		sched_yield();
+	}
+
+	return true;
+}
+
+static int g_SignalledThreads;
+#endif
+
+CThreadFreezer::CThreadFreezer() : m_Frozen(false)
+#if defined(__APPLE__)
+	, m_Threads(NULL), m_ThreadCount(0)
+#endif
+{
+}
+
+CThreadFreezer::~CThreadFreezer()
+{
+	if (m_Frozen)
+		Thaw();
+}
+
+bool CThreadFreezer::IsFrozen() const
+{
+	return m_Frozen;
+}
+
+#if defined(__APPLE__)
+bool CThreadFreezer::Freeze()
+{
+	thread_act_array_t threads;
+	mach_msg_type_number_t count;
+	mach_port_t self = mach_thread_self();
+
+	if (m_Frozen)
+	{
+		mach_port_deallocate(mach_task_self(), self);
+		return true;
+	}
+
+	/* Another thread freezing at the same time would suspend this one while it suspends that one */
+	CCodePatchLock::Acquire();
+
+	if (task_threads(mach_task_self(), &threads, &count) != KERN_SUCCESS)
+	{
+		CCodePatchLock::Release();
+		mach_port_deallocate(mach_task_self(), self);
+		return false;
+	}
+
+	for (mach_msg_type_number_t i = 0; i < count; i++)
+	{
+		if (threads[i] == self)
+			continue;
+
+		/* A thread that fails to suspend has most likely exited already */
+		if (thread_suspend(threads[i]) != KERN_SUCCESS)
+		{
+			mach_port_deallocate(mach_task_self(), threads[i]);
+			threads[i] = MACH_PORT_NULL;
+		}
+	}
+
+	mach_port_deallocate(mach_task_self(), self);
+
+	m_Threads = threads;
+	m_ThreadCount = count;
+	m_Frozen = true;
+
+	return true;
+}
+
+void CThreadFreezer::Thaw(const IPFixup *fixups, size_t count)
+{
+	thread_act_array_t threads = (thread_act_array_t)m_Threads;
+	mach_port_t self = mach_thread_self();
+
+	if (!m_Frozen)
+	{
+		mach_port_deallocate(mach_task_self(), self);
+		return;
+	}
+
+	for (unsigned int i = 0; i < m_ThreadCount; i++)
+	{
+		if (threads[i] == MACH_PORT_NULL)
+			continue;
+
+		if (threads[i] != self)
+		{
+			if (count)
+			{
+#if defined(__x86_64__)
+				x86_thread_state64_t state;
+				mach_msg_type_number_t stateCount = x86_THREAD_STATE64_COUNT;
+				if (thread_get_state(threads[i], x86_THREAD_STATE64, (thread_state_t)&state, &stateCount) == KERN_SUCCESS)
+				{
+					uintptr_t ip = FixupIP(state.__rip, fixups, count);
+					if (ip != state.__rip)
+					{
+						state.__rip = ip;
+						thread_set_state(threads[i], x86_THREAD_STATE64, (thread_state_t)&state, stateCount);
+					}
+				}
+#else
+				x86_thread_state32_t state;
+				mach_msg_type_number_t stateCount = x86_THREAD_STATE32_COUNT;
+				if (thread_get_state(threads[i], x86_THREAD_STATE32, (thread_state_t)&state, &stateCount) == KERN_SUCCESS)
+				{
+					uintptr_t ip = FixupIP(state.__eip, fixups, count);
+					if (ip != state.__eip)
+					{
+						state.__eip = ip;
+						thread_set_state(threads[i], x86_THREAD_STATE32, (thread_state_t)&state, stateCount);
+					}
+				}
+#endif
+			}
+
+			thread_resume(threads[i]);
+		}
+
+		mach_port_deallocate(mach_task_self(), threads[i]);
+	}
+
+	mach_port_deallocate(mach_task_self(), self);
+	vm_deallocate(mach_task_self(), (vm_address_t)threads, m_ThreadCount * sizeof(thread_act_t));
+
+	m_Threads = NULL;
+	m_ThreadCount = 0;
+	m_Frozen = false;
+
+	CCodePatchLock::Release();
+}
+#elif defined(__linux__)
+bool CThreadFreezer::Freeze()
+{
+	struct sigaction sa;
+	DIR *dir;
+	struct dirent *ent;
+	pid_t threads[FREEZE_MAX_THREADS];
+	int threadCount = 0;
+	pid_t self = (pid_t)syscall(SYS_gettid);
+
+	if (m_Frozen)
+		return true;
+
+	/* The counters and fixups below are shared by every freezer */
+	CCodePatchLock::Acquire();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = FreezeHandler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigfillset(&sa.sa_mask);
+	if (sigaction(FREEZE_SIGNAL, &sa, NULL) != 0)
+	{
+		CCodePatchLock::Release();
+		return false;
+	}
+
+	/* Collect the thread ids first, since a stopped thread could be holding the malloc lock */
+	dir = opendir("/proc/self/task");
+	if (!dir)
+	{
+		CCodePatchLock::Release();
+		return false;
+	}
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		pid_t tid = (pid_t)atoi(ent->d_name);
+		if (tid <= 0 || tid == self)
+			continue;
+
+		if (threadCount == FREEZE_MAX_THREADS)
+		{
+			closedir(dir);
+			CCodePatchLock::Release();
+			return false;
+		}
+
+		threads[threadCount++] = tid;
+	}
+
+	closedir(dir);
+
+	g_FrozenThreads = 0;
+	g_ReleasedThreads = 0;
+	g_Release = false;
+	g_Fixups = NULL;
+	g_FixupCount = 0;
+	g_SignalledThreads = 0;
+
+	for (int i = 0; i < threadCount; i++)
+	{
+		if (syscall(SYS_tgkill, getpid(), threads[i], FREEZE_SIGNAL) == 0)
+			g_SignalledThreads++;
+	}
+
+	m_Frozen = true;
+
+	/* A thread that has the signal blocked will never stop, so give up rather than hang */
+	if (!WaitForCount(&g_FrozenThreads, g_SignalledThreads))
+	{
+		Thaw();
+		printf("Failed to stop all threads (%d of %d)\n", g_FrozenThreads, g_SignalledThreads);
+		return false;
+	}
+
+	return true;
+}
+
+void CThreadFreezer::Thaw(const IPFixup *fixups, size_t count)
+{
+	if (!m_Frozen)
+		return;
+
+	g_Fixups = fixups;
+	g_FixupCount = count;
+	__sync_synchronize();
+	g_Release = true;
+
+	/* The fixups are read by the handlers, so they have to stay alive until every thread is done */
+	WaitForCount(&g_ReleasedThreads, g_FrozenThreads);
+
+	/* Anything that stops late must not see fixups that are no longer valid */
+	g_FixupCount = 0;
+	g_Fixups = NULL;
+
+	m_Frozen = false;
+
+	CCodePatchLock::Release();
+}
+#else
+#error "Unsupported platform."
+#endif
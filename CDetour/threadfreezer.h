@@ -0,0 +1,96 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef _INCLUDE_SRCDS_OSX_THREADFREEZER_H_
+#define _INCLUDE_SRCDS_OSX_THREADFREEZER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Moves any thread whose instruction pointer lies in [start, start + size) to the same offset
+ * from target.
+ */
+struct IPFixup
+{
+	uintptr_t start;
+	size_t size;
+	uintptr_t target;
+};
+
+/**
+ * Serializes everything that rewrites code, since patches from different threads can share a page
+ * and one of them could make it executable again while the other is still writing. Taken by
+ * CPatchTransaction::Commit, CDetourManager::EnableDetours and DisableDetours, and by a freezer
+ * from Freeze until Thaw, so that two freezers never try to stop each other. It is recursive, so
+ * any of these can be nested in another.
+ */
+class CCodePatchLock
+{
+public:
+	CCodePatchLock();
+	~CCodePatchLock();
+public:
+	static void Acquire();
+	static void Release();
+private:
+	// Disallow copy construction and assignment
+	CCodePatchLock(const CCodePatchLock &other);
+	CCodePatchLock &operator =(const CCodePatchLock &other);
+};
+
+/**
+ * Stops every other thread in the process so that code they may be executing can be rewritten.
+ *
+ * On Mac OS X threads are suspended through their Mach ports. On Linux each thread is sent a
+ * signal whose handler waits until the freezer thaws, then applies any instruction pointer
+ * fixups to its own context. Threads created while frozen are not stopped.
+ *
+ * The code patch lock is held while frozen.
+ */
+class CThreadFreezer
+{
+public:
+	CThreadFreezer();
+	~CThreadFreezer();
+public:
+	bool Freeze();
+
+	/**
+	 * Resumes all threads, first moving any that stopped within one of the given ranges.
+	 */
+	void Thaw(const IPFixup *fixups = NULL, size_t count = 0);
+
+	bool IsFrozen() const;
+private:
+	// Disallow copy construction and assignment
+	CThreadFreezer(const CThreadFreezer &other);
+	CThreadFreezer &operator =(const CThreadFreezer &other);
+private:
+	bool m_Frozen;
+#if defined(__APPLE__)
+	void *m_Threads;
+	unsigned int m_ThreadCount;
+#endif
+};
+
+#endif // _INCLUDE_SRCDS_OSX_THREADFREEZER_H_
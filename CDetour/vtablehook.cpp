@@ -0,0 +1,212 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "vtablehook.h"
+#include <sh_include.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#endif
+
+/* Entries before the address point of a vtable: offset to top and type info */
+#define VTABLE_PREFIX		2
+
+bool GetMemAccess(void *addr, int &access)
+{
+#if defined(__APPLE__)
+	mach_vm_address_t region = mach_vm_address_t(addr);
+	mach_vm_size_t size;
+	vm_region_basic_info_data_64_t info;
+	mach_msg_type_number_t count = VM_REGION_BASIC_INFO_COUNT_64;
+	mach_port_t object;
+
+	if (mach_vm_region(mach_task_self(), &region, &size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info,
+	                   &count, &object) != KERN_SUCCESS || region > mach_vm_address_t(addr))
+	{
+		return false;
+	}
+
+	/* VM_PROT_* have the same values as PROT_* */
+	access = info.protection & (SH_MEM_READ|SH_MEM_WRITE|SH_MEM_EXEC);
+	return true;
+#elif defined(__linux__)
+	FILE *fp = fopen("/proc/self/maps", "r");
+	if (!fp)
+		return false;
+
+	char line[512];
+	bool found = false;
+
+	while (!found && fgets(line, sizeof(line), fp))
+	{
+		unsigned long start, end;
+		char perms[5];
+
+		if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3)
+			continue;
+
+		if (uintptr_t(addr) >= start && uintptr_t(addr) < end)
+		{
+			access = (perms[0] == 'r' ? SH_MEM_READ : 0) | (perms[1] == 'w' ? SH_MEM_WRITE : 0) |
+			         (perms[2] == 'x' ? SH_MEM_EXEC : 0);
+			found = true;
+		}
+	}
+
+	fclose(fp);
+	return found;
+#else
+	return false;
+#endif
+}
+
+CVTableHook::CVTableHook() : m_Table(NULL), m_Index(0), m_Callback(NULL), m_Original(NULL), m_Access(0),
+	m_Instance(NULL), m_OriginalTable(NULL), m_Copy(NULL), m_Enabled(false)
+{
+}
+
+CVTableHook::~CVTableHook()
+{
+	free(m_Copy);
+}
+
+CVTableHook *CVTableHook::CreateSlotHook(void **vtable, int index, void *callback, void **original)
+{
+	if (!vtable || index < 0 || !callback)
+		return NULL;
+
+	/* The page can hold code too, so it is only ever made writable on top of what it already allows */
+	int access;
+	if (!GetMemAccess(&vtable[index], access))
+		return NULL;
+
+	CVTableHook *hook = new CVTableHook();
+	hook->m_Table = vtable;
+	hook->m_Index = index;
+	hook->m_Callback = callback;
+	hook->m_Original = vtable[index];
+	hook->m_Access = access;
+
+	*original = hook->m_Original;
+
+	return hook;
+}
+
+CVTableHook *CVTableHook::CreateInstanceHook(void *instance, int index, int count, void *callback, void **original)
+{
+	if (!instance || index < 0 || index >= count || !callback)
+		return NULL;
+
+	void **vtable = *reinterpret_cast<void ***>(instance);
+	void **copy = (void **)malloc((count + VTABLE_PREFIX) * sizeof(void *));
+	if (!copy)
+		return NULL;
+
+	/* RTTI and offset to top are copied too, so dynamic_cast still works on the object */
+	memcpy(copy, vtable - VTABLE_PREFIX, (count + VTABLE_PREFIX) * sizeof(void *));
+
+	CVTableHook *hook = new CVTableHook();
+	hook->m_Table = copy + VTABLE_PREFIX;
+	hook->m_Index = index;
+	hook->m_Callback = callback;
+	hook->m_Original = vtable[index];
+	hook->m_Instance = reinterpret_cast<void ***>(instance);
+	hook->m_OriginalTable = vtable;
+	hook->m_Copy = copy;
+
+	/* The copy already points at the callback, it only gets used once the object points at it */
+	hook->m_Table[index] = callback;
+
+	*original = hook->m_Original;
+
+	return hook;
+}
+
+bool CVTableHook::Enable()
+{
+	if (m_Enabled)
+		return true;
+
+	/* Pointer sized aligned stores are atomic, so concurrent calls see either function */
+	if (m_Instance)
+	{
+		if (*m_Instance != m_OriginalTable)
+			return false;
+
+		*(void **volatile *)m_Instance = m_Table;
+	}
+	else if (!WriteEntry(m_Callback))
+	{
+		return false;
+	}
+
+	m_Enabled = true;
+	return true;
+}
+
+void CVTableHook::Disable()
+{
+	if (!m_Enabled)
+		return;
+
+	/* Leave anything that has replaced us alone */
+	if (m_Instance)
+	{
+		if (*m_Instance == m_Table)
+			*(void **volatile *)m_Instance = m_OriginalTable;
+	}
+	else if (m_Table[m_Index] == m_Callback)
+	{
+		WriteEntry(m_Original);
+	}
+
+	m_Enabled = false;
+}
+
+bool CVTableHook::WriteEntry(void *value)
+{
+	void **entry = &m_Table[m_Index];
+	bool readOnly = !(m_Access & SH_MEM_WRITE);
+
+	if (readOnly && !SetMemAccess(entry, sizeof(void *), m_Access|SH_MEM_WRITE))
+		return false;
+
+	*(void *volatile *)entry = value;
+
+	if (readOnly)
+		SetMemAccess(entry, sizeof(void *), m_Access);
+
+	return true;
+}
+
+bool CVTableHook::IsEnabled()
+{
+	return m_Enabled;
+}
+
+void CVTableHook::Destroy()
+{
+	Disable();
+	delete this;
+}
@@ -0,0 +1,99 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_VTABLEHOOK_H_
+#define _INCLUDE_SRCDS_OSX_VTABLEHOOK_H_
+
+#include <stddef.h>
+
+/**
+ * Hooks a virtual function by replacing its vtable entry, which needs no trampoline and doesn't
+ * touch any code. The callback is declared and called through its original the same way as for a
+ * detour, e.g. with DETOUR_DECL_MEMBER and DETOUR_MEMBER_CALL.
+ *
+ * A slot hook swaps the entry in the vtable itself, so it affects every object of that class.
+ * The page holding the entry is only made writable while the entry is being swapped, and keeps
+ * the rest of its protection, since it may also hold code. An instance hook gives one object
+ * a copy of its vtable with the entry swapped. Other objects are unaffected and no page
+ * protection changes.
+ *
+ * Only calls made through the vtable are hooked, not direct calls to the function.
+ */
+class CVTableHook
+{
+public:
+	/**
+	 * Creates a hook on an entry of a vtable. The hook is not enabled yet.
+	 *
+	 * @param vtable		Vtable, as found at the start of an object.
+	 * @param index			Index of the entry to replace.
+	 * @param callback		Function to put in the entry.
+	 * @param original		Receives the function that was in the entry.
+	 * @return				New hook, or NULL on failure.
+	 */
+	static CVTableHook *CreateSlotHook(void **vtable, int index, void *callback, void **original);
+
+	/**
+	 * Creates a hook on an entry of one object's vtable. The hook is not enabled yet.
+	 *
+	 * @param instance		Object to hook.
+	 * @param index			Index of the entry to replace.
+	 * @param count			Number of entries in the vtable, all of which are copied.
+	 * @param callback		Function to put in the entry.
+	 * @param original		Receives the function that was in the entry.
+	 * @return				New hook, or NULL on failure.
+	 */
+	static CVTableHook *CreateInstanceHook(void *instance, int index, int count, void *callback, void **original);
+public:
+	bool Enable();
+	void Disable();
+	bool IsEnabled();
+
+	/* Disables and frees the hook. Nothing may still be calling through the copied vtable. */
+	void Destroy();
+private:
+	CVTableHook();
+	~CVTableHook();
+
+	/* Stores value in the entry of a slot hook */
+	bool WriteEntry(void *value);
+private:
+	/* Table holding the entry that gets replaced, either the original vtable or the copy */
+	void **m_Table;
+	int m_Index;
+	void *m_Callback;
+	void *m_Original;
+	/* Protection of the page holding the entry, only for slot hooks */
+	int m_Access;
+	/* Only for instance hooks */
+	void ***m_Instance;
+	void **m_OriginalTable;
+	void **m_Copy;
+	bool m_Enabled;
+};
+
+/**
+ * Finds the current protection of the page holding addr, as SH_MEM_* flags. These are the PROT_*
+ * flags, so the result can be given back to mprotect as is.
+ */
+bool GetMemAccess(void *addr, int &access);
+
+#endif // _INCLUDE_SRCDS_OSX_VTABLEHOOK_H_
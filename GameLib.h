@@ -32,6 +32,7 @@
 #include "platform.h"
 #include "am-string.h"
 #include <stddef.h>
+#include <stdint.h>
 
 using namespace ke;
 
@@ -43,7 +44,10 @@ typedef void * LibHandle;
 
 typedef void *(*CreateInterfaceFn)(const char *, int *);
 
-// Represents a dynamic library for Source games
+struct LoadedModule;
+
+// Represents a dynamic library for Source games. Libraries are shared through ModuleRegistry, so
+// opening the same one again is cheap.
 class GameLib
 {
 public:
@@ -53,10 +57,14 @@ public:
 public:
     const AString& GetName() const;
     bool IsLoaded() const;
+    uintptr_t GetBase() const;
     
     virtual bool Load(const char *name);
     void Close();
 
+    // Like Load, but only succeeds if the library has already been loaded
+    bool Find(const char *name);
+
     template <typename T>
     T ResolveSymbol(const char *symbol)
     {
@@ -73,6 +81,8 @@ public:
         return IsLoaded();
     }
 private:
+    static const size_t kMaxCandidates = 4;
+
     // Disallow copy construction and assignment
     GameLib(const GameLib &other);
     GameLib &operator =(const GameLib &other);
@@ -83,6 +93,8 @@ protected:
     AString name_;
     const char *shortName_;
     LibHandle handle_;
+    LoadedModule *module_;
+    bool noLoad_;
 };
 
 #endif // _INCLUDE_SRCDS_GAMELIB_H_
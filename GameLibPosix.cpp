@@ -31,6 +31,8 @@
 #include <dlfcn.h>
 #include <string.h>
 #include "GameLib.h"
+#include "LibrarySearch.h"
+#include "ModuleRegistry.h"
 
 #if defined(PLATFORM_MACOSX)
 #define LIBEXT ".dylib"
@@ -38,12 +40,12 @@
 #define LIBEXT ".so"
 #endif
 
-GameLib::GameLib() : shortName_(nullptr), handle_(nullptr)
+GameLib::GameLib() : shortName_(nullptr), handle_(nullptr), module_(nullptr), noLoad_(false)
 {
 
 }
 
-GameLib::GameLib(const char *name) : handle_(nullptr)
+GameLib::GameLib(const char *name) : handle_(nullptr), module_(nullptr), noLoad_(false)
 {
     Load(name);
 }
@@ -63,56 +65,82 @@ bool GameLib::IsLoaded() const
     return handle_ != NULL;
 }
 
+uintptr_t GameLib::GetBase() const
+{
+    return module_ ? module_->base : 0;
+}
+
 bool GameLib::Load(const char *name)
 {
     if (IsLoaded())
         Close();
     
     shortName_ = name;
-	name_ = name;
+
+    AString candidates[kMaxCandidates];
+    size_t count = 0;
     
 #if defined(PLATFORM_LINUX)
     // On Linux, look for libraries with _srv suffix first
-    name_.append("_srv" LIBEXT);
-    
-    if (TryLoad())
-        return IsLoaded();
-    
-    name_ = name;
-    name_.append(LIBEXT);
+    candidates[count] = name;
+    candidates[count++].append("_srv" LIBEXT);
     
-    if (TryLoad())
-        return IsLoaded();
+    candidates[count] = name;
+    candidates[count++].append(LIBEXT);
 
-    name_ = "lib";
-    name_.append(name);
-    name_.append("_srv" LIBEXT);
-    
-    if (TryLoad())
-        return IsLoaded();
-
-    name_ = "lib";
-    name_.append(name);
-    name_.append(LIBEXT);
+    candidates[count] = "lib";
+    candidates[count].append(name);
+    candidates[count++].append("_srv" LIBEXT);
 #else
-    name_.append(LIBEXT);
-    
-    if (TryLoad())
-        return IsLoaded();
-    
-    name_ = "lib";
-    name_.append(name);
-    name_.append(LIBEXT);
+    candidates[count] = name;
+    candidates[count++].append(LIBEXT);
 #endif
-    
-    return TryLoad();
+
+    candidates[count] = "lib";
+    candidates[count].append(name);
+    candidates[count++].append(LIBEXT);
+
+    // Go straight to the first name in the search path rather than have the loader look for
+    // the ones before it in every directory
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!LibrarySearch::Contains(candidates[i].chars()))
+            continue;
+
+        name_ = candidates[i];
+        if (TryLoad())
+        {
+            LibrarySearch::SkipNames(i);
+            return true;
+        }
+        break;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        name_ = candidates[i];
+        if (TryLoad())
+            return true;
+    }
+
+    return false;
+}
+
+bool GameLib::Find(const char *name)
+{
+    noLoad_ = true;
+    bool found = Load(name);
+    noLoad_ = false;
+
+    return found;
 }
 
 void GameLib::Close()
 {
-    if (handle_)
+    if (module_)
     {
-        dlclose(handle_);
+        ModuleRegistry::Release(module_);
+        module_ = nullptr;
         handle_ = nullptr;
     }
 }
@@ -124,7 +152,18 @@ void *GameLib::GetSymbolAddr(const char *symbol)
 
 bool GameLib::TryLoad()
 {
-    handle_ = dlopen(name_.chars(), RTLD_LAZY);
+    int mode = noLoad_ ? RTLD_LAZY | RTLD_NOLOAD : RTLD_LAZY;
+    LibHandle handle = nullptr;
+
+    if (const char *path = LibrarySearch::Resolve(name_.chars()))
+        handle = dlopen(path, mode);
+    if (!handle)
+        handle = dlopen(name_.chars(), mode);
+    if (!handle)
+        return false;
+
+    module_ = ModuleRegistry::Acquire(handle, name_.chars());
+    handle_ = module_ ? module_->handle : nullptr;
     return IsLoaded();
 }
 
@@ -27,6 +27,7 @@
  */
 
 #include "HSGameLib.h"
+#include <algorithm>
 #include <dlfcn.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -203,14 +204,12 @@ int HSGameLib::SetLibraryPath(const char *path)
 #endif
 }
 
-HSGameLib::HSGameLib()
-    : GameLib(), baseAddress_(0), lastPosition_(0), valid_(false), fileHeader_(nullptr), mapSize_(0), searchSize_(0)
+HSGameLib::HSGameLib() : GameLib()
 {
 
 }
 
-HSGameLib::HSGameLib(const char *name)
-    : GameLib(name), baseAddress_(0), lastPosition_(0), valid_(false), fileHeader_(nullptr), mapSize_(0), searchSize_(0)
+HSGameLib::HSGameLib(const char *name) : GameLib(name)
 {
     if (!IsLoaded())
         return;
@@ -218,31 +217,17 @@ HSGameLib::HSGameLib(const char *name)
     Initialize();
 }
 
-HSGameLib::~HSGameLib()
-{
-#if defined(PLATFORM_LINUX)
-	if (fileHeader_ != nullptr && mapSize_ > 0)
-		munmap(fileHeader_, mapSize_);
-#endif
-}
-
 bool HSGameLib::Load(const char *name)
 {
-    if (IsLoaded())
-        Close();
-    
     if (GameLib::Load(name))
-    {
-        Invalidate();
         Initialize();
-    }
     
     return IsValid();
 }
 
 bool HSGameLib::IsValid() const
 {
-    return valid_;
+    return module_ && module_->valid;
 }
 
 size_t HSGameLib::ResolveHiddenSymbols(SymbolInfo *list, const char **names)
@@ -270,6 +255,19 @@ size_t HSGameLib::ResolveHiddenSymbols(SymbolInfo *list, const char **names)
 }
 
 void HSGameLib::Initialize()
+{
+    pthread_mutex_lock(&module_->lock);
+
+    if (!module_->examined)
+    {
+        Examine(module_);
+        module_->examined = true;
+    }
+
+    pthread_mutex_unlock(&module_->lock);
+}
+
+void HSGameLib::Examine(LoadedModule *module)
 {
 #if defined(PLATFORM_MACOSX)
 #if defined(PLATFORM_X64)
@@ -286,22 +284,20 @@ void HSGameLib::Initialize()
     uint32_t loadCmdCount = 0;
     uintptr_t linkEditAddr = 0;
     
-    baseAddress_ = GetBaseAddress();
-    
-    if (!baseAddress_)
+    if (!module->base)
         return;
 
-	fileHeader_ = (void *)baseAddress_;
+	module->fileHeader = (void *)module->base;
     
     // Initialize symbol hash table
-    table_.Initialize();
+    module->table.Initialize();
 
 #if defined(PLATFORM_X64)
-    fileHdr = (struct mach_header_64 *)baseAddress_;
-    loadCmds = (struct load_command *)(baseAddress_ + sizeof(mach_header_64));
+    fileHdr = (struct mach_header_64 *)module->base;
+    loadCmds = (struct load_command *)(module->base + sizeof(mach_header_64));
 #else
-    fileHdr = (struct mach_header *)baseAddress_;
-    loadCmds = (struct load_command *)(baseAddress_ + sizeof(mach_header));
+    fileHdr = (struct mach_header *)module->base;
+    loadCmds = (struct load_command *)(module->base + sizeof(mach_header));
 #endif
     
     loadCmdCount = fileHdr->ncmds;
@@ -337,39 +333,76 @@ void HSGameLib::Initialize()
         loadCmds = (struct load_command *)(uintptr_t(loadCmds) + loadCmds->cmdsize);
     }
 	
-#if defined(PLATFORM_X64)
-    segment_command_64 *seg = (struct segment_command_64 *)(baseAddress_ + sizeof(mach_header_64));
-#else
-    segment_command *seg = (struct segment_command *)(baseAddress_ + sizeof(mach_header));
-#endif
+	struct load_command *cmd = (struct load_command *)(uintptr_t(fileHdr) + sizeof(*fileHdr));
+	struct linkedit_data_command *funcStartsCmd = nullptr;
+	uintptr_t textAddr = 0;
+	uintptr_t imageEnd = 0;
 
 	for (uint32_t i = 0; i < loadCmdCount; i++)
 	{
 #if defined(PLATFORM_X64)
-		if (seg->cmd == LC_SEGMENT_64)
+		if (cmd->cmd == LC_SEGMENT_64)
+		{
+			struct segment_command_64 *seg = (struct segment_command_64 *)cmd;
+			struct section_64 *sects = (struct section_64 *)(seg + 1);
 #else
-		if (seg->cmd == LC_SEGMENT)
+		if (cmd->cmd == LC_SEGMENT)
+		{
+			struct segment_command *seg = (struct segment_command *)cmd;
+			struct section *sects = (struct section *)(seg + 1);
 #endif
+			module->searchSize += seg->vmsize;
+
+			if (strcmp(seg->segname, "__TEXT") == 0)
+				textAddr = seg->vmaddr;
+
+			// Skip __PAGEZERO and anything else that isn't actually mapped
+			if (seg->initprot != VM_PROT_NONE && seg->vmaddr + seg->vmsize > imageEnd)
+				imageEnd = seg->vmaddr + seg->vmsize;
+
+			for (uint32_t j = 0; j < seg->nsects; j++)
+			{
+				if (sects[j].flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS))
+					AddCodeRange(module, sects[j].addr, sects[j].size);
+			}
+		}
+		else if (cmd->cmd == LC_UUID)
 		{
-			searchSize_ += seg->vmsize;
+			struct uuid_command *uuid = (struct uuid_command *)cmd;
+			uint64_t halves[2];
+
+			memcpy(halves, uuid->uuid, sizeof(halves));
+			module->buildId = halves[0] ^ halves[1];
 		}
-	
-#if defined(PLATFORM_X64)
-		seg = (struct segment_command_64 *)(uintptr_t(seg) + seg->cmdsize);
-#else
-		seg = (struct segment_command *)(uintptr_t(seg) + seg->cmdsize);
-#endif
+		else if (cmd->cmd == LC_FUNCTION_STARTS)
+		{
+			funcStartsCmd = (struct linkedit_data_command *)cmd;
+		}
+
+		cmd = (struct load_command *)(uintptr_t(cmd) + cmd->cmdsize);
 	}
 
+	// Section addresses are relative to the preferred address of __TEXT rather than the actual base
+	for (size_t i = 0; i < module->codeRangeCount; i++)
+		module->codeRanges[i].start += module->base - textAddr;
+
+	module->imageSize = imageEnd - textAddr;
+
     if (!linkEditHdr || !symTableHdr || !symTableHdr->symoff || !symTableHdr->stroff)
         return;
     
-    linkEditAddr = baseAddress_ + linkEditHdr->vmaddr;
-    symbolTable_ = (RawSymbolTable)(linkEditAddr + symTableHdr->symoff - linkEditHdr->fileoff);
-    stringTable_ = (const char *)(linkEditAddr + symTableHdr->stroff - linkEditHdr->fileoff);
-    symbolCount_ = symTableHdr->nsyms;
+    linkEditAddr = module->base + linkEditHdr->vmaddr;
+    module->symbolTable = (RawSymbolTable)(linkEditAddr + symTableHdr->symoff - linkEditHdr->fileoff);
+    module->stringTable = (const char *)(linkEditAddr + symTableHdr->stroff - linkEditHdr->fileoff);
+    module->symbolCount = symTableHdr->nsyms;
+
+	if (funcStartsCmd && funcStartsCmd->datasize)
+	{
+		module->functionStarts = linkEditAddr + funcStartsCmd->dataoff - linkEditHdr->fileoff;
+		module->functionStartsSize = funcStartsCmd->datasize;
+	}
 
-    valid_ = true;
+    module->valid = true;
 #elif defined(PLATFORM_LINUX)
 	struct link_map *dlmap;
 	struct stat dlstat;
@@ -391,15 +424,13 @@ void HSGameLib::Initialize()
 	uint32_t symbol_count;
 	uint16_t phdr_count;
 
-    baseAddress_ = GetBaseAddress();
-    
-    if (!baseAddress_)
+    if (!module->base)
         return;
     
     // Initialize symbol hash table
-    table_.Initialize();
+    module->table.Initialize();
 
-	dlmap = (struct link_map *)handle_;
+	dlmap = (struct link_map *)module->handle;
 
 	dlfile = open(dlmap->l_name, O_RDONLY);
 	if (dlfile == -1 || fstat(dlfile, &dlstat) == -1)
@@ -461,6 +492,9 @@ void HSGameLib::Initialize()
 		{
 			strtab_hdr = &hdr;
 		}
+
+		if (hdr.sh_type == SHT_PROGBITS && (hdr.sh_flags & (SHF_ALLOC|SHF_EXECINSTR)) == (SHF_ALLOC|SHF_EXECINSTR))
+			AddCodeRange(module, module->base + hdr.sh_addr, hdr.sh_size);
 	}
 
 	#define PAGE_SIZE			4096
@@ -475,7 +509,33 @@ void HSGameLib::Initialize()
 #endif
 
 		if (hdr.p_type == PT_LOAD && hdr.p_flags == (PF_X|PF_R))
-			searchSize_ += PAGE_ALIGN_UP(hdr.p_filesz);
+			module->searchSize += PAGE_ALIGN_UP(hdr.p_filesz);
+
+		if (hdr.p_type == PT_LOAD && hdr.p_vaddr + hdr.p_memsz > module->imageSize)
+			module->imageSize = hdr.p_vaddr + hdr.p_memsz;
+
+		if (hdr.p_type == PT_NOTE)
+		{
+			// Look for the GNU build id note, which is a hash of the linked image
+			uintptr_t note = map_base + hdr.p_offset;
+			uintptr_t noteEnd = note + hdr.p_filesz;
+
+			while (note + sizeof(Elf32_Nhdr) <= noteEnd)
+			{
+				Elf32_Nhdr *nhdr = (Elf32_Nhdr *)note;
+				const char *noteName = (const char *)(nhdr + 1);
+				const uint8_t *desc = (const uint8_t *)(noteName + ((nhdr->n_namesz + 3) & ~3));
+
+				if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(noteName, "GNU", 4) == 0)
+				{
+					for (uint32_t j = 0; j < nhdr->n_descsz; j++)
+						module->buildId = (module->buildId << 8 | module->buildId >> 56) ^ desc[j];
+					break;
+				}
+
+				note = uintptr_t(desc) + ((nhdr->n_descsz + 3) & ~3);
+			}
+		}
 	}
 	
 	/* Uh oh, we don't have a symbol table or a string table */
@@ -485,132 +545,204 @@ void HSGameLib::Initialize()
 		return;
 	}
 
-	fileHeader_ = (void *)file_hdr;
-	mapSize_ = dlstat.st_size;
-	symbolTable_ = (RawSymbolTable)(map_base + symtab_hdr->sh_offset);
-	stringTable_ = (const char *)(map_base + strtab_hdr->sh_offset);
-	symbolCount_ = symtab_hdr->sh_size / symtab_hdr->sh_entsize;
+	module->fileHeader = (void *)file_hdr;
+	module->mapSize = dlstat.st_size;
+	module->symbolTable = (RawSymbolTable)(map_base + symtab_hdr->sh_offset);
+	module->stringTable = (const char *)(map_base + strtab_hdr->sh_offset);
+	module->symbolCount = symtab_hdr->sh_size / symtab_hdr->sh_entsize;
 
-	valid_ = true;
+	module->valid = true;
 #else
 #error "Unsupported platform."
 #endif
 }
 
-void HSGameLib::Invalidate()
+void HSGameLib::AddCodeRange(LoadedModule *module, uintptr_t start, size_t size)
 {
-    if (!table_.IsEmpty())
-        table_.Destroy();
+	if (size == 0 || module->codeRangeCount == LoadedModule::kMaxCodeRanges)
+		return;
 
-#if defined(PLATFORM_LINUX)
-	if (fileHeader_ != nullptr && mapSize_ > 0)
-		munmap(fileHeader_, mapSize_);
-#endif
+	// Keep the list sorted by address
+	size_t i = module->codeRangeCount++;
+	while (i > 0 && module->codeRanges[i - 1].start > start)
+	{
+		module->codeRanges[i] = module->codeRanges[i - 1];
+		i--;
+	}
 
-	fileHeader_ = nullptr;
-	mapSize_ = 0;
+	module->codeRanges[i].start = start;
+	module->codeRanges[i].size = size;
+}
 
-    valid_ = false;
+size_t HSGameLib::GetImageSize() const
+{
+	return module_ ? module_->imageSize : 0;
 }
 
-#if defined(PLATFORM_LINUX)
-int HSGameLib::baseaddr_callback(struct dl_phdr_info *info, size_t size, void *data)
+uint64_t HSGameLib::GetBuildId()
 {
-	void *handle = dlopen(info->dlpi_name, RTLD_NOLOAD);
-	HSGameLib *lib = (HSGameLib *)data;
-	if (handle == lib->handle_)
-		lib->baseAddress_ = info->dlpi_addr;
-	dlclose(handle);
+	LoadedModule *module = module_;
+	if (!module || module->buildId || !module->base)
+		return module ? module->buildId : 0;
+
+	// No build id or UUID was found, so fall back to hashing the code itself (FNV-1a)
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < module->codeRangeCount; i++)
+	{
+		const uint8_t *code = (const uint8_t *)module->codeRanges[i].start;
+		for (size_t j = 0; j < module->codeRanges[i].size; j++)
+		{
+			hash ^= code[j];
+			hash *= 1099511628211ULL;
+		}
+	}
 
-	return lib->baseAddress_ ? 1 : 0;
+	// Every HSGameLib on the module would come up with the same hash, so it can be stored unlocked
+	module->buildId = hash;
+	return module->buildId;
 }
-#endif
 
-uintptr_t HSGameLib::GetBaseAddress()
+size_t HSGameLib::GetCodeRanges(CodeRange *ranges, size_t maxRanges) const
 {
-    Dl_info info;
-    void *factory;
-    uintptr_t base = 0;
-    
-    factory = (void *)GetFactory();
-    
-    // First try using dladdr() with the public factory symbol
-    if (factory)
-    {
-        if (dladdr((void *)factory, &info) && info.dli_fbase && info.dli_fname)
-            base = (uintptr_t)info.dli_fbase;
-    }
+	LoadedModule *module = module_;
+	if (!module)
+		return 0;
+
+	size_t count = module->codeRangeCount < maxRanges ? module->codeRangeCount : maxRanges;
+
+	for (size_t i = 0; i < count; i++)
+		ranges[i] = module->codeRanges[i];
+
+	return module->codeRangeCount;
+}
+
+bool HSGameLib::GetFunctionStarts(std::vector<uint32_t> &starts)
+{
+	LoadedModule *module = module_;
+	starts.clear();
+
+	if (!module || !module->base)
+		return false;
 
 #if defined(PLATFORM_MACOSX)
-    // If the library doesn't have a factory symbol or dladdr() failed, try looking through all the
-    // libraries loaded in the process for a matching handle.
-    if (!base)
-    {
-        struct dyld_all_image_infos *infos = GetDyldImageInfo();
-        
-        if (infos)
-        {
-            uint32_t imageCount = infos->infoArrayCount;
-        
-            for (uint32_t i = 1; i < imageCount; i++)
-            {
-                const struct dyld_image_info &info = infos->infoArray[i];
-            
-                void *handle = dlopen(info.imageFilePath, RTLD_NOLOAD);
-                if (handle == handle_)
-                {
-                    base = (uintptr_t)info.imageLoadAddress;
-                    dlclose(handle);
-                    break;
-                }
-            }
-        }
-    }
+	if (module->functionStarts)
+	{
+		// LC_FUNCTION_STARTS is a list of ULEB128 deltas, the first being relative to __TEXT
+		const uint8_t *p = (const uint8_t *)module->functionStarts;
+		const uint8_t *end = p + module->functionStartsSize;
+		uint32_t offset = 0;
+
+		while (p < end)
+		{
+			uint64_t delta = 0;
+			unsigned int shift = 0;
+
+			do
+			{
+				delta |= uint64_t(*p & 0x7F) << shift;
+				shift += 7;
+			} while ((*p++ & 0x80) && p < end);
+
+			// A zero delta terminates the list
+			if (delta == 0)
+				break;
+
+			offset += delta;
+			starts.push_back(offset);
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < module->symbolCount; i++)
+		{
+		#if defined(PLATFORM_X64)
+			struct nlist_64 &sym = module->symbolTable[i];
+		#else
+			struct nlist &sym = module->symbolTable[i];
+		#endif
+
+			if ((sym.n_type & N_STAB) || (sym.n_type & N_TYPE) != N_SECT)
+				continue;
+
+			uintptr_t addr = module->base + sym.n_value;
+			for (size_t j = 0; j < module->codeRangeCount; j++)
+			{
+				if (addr >= module->codeRanges[j].start && addr < module->codeRanges[j].start + module->codeRanges[j].size)
+				{
+					starts.push_back(uint32_t(sym.n_value));
+					break;
+				}
+			}
+		}
+	}
 #elif defined(PLATFORM_LINUX)
-	if (!base)
-		dl_iterate_phdr(baseaddr_callback, this);
+	for (uint32_t i = 0; i < module->symbolCount; i++)
+	{
+	#if defined(PLATFORM_X64)
+		Elf64_Sym &sym = module->symbolTable[i];
+		unsigned char symType = ELF64_ST_TYPE(sym.st_info);
+	#else
+		Elf32_Sym &sym = module->symbolTable[i];
+		unsigned char symType = ELF32_ST_TYPE(sym.st_info);
+	#endif
+
+		if (sym.st_shndx == SHN_UNDEF || symType != STT_FUNC || sym.st_value == 0)
+			continue;
+
+		starts.push_back(uint32_t(sym.st_value));
+	}
 #endif
-    
-    return base;
+
+	std::sort(starts.begin(), starts.end());
+	starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+
+	return !starts.empty();
 }
 
 void *HSGameLib::GetHiddenSymbolAddr(const char *symbol)
 {
+    LoadedModule *module = module_;
     Symbol *entry;
 
-    if (!baseAddress_)
+    if (!module || !module->base)
         return nullptr;
+
+    // The cache is shared with every other HSGameLib open on the library
+    pthread_mutex_lock(&module->lock);
     
     // In the best case, the symbol has already been cached
-    entry = table_.FindSymbol(symbol, strlen(symbol));
+    entry = module->table.FindSymbol(symbol, strlen(symbol));
     if (entry)
+    {
+        pthread_mutex_unlock(&module->lock);
         return entry->address;
+    }
     
-    for (uint32_t i = lastPosition_; i < symbolCount_; i++)
+    for (uint32_t i = module->lastPosition; i < module->symbolCount; i++)
     {
 #if defined(PLATFORM_MACOSX)
     	#if defined(PLATFORM_X64)
-        	struct nlist_64 &sym = symbolTable_[i];
+        	struct nlist_64 &sym = module->symbolTable[i];
         #else
-        	struct nlist &sym = symbolTable_[i];
+        	struct nlist &sym = module->symbolTable[i];
         #endif
         
         // Ignore the prepended underscore on all symbols to match dlsym() functionality
-        const char *symName = stringTable_ + sym.n_un.n_strx + 1;
+        const char *symName = module->stringTable + sym.n_un.n_strx + 1;
         
         // Skip undefined symbols
         if (sym.n_sect == NO_SECT)
             continue;
 #elif defined(PLATFORM_LINUX)
 	#if defined(PLATFORM_X64)
-		Elf64_Sym &sym = symbolTable_[i];
+		Elf64_Sym &sym = module->symbolTable[i];
 		unsigned char symType = ELF64_ST_TYPE(sym.st_info);
 	#else
-		Elf32_Sym &sym = symbolTable_[i];
+		Elf32_Sym &sym = module->symbolTable[i];
 		unsigned char symType = ELF32_ST_TYPE(sym.st_info);
 	#endif
 	
-	const char *symName = stringTable_ + sym.st_name;
+	const char *symName = module->stringTable + sym.st_name;
 
 	// Skip symbols that are undefined or do not refer to functions or objects
 	if (sym.st_shndx == SHN_UNDEF || (symType != STT_FUNC && symType != STT_OBJECT))
@@ -618,26 +750,28 @@ void *HSGameLib::GetHiddenSymbolAddr(const char *symbol)
 #endif
         
         Symbol *currentSymbol;
-        currentSymbol = table_.InternSymbol(symName,
+        currentSymbol = module->table.InternSymbol(symName,
                                             strlen(symName),
 #if defined(PLATFORM_MACOSX)
-                                            (void *)(baseAddress_ + sym.n_value));
+                                            (void *)(module->base + sym.n_value));
 #elif defined(PLATFORM_LINUX)
-                                            (void *)(baseAddress_ + sym.st_value));		
+                                            (void *)(module->base + sym.st_value));		
 #endif
         
         if (strcmp(symbol, symName) == 0)
         {
             entry = currentSymbol;
-            lastPosition_ = ++i;
+            module->lastPosition = ++i;
             break;
         }
     }
+
+    pthread_mutex_unlock(&module->lock);
     
     return entry ? entry->address : nullptr;
 }
 
-void *HSGameLib::FindPattern(const char *pattern, size_t len)
+static char *SearchPattern(char *ptr, size_t searchLen, const char *pattern, size_t len)
 {
 	// Algorithm based on Boyer-Moore-Horspool string search with addition of wildcard handling
 	// See: https://en.wikipedia.org/wiki/Boyer%E2%80%93Moore%E2%80%93Horspool_algorithm
@@ -645,29 +779,19 @@ void *HSGameLib::FindPattern(const char *pattern, size_t len)
 	const char wildcard = '\x2A';
 	size_t bad_shift[UCHAR_MAX + 1];
 	size_t last = len - 1;
-	size_t idx = 0;
-	size_t searchLen = searchSize_;
-	char *ptr = reinterpret_cast<char *>(baseAddress_);
+	size_t idx = last;
 	
-	// First locate the first rightmost wildcard
-	// Loop over pattern until first wildcard is found or we reach the end
-	while (idx < last && pattern[idx] != wildcard)
-		idx++;
-	// Loop over pattern wildcards until non-wildcard is reached
-	while (idx < last && pattern[idx] == wildcard)
-		idx++;
-
-	if (idx == last)
-		idx = -1;  // wildcard not found in pattern
-	else
-		idx--;     // wildcard found in pattern, adjust index
+	// Locate the rightmost wildcard, ignoring the last character of the pattern. A wildcard matches
+	// any character, so the pattern can never be shifted past it.
+	while (idx > 0 && pattern[idx - 1] != wildcard)
+		idx--;
 
 	// Initialize bad character shift table, accounting for wildcards in the pattern
 	for (size_t i = 0; i <= UCHAR_MAX; i++)
-		bad_shift[i] = last - idx;
+		bad_shift[i] = last + 1 - idx;
 
-	// Set values in bad character shift table for characters in pattern
-	for (size_t i = 0; i < last; i++)
+	// Set values in bad character shift table for characters in pattern after the wildcard
+	for (size_t i = idx; i < last; i++)
 		bad_shift[(unsigned char)pattern[i]] = last - i;
 	
 	// Search memory for the pattern
@@ -682,7 +806,7 @@ void *HSGameLib::FindPattern(const char *pattern, size_t len)
 		}
 
 		// Skip ahead based on bad character shift table
-		unsigned char lastChar = ptr[i];
+		unsigned char lastChar = ptr[last];
 		searchLen -= bad_shift[lastChar];
 		ptr += bad_shift[lastChar];
 	}
@@ -690,3 +814,35 @@ void *HSGameLib::FindPattern(const char *pattern, size_t len)
 	return nullptr;
 }
 
+void *HSGameLib::FindPattern(const char *pattern, size_t len)
+{
+	if (!module_)
+		return nullptr;
+
+	return SearchPattern(reinterpret_cast<char *>(module_->base), module_->searchSize, pattern, len);
+}
+
+size_t HSGameLib::CountPattern(const char *pattern, size_t len, size_t maxCount)
+{
+	if (!module_)
+		return 0;
+
+	char *ptr = reinterpret_cast<char *>(module_->base);
+	size_t searchLen = module_->searchSize;
+	size_t count = 0;
+
+	while (count < maxCount)
+	{
+		char *match = SearchPattern(ptr, searchLen, pattern, len);
+		if (!match)
+			break;
+
+		count++;
+
+		// Overlapping matches are counted too, since FindPattern could return either of them
+		searchLen -= match + 1 - ptr;
+		ptr = match + 1;
+	}
+
+	return count;
+}
@@ -30,26 +30,10 @@
 #define _INCLUDE_SRCDS_HSGAMELIB_H_
 
 #include "GameLib.h"
-#include "sm_symtable.h"
+#include "ModuleRegistry.h"
 #include "am-string.h"
-#include <sys/types.h>
-
-#if defined(PLATFORM_LINUX)
-#include <elf.h>
-#include <link.h>
-#if defined(PLATFORM_X64)
-typedef Elf64_Sym *RawSymbolTable;
-#else
-typedef Elf32_Sym *RawSymbolTable;
-#endif // defined(PLATFORM_X64)
-#elif defined(PLATFORM_MACOSX)
-#include <mach-o/nlist.h>
-#if defined(PLATFORM_X64)
-typedef struct nlist_64 *RawSymbolTable;
-#else
-typedef struct nlist *RawSymbolTable;
-#endif // defined(PLATFORM_X64)
-#endif
+#include <stdint.h>
+#include <vector>
 
 struct SymbolInfo
 {
@@ -57,13 +41,13 @@ struct SymbolInfo
     void *address;
 };
 
-// GameLib subclass capable of finding symbols hidden via gcc or clangs -fvisibility=hidden option
+// GameLib subclass capable of finding symbols hidden via gcc or clangs -fvisibility=hidden option.
+// The library is only examined by the first HSGameLib opened on it, later ones share the results.
 class HSGameLib : public GameLib
 {
 public:
     HSGameLib();
     explicit HSGameLib(const char *name);
-	~HSGameLib();
     
     bool Load(const char *name);
     bool IsValid() const;
@@ -77,28 +61,25 @@ public:
     size_t ResolveHiddenSymbols(SymbolInfo *list, const char **names);
 
 	void *FindPattern(const char *pattern, size_t len);
+
+	// Returns the number of places the pattern matches, stopping once maxCount is reached
+	size_t CountPattern(const char *pattern, size_t len, size_t maxCount = SIZE_MAX);
+
+    size_t GetImageSize() const;
+    uint64_t GetBuildId();
+
+    // Executable sections of the library, sorted by address
+    size_t GetCodeRanges(CodeRange *ranges, size_t maxRanges) const;
+
+    // Offsets from the base address of known function entry points, sorted and unique
+    bool GetFunctionStarts(std::vector<uint32_t> &starts);
     
     static int SetLibraryPath(const char *path);
 private:
+    static void AddCodeRange(LoadedModule *module, uintptr_t start, size_t size);
+    static void Examine(LoadedModule *module);
     void Initialize();
-    void Invalidate();
-    uintptr_t GetBaseAddress();
     void *GetHiddenSymbolAddr(const char *symbol);
-#if defined(PLATFORM_LINUX)
-	static int baseaddr_callback(struct dl_phdr_info *info, size_t size, void *data);
-	friend int baseaddr_callback(struct dl_phdr_info *info, size_t size, void *data);
-#endif
-private:
-    SymbolTable table_;
-    uintptr_t baseAddress_;
-    uint32_t lastPosition_;
-    RawSymbolTable symbolTable_;
-    const char *stringTable_;
-    uint32_t symbolCount_;
-    bool valid_;
-	void *fileHeader_;
-	off_t mapSize_;
-	off_t searchSize_;
 };
 
 #endif // _INCLUDE_SRCDS_HSGAMELIB_H_
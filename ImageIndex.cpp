@@ -0,0 +1,521 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "ImageIndex.h"
+#include "libudis86/udis86.h"
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#define INDEX_MAGIC		0x58444953	// 'SIDX'
+#define INDEX_VERSION	1
+
+struct IndexHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pointerSize;
+	uint32_t reserved;
+	uint64_t buildId;
+	uint64_t imageSize;
+	uint64_t insnCount;
+	uint64_t insnOffset;
+	uint64_t xrefCount;
+	uint64_t xrefOffset;
+};
+
+// Contiguous span of code decoded by a single worker
+struct SweepPiece
+{
+	uintptr_t start;
+	uintptr_t end;
+	uintptr_t rangeEnd;		// End of the code range, which the last instruction may run up to
+	std::vector<IndexedInsn> insns;
+	std::vector<IndexedXref> xrefs;
+};
+
+static inline bool IsCondJump(enum ud_mnemonic_code mnemonic)
+{
+	switch (mnemonic)
+	{
+	case UD_Ijo: case UD_Ijno: case UD_Ijb: case UD_Ijae:
+	case UD_Ijz: case UD_Ijnz: case UD_Ijbe: case UD_Ija:
+	case UD_Ijs: case UD_Ijns: case UD_Ijp: case UD_Ijnp:
+	case UD_Ijl: case UD_Ijge: case UD_Ijle: case UD_Ijg:
+	case UD_Ijcxz: case UD_Ijecxz: case UD_Ijrcxz:
+	case UD_Iloop: case UD_Iloope: case UD_Iloopne:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void SweepCode(SweepPiece *piece, uintptr_t base, size_t imageSize, const uint32_t *starts, size_t startCount)
+{
+	ud_t ud;
+	uintptr_t pos = piece->start;
+	uintptr_t imageEnd = base + imageSize;
+
+	// First known function start at or after the beginning of this piece
+	const uint32_t *nextStart = std::lower_bound(starts, starts + startCount, uint32_t(pos - base));
+	const uint32_t *lastStart = starts + startCount;
+
+	ud_init(&ud);
+#if defined(PLATFORM_X64)
+	ud_set_mode(&ud, 64);
+#else
+	ud_set_mode(&ud, 32);
+#endif
+	// Only the decoded operands are needed, so skip generating assembly text
+	ud_set_syntax(&ud, NULL);
+	ud_set_input_buffer(&ud, (const uint8_t *)pos, piece->rangeEnd - pos);
+	ud_set_pc(&ud, pos);
+
+	while (pos < piece->end)
+	{
+		unsigned int len = ud_disassemble(&ud);
+		if (len == 0)
+			break;
+
+		uintptr_t next = pos + len;
+
+		while (nextStart != lastStart && base + *nextStart < pos)
+			nextStart++;
+
+		// The instruction overlaps a known function start, so the sweep has lost sync with the
+		// real instruction stream. Throw it away and restart decoding at the function start.
+		if (nextStart != lastStart && base + *nextStart > pos && base + *nextStart < next)
+		{
+			pos = base + *nextStart;
+			ud_set_input_buffer(&ud, (const uint8_t *)pos, piece->rangeEnd - pos);
+			ud_set_pc(&ud, pos);
+			continue;
+		}
+
+		// Instructions straddling the end of the piece belong to the next one
+		if (next > piece->end)
+			break;
+
+		IndexedInsn insn;
+		insn.rva = uint32_t(pos - base);
+		insn.length = uint8_t(len);
+		insn.flags = 0;
+		insn.reserved = 0;
+
+		if (nextStart != lastStart && base + *nextStart == pos)
+			insn.flags |= Insn_FuncStart;
+
+		enum ud_mnemonic_code mnemonic = ud_insn_mnemonic(&ud);
+		if (mnemonic == UD_Iinvalid)
+			insn.flags |= Insn_Invalid;
+		else if (mnemonic == UD_Icall)
+			insn.flags |= Insn_Call;
+		else if (mnemonic == UD_Ijmp)
+			insn.flags |= Insn_Jump;
+		else if (mnemonic == UD_Iret || mnemonic == UD_Iretf)
+			insn.flags |= Insn_Return;
+		else if (IsCondJump(mnemonic))
+			insn.flags |= Insn_CondJump;
+
+		const ud_operand_t *op;
+		for (unsigned int i = 0; (op = ud_insn_opr(&ud, i)) != NULL; i++)
+		{
+			uintptr_t target = 0;
+			bool isData = true;
+
+			if (op->type == UD_OP_JIMM)
+			{
+				isData = false;
+				if (op->size == 8)
+					target = next + op->lval.sbyte;
+				else if (op->size == 16)
+					target = next + op->lval.sword;
+				else
+					target = next + op->lval.sdword;
+			}
+			else if (op->type == UD_OP_MEM && op->base == UD_R_RIP && op->offset == 32)
+			{
+				target = next + op->lval.sdword;
+			}
+			else if (op->type == UD_OP_MEM && op->base == UD_NONE && op->index == UD_NONE && op->offset == 32)
+			{
+				target = uintptr_t(intptr_t(op->lval.sdword));
+			}
+#if !defined(PLATFORM_X64)
+			else if (op->type == UD_OP_IMM && op->size == 32)
+			{
+				// Could be an address pushed or moved into a register
+				target = op->lval.udword;
+			}
+#endif
+
+			if (target < base || target >= imageEnd)
+				continue;
+
+			if (isData)
+				insn.flags |= Insn_DataRef;
+
+			IndexedXref xref;
+			xref.target = uint32_t(target - base);
+			xref.from = insn.rva;
+			piece->xrefs.push_back(xref);
+		}
+
+		piece->insns.push_back(insn);
+		pos = next;
+	}
+}
+
+static bool CompareXrefs(const IndexedXref &a, const IndexedXref &b)
+{
+	if (a.target != b.target)
+		return a.target < b.target;
+	return a.from < b.from;
+}
+
+ImageIndex::ImageIndex()
+	: insnData_(nullptr), insnCount_(0), xrefData_(nullptr), xrefCount_(0), map_(nullptr), mapSize_(0),
+	  buildId_(0), imageSize_(0)
+{
+}
+
+ImageIndex::~ImageIndex()
+{
+	Close();
+}
+
+bool ImageIndex::Open(HSGameLib &lib, const char *cacheDir, unsigned int threads)
+{
+	char path[PATH_MAX];
+
+	if (!GetCachePath(lib, cacheDir, path, sizeof(path)))
+		return Build(lib, threads);
+
+	if (Load(lib, path))
+		return true;
+
+	if (!Build(lib, threads))
+		return false;
+
+	// Failing to write the cache only costs time on the next run
+	if (!Save(path))
+		printf("Failed to write image index %s\n", path);
+
+	return true;
+}
+
+bool ImageIndex::Build(HSGameLib &lib, unsigned int threads)
+{
+	CodeRange ranges[16];
+	std::vector<uint32_t> starts;
+	std::vector<SweepPiece> pieces;
+	uintptr_t base = lib.GetBase();
+	size_t imageSize = lib.GetImageSize();
+	size_t total = 0;
+
+	Close();
+
+	if (!base || !imageSize)
+		return false;
+
+	size_t rangeCount = lib.GetCodeRanges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+	if (rangeCount > sizeof(ranges) / sizeof(ranges[0]))
+		rangeCount = sizeof(ranges) / sizeof(ranges[0]);
+
+	lib.GetFunctionStarts(starts);
+
+	for (size_t i = 0; i < rangeCount; i++)
+		total += ranges[i].size;
+
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+
+	// Split the code into pieces of roughly equal size. Each cut is moved forward to the next
+	// known function start so that no worker begins decoding in the middle of an instruction.
+	// Without any starts there is nowhere safe to cut, so each range stays in one piece.
+	size_t chunk = total / threads + 1;
+	for (size_t i = 0; i < rangeCount; i++)
+	{
+		uintptr_t pos = ranges[i].start;
+		uintptr_t end = ranges[i].start + ranges[i].size;
+
+		while (pos < end)
+		{
+			uintptr_t cut = end;
+
+			if (end - pos > chunk)
+			{
+				const uint32_t *s = std::lower_bound(starts.data(), starts.data() + starts.size(),
+				                                     uint32_t(pos + chunk - base));
+				if (s != starts.data() + starts.size() && base + *s < end)
+					cut = base + *s;
+			}
+
+			SweepPiece piece;
+			piece.start = pos;
+			piece.end = cut;
+			piece.rangeEnd = end;
+			pieces.push_back(std::move(piece));
+
+			pos = cut;
+		}
+	}
+
+	// Workers pull pieces off a shared counter until there are none left
+	std::atomic<size_t> nextPiece(0);
+	std::vector<std::thread> workers;
+	const uint32_t *startData = starts.data();
+	size_t startCount = starts.size();
+
+	auto worker = [&]() {
+		size_t i;
+		while ((i = nextPiece++) < pieces.size())
+			SweepCode(&pieces[i], base, imageSize, startData, startCount);
+	};
+
+	if (threads > pieces.size())
+		threads = pieces.size();
+
+	for (unsigned int i = 1; i < threads; i++)
+		workers.push_back(std::thread(worker));
+
+	worker();
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	// Pieces were created in address order, so the instructions only need to be concatenated
+	size_t insnTotal = 0, xrefTotal = 0;
+	for (size_t i = 0; i < pieces.size(); i++)
+	{
+		insnTotal += pieces[i].insns.size();
+		xrefTotal += pieces[i].xrefs.size();
+	}
+
+	insns_.reserve(insnTotal);
+	xrefs_.reserve(xrefTotal);
+
+	for (size_t i = 0; i < pieces.size(); i++)
+	{
+		insns_.insert(insns_.end(), pieces[i].insns.begin(), pieces[i].insns.end());
+		xrefs_.insert(xrefs_.end(), pieces[i].xrefs.begin(), pieces[i].xrefs.end());
+	}
+
+	std::sort(xrefs_.begin(), xrefs_.end(), CompareXrefs);
+
+	insnData_ = insns_.data();
+	insnCount_ = insns_.size();
+	xrefData_ = xrefs_.data();
+	xrefCount_ = xrefs_.size();
+	buildId_ = lib.GetBuildId();
+	imageSize_ = imageSize;
+
+	return insnCount_ > 0;
+}
+
+bool ImageIndex::Load(HSGameLib &lib, const char *path)
+{
+	struct stat st;
+
+	Close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(IndexHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	const IndexHeader *hdr = (const IndexHeader *)map;
+	uint64_t size = st.st_size;
+
+	if (hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION ||
+	    hdr->pointerSize != sizeof(void *) || hdr->buildId != lib.GetBuildId() ||
+	    hdr->imageSize != lib.GetImageSize() ||
+	    hdr->insnOffset > size || hdr->insnCount > (size - hdr->insnOffset) / sizeof(IndexedInsn) ||
+	    hdr->xrefOffset > size || hdr->xrefCount > (size - hdr->xrefOffset) / sizeof(IndexedXref))
+	{
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	map_ = map;
+	mapSize_ = st.st_size;
+	insnData_ = (const IndexedInsn *)((uintptr_t)map + hdr->insnOffset);
+	insnCount_ = hdr->insnCount;
+	xrefData_ = (const IndexedXref *)((uintptr_t)map + hdr->xrefOffset);
+	xrefCount_ = hdr->xrefCount;
+	buildId_ = hdr->buildId;
+	imageSize_ = hdr->imageSize;
+
+	return true;
+}
+
+bool ImageIndex::Save(const char *path) const
+{
+	char tmpPath[PATH_MAX];
+	IndexHeader hdr;
+
+	if (!IsValid())
+		return false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = INDEX_MAGIC;
+	hdr.version = INDEX_VERSION;
+	hdr.pointerSize = sizeof(void *);
+	hdr.buildId = buildId_;
+	hdr.imageSize = imageSize_;
+	hdr.insnCount = insnCount_;
+	hdr.insnOffset = sizeof(hdr);
+	hdr.xrefCount = xrefCount_;
+	hdr.xrefOffset = hdr.insnOffset + insnCount_ * sizeof(IndexedInsn);
+
+	// Write to a temporary file first so that a concurrent reader never maps a partial index
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, getpid());
+
+	FILE *fp = fopen(tmpPath, "wb");
+	if (!fp)
+		return false;
+
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	          fwrite(insnData_, sizeof(IndexedInsn), insnCount_, fp) == insnCount_ &&
+	          fwrite(xrefData_, sizeof(IndexedXref), xrefCount_, fp) == xrefCount_;
+
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok || rename(tmpPath, path) != 0)
+	{
+		unlink(tmpPath);
+		return false;
+	}
+
+	return true;
+}
+
+void ImageIndex::Close()
+{
+	if (map_)
+		munmap(map_, mapSize_);
+
+	insns_.clear();
+	insns_.shrink_to_fit();
+	xrefs_.clear();
+	xrefs_.shrink_to_fit();
+
+	insnData_ = nullptr;
+	insnCount_ = 0;
+	xrefData_ = nullptr;
+	xrefCount_ = 0;
+	map_ = nullptr;
+	mapSize_ = 0;
+	buildId_ = 0;
+	imageSize_ = 0;
+}
+
+bool ImageIndex::IsValid() const
+{
+	return insnData_ != nullptr;
+}
+
+const IndexedInsn *ImageIndex::FindInstruction(uint32_t rva) const
+{
+	const IndexedInsn *end = insnData_ + insnCount_;
+	const IndexedInsn *insn = std::upper_bound(insnData_, end, rva,
+		[](uint32_t value, const IndexedInsn &i) { return value < i.rva; });
+
+	if (insn == insnData_)
+		return nullptr;
+
+	insn--;
+	return rva < insn->rva + insn->length ? insn : nullptr;
+}
+
+size_t ImageIndex::FindXrefs(uint32_t target, const IndexedXref **first) const
+{
+	const IndexedXref *end = xrefData_ + xrefCount_;
+	const IndexedXref *lower = std::lower_bound(xrefData_, end, target,
+		[](const IndexedXref &x, uint32_t value) { return x.target < value; });
+	const IndexedXref *upper = lower;
+
+	while (upper != end && upper->target == target)
+		upper++;
+
+	if (first)
+		*first = lower;
+
+	return upper - lower;
+}
+
+const IndexedInsn *ImageIndex::GetInstructions() const
+{
+	return insnData_;
+}
+
+size_t ImageIndex::GetInstructionCount() const
+{
+	return insnCount_;
+}
+
+const IndexedXref *ImageIndex::GetXrefs() const
+{
+	return xrefData_;
+}
+
+size_t ImageIndex::GetXrefCount() const
+{
+	return xrefCount_;
+}
+
+bool ImageIndex::GetCachePath(HSGameLib &lib, const char *cacheDir, char *buffer, size_t maxlength)
+{
+	if (!cacheDir || !cacheDir[0] || !lib.GetBase())
+		return false;
+
+	const char *name = lib.GetName().chars();
+	const char *slash = strrchr(name, '/');
+	if (slash)
+		name = slash + 1;
+
+	int len = snprintf(buffer, maxlength, "%s/%s-%016llx.idx", cacheDir, name,
+	                   (unsigned long long)lib.GetBuildId());
+
+	return len > 0 && size_t(len) < maxlength;
+}
@@ -0,0 +1,110 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef _INCLUDE_SRCDS_OSX_IMAGEINDEX_H_
+#define _INCLUDE_SRCDS_OSX_IMAGEINDEX_H_
+
+#include "HSGameLib.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+enum IndexedInsnFlags
+{
+	Insn_Call      = (1 << 0),
+	Insn_Jump      = (1 << 1),
+	Insn_CondJump  = (1 << 2),
+	Insn_Return    = (1 << 3),
+	Insn_DataRef   = (1 << 4),  // References an address inside the image that isn't a branch target
+	Insn_Invalid   = (1 << 5),  // Byte that could not be decoded
+	Insn_FuncStart = (1 << 6),  // Known function entry point
+};
+
+// Decoded instruction, addressed relative to the library's base address
+struct IndexedInsn
+{
+	uint32_t rva;
+	uint8_t length;
+	uint8_t flags;
+	uint16_t reserved;
+};
+
+// Reference from the instruction at 'from' to the address 'target'
+struct IndexedXref
+{
+	uint32_t target;
+	uint32_t from;
+};
+
+// Linear sweep disassembly of every executable section of a library.
+//
+// Building splits the code across worker threads at known function starts and is slow for
+// large images, so the result is written to a per-build cache file that later runs simply
+// map into memory.
+class ImageIndex
+{
+public:
+	ImageIndex();
+	~ImageIndex();
+public:
+	// Maps the cached index for the library, or builds and caches it if missing or out of date
+	bool Open(HSGameLib &lib, const char *cacheDir, unsigned int threads = 0);
+
+	// Disassembles the library using the given number of threads (0 = one per CPU)
+	bool Build(HSGameLib &lib, unsigned int threads = 0);
+
+	bool Load(HSGameLib &lib, const char *path);
+	bool Save(const char *path) const;
+	void Close();
+
+	bool IsValid() const;
+
+	// Returns the instruction containing the given offset
+	const IndexedInsn *FindInstruction(uint32_t rva) const;
+
+	// Returns the number of references to the given offset and a pointer to the first of them
+	size_t FindXrefs(uint32_t target, const IndexedXref **first) const;
+
+	const IndexedInsn *GetInstructions() const;
+	size_t GetInstructionCount() const;
+	const IndexedXref *GetXrefs() const;
+	size_t GetXrefCount() const;
+
+	static bool GetCachePath(HSGameLib &lib, const char *cacheDir, char *buffer, size_t maxlength);
+private:
+	// Disallow copy construction and assignment
+	ImageIndex(const ImageIndex &other);
+	ImageIndex &operator =(const ImageIndex &other);
+private:
+	std::vector<IndexedInsn> insns_;
+	std::vector<IndexedXref> xrefs_;
+	const IndexedInsn *insnData_;
+	size_t insnCount_;
+	const IndexedXref *xrefData_;
+	size_t xrefCount_;
+	void *map_;
+	size_t mapSize_;
+	uint64_t buildId_;
+	uint64_t imageSize_;
+};
+
+#endif // _INCLUDE_SRCDS_OSX_IMAGEINDEX_H_
@@ -0,0 +1,423 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ImportHook.h"
+#include "CDetour/vtablehook.h"
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(PLATFORM_MACOSX)
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#elif defined(PLATFORM_LINUX)
+#include <elf.h>
+#include <link.h>
+#endif
+
+#if defined(PLATFORM_MACOSX)
+#if defined(PLATFORM_X64)
+typedef struct mach_header_64 MachHeader;
+typedef struct segment_command_64 MachSegment;
+typedef struct section_64 MachSection;
+typedef struct nlist_64 MachSymbol;
+#define MACH_LC_SEGMENT LC_SEGMENT_64
+#else
+typedef struct mach_header MachHeader;
+typedef struct segment_command MachSegment;
+typedef struct section MachSection;
+typedef struct nlist MachSymbol;
+#define MACH_LC_SEGMENT LC_SEGMENT
+#endif
+#elif defined(PLATFORM_LINUX)
+#if defined(PLATFORM_X64)
+typedef ElfW(Rela) ElfReloc;
+#define ELF_R_SYM(info)     ELF64_R_SYM(info)
+#define ELF_R_TYPE(info)    ELF64_R_TYPE(info)
+#define ELF_JUMP_SLOT       R_X86_64_JUMP_SLOT
+#define ELF_GLOB_DAT        R_X86_64_GLOB_DAT
+#define ELF_DT_RELOC        DT_RELA
+#define ELF_DT_RELOCSZ      DT_RELASZ
+#else
+typedef ElfW(Rel) ElfReloc;
+#define ELF_R_SYM(info)     ELF32_R_SYM(info)
+#define ELF_R_TYPE(info)    ELF32_R_TYPE(info)
+#define ELF_JUMP_SLOT       R_386_JMP_SLOT
+#define ELF_GLOB_DAT        R_386_GLOB_DAT
+#define ELF_DT_RELOC        DT_REL
+#define ELF_DT_RELOCSZ      DT_RELSZ
+#endif
+
+struct ElfModule
+{
+	uintptr_t addr;
+	uintptr_t base;
+	const ElfW(Phdr) *phdrs;
+	ElfW(Half) phdrCount;
+};
+
+static int FindElfModule(struct dl_phdr_info *info, size_t size, void *data)
+{
+	ElfModule *module = (ElfModule *)data;
+
+	for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++)
+	{
+		const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+
+		if (phdr.p_type == PT_LOAD && module->addr >= start && module->addr < start + phdr.p_memsz)
+		{
+			module->base = info->dlpi_addr;
+			module->phdrs = info->dlpi_phdr;
+			module->phdrCount = info->dlpi_phnum;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// glibc relocates the pointers in the dynamic section when loading, other loaders leave them as offsets
+static inline uintptr_t ElfDynamicAddr(uintptr_t base, uintptr_t ptr)
+{
+	return ptr < base ? base + ptr : ptr;
+}
+#endif
+
+ImportHook::ImportHook() : slots_(NULL), slotCount_(0), slotSize_(0), callback_(NULL), enabled_(false)
+{
+}
+
+ImportHook::~ImportHook()
+{
+	free(slots_);
+}
+
+ImportHook *ImportHook::Create(HSGameLib &lib, const char *symbol, void *callback, void **original)
+{
+	return Create(lib.GetBase(), symbol, callback, original);
+}
+
+ImportHook *ImportHook::Create(uintptr_t base, const char *symbol, void *callback, void **original)
+{
+	Dl_info info;
+	void *header;
+
+	if (!base || !symbol || !callback || !dladdr((void *)base, &info))
+		return NULL;
+
+	header = info.dli_fbase;
+
+	ImportHook *hook = new ImportHook();
+	hook->callback_ = callback;
+
+	if (!hook->FindSlots(base, symbol) || !hook->slotCount_)
+	{
+		delete hook;
+		return NULL;
+	}
+
+	// A lazy pointer that hasn't been bound yet points back into the library, at the code that binds
+	// it. Calling through that would bind the pointer again over the hook, so only take a pointer
+	// that leads out of the library, or else look the function up.
+	void *target = NULL;
+
+	for (size_t i = 0; i < hook->slotCount_ && !target; i++)
+	{
+		void *value = *hook->slots_[i].address;
+
+		if (value && (!dladdr(value, &info) || info.dli_fbase != header))
+			target = value;
+	}
+
+	if (!target)
+		target = dlsym(RTLD_DEFAULT, symbol);
+
+	if (!target)
+	{
+		delete hook;
+		return NULL;
+	}
+
+	*original = target;
+
+	return hook;
+}
+
+bool ImportHook::AddSlot(void **address, bool readOnly)
+{
+	if (slotCount_ == slotSize_)
+	{
+		size_t size = slotSize_ ? slotSize_ * 2 : 4;
+		Slot *slots = (Slot *)realloc(slots_, size * sizeof(Slot));
+		if (!slots)
+			return false;
+
+		slots_ = slots;
+		slotSize_ = size;
+	}
+
+	Slot &slot = slots_[slotCount_++];
+	slot.address = address;
+	slot.saved = NULL;
+	slot.readOnly = readOnly;
+
+	return true;
+}
+
+bool ImportHook::FindSlots(uintptr_t base, const char *symbol)
+{
+#if defined(PLATFORM_MACOSX)
+	const MachHeader *header = (const MachHeader *)base;
+	const struct load_command *cmd = (const struct load_command *)(base + sizeof(MachHeader));
+	const MachSegment *linkEdit = NULL;
+	const struct symtab_command *symtab = NULL;
+	const struct dysymtab_command *dysymtab = NULL;
+	intptr_t slide = 0;
+
+	for (uint32_t i = 0; i < header->ncmds; i++)
+	{
+		if (cmd->cmd == MACH_LC_SEGMENT)
+		{
+			const MachSegment *seg = (const MachSegment *)cmd;
+
+			if (strcmp(seg->segname, "__TEXT") == 0)
+				slide = base - seg->vmaddr;
+			else if (strcmp(seg->segname, "__LINKEDIT") == 0)
+				linkEdit = seg;
+		}
+		else if (cmd->cmd == LC_SYMTAB)
+		{
+			symtab = (const struct symtab_command *)cmd;
+		}
+		else if (cmd->cmd == LC_DYSYMTAB)
+		{
+			dysymtab = (const struct dysymtab_command *)cmd;
+		}
+
+		cmd = (const struct load_command *)(uintptr_t(cmd) + cmd->cmdsize);
+	}
+
+	if (!linkEdit || !symtab || !dysymtab || !dysymtab->nindirectsyms)
+		return false;
+
+	uintptr_t linkEditBase = slide + linkEdit->vmaddr - linkEdit->fileoff;
+	const MachSymbol *symbols = (const MachSymbol *)(linkEditBase + symtab->symoff);
+	const char *strings = (const char *)(linkEditBase + symtab->stroff);
+	const uint32_t *indirect = (const uint32_t *)(linkEditBase + dysymtab->indirectsymoff);
+
+	cmd = (const struct load_command *)(base + sizeof(MachHeader));
+
+	for (uint32_t i = 0; i < header->ncmds; i++, cmd = (const struct load_command *)(uintptr_t(cmd) + cmd->cmdsize))
+	{
+		if (cmd->cmd != MACH_LC_SEGMENT)
+			continue;
+
+		const MachSegment *seg = (const MachSegment *)cmd;
+		const MachSection *sect = (const MachSection *)(seg + 1);
+
+		// dyld makes __DATA_CONST read-only once it has bound everything in it
+		bool readOnly = strcmp(seg->segname, "__DATA_CONST") == 0 || !(seg->initprot & VM_PROT_WRITE);
+
+		for (uint32_t j = 0; j < seg->nsects; j++, sect++)
+		{
+			uint32_t type = sect->flags & SECTION_TYPE;
+			if (type != S_LAZY_SYMBOL_POINTERS && type != S_NON_LAZY_SYMBOL_POINTERS)
+				continue;
+
+			const uint32_t *indices = indirect + sect->reserved1;
+			void **pointers = (void **)(slide + sect->addr);
+
+			for (size_t k = 0; k < sect->size / sizeof(void *); k++)
+			{
+				uint32_t index = indices[k];
+				if (index & (INDIRECT_SYMBOL_LOCAL | INDIRECT_SYMBOL_ABS) || index >= symtab->nsyms)
+					continue;
+
+				// Ignore the prepended underscore to match dlsym()
+				const char *name = strings + symbols[index].n_un.n_strx;
+				if (name[0] == '_' && strcmp(name + 1, symbol) == 0 && !AddSlot(&pointers[k], readOnly))
+					return false;
+			}
+		}
+	}
+
+	return true;
+#elif defined(PLATFORM_LINUX)
+	ElfModule module;
+	module.addr = base;
+
+	if (!dl_iterate_phdr(FindElfModule, &module))
+		return false;
+
+	const ElfW(Dyn) *dynamic = NULL;
+	uintptr_t relroStart = 0, relroEnd = 0;
+
+	for (ElfW(Half) i = 0; i < module.phdrCount; i++)
+	{
+		const ElfW(Phdr) &phdr = module.phdrs[i];
+
+		if (phdr.p_type == PT_DYNAMIC)
+		{
+			dynamic = (const ElfW(Dyn) *)(module.base + phdr.p_vaddr);
+		}
+		else if (phdr.p_type == PT_GNU_RELRO)
+		{
+			relroStart = module.base + phdr.p_vaddr;
+			relroEnd = relroStart + phdr.p_memsz;
+		}
+	}
+
+	if (!dynamic)
+		return false;
+
+	const ElfW(Sym) *symbols = NULL;
+	const char *strings = NULL;
+	const ElfReloc *relocs[2] = {NULL, NULL};
+	size_t relocSizes[2] = {0, 0};
+
+	for (const ElfW(Dyn) *dyn = dynamic; dyn->d_tag != DT_NULL; dyn++)
+	{
+		switch (dyn->d_tag)
+		{
+		case DT_SYMTAB:
+			symbols = (const ElfW(Sym) *)ElfDynamicAddr(module.base, dyn->d_un.d_ptr);
+			break;
+		case DT_STRTAB:
+			strings = (const char *)ElfDynamicAddr(module.base, dyn->d_un.d_ptr);
+			break;
+		case DT_JMPREL:
+			relocs[0] = (const ElfReloc *)ElfDynamicAddr(module.base, dyn->d_un.d_ptr);
+			break;
+		case DT_PLTRELSZ:
+			relocSizes[0] = dyn->d_un.d_val;
+			break;
+		case ELF_DT_RELOC:
+			relocs[1] = (const ElfReloc *)ElfDynamicAddr(module.base, dyn->d_un.d_ptr);
+			break;
+		case ELF_DT_RELOCSZ:
+			relocSizes[1] = dyn->d_un.d_val;
+			break;
+		}
+	}
+
+	if (!symbols || !strings)
+		return false;
+
+	// Calls go through .rela.plt, taking the function's address through .rela.dyn
+	for (size_t i = 0; i < 2; i++)
+	{
+		for (size_t j = 0; relocs[i] && j < relocSizes[i] / sizeof(ElfReloc); j++)
+		{
+			const ElfReloc &reloc = relocs[i][j];
+			unsigned int type = ELF_R_TYPE(reloc.r_info);
+
+			if ((type != ELF_JUMP_SLOT && type != ELF_GLOB_DAT) || !ELF_R_SYM(reloc.r_info))
+				continue;
+
+			const char *name = strings + symbols[ELF_R_SYM(reloc.r_info)].st_name;
+			if (strcmp(name, symbol) != 0)
+				continue;
+
+			uintptr_t address = module.base + reloc.r_offset;
+			if (!AddSlot((void **)address, address >= relroStart && address < relroEnd))
+				return false;
+		}
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool ImportHook::WriteSlot(void **address, bool readOnly, void *value)
+{
+	static uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+	void *page = (void *)(uintptr_t(address) & ~(pageSize - 1));
+
+	// The page is put back exactly as it was, since it isn't always only readable
+	int access = 0;
+	if (readOnly && (!GetMemAccess(address, access) || mprotect(page, pageSize, access | PROT_WRITE) != 0))
+		return false;
+
+	// Pointer sized aligned stores are atomic, so concurrent calls see either function
+	*(void *volatile *)address = value;
+
+	if (readOnly)
+		mprotect(page, pageSize, access);
+
+	return true;
+}
+
+bool ImportHook::Enable()
+{
+	if (enabled_)
+		return true;
+
+	for (size_t i = 0; i < slotCount_; i++)
+	{
+		Slot &slot = slots_[i];
+		slot.saved = *slot.address;
+
+		if (!WriteSlot(slot.address, slot.readOnly, callback_))
+		{
+			while (i-- > 0)
+				WriteSlot(slots_[i].address, slots_[i].readOnly, slots_[i].saved);
+			return false;
+		}
+	}
+
+	enabled_ = true;
+	return true;
+}
+
+void ImportHook::Disable()
+{
+	if (!enabled_)
+		return;
+
+	// Leave anything that has replaced us alone
+	for (size_t i = 0; i < slotCount_; i++)
+	{
+		if (*slots_[i].address == callback_)
+			WriteSlot(slots_[i].address, slots_[i].readOnly, slots_[i].saved);
+	}
+
+	enabled_ = false;
+}
+
+bool ImportHook::IsEnabled() const
+{
+	return enabled_;
+}
+
+void ImportHook::Destroy()
+{
+	Disable();
+	delete this;
+}
+
+size_t ImportHook::GetSlotCount() const
+{
+	return slotCount_;
+}
@@ -0,0 +1,80 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_IMPORTHOOK_H_
+#define _INCLUDE_SRCDS_OSX_IMPORTHOOK_H_
+
+#include "HSGameLib.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Redirects the calls one library makes to a function it imports, without patching any code.
+//
+// Every pointer the dynamic linker fills in for the import is replaced: on Mach-O the lazy and
+// non-lazy symbol pointers (__la_symbol_ptr, __nl_symbol_ptr and __got) found through the
+// indirect symbol table, and on ELF the JUMP_SLOT and GLOB_DAT relocations in .rela.plt and
+// .rela.dyn. Other libraries keep calling the real function.
+//
+// Pointers that are read-only after binding (__DATA_CONST, RELRO) are made writable only for as
+// long as it takes to swap them.
+class ImportHook
+{
+public:
+	// Creates a hook on the imports of symbol by the library. The hook is not enabled yet.
+	// original receives the function the library would have called. Returns NULL if the library
+	// doesn't import the symbol.
+	static ImportHook *Create(HSGameLib &lib, const char *symbol, void *callback, void **original);
+
+	// Same, for the library loaded at base
+	static ImportHook *Create(uintptr_t base, const char *symbol, void *callback, void **original);
+public:
+	bool Enable();
+	void Disable();
+	bool IsEnabled() const;
+
+	// Disables and frees the hook
+	void Destroy();
+
+	// Number of pointers the hook replaces
+	size_t GetSlotCount() const;
+private:
+	ImportHook();
+	~ImportHook();
+
+	bool AddSlot(void **address, bool readOnly);
+	bool FindSlots(uintptr_t base, const char *symbol);
+	static bool WriteSlot(void **address, bool readOnly, void *value);
+private:
+	struct Slot
+	{
+		void **address;
+		void *saved;		// What the dynamic linker had put there
+		bool readOnly;
+	};
+
+	Slot *slots_;
+	size_t slotCount_;
+	size_t slotSize_;
+	void *callback_;
+	bool enabled_;
+};
+
+#endif // _INCLUDE_SRCDS_OSX_IMPORTHOOK_H_
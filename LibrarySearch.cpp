@@ -0,0 +1,210 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "LibrarySearch.h"
+#include "am-allocator-policies.h"
+#include "am-vector.h"
+#include <algorithm>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(PLATFORM_MACOSX)
+#define LIBEXT ".dylib"
+#else
+#define LIBEXT ".so"
+#endif
+
+struct LibraryEntry
+{
+	const char *name;
+	const char *path;
+	size_t dir;						// Position of the directory in the search path
+};
+
+static inline bool operator <(const LibraryEntry &a, const LibraryEntry &b)
+{
+	int cmp = strcmp(a.name, b.name);
+	return cmp < 0 || (cmp == 0 && a.dir < b.dir);
+}
+
+// Built at startup before the game runs, and only read after that
+static ke::Arena g_Strings;
+static ke::Vector<LibraryEntry> g_Libraries;
+static size_t g_DirCount = 0;
+
+static volatile size_t g_Resolved = 0;
+static volatile size_t g_ProbesAvoided = 0;
+
+static inline bool HasExtension(const char *name, size_t length)
+{
+	const size_t extLength = sizeof(LIBEXT) - 1;
+	return length > extLength && strcmp(name + length - extLength, LIBEXT) == 0;
+}
+
+static void AddDirectory(const char *dir, size_t dirLength)
+{
+	char dirPath[PATH_MAX];
+	if (dirLength >= sizeof(dirPath))
+		return;
+
+	memcpy(dirPath, dir, dirLength);
+	dirPath[dirLength] = '\0';
+
+	DIR *listing = opendir(dirPath);
+	if (!listing)
+		return;
+
+	while (struct dirent *entry = readdir(listing))
+	{
+		if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+			continue;
+
+		size_t nameLength = strlen(entry->d_name);
+		if (!HasExtension(entry->d_name, nameLength) || dirLength + nameLength + 2 > PATH_MAX)
+			continue;
+
+		char *path = (char *)g_Strings.allocate(dirLength + nameLength + 2);
+		if (!path)
+			break;
+
+		memcpy(path, dirPath, dirLength);
+		path[dirLength] = '/';
+		memcpy(path + dirLength + 1, entry->d_name, nameLength + 1);
+
+		LibraryEntry library = {path + dirLength + 1, path, g_DirCount};
+		if (!g_Libraries.append(library))
+			break;
+	}
+
+	closedir(listing);
+}
+
+size_t LibrarySearch::SetPath(const char *path)
+{
+	g_Libraries.clear();
+	g_Strings.reset();
+	g_DirCount = 0;
+
+	// The loader takes relative directories from the working directory
+	char cwd[PATH_MAX];
+	size_t cwdLength = getcwd(cwd, sizeof(cwd)) ? strlen(cwd) : 0;
+
+	while (path && *path)
+	{
+		const char *end = strchr(path, ':');
+		size_t length = end ? end - path : strlen(path);
+
+		while (length > 1 && path[length - 1] == '/')
+			length--;
+
+		if (length && path[0] == '/')
+		{
+			AddDirectory(path, length);
+			g_DirCount++;
+		}
+		else if (length && cwdLength && cwdLength + length + 1 < sizeof(cwd))
+		{
+			char dir[PATH_MAX];
+			memcpy(dir, cwd, cwdLength);
+			dir[cwdLength] = '/';
+			memcpy(dir + cwdLength + 1, path, length);
+
+			AddDirectory(dir, cwdLength + 1 + length);
+			g_DirCount++;
+		}
+
+		path = end ? end + 1 : nullptr;
+	}
+
+	// Sorted by name, and then by directory so that the first match is the one the loader finds
+	std::sort(g_Libraries.begin(), g_Libraries.end());
+
+	return g_Libraries.length();
+}
+
+static const LibraryEntry *FindLibrary(const char *name)
+{
+	LibraryEntry key = {name, nullptr, 0};
+	const LibraryEntry *found = std::lower_bound(g_Libraries.begin(), g_Libraries.end(), key);
+	if (found == g_Libraries.end() || strcmp(found->name, name) != 0)
+		return nullptr;
+
+	return found;
+}
+
+static const LibraryEntry *Lookup(const char *name)
+{
+	// A name with directories is opened where it says rather than searched for
+	if (!name || strchr(name, '/') || !g_Libraries.length())
+		return nullptr;
+
+	size_t length = strlen(name);
+
+	if (HasExtension(name, length))
+		return FindLibrary(name);
+
+	// The engine's Sys_LoadModule adds the extension if it's missing
+	char withExt[PATH_MAX];
+	if (length + sizeof(LIBEXT) > sizeof(withExt))
+		return nullptr;
+
+	memcpy(withExt, name, length);
+	memcpy(withExt + length, LIBEXT, sizeof(LIBEXT));
+	return FindLibrary(withExt);
+}
+
+const char *LibrarySearch::Resolve(const char *name)
+{
+	const LibraryEntry *library = Lookup(name);
+	if (!library)
+		return nullptr;
+
+	__sync_fetch_and_add(&g_Resolved, 1);
+#if defined(PLATFORM_LINUX)
+	// A path with a slash isn't searched for at all. dyld still looks for the file name in
+	// DYLD_LIBRARY_PATH first, finding the same library, so only skipped names save anything there.
+	__sync_fetch_and_add(&g_ProbesAvoided, library->dir);
+#endif
+
+	return library->path;
+}
+
+bool LibrarySearch::Contains(const char *name)
+{
+	return Lookup(name) != nullptr;
+}
+
+void LibrarySearch::SkipNames(size_t count)
+{
+	__sync_fetch_and_add(&g_ProbesAvoided, count * g_DirCount);
+}
+
+void LibrarySearch::PrintStats()
+{
+	if (!g_Resolved)
+		return;
+
+	printf("Library search: %zu loads resolved from %zu libraries in %zu directories, %zu directory probes avoided\n",
+	       size_t(g_Resolved), g_Libraries.length(), g_DirCount, size_t(g_ProbesAvoided));
+}
@@ -0,0 +1,65 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_LIBRARYSEARCH_H_
+#define _INCLUDE_SRCDS_OSX_LIBRARYSEARCH_H_
+
+#include <stddef.h>
+
+/*
+ * Index of the libraries in the search path, by file name.
+ *
+ * Opening a library by name makes the loader try each directory in DYLD_LIBRARY_PATH in turn,
+ * so every load touches the filesystem once per directory until it hits, and a name that isn't
+ * there misses in all of them. The directories are listed once instead, so that names which
+ * aren't in the search path can be passed over and loads can be given the library's full path.
+ */
+class LibrarySearch
+{
+public:
+	/**
+	 * Lists the directories in a search path, replacing the previous index.
+	 *
+	 * @param path			Colon separated directories, in the order the loader searches them.
+	 * @return				Number of libraries found.
+	 */
+	static size_t SetPath(const char *path);
+
+	/**
+	 * Finds the library that the loader would find for a name.
+	 *
+	 * @param name			Library file name, which may lack its extension.
+	 * @return				Full path of the library, or NULL if it isn't in the search path or
+	 *						the name includes directories.
+	 */
+	static const char *Resolve(const char *name);
+
+	/* Like Resolve, but only checks whether the library is in the search path */
+	static bool Contains(const char *name);
+
+	/* Counts names that weren't tried because a later one is in the index */
+	static void SkipNames(size_t count);
+
+	/* Prints how many loads were resolved and the directory probes that saved */
+	static void PrintStats();
+};
+
+#endif // _INCLUDE_SRCDS_OSX_LIBRARYSEARCH_H_
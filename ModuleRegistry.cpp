@@ -0,0 +1,389 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ModuleRegistry.h"
+#include "am-vector.h"
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(PLATFORM_MACOSX)
+#include <mach-o/dyld.h>
+#elif defined(PLATFORM_LINUX)
+#include <sys/mman.h>
+#endif
+
+static ke::Vector<LoadedModule *> g_Modules;
+static pthread_mutex_t g_ModuleLock = PTHREAD_MUTEX_INITIALIZER;
+
+LoadedModule::LoadedModule()
+	: handle(nullptr), base(0), refCount(0), examined(false), valid(false), lastPosition(0),
+	  symbolTable(nullptr), stringTable(nullptr), symbolCount(0), fileHeader(nullptr), mapSize(0),
+	  searchSize(0), imageSize(0), buildId(0), codeRangeCount(0), functionStarts(0), functionStartsSize(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+LoadedModule::~LoadedModule()
+{
+#if defined(PLATFORM_LINUX)
+	if (fileHeader != nullptr && mapSize > 0)
+		munmap(fileHeader, mapSize);
+#endif
+	pthread_mutex_destroy(&lock);
+}
+
+#if defined(PLATFORM_MACOSX)
+/*
+ * Every image in the process by file name, kept up to date by dyld as images come and go, so
+ * that finding a library doesn't mean asking dlopen() about each of them in turn.
+ * Open addressing with linear probing, kept at most half full.
+ */
+struct ImageRecord
+{
+	const struct mach_header *header;
+	const char *name;		// File name part of path
+	char path[1];
+};
+
+static ImageRecord **g_Images = nullptr;
+static size_t g_ImageCount = 0;
+static size_t g_ImageMask = 0;
+static pthread_mutex_t g_ImageLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_ImageOnce = PTHREAD_ONCE_INIT;
+
+static const size_t kMaxCandidates = 4;
+
+static inline const char *FileName(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+static inline size_t HashName(const char *name)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (; *name; name++)
+	{
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static bool InsertImage(ImageRecord *record)
+{
+	if ((g_ImageCount + 1) * 2 > g_ImageMask + 1)
+	{
+		size_t capacity = g_Images ? (g_ImageMask + 1) * 2 : 256;
+		ImageRecord **table = (ImageRecord **)calloc(capacity, sizeof(ImageRecord *));
+		if (!table)
+			return false;
+
+		for (size_t i = 0; g_Images && i <= g_ImageMask; i++)
+		{
+			if (!g_Images[i])
+				continue;
+
+			size_t j = HashName(g_Images[i]->name) & (capacity - 1);
+			while (table[j])
+				j = (j + 1) & (capacity - 1);
+			table[j] = g_Images[i];
+		}
+
+		free(g_Images);
+		g_Images = table;
+		g_ImageMask = capacity - 1;
+	}
+
+	size_t i = HashName(record->name) & g_ImageMask;
+	while (g_Images[i])
+		i = (i + 1) & g_ImageMask;
+
+	g_Images[i] = record;
+	g_ImageCount++;
+
+	return true;
+}
+
+static void RemoveImage(const struct mach_header *header)
+{
+	size_t i = 0;
+	while (g_Images && i <= g_ImageMask && (!g_Images[i] || g_Images[i]->header != header))
+		i++;
+
+	if (!g_Images || i > g_ImageMask)
+		return;
+
+	free(g_Images[i]);
+	g_Images[i] = nullptr;
+	g_ImageCount--;
+
+	// Shift back later entries of the run that could have used the slot
+	for (size_t j = (i + 1) & g_ImageMask; g_Images[j]; j = (j + 1) & g_ImageMask)
+	{
+		size_t home = HashName(g_Images[j]->name) & g_ImageMask;
+		if (((j - home) & g_ImageMask) >= ((j - i) & g_ImageMask))
+		{
+			g_Images[i] = g_Images[j];
+			g_Images[j] = nullptr;
+			i = j;
+		}
+	}
+}
+
+static void OnAddImage(const struct mach_header *header, intptr_t slide)
+{
+	Dl_info info;
+	if (!dladdr(header, &info) || !info.dli_fname)
+		return;
+
+	size_t length = strlen(info.dli_fname);
+	ImageRecord *record = (ImageRecord *)malloc(sizeof(ImageRecord) + length);
+	if (!record)
+		return;
+
+	record->header = header;
+	memcpy(record->path, info.dli_fname, length + 1);
+	record->name = FileName(record->path);
+
+	pthread_mutex_lock(&g_ImageLock);
+	if (!InsertImage(record))
+		free(record);
+	pthread_mutex_unlock(&g_ImageLock);
+}
+
+static void OnRemoveImage(const struct mach_header *header, intptr_t slide)
+{
+	pthread_mutex_lock(&g_ImageLock);
+	RemoveImage(header);
+	pthread_mutex_unlock(&g_ImageLock);
+}
+
+static void WatchImages()
+{
+	// Called back right away for the images already loaded
+	_dyld_register_func_for_add_image(OnAddImage);
+	_dyld_register_func_for_remove_image(OnRemoveImage);
+}
+
+/* Finds the image that a library opened by name came from */
+static uintptr_t LookupImage(LibHandle handle, const char *name, AString &path)
+{
+	AString candidates[kMaxCandidates];
+	uintptr_t bases[kMaxCandidates];
+	size_t count = 0;
+
+	pthread_once(&g_ImageOnce, WatchImages);
+
+	const char *file = FileName(name);
+	size_t nameLength = strlen(name);
+
+	pthread_mutex_lock(&g_ImageLock);
+	for (size_t i = HashName(file) & g_ImageMask; g_Images && g_Images[i]; i = (i + 1) & g_ImageMask)
+	{
+		ImageRecord *record = g_Images[i];
+		if (strcmp(record->name, file) != 0)
+			continue;
+
+		// The name can include directories, e.g. bin/engine.dylib
+		size_t pathLength = strlen(record->path);
+		if (pathLength < nameLength || strcmp(record->path + pathLength - nameLength, name) != 0)
+			continue;
+
+		if (count < kMaxCandidates)
+		{
+			candidates[count] = record->path;
+			bases[count++] = (uintptr_t)record->header;
+		}
+	}
+	pthread_mutex_unlock(&g_ImageLock);
+
+	// Usually there is only one image by that name, but make sure it's the one the handle is for
+	for (size_t i = 0; i < count; i++)
+	{
+		void *other = dlopen(candidates[i].chars(), RTLD_NOLOAD);
+		if (!other)
+			continue;
+		dlclose(other);
+
+		if (other == handle)
+		{
+			path = candidates[i];
+			return bases[i];
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* Finds where the library is loaded and the path it was loaded from */
+static uintptr_t FindImage(LibHandle handle, const char *libName, AString &path)
+{
+	Dl_info info;
+	uintptr_t base = 0;
+	const char *name = nullptr;
+
+	// First try using dladdr() with the public factory symbol
+	void *factory = dlsym(handle, "CreateInterface");
+	if (factory && dladdr(factory, &info) && info.dli_fbase && info.dli_fname)
+	{
+		base = (uintptr_t)info.dli_fbase;
+		name = info.dli_fname;
+	}
+
+#if defined(PLATFORM_MACOSX)
+	AString imagePath;
+	if (!base && libName)
+	{
+		base = LookupImage(handle, libName, imagePath);
+		if (base)
+			name = imagePath.chars();
+	}
+
+	// Otherwise look through all the libraries loaded in the process for a matching handle.
+	// This is only needed when the library was opened by a name that differs from its image path.
+	uint32_t imageCount = _dyld_image_count();
+	for (uint32_t i = 1; !base && i < imageCount; i++)
+	{
+		const char *imageName = _dyld_get_image_name(i);
+		void *other = dlopen(imageName, RTLD_NOLOAD);
+		if (!other)
+			continue;
+
+		if (other == handle)
+		{
+			base = (uintptr_t)_dyld_get_image_header(i);
+			name = imageName;
+		}
+		dlclose(other);
+	}
+#elif defined(PLATFORM_LINUX)
+	// Otherwise the handle leads to the library's link map entry, which has both
+	struct link_map *map;
+	if (!base && dlinfo(handle, RTLD_DI_LINKMAP, &map) == 0 && map)
+	{
+		base = map->l_addr;
+		name = map->l_name;
+	}
+#endif
+
+	if (name && *name)
+	{
+		char resolved[PATH_MAX];
+		path = realpath(name, resolved) ? resolved : name;
+	}
+
+	return base;
+}
+
+static LoadedModule *FindModule(LibHandle handle, const AString &path)
+{
+	for (size_t i = 0; i < g_Modules.length(); i++)
+	{
+		LoadedModule *module = g_Modules[i];
+		if (module->handle == handle || (path.length() && module->path == path))
+			return module;
+	}
+
+	return nullptr;
+}
+
+LoadedModule *ModuleRegistry::Acquire(LibHandle handle, const char *name)
+{
+	if (!handle)
+		return nullptr;
+
+	pthread_mutex_lock(&g_ModuleLock);
+
+	LoadedModule *module = FindModule(handle, AString());
+	if (!module)
+	{
+		AString path;
+		uintptr_t base = FindImage(handle, name, path);
+
+		// The same image can be reached through another handle, e.g. when opened by a different path
+		module = FindModule(handle, path);
+		if (!module)
+		{
+			module = new LoadedModule;
+			module->path = path;
+			module->base = base;
+
+			if (!g_Modules.append(module))
+			{
+				delete module;
+				pthread_mutex_unlock(&g_ModuleLock);
+				dlclose(handle);
+				return nullptr;
+			}
+
+			module->handle = handle;
+			handle = nullptr;
+		}
+	}
+
+	module->refCount++;
+
+	pthread_mutex_unlock(&g_ModuleLock);
+
+	// The module keeps the library loaded with its own handle
+	if (handle)
+		dlclose(handle);
+
+	return module;
+}
+
+void ModuleRegistry::Release(LoadedModule *module)
+{
+	pthread_mutex_lock(&g_ModuleLock);
+	module->refCount--;
+	pthread_mutex_unlock(&g_ModuleLock);
+}
+
+void ModuleRegistry::ReleaseUnused()
+{
+	ke::Vector<LoadedModule *> unused;
+
+	pthread_mutex_lock(&g_ModuleLock);
+
+	size_t kept = 0;
+	for (size_t i = 0; i < g_Modules.length(); i++)
+	{
+		if (g_Modules[i]->refCount > 0)
+			g_Modules[kept++] = g_Modules[i];
+		else
+			unused.append(g_Modules[i]);
+	}
+
+	while (g_Modules.length() > kept)
+		g_Modules.pop();
+
+	pthread_mutex_unlock(&g_ModuleLock);
+
+	for (size_t i = 0; i < unused.length(); i++)
+	{
+		dlclose(unused[i]->handle);
+		delete unused[i];
+	}
+}
@@ -0,0 +1,124 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_MODULEREGISTRY_H_
+#define _INCLUDE_SRCDS_OSX_MODULEREGISTRY_H_
+
+#include "GameLib.h"
+#include "sm_symtable.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(PLATFORM_LINUX)
+#include <elf.h>
+#include <link.h>
+#if defined(PLATFORM_X64)
+typedef Elf64_Sym *RawSymbolTable;
+#else
+typedef Elf32_Sym *RawSymbolTable;
+#endif // defined(PLATFORM_X64)
+#elif defined(PLATFORM_MACOSX)
+#include <mach-o/nlist.h>
+#if defined(PLATFORM_X64)
+typedef struct nlist_64 *RawSymbolTable;
+#else
+typedef struct nlist *RawSymbolTable;
+#endif // defined(PLATFORM_X64)
+#endif
+
+// Range of executable code within a loaded library
+struct CodeRange
+{
+	uintptr_t start;
+	size_t size;
+};
+
+/*
+ * One library loaded in the process, shared by every GameLib that opens it.
+ *
+ * The registry holds a single handle to the library. Everything below lock is filled in by
+ * HSGameLib the first time one is opened on the module, and is then reused by every later one.
+ */
+struct LoadedModule
+{
+	static const size_t kMaxCodeRanges = 16;
+
+	LoadedModule();
+	~LoadedModule();
+
+	AString path;					// Resolved path of the image, empty if it couldn't be found
+	LibHandle handle;
+	uintptr_t base;
+	int refCount;					// GameLibs open on the module
+
+	pthread_mutex_t lock;			// Guards the rest, symbols are cached as they are looked up
+	bool examined;
+	bool valid;						// The symbol table was found
+	SymbolTable table;
+	uint32_t lastPosition;			// Where the search for an uncached symbol resumes
+	RawSymbolTable symbolTable;
+	const char *stringTable;
+	uint32_t symbolCount;
+	void *fileHeader;
+	off_t mapSize;					// Size of fileHeader if it is a mapping of the file
+	off_t searchSize;
+	size_t imageSize;
+	uint64_t buildId;
+	CodeRange codeRanges[kMaxCodeRanges];
+	size_t codeRangeCount;
+	uintptr_t functionStarts;
+	uint32_t functionStartsSize;
+
+private:
+	LoadedModule(const LoadedModule &other);
+	LoadedModule &operator =(const LoadedModule &other);
+};
+
+/*
+ * Process-wide table of the libraries opened through GameLib, keyed by resolved image path.
+ *
+ * Libraries are opened many times over during startup, often only to look something up. Sharing
+ * one LoadedModule per image means its base address is found and its symbols are indexed once.
+ * A module stays in the registry, along with its handle, after its last GameLib is closed, so
+ * that opening it again later is cheap. ReleaseUnused() lets those go.
+ */
+class ModuleRegistry
+{
+public:
+	/**
+	 * Finds or adds the module for a library handle, adding a reference to it.
+	 *
+	 * @param handle		Handle from dlopen(). The registry takes it over, and closes it if the
+	 *						module already has a handle.
+	 * @param name			Name the library was opened with, used to find its image quickly.
+	 * @return				Module, or NULL if it couldn't be added (handle is closed).
+	 */
+	static LoadedModule *Acquire(LibHandle handle, const char *name = NULL);
+
+	/* Drops a reference from Acquire() */
+	static void Release(LoadedModule *module);
+
+	/* Closes and forgets every module that no GameLib has open */
+	static void ReleaseUnused();
+};
+
+#endif // _INCLUDE_SRCDS_OSX_MODULEREGISTRY_H_
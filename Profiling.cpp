@@ -0,0 +1,246 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Profiling.h"
+#include "HSGameLib.h"
+#include "CDetour/profiler.h"
+#include "am-vector.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Function to profile, as read from the spec file */
+struct ProfileSpec
+{
+	AString library;
+	AString name;
+	ke::Vector<char> pattern;	/* Empty if name is a symbol */
+	bool done;
+};
+
+static ke::Vector<ProfileSpec *> g_Specs;
+static pthread_t g_Monitor;
+static volatile bool g_MonitorRunning = false;
+static volatile sig_atomic_t g_ReportRequested = 0;
+
+static void RequestReport(int sig)
+{
+	g_ReportRequested = 1;
+}
+
+static int HexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Decodes \xNN escapes, anything else is taken literally */
+static bool ParsePattern(const char *text, ke::Vector<char> &pattern)
+{
+	while (*text)
+	{
+		if (text[0] == '\\' && text[1] == 'x')
+		{
+			int hi = HexValue(text[2]);
+			int lo = hi < 0 ? -1 : HexValue(text[3]);
+			if (lo < 0)
+				return false;
+
+			if (!pattern.append(char((hi << 4) | lo)))
+				return false;
+			text += 4;
+		}
+		else if (!pattern.append(*text++))
+		{
+			return false;
+		}
+	}
+
+	return pattern.length() > 0;
+}
+
+static bool ParseSpecs(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+	{
+		printf("Failed to open profile spec file %s\n", path);
+		return false;
+	}
+
+	char line[1024];
+	int lineNum = 0;
+	bool ok = true;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		char *tokens[3] = {NULL, NULL, NULL};
+		char *save = NULL;
+		int count = 0;
+
+		lineNum++;
+
+		for (char *tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save))
+		{
+			if (count == 3)
+			{
+				count++;
+				break;
+			}
+			tokens[count++] = tok;
+		}
+
+		if (count == 0 || tokens[0][0] == '#')
+			continue;
+
+		ProfileSpec *spec = new ProfileSpec;
+		spec->library = tokens[0];
+		spec->done = false;
+
+		if (count == 2 || (count == 3 && ParsePattern(tokens[2], spec->pattern)))
+		{
+			spec->name = tokens[1];
+		}
+		else
+		{
+			printf("%s:%d: expected \"library symbol\" or \"library name signature\"\n", path, lineNum);
+			delete spec;
+			ok = false;
+			continue;
+		}
+
+		if (!g_Specs.append(spec))
+		{
+			delete spec;
+			ok = false;
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return ok;
+}
+
+/* Profiles everything in libraries that have been loaded since the last call */
+static void InstallPending()
+{
+	for (size_t i = 0; i < g_Specs.length(); i++)
+	{
+		if (g_Specs[i]->done)
+			continue;
+
+		HSGameLib lib;
+		if (!lib.Find(g_Specs[i]->library.chars()))
+			continue;
+
+		/* Only parse the library once for all of its functions */
+		for (size_t j = i; j < g_Specs.length(); j++)
+		{
+			ProfileSpec *spec = g_Specs[j];
+			if (spec->done || !(spec->library == g_Specs[i]->library))
+				continue;
+
+			void *addr;
+			if (!spec->pattern.length())
+				addr = lib.ResolveHiddenSymbol<void *>(spec->name.chars());
+			else
+				addr = lib.FindPattern(spec->pattern.buffer(), spec->pattern.length());
+
+			spec->done = true;
+
+			if (!addr)
+			{
+				printf("Failed to find %s in %s for profiling\n", spec->name.chars(), spec->library.chars());
+				continue;
+			}
+
+			CProfiler::Add(spec->name.chars(), addr);
+		}
+	}
+}
+
+static void *MonitorThread(void *param)
+{
+	while (g_MonitorRunning)
+	{
+		InstallPending();
+
+		if (g_ReportRequested)
+		{
+			g_ReportRequested = 0;
+			CProfiler::Report(stdout);
+		}
+
+		sleep(1);
+	}
+
+	return NULL;
+}
+
+bool InitProfiling(const char *specPath)
+{
+	if (!ParseSpecs(specPath))
+		return false;
+
+	InstallPending();
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = RequestReport;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	g_MonitorRunning = true;
+	if (pthread_create(&g_Monitor, NULL, MonitorThread, NULL) != 0)
+	{
+		printf("Failed to start profiling thread\n");
+		g_MonitorRunning = false;
+		return false;
+	}
+
+	return true;
+}
+
+void ShutdownProfiling()
+{
+	if (!g_MonitorRunning)
+		return;
+
+	g_MonitorRunning = false;
+	pthread_join(g_Monitor, NULL);
+
+	CProfiler::Report(stdout);
+	CProfiler::RemoveAll();
+
+	for (size_t i = 0; i < g_Specs.length(); i++)
+		delete g_Specs[i];
+	g_Specs.clear();
+}
@@ -0,0 +1,44 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_PROFILING_H_
+#define _INCLUDE_SRCDS_OSX_PROFILING_H_
+
+/*
+ * Starts profiling the functions listed in specPath (given by -profile). Each line holds a
+ * library name, as passed to HSGameLib, and a symbol:
+ *
+ *   engine _ZN7CEngine5FrameEv
+ *
+ * or a name to report the function under followed by its signature, with \x escapes and \x2A
+ * as a wildcard:
+ *
+ *   engine CEngine::Frame \x55\x48\x89\xE5\x41\x57\x2A\x2A\x53
+ *
+ * Functions in libraries that have not been loaded yet are picked up once they are, within a
+ * second or so. SIGUSR1 prints the counts gathered so far.
+ */
+bool InitProfiling(const char *specPath);
+
+/* Prints the final counts and removes the profiling detours */
+void ShutdownProfiling();
+
+#endif // _INCLUDE_SRCDS_OSX_PROFILING_H_
@@ -32,6 +32,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "am-utility.h"
 
 namespace ke {
 
@@ -60,6 +62,283 @@ class SystemAllocatorPolicy
     }
 };
 
+// Bump allocator for objects that are all thrown away together. Allocations
+// are carved out of large chunks and can't be freed one at a time; reset()
+// and the destructor release every chunk at once.
+class Arena
+{
+ public:
+  static const size_t kDefaultChunkSize = 16 * kKB;
+
+  explicit Arena(size_t chunkSize = kDefaultChunkSize)
+   : chunks_(NULL),
+     pos_(NULL),
+     end_(NULL),
+     chunkSize_(chunkSize)
+  {
+  }
+  ~Arena() {
+    reset();
+  }
+
+  void *allocate(size_t bytes) {
+    bytes = Align(bytes ? bytes : 1, kMallocAlignment);
+    if (bytes > size_t(end_ - pos_))
+      return allocateSlow(bytes);
+
+    void *ptr = pos_;
+    pos_ += bytes;
+    return ptr;
+  }
+
+  // Frees everything allocated from the arena.
+  void reset() {
+    while (chunks_) {
+      Chunk *next = chunks_->next;
+      ::free(chunks_);
+      chunks_ = next;
+    }
+    pos_ = end_ = NULL;
+  }
+
+ private:
+  struct Chunk {
+    Chunk *next;
+  };
+
+  static size_t headerSize() {
+    return Align(sizeof(Chunk), kMallocAlignment);
+  }
+
+  void *allocateSlow(size_t bytes) {
+    // Big allocations get a chunk of their own, so that the rest of the
+    // current chunk isn't wasted.
+    bool dedicated = bytes > chunkSize_ / 4;
+    size_t size = dedicated ? headerSize() + bytes : chunkSize_;
+
+    Chunk *chunk = (Chunk *)::malloc(size);
+    if (!chunk)
+      return NULL;
+
+    Address base = Address(chunk) + headerSize();
+    if (dedicated && chunks_) {
+      chunk->next = chunks_->next;
+      chunks_->next = chunk;
+      return base;
+    }
+
+    chunk->next = chunks_;
+    chunks_ = chunk;
+    pos_ = base + bytes;
+    end_ = Address(chunk) + size;
+    return base;
+  }
+
+ private:
+  Chunk *chunks_;
+  Address pos_;
+  Address end_;
+  size_t chunkSize_;
+
+ private:
+  Arena(const Arena &other) KE_DELETE;
+  Arena &operator =(const Arena &other) KE_DELETE;
+};
+
+// Allocates from an Arena that outlives the container. free() does nothing;
+// the memory comes back when the arena is reset or destroyed, so containers
+// using this policy can be torn down without walking their elements' memory.
+class ArenaAllocatorPolicy : public SystemAllocatorPolicy
+{
+  public:
+    explicit ArenaAllocatorPolicy(Arena *arena)
+      : arena_(arena)
+    {
+    }
+
+  public:
+    void free(void *memory) {
+    }
+    void *malloc(size_t bytes) {
+      void *ptr = arena_->allocate(bytes);
+      if (!ptr)
+        reportOutOfMemory();
+      return ptr;
+    }
+
+  private:
+    Arena *arena_;
+};
+
+// Pool of small blocks with a free list for each size, for containers that
+// allocate a node at a time. Every chunk holds blocks of a single size, so
+// nodes of the same container end up next to each other, and a block's size
+// is found from the chunk it lives in. Blocks that are still allocated when
+// the pool is destroyed are released with it.
+class NodePool
+{
+ public:
+  static const size_t kChunkSize = 16 * kKB;
+  static const size_t kGranularity = kMallocAlignment;
+  static const size_t kMaxNodeSize = 512;
+
+  NodePool()
+   : chunks_(NULL)
+  {
+    memset(free_, 0, sizeof(free_));
+  }
+  ~NodePool() {
+    while (chunks_) {
+      Chunk *next = chunks_->next;
+      freeChunk(chunks_);
+      chunks_ = next;
+    }
+  }
+
+  void *allocate(size_t bytes) {
+    if (bytes > kMaxNodeSize)
+      return allocateLarge(bytes);
+
+    size_t sizeClass = bytes ? (bytes - 1) / kGranularity : 0;
+    if (!free_[sizeClass] && !refill(sizeClass))
+      return NULL;
+
+    FreeNode *node = free_[sizeClass];
+    free_[sizeClass] = node->next;
+    return node;
+  }
+
+  void release(void *memory) {
+    if (!memory)
+      return;
+
+    Chunk *chunk = (Chunk *)AlignedBase(Address(memory), kChunkSize);
+    if (chunk->sizeClass == kLargeClass) {
+      unlink(chunk);
+      freeChunk(chunk);
+      return;
+    }
+
+    FreeNode *node = (FreeNode *)memory;
+    node->next = free_[chunk->sizeClass];
+    free_[chunk->sizeClass] = node;
+  }
+
+ private:
+  static const size_t kClassCount = kMaxNodeSize / kGranularity;
+  static const size_t kLargeClass = size_t(-1);
+
+  struct Chunk {
+    Chunk *prev;
+    Chunk *next;
+    size_t sizeClass;
+  };
+  struct FreeNode {
+    FreeNode *next;
+  };
+
+  static size_t headerSize() {
+    return Align(sizeof(Chunk), kMallocAlignment);
+  }
+
+  // Chunks are aligned to kChunkSize so that release() can find them.
+  Chunk *newChunk(size_t size, size_t sizeClass) {
+#if defined(_MSC_VER)
+    void *memory = _aligned_malloc(size, kChunkSize);
+    if (!memory)
+      return NULL;
+#else
+    void *memory;
+    if (posix_memalign(&memory, kChunkSize, size) != 0)
+      return NULL;
+#endif
+
+    Chunk *chunk = (Chunk *)memory;
+    chunk->prev = NULL;
+    chunk->next = chunks_;
+    chunk->sizeClass = sizeClass;
+    if (chunks_)
+      chunks_->prev = chunk;
+    chunks_ = chunk;
+    return chunk;
+  }
+
+  static void freeChunk(Chunk *chunk) {
+#if defined(_MSC_VER)
+    _aligned_free(chunk);
+#else
+    ::free(chunk);
+#endif
+  }
+
+  void unlink(Chunk *chunk) {
+    if (chunk->prev)
+      chunk->prev->next = chunk->next;
+    else
+      chunks_ = chunk->next;
+    if (chunk->next)
+      chunk->next->prev = chunk->prev;
+  }
+
+  bool refill(size_t sizeClass) {
+    Chunk *chunk = newChunk(kChunkSize, sizeClass);
+    if (!chunk)
+      return false;
+
+    size_t nodeSize = (sizeClass + 1) * kGranularity;
+    Address pos = Address(chunk) + headerSize();
+    Address end = Address(chunk) + kChunkSize;
+
+    // Thread the blocks in address order, so they are handed out that way.
+    FreeNode **link = &free_[sizeClass];
+    for (; pos + nodeSize <= end; pos += nodeSize) {
+      *link = (FreeNode *)pos;
+      link = &(*link)->next;
+    }
+    *link = NULL;
+    return true;
+  }
+
+  void *allocateLarge(size_t bytes) {
+    Chunk *chunk = newChunk(headerSize() + bytes, kLargeClass);
+    if (!chunk)
+      return NULL;
+    return Address(chunk) + headerSize();
+  }
+
+ private:
+  Chunk *chunks_;
+  FreeNode *free_[kClassCount];
+
+ private:
+  NodePool(const NodePool &other) KE_DELETE;
+  NodePool &operator =(const NodePool &other) KE_DELETE;
+};
+
+// Allocates from a NodePool that outlives the container.
+class NodePoolAllocatorPolicy : public SystemAllocatorPolicy
+{
+  public:
+    explicit NodePoolAllocatorPolicy(NodePool *pool)
+      : pool_(pool)
+    {
+    }
+
+  public:
+    void free(void *memory) {
+      pool_->release(memory);
+    }
+    void *malloc(size_t bytes) {
+      void *ptr = pool_->allocate(bytes);
+      if (!ptr)
+        reportOutOfMemory();
+      return ptr;
+    }
+
+  private:
+    NodePool *pool_;
+};
+
 }
 
 #endif // _include_amtl_allocatorpolicies_h_
@@ -70,12 +70,10 @@ class LinkedList : public AllocPolicy
   };
 
 public:
-  LinkedList(AllocPolicy = AllocPolicy())
-   : length_(0)
+  LinkedList(AllocPolicy ap = AllocPolicy())
+   : AllocPolicy(ap),
+     length_(0)
   {
-    FILE *fp = fopen("/tmp/srcds.log", "wt");
-    fprintf(fp, "Linked list constructed!\n");
-    fclose(fp);
     head()->prev = head();
     head()->next = head();
   }
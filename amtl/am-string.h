@@ -34,67 +34,81 @@
 #include <string.h>
 #include "am-utility.h"
 #include "am-moveable.h"
+#include "am-allocator-policies.h"
 
 namespace ke {
 
-// ASCII string.
-class AString
+// ASCII string. Strings of up to kInlineLength characters are kept inside the
+// object, longer ones are allocated through AllocPolicy, with room to grow.
+template <class AllocPolicy = SystemAllocatorPolicy>
+class AStringBase : public AllocPolicy
 {
  public:
-  AString()
-   : length_(0)
+  static const size_t kInlineLength = 23;
+
+  explicit AStringBase(AllocPolicy ap = AllocPolicy())
+   : AllocPolicy(ap)
   {
+    init();
   }
 
-  explicit AString(const char *str) {
+  explicit AStringBase(const char *str, AllocPolicy ap = AllocPolicy())
+   : AllocPolicy(ap)
+  {
+    init();
     set(str, strlen(str));
   }
-  AString(const char *str, size_t length) {
+  AStringBase(const char *str, size_t length, AllocPolicy ap = AllocPolicy())
+   : AllocPolicy(ap)
+  {
+    init();
     set(str, length);
   }
-  AString(const AString &other) {
-    if (other.length_)
-      set(other.chars_, other.length_);
+  AStringBase(const AStringBase &other)
+   : AllocPolicy(other)
+  {
+    init();
+    copy(other);
   }
-  AString(Moveable<AString> other)
-    : chars_(other->chars_.take()),
-      length_(other->length_)
+  AStringBase(Moveable<AStringBase> other)
+   : AllocPolicy(static_cast<AStringBase &>(other))
   {
-    other->length_ = 0;
+    init();
+    take(other);
+  }
+  ~AStringBase() {
+    release();
   }
 
-  AString &operator =(const char *str) {
-    if (str && str[0]) {
+  AStringBase &operator =(const char *str) {
+    if (str && str[0])
       set(str, strlen(str));
-    } else {
-      chars_ = NULL;
-      length_ = 0;
-    }
+    else
+      clear();
     return *this;
   }
-  AString &operator =(const AString &other) {
-    if (other.length_) {
-      set(other.chars_, other.length_);
-    } else {
-      chars_ = NULL;
-      length_ = 0;
-    }
+  AStringBase &operator =(const AStringBase &other) {
+    if (&other != this)
+      copy(other);
     return *this;
   }
-  AString &operator =(Moveable<AString> other) {
-    chars_ = other->chars_.take();
-    length_ = other->length_;
-    other->length_ = 0;
+  AStringBase &operator =(Moveable<AStringBase> other) {
+    AStringBase &source = other;
+    if (&source != this) {
+      release();
+      init();
+      take(source);
+    }
     return *this;
   }
 
   int compare(const char *str) const {
     return strcmp(chars(), str);
   }
-  int compare(const AString &other) const {
+  int compare(const AStringBase &other) const {
     return strcmp(chars(), other.chars());
   }
-  bool operator ==(const AString &other) const {
+  bool operator ==(const AStringBase &other) const {
     return other.length() == length() &&
            memcmp(other.chars(), chars(), length()) == 0;
   }
@@ -104,25 +118,25 @@ class AString
     return chars()[index];
   }
 
-  AString &append(const char *str) {
+  AStringBase &append(const char *str) {
     size_t length = strlen(str);
     if (length)
       insert(length_, str, length);
     return *this;
   }
-  AString &append(const char *str, size_t length) {
+  AStringBase &append(const char *str, size_t length) {
     if (length)
       insert(length_, str, length);
     return *this;
   }
-  AString &append(const AString &other) {
-    if (other.length_)
+  AStringBase &append(const AStringBase &other) {
+    if (other.length_ && !other.isVoid())
       insert(length_, other.chars_, other.length_);
     return *this;
   }
 
   void setVoid() {
-    chars_ = NULL;
+    clear();
     length_ = kInvalidLength;
   }
 
@@ -136,39 +150,114 @@ class AString
   }
 
   const char *chars() const {
-    if (!chars_)
-      return isVoid() ? NULL : "";
-    return chars_;
+    return isVoid() ? NULL : chars_;
   }
 
  private:
   static const size_t kInvalidLength = (size_t)-1;
 
+  bool isInline() const {
+    return chars_ == inline_;
+  }
+
+  void init() {
+    inline_[0] = '\0';
+    chars_ = inline_;
+    length_ = 0;
+    capacity_ = kInlineLength;
+  }
+
+  void release() {
+    if (!isInline())
+      this->free(chars_);
+  }
+
+  // Empties the string, keeping its buffer for reuse.
+  void clear() {
+    length_ = 0;
+    chars_[0] = '\0';
+  }
+
+  void copy(const AStringBase &other) {
+    if (other.isVoid())
+      setVoid();
+    else if (other.length_)
+      set(other.chars_, other.length_);
+    else
+      clear();
+  }
+
+  // Takes other's characters, leaving it empty. Must start out empty.
+  void take(AStringBase &other) {
+    if (other.isVoid()) {
+      length_ = kInvalidLength;
+      return;
+    }
+    if (other.isInline()) {
+      set(other.chars_, other.length_);
+    } else {
+      chars_ = other.chars_;
+      capacity_ = other.capacity_;
+      length_ = other.length_;
+      other.init();
+      return;
+    }
+    other.clear();
+  }
+
   void set(const char *str, size_t length) {
-    chars_ = new char[length + 1];
+    if (isVoid())
+      length_ = 0;
+    if (length > capacity_ && !reserve(length))
+      return;
     length_ = length;
-    memcpy(chars_, str, length);
+    memmove(chars_, str, length);
     chars_[length] = '\0';
   }
 
   void insert(size_t pos, const char *str, size_t length) {
-    grow(length);
-    length_ += length;
+    if (isVoid())
+      length_ = pos = 0;
+    if (length > kInvalidLength - 1 - length_) {
+      this->reportAllocationOverflow();
+      return;
+    }
+    if (length_ + length > capacity_) {
+      size_t needed = length_ + length;
+      size_t capacity = capacity_ * 2 > needed ? capacity_ * 2 : needed;
+      if (!reserve(capacity))
+        return;
+    }
     memcpy(chars_ + pos, str, length);
+    length_ += length;
     chars_[length_] = '\0';
   }
 
-  void grow(size_t needed) {
-    char *new_chars = new char[length_ + needed + 1];
-    memcpy(new_chars, chars_, length_);
+  // Makes room for capacity characters, keeping the current ones.
+  bool reserve(size_t capacity) {
+    if (capacity >= kInvalidLength - 1) {
+      this->reportAllocationOverflow();
+      return false;
+    }
+    char *new_chars = (char *)this->malloc(capacity + 1);
+    if (!new_chars)
+      return false;
+    memcpy(new_chars, chars_, length_ + 1);
+    release();
     chars_ = new_chars;
+    capacity_ = capacity;
+    return true;
   }
 
  private:
-  AutoArray<char> chars_;
+  char *chars_;
   size_t length_;
+  size_t capacity_;
+  char inline_[kInlineLength + 1];
 };
 
+typedef AStringBase<> AString;
+
 }
 
 #endif // _include_amtl_string_h_
@@ -0,0 +1,255 @@
+// vim: set sts=8 ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2013, David Anderson and AlliedModders LLC
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _include_amtl_vector_h_
+#define _include_amtl_vector_h_
+
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include "am-allocator-policies.h"
+#include "am-utility.h"
+#include "am-moveable.h"
+
+namespace ke {
+
+// Contiguous, growable array. Elements are moved, not copied, when the
+// buffer grows, using T's Moveable constructor if it has one. Functions that
+// allocate return false if memory couldn't be allocated, leaving the vector
+// as it was.
+template <typename T, typename AllocPolicy = SystemAllocatorPolicy>
+class Vector : public AllocPolicy
+{
+ public:
+  explicit Vector(AllocPolicy ap = AllocPolicy())
+   : AllocPolicy(ap),
+     data_(NULL),
+     nitems_(0),
+     maxsize_(0)
+  {
+  }
+  Vector(Moveable<Vector> other)
+   : AllocPolicy(static_cast<Vector &>(other))
+  {
+    data_ = other->data_;
+    nitems_ = other->nitems_;
+    maxsize_ = other->maxsize_;
+    other->reset();
+  }
+  ~Vector() {
+    zap();
+  }
+
+  Vector &operator =(Moveable<Vector> other) {
+    Vector &source = other;
+    if (&source != this) {
+      zap();
+      data_ = source.data_;
+      nitems_ = source.nitems_;
+      maxsize_ = source.maxsize_;
+      source.reset();
+    }
+    return *this;
+  }
+
+  bool append(const T &item) {
+    if (!growIfNeeded(1))
+      return false;
+    new (&data_[nitems_]) T(item);
+    nitems_++;
+    return true;
+  }
+  bool append(Moveable<T> item) {
+    if (!growIfNeeded(1))
+      return false;
+    new (&data_[nitems_]) T(item);
+    nitems_++;
+    return true;
+  }
+
+  // Inserts item before the element at index, which may be length().
+  bool insert(size_t index, const T &item) {
+    assert(index <= length());
+    if (!growIfNeeded(1))
+      return false;
+    openGap(index);
+    new (&data_[index]) T(item);
+    return true;
+  }
+  bool insert(size_t index, Moveable<T> item) {
+    assert(index <= length());
+    if (!growIfNeeded(1))
+      return false;
+    openGap(index);
+    new (&data_[index]) T(item);
+    return true;
+  }
+
+  // Removes the element at index, keeping the order of the others.
+  void remove(size_t index) {
+    assert(index < length());
+    for (size_t i = index; i < nitems_ - 1; i++)
+      data_[i] = Moveable<T>(data_[i + 1]);
+    data_[nitems_ - 1].~T();
+    nitems_--;
+  }
+
+  T popCopy() {
+    T t = at(length() - 1);
+    pop();
+    return t;
+  }
+  void pop() {
+    assert(!empty());
+    data_[nitems_ - 1].~T();
+    nitems_--;
+  }
+
+  bool empty() const {
+    return length() == 0;
+  }
+  size_t length() const {
+    return nitems_;
+  }
+  T &at(size_t i) {
+    assert(i < length());
+    return data_[i];
+  }
+  const T &at(size_t i) const {
+    assert(i < length());
+    return data_[i];
+  }
+  T &operator [](size_t i) {
+    return at(i);
+  }
+  const T &operator [](size_t i) const {
+    return at(i);
+  }
+  T &back() {
+    return at(length() - 1);
+  }
+  const T &back() const {
+    return at(length() - 1);
+  }
+
+  T *buffer() const {
+    return data_;
+  }
+  T *begin() const {
+    return data_;
+  }
+  T *end() const {
+    return data_ + nitems_;
+  }
+
+  // Destroys every element, keeping the buffer.
+  void clear() {
+    for (size_t i = 0; i < nitems_; i++)
+      data_[i].~T();
+    nitems_ = 0;
+  }
+
+  // Makes room for desired elements in total.
+  bool ensure(size_t desired) {
+    if (desired <= length())
+      return true;
+    return growIfNeeded(desired - length());
+  }
+
+ private:
+  void reset() {
+    data_ = NULL;
+    nitems_ = 0;
+    maxsize_ = 0;
+  }
+
+  void zap() {
+    clear();
+    this->free(data_);
+    reset();
+  }
+
+  // Shifts the elements from index on up by one, leaving index unconstructed.
+  void openGap(size_t index) {
+    for (size_t i = nitems_; i > index; i--) {
+      new (&data_[i]) T(Moveable<T>(data_[i - 1]));
+      data_[i - 1].~T();
+    }
+    nitems_++;
+  }
+
+  bool growIfNeeded(size_t amount) {
+    if (!IsUintPtrAddSafe(nitems_, amount)) {
+      this->reportAllocationOverflow();
+      return false;
+    }
+    if (nitems_ + amount <= maxsize_)
+      return true;
+
+    size_t new_maxsize = maxsize_ ? maxsize_ : 8;
+    while (nitems_ + amount > new_maxsize) {
+      if (!IsUintPtrMultiplySafe(new_maxsize, 2)) {
+        this->reportAllocationOverflow();
+        return false;
+      }
+      new_maxsize *= 2;
+    }
+
+    if (!IsUintPtrMultiplySafe(new_maxsize, sizeof(T))) {
+      this->reportAllocationOverflow();
+      return false;
+    }
+
+    T *newdata = (T *)this->malloc(sizeof(T) * new_maxsize);
+    if (!newdata)
+      return false;
+    for (size_t i = 0; i < nitems_; i++) {
+      new (&newdata[i]) T(Moveable<T>(data_[i]));
+      data_[i].~T();
+    }
+    this->free(data_);
+
+    data_ = newdata;
+    maxsize_ = new_maxsize;
+    return true;
+  }
+
+ private:
+  T *data_;
+  size_t nitems_;
+  size_t maxsize_;
+
+ private:
+  Vector(const Vector &other) KE_DELETE;
+  Vector &operator =(const Vector &other) KE_DELETE;
+};
+
+} // namespace ke
+
+#endif // _include_amtl_vector_h_
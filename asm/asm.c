@@ -8,118 +8,384 @@
 
 #include "libudis86/udis86.h"
 
-#define REG_EAX			0
-#define REG_ECX			1
-#define REG_EDX			2
-#define REG_EBX			3
-
 #define IA32_MOV_REG_IMM		0xB8	// encoding is +r <imm32>
+#define IA32_MOV_REG_MEM		0x8B	// encoding is /r
+#define IA32_CALL_IMM32			0xE8
+#define IA32_JCC_IMM8			0x70	// encoding is +cc <imm8>
+#define IA32_JCC_IMM32			0x80	// encoding is 0F +cc <imm32>
+#define IA32_CALL_SEG			0x15	// FF /2 with a rip-relative operand
+
+#define X64_REX_W				0x48
+#define X64_REX_R				0x44
+#define X64_REX_B				0x41
+
+#define MAX_INSN_SIZE			15
+#endif
+
+#if defined(__x86_64__)
+#define CAN_REACH(rel)			((rel) == (int32_t)(rel))
+#else
+/* Every address can be reached with a 32-bit displacement */
+#define CAN_REACH(rel)			1
+#endif
+
+static void init_decoder(ud_t *ud, unsigned char *func, size_t len)
+{
+	ud_init(ud);
+
+#if defined(__x86_64__)
+	ud_set_mode(ud, 64);
+#else
+	ud_set_mode(ud, 32);
 #endif
 
+	ud_set_input_buffer(ud, func, len);
+	ud_set_pc(ud, (uint64_t)(uintptr_t)func);
+	ud_set_syntax(ud, NULL);
+}
+
+static int64_t displacement(uint64_t target, unsigned char *next)
+{
+	return (int64_t)(target - (uint64_t)(uintptr_t)next);
+}
+
+static int64_t branch_offset(const struct ud_operand *op)
+{
+	switch (op->size)
+	{
+	case 8:
+		return op->lval.sbyte;
+	case 16:
+		return op->lval.sword;
+	default:
+		return op->lval.sdword;
+	}
+}
+
+static const struct ud_operand *rip_operand(const ud_t *ud)
+{
+	const struct ud_operand *op;
+	unsigned int i;
+
+	for (i = 0; (op = ud_insn_opr(ud, i)) != NULL; i++)
+	{
+		if (op->type == UD_OP_MEM && op->base == UD_R_RIP)
+			return op;
+	}
+
+	return NULL;
+}
+
+/* Immediates are encoded after the displacement, so they have to be skipped to find it */
+static unsigned int immediate_size(const ud_t *ud)
+{
+	const struct ud_operand *op;
+	unsigned int i, size = 0;
+
+	for (i = 0; (op = ud_insn_opr(ud, i)) != NULL; i++)
+	{
+		if (op->type == UD_OP_IMM)
+			size += op->size / 8;
+	}
+
+	return size;
+}
+
+static int register_number(const struct ud_operand *op)
+{
+	if (op->type != UD_OP_REG)
+		return -1;
+	if (op->base >= UD_R_RAX && op->base <= UD_R_R15)
+		return op->base - UD_R_RAX;
+	if (op->base >= UD_R_EAX && op->base <= UD_R_R15D)
+		return op->base - UD_R_EAX;
+
+	return -1;
+}
+
+#if !defined(__x86_64__)
 /**
-* Checks if a call to a fpic thunk has just been written into dest.
-* If found replaces it with a direct mov that sets the required register to the value of pc.
+* Checks if a call goes to a fpic thunk (mov reg, [esp]; ret).
 *
-* @param dest		Destination buffer where a call opcode + addr (5 bytes) has just been written.
-* @param pc		The program counter value that needs to be set (usually the next address from the source).
-* @noreturn
+* @param target	Address being called.
+* @return		Register the thunk loads the return address into, or -1 if it isn't a thunk.
 */
-void check_thunks(unsigned char *dest, unsigned char *pc)
+static int thunk_register(const unsigned char *target)
 {
-#if defined(_WIN32) || defined(__x86_64__)
-	return;
-#else
-	/* Step write address back 4 to the start of the function address */
-	unsigned char *writeaddr = dest - 4;
-	unsigned char *calloffset = *(unsigned char **)writeaddr;
-	unsigned char *calladdr = (unsigned char *)(dest + (unsigned int)calloffset);
+	/* ModRM with mod 00 and a SIB byte, which is 24 for plain [esp] */
+	if (target[0] != IA32_MOV_REG_MEM || (target[1] & 0xC7) != 0x04 || target[2] != 0x24 || target[3] != 0xC3)
+		return -1;
+
+	return (target[1] >> 3) & 7;
+}
+#endif
+
+static int emit_abs_jump(unsigned char *dest, uint64_t target)
+{
+	/* jmp [rip+0] followed by the address */
+	dest[0] = OP_PREFIX;
+	dest[1] = OP_JMP_SEG;
+	*(int32_t *)(dest + 2) = 0;
+	*(uint64_t *)(dest + 6) = target;
+
+	return X64_ABS_SIZE;
+}
+
+static int emit_jump(unsigned char *dest, unsigned char *pc, uint64_t target)
+{
+	int64_t rel = displacement(target, pc + OP_JMP_SIZE);
+
+	if (!CAN_REACH(rel))
+		return emit_abs_jump(dest, target);
+
+	dest[0] = OP_JMP;
+	*(int32_t *)(dest + 1) = (int32_t)rel;
 
-	/* Lookup name of function being called */
-	if ((*calladdr == 0x8B) && (*(calladdr+2) == 0x24) && (*(calladdr+3) == 0xC3))
+	return OP_JMP_SIZE;
+}
+
+static int emit_mov_imm64(unsigned char *dest, int reg, uint64_t value)
+{
+	dest[0] = X64_REX_W | (reg >= 8 ? X64_REX_B : 0);
+	dest[1] = IA32_MOV_REG_IMM + (reg & 7);
+	*(uint64_t *)(dest + 2) = value;
+
+	return 10;
+}
+
+static int relocate_branch(ud_t *ud, uint64_t target, unsigned char *dest, unsigned char *pc)
+{
+	const uint8_t *src = ud_insn_ptr(ud);
+	unsigned int len = ud_insn_len(ud);
+	const struct ud_operand *op = ud_insn_opr(ud, 0);
+	enum ud_mnemonic_code mnemonic = ud_insn_mnemonic(ud);
+	unsigned char cond;
+	int64_t rel;
+	int written;
+
+	/* A 16-bit operand size would truncate the instruction pointer */
+	if (op->size == 16)
+		return -1;
+
+	switch (mnemonic)
 	{
-		//a thunk maybe?
-		char movByte = IA32_MOV_REG_IMM;
+	case UD_Ijmp:
+		return emit_jump(dest, pc, target);
 
-		/* Calculate the correct mov opcode */
-		switch (*(calladdr+1))
+	case UD_Icall:
+#if !defined(__x86_64__)
 		{
-		case 0x04:
+			/* The thunk would return the trampoline's address, so load the original one directly */
+			int reg = thunk_register((const unsigned char *)(uintptr_t)target);
+			if (reg >= 0 && reg != 4)
 			{
-				movByte += REG_EAX;
-				break;
-			}
-		case 0x1C:
-			{
-				movByte += REG_EBX;
-				break;
-			}
-		case 0x0C:
-			{
-				movByte += REG_ECX;
-				break;
-			}
-		case 0x14:
-			{
-				movByte += REG_EDX;
-				break;
-			}
-		default:
-			{
-				printf("Unknown thunk: %c\n", *(calladdr+1));
-				break;
+				dest[0] = IA32_MOV_REG_IMM + reg;
+				*(uint32_t *)(dest + 1) = (uint32_t)(ud_insn_off(ud) + len);
+				return 5;
 			}
 		}
+#endif
+		rel = displacement(target, pc + 5);
+		if (CAN_REACH(rel))
+		{
+			dest[0] = IA32_CALL_IMM32;
+			*(int32_t *)(dest + 1) = (int32_t)rel;
+			return 5;
+		}
 
-		/* Move our write address back one to where the call opcode was */
-		writeaddr--;
+		/* call [rip+2], then jump over the address so the call returns past it */
+		dest[0] = OP_PREFIX;
+		dest[1] = IA32_CALL_SEG;
+		*(int32_t *)(dest + 2) = 2;
+		dest[6] = OP_JMP_BYTE;
+		dest[7] = 8;
+		*(uint64_t *)(dest + 8) = target;
+		return 16;
+
+	case UD_Ijcxz:
+	case UD_Ijecxz:
+	case UD_Ijrcxz:
+	case UD_Iloop:
+	case UD_Iloope:
+	case UD_Iloopne:
+		/* These only have a short form, so they branch to a jump placed after a jump skipping it */
+		memcpy(dest, src, len - 1);
+		dest[len - 1] = OP_JMP_BYTE_SIZE;
+		dest[len] = OP_JMP_BYTE;
+		written = emit_jump(dest + len + OP_JMP_BYTE_SIZE, pc + len + OP_JMP_BYTE_SIZE, target);
+		dest[len + 1] = (unsigned char)written;
+		return len + OP_JMP_BYTE_SIZE + written;
+
+	default:
+		break;
+	}
 
+	if (mnemonic < UD_Ijo || mnemonic > UD_Ijg)
+		return -1;
 
-		/* Write our mov */
-		*writeaddr = movByte;
-		writeaddr++;
+	/* The condition is in the low bits of the opcode for both forms */
+	cond = (op->size == 8 ? src[len - 2] : src[len - 5]) & 0x0F;
 
-		/* Write the value - The provided program counter value */
-		*(void **)writeaddr = (void *)pc;
-		writeaddr += 4;
+	rel = displacement(target, pc + 6);
+	if (CAN_REACH(rel))
+	{
+		dest[0] = 0x0F;
+		dest[1] = IA32_JCC_IMM32 | cond;
+		*(int32_t *)(dest + 2) = (int32_t)rel;
+		return 6;
 	}
 
-	return;
-#endif
+	/* The inverted condition skips over an absolute jump */
+	dest[0] = IA32_JCC_IMM8 | (cond ^ 1);
+	dest[1] = X64_ABS_SIZE;
+	return 2 + emit_abs_jump(dest + 2, target);
 }
 
-int copy_bytes(unsigned char *func, unsigned char *dest, int required_len)
+static int relocate_rip(ud_t *ud, const struct ud_operand *mem, unsigned char *dest, unsigned char *pc)
+{
+	const uint8_t *src = ud_insn_ptr(ud);
+	unsigned int len = ud_insn_len(ud);
+	const struct ud_operand *op = ud_insn_opr(ud, 0);
+	enum ud_mnemonic_code mnemonic = ud_insn_mnemonic(ud);
+	uint64_t target = ud_insn_off(ud) + len + mem->lval.sdword;
+	int64_t rel = displacement(target, pc + len);
+	int reg, low, written;
+
+	if (CAN_REACH(rel))
+	{
+		memcpy(dest, src, len);
+		*(int32_t *)(dest + len - immediate_size(ud) - 4) = (int32_t)rel;
+		return len;
+	}
+
+	/* Out of range, but loads of the address or of a value from it can go through the register */
+	if (op == NULL || (reg = register_number(op)) < 0 || mem != ud_insn_opr(ud, 1))
+		return -1;
+
+	if (mnemonic == UD_Ilea && op->size == 64)
+		return emit_mov_imm64(dest, reg, target);
+
+	if (mnemonic != UD_Imov || (op->size != 64 && op->size != 32))
+		return -1;
+
+	written = emit_mov_imm64(dest, reg, target);
+
+	/* mov reg, [reg] */
+	low = reg & 7;
+	if (op->size == 64 || reg >= 8)
+		dest[written++] = 0x40 | (op->size == 64 ? X64_REX_W : 0) | (reg >= 8 ? X64_REX_R | X64_REX_B : 0);
+	dest[written++] = IA32_MOV_REG_MEM;
+
+	if (low == 5)
+	{
+		/* rbp and r13 need a displacement, without one they mean rip */
+		dest[written++] = 0x40 | (low << 3) | low;
+		dest[written++] = 0;
+	}
+	else if (low == 4)
+	{
+		/* rsp and r12 need a SIB byte */
+		dest[written++] = (low << 3) | low;
+		dest[written++] = 0x24;
+	}
+	else
+	{
+		dest[written++] = (low << 3) | low;
+	}
+
+	return written;
+}
+
+int relocate_bound(unsigned char *func, int src_len)
 {
 	ud_t ud_obj;
-	ud_init(&ud_obj);
+	int bound = 0;
 
-#if defined(__x86_64__)
-	ud_set_mode(&ud_obj, 64);
-#else
-	ud_set_mode(&ud_obj, 32);
-#endif
+	init_decoder(&ud_obj, func, src_len);
 
-	ud_set_input_buffer(&ud_obj, func, 20);
-	unsigned int bytecount = 0;
-	
-	while (bytecount < required_len && ud_disassemble(&ud_obj))
+	while (ud_disassemble(&ud_obj))
 	{
-		unsigned int insn_len = ud_insn_len(&ud_obj);
-		bytecount += insn_len;
-		
-		if (dest)
+		const struct ud_operand *op = ud_insn_opr(&ud_obj, 0);
+		int insn_len = ud_insn_len(&ud_obj);
+
+		if (op && op->type == UD_OP_JIMM)
+			bound += insn_len + OP_JMP_BYTE_SIZE + X64_ABS_SIZE;
+		else if (rip_operand(&ud_obj))
+			bound += insn_len > X64_ABS_SIZE ? insn_len : X64_ABS_SIZE;
+		else
+			bound += insn_len;
+	}
+
+	return bound;
+}
+
+int relocate_code(unsigned char *func, int src_len, unsigned char *dest, unsigned char *dest_pc, unsigned char *offsets)
+{
+	ud_t ud_obj;
+	int src_pos = 0, dest_pos = 0;
+
+	init_decoder(&ud_obj, func, src_len);
+
+	while (src_pos < src_len && ud_disassemble(&ud_obj))
+	{
+		const struct ud_operand *op = ud_insn_opr(&ud_obj, 0);
+		const struct ud_operand *mem = rip_operand(&ud_obj);
+		int insn_len = ud_insn_len(&ud_obj);
+		int written;
+
+		if (ud_insn_mnemonic(&ud_obj) == UD_Iinvalid)
+			return -1;
+
+		if (offsets)
+			offsets[src_pos] = (unsigned char)dest_pos;
+
+		if (op && op->type == UD_OP_JIMM)
+		{
+			uint64_t target = ud_insn_off(&ud_obj) + insn_len + branch_offset(op);
+
+			/* Branches back into the copied code would need their own mapping */
+			if (target >= (uint64_t)(uintptr_t)func && target < (uint64_t)(uintptr_t)(func + src_len))
+				return -1;
+
+			written = relocate_branch(&ud_obj, target, dest + dest_pos, dest_pc + dest_pos);
+		}
+		else if (mem)
 		{
-			memcpy(dest, func, insn_len);
-			
-			const uint8_t *opcode = ud_insn_ptr(&ud_obj);
-			if ((opcode[0] & 0xFE) == 0xE8 && ud_insn_opr(&ud_obj, 0)->size == 32)
-				check_thunks(dest+4, func+4);
-				
-			dest += insn_len;
+			written = relocate_rip(&ud_obj, mem, dest + dest_pos, dest_pc + dest_pos);
+		}
+		else
+		{
+			memcpy(dest + dest_pos, ud_insn_ptr(&ud_obj), insn_len);
+			written = insn_len;
 		}
 
-		func += insn_len;
+		if (written < 0)
+			return -1;
+
+		src_pos += insn_len;
+		dest_pos += written;
 	}
-	
+
+	if (offsets)
+		offsets[src_pos] = (unsigned char)dest_pos;
+
+	return dest_pos;
+}
+
+int copy_bytes(unsigned char *func, unsigned char *dest, int required_len)
+{
+	ud_t ud_obj;
+	int bytecount = 0;
+
+	/* Enough input for the last instruction to run past required_len */
+	init_decoder(&ud_obj, func, required_len + MAX_INSN_SIZE);
+
+	while (bytecount < required_len && ud_disassemble(&ud_obj))
+		bytecount += ud_insn_len(&ud_obj);
+
+	if (dest && relocate_code(func, bytecount, dest, dest, NULL) < 0)
+		return -1;
+
 	return bytecount;
 }
 
@@ -18,13 +18,23 @@
 extern "C" {
 #endif
 
-void check_thunks(unsigned char *dest, unsigned char *pc);
-
 //if dest is NULL, returns minimum number of bytes needed to be copied
-//if dest is not NULL, it will copy the bytes to dest as well as fix CALLs and JMPs
+//if dest is not NULL, it will also relocate the bytes to dest (see relocate_code), returning -1 if that fails
 //http://www.devmaster.net/forums/showthread.php?t=2311
 int copy_bytes(unsigned char *func, unsigned char* dest, int required_len);
 
+//returns the most bytes relocate_code can write for the src_len bytes at func
+int relocate_bound(unsigned char *func, int src_len);
+
+//copies src_len bytes of whole instructions from func to dest so they still work when run from dest_pc,
+//which is where dest will be executed from. branches and rip-relative operands are adjusted, and rewritten
+//into longer forms where they can't reach anymore. calls to fpic thunks become a mov of the original pc.
+//if offsets is not NULL, offsets[i] is set to where the instruction at func+i went for every instruction
+//start i, as well as for src_len itself; it needs room for src_len+1 entries.
+//returns the number of bytes written, or -1 if some instruction can't be moved (like a branch back into
+//the copied bytes).
+int relocate_code(unsigned char *func, int src_len, unsigned char *dest, unsigned char *dest_pc, unsigned char *offsets);
+
 //insert a specific JMP instruction at the given location
 void inject_jmp(void* src, void* dest);
 
@@ -0,0 +1,130 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * allocbench - Cost of allocating and freeing code memory with CPageAlloc
+ *
+ * Every detour, trampoline and generated stub comes from a CPageAlloc, and servers with many
+ * plugins end up with thousands of them. The cases below allocate a batch of blocks and free it
+ * again, so a run reports the cost of one allocation plus one free with that many blocks live.
+ */
+
+#include "sh_include.h"
+#include "bench.h"
+#include <stdlib.h>
+
+static const size_t kBlocks = 4096;
+static const size_t kRounds = 20;
+
+static void *g_Blocks[kBlocks];
+static size_t g_Sizes[kBlocks];
+static size_t g_Order[kBlocks];
+
+extern "C" __attribute__((noinline)) int NearTarget(int x)
+{
+	asm volatile("");
+	return x + 1;
+}
+
+/* Allocates every block and frees them in g_Order, kRounds times over */
+static double Measure(CPageAlloc &alloc, const void *nearTo, bool isolated)
+{
+	return BenchMin([&](size_t n) {
+		for (size_t round = 0; round < n / kBlocks; round++)
+		{
+			for (size_t i = 0; i < kBlocks; i++)
+			{
+				if (isolated)
+					g_Blocks[i] = alloc.AllocIsolated(g_Sizes[i]);
+				else if (nearTo)
+					g_Blocks[i] = alloc.AllocNear(g_Sizes[i], nearTo);
+				else
+					g_Blocks[i] = alloc.Alloc(g_Sizes[i]);
+
+				if (!g_Blocks[i])
+				{
+					printf("Allocation of %zu bytes failed\n", g_Sizes[i]);
+					exit(1);
+				}
+			}
+
+			for (size_t i = 0; i < kBlocks; i++)
+				alloc.Free(g_Blocks[g_Order[i]]);
+		}
+	}, kBlocks * kRounds, 3);
+}
+
+static void SetSizes(size_t min, size_t max)
+{
+	for (size_t i = 0; i < kBlocks; i++)
+		g_Sizes[i] = min + (size_t)rand() % (max - min + 1);
+}
+
+static void SetOrder(bool shuffle)
+{
+	for (size_t i = 0; i < kBlocks; i++)
+		g_Order[i] = i;
+
+	for (size_t i = kBlocks - 1; shuffle && i > 0; i--)
+	{
+		size_t j = (size_t)rand() % (i + 1);
+		size_t tmp = g_Order[i];
+		g_Order[i] = g_Order[j];
+		g_Order[j] = tmp;
+	}
+}
+
+int main()
+{
+	srand(1);
+
+	CPageAlloc alloc(16);
+
+	/* Trampolines and gates */
+	SetSizes(16, 64);
+	SetOrder(false);
+	BenchReport("allocbench", "small_fifo", Measure(alloc, NULL, false), kBlocks * kRounds);
+
+	SetOrder(true);
+	BenchReport("allocbench", "small_random", Measure(alloc, NULL, false), kBlocks * kRounds);
+
+	/* Generated hook managers and dispatchers */
+	SetSizes(16, 2048);
+	BenchReport("allocbench", "mixed_random", Measure(alloc, NULL, false), kBlocks * kRounds);
+	BenchReport("allocbench", "mixed_near", Measure(alloc, (void *)NearTarget, false), kBlocks * kRounds);
+
+	/* Hold on to far blocks so near allocations have to skip them */
+	CPageAlloc crowded(16);
+	void *far[kBlocks];
+	for (size_t i = 0; i < kBlocks; i++)
+		far[i] = crowded.Alloc(g_Sizes[i]);
+
+	BenchReport("allocbench", "near_crowded", Measure(crowded, (void *)NearTarget, false), kBlocks * kRounds);
+
+	for (size_t i = 0; i < kBlocks; i++)
+		crowded.Free(far[i]);
+
+	/* Each block gets pages of its own */
+	SetSizes(16, 64);
+	BenchReport("allocbench", "isolated", Measure(alloc, NULL, true), kBlocks * kRounds);
+
+	return 0;
+}
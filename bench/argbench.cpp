@@ -0,0 +1,375 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * argbench - Reading arguments with DetourArgs from functions the compiler built, and the cost of it
+ *
+ * Every function in argtarget is hooked with a pre hook that reads each argument and checks it
+ * against what the caller passed, then changes some of them and checks that the original sees the
+ * change. The cases cover running out of integer and SSE registers, mixing the two, structures of
+ * up to 16 bytes that do and don't fit in the registers left, larger structures, returning a
+ * structure in memory and structures that are 16-byte aligned on the stack.
+ */
+
+#include "CDetour/dispatcher.h"
+#include "argtarget.h"
+#include "bench.h"
+
+#if !defined(__x86_64__)
+#error argbench follows the System V AMD64 ABI
+#endif
+
+static const size_t kCallIterations = 2000000;
+
+static const char *g_Failure = NULL;
+
+static void Expect(bool passed, const char *what)
+{
+	if (!passed && !g_Failure)
+		g_Failure = what;
+}
+
+static bool InRegisters(DetourContext *ctx, void *arg)
+{
+	unsigned char *p = reinterpret_cast<unsigned char *>(arg);
+	return (p >= reinterpret_cast<unsigned char *>(ctx->gpr) && p < reinterpret_cast<unsigned char *>(ctx->gpr + 6)) ||
+		(p >= reinterpret_cast<unsigned char *>(ctx->xmm) && p < reinterpret_cast<unsigned char *>(ctx->xmm + 8));
+}
+
+static DetourResult IntArgsPre(DetourContext *ctx, void *param)
+{
+	DetourArgs args(ctx);
+	uintptr_t *arg = NULL;
+
+	for (long i = 1; i <= 8; i++)
+	{
+		arg = args.NextInt();
+		Expect(long(*arg) == i, "integer argument");
+		Expect(InRegisters(ctx, arg) == (i <= 6), "integer argument placement");
+	}
+
+	*arg += 1000;
+	return Detour_Ignored;
+}
+
+static DetourResult SSEArgsPre(DetourContext *ctx, void *param)
+{
+	DetourArgs args(ctx);
+	double *arg = NULL;
+
+	for (int i = 1; i <= 10; i++)
+	{
+		arg = args.NextDouble();
+		Expect(*arg == i, "double argument");
+		Expect(InRegisters(ctx, arg) == (i <= 8), "double argument placement");
+	}
+
+	*arg += 1000;
+	return Detour_Ignored;
+}
+
+/* Reads MixedArgs, which passes the integers 1 to 17 as int, long, float or double */
+static uintptr_t *ReadMixedArgs(DetourArgs &args, double *sum)
+{
+	*sum = int(*args.NextInt());
+	*sum += *args.NextDouble();
+	*sum += long(*args.NextInt());
+	*sum += *args.NextFloat();
+	*sum += long(*args.NextInt());
+	*sum += *args.NextDouble();
+	*sum += long(*args.NextInt());
+	*sum += *args.NextFloat();
+	*sum += long(*args.NextInt());
+	*sum += *args.NextDouble();
+	*sum += long(*args.NextInt());
+	for (int i = 0; i < 5; i++)
+		*sum += *args.NextDouble();
+
+	uintptr_t *last = args.NextInt();
+	*sum += long(*last);
+	return last;
+}
+
+static DetourResult MixedArgsPre(DetourContext *ctx, void *param)
+{
+	DetourArgs args(ctx);
+	double sum;
+
+	uintptr_t *last = ReadMixedArgs(args, &sum);
+	Expect(sum == 17 * 18 / 2, "mixed arguments");
+	Expect(!InRegisters(ctx, last), "mixed argument placement");
+
+	*last += 1000;
+	return Detour_Ignored;
+}
+
+static DetourResult MixedArgsRead(DetourContext *ctx, void *param)
+{
+	DetourArgs args(ctx);
+	double sum;
+
+	ReadMixedArgs(args, &sum);
+	*reinterpret_cast<double *>(param) = sum;
+	return Detour_Ignored;
+}
+
+static DetourResult PairArgsPre(DetourContext *ctx, void *param)
+{
+	DetourArgs args(ctx);
+
+	uintptr_t *p = args.NextPair();
+	Expect(p[0] == 1 && p[1] == 2 && InRegisters(ctx, p), "pair in registers");
+	for (uintptr_t i = 3; i <= 5; i++)
+		Expect(*args.NextInt() == i, "integer after a pair");
+
+	/* Only r9 is left, so the pair goes on the stack and z still gets r9 */
+	uintptr_t *q = args.NextPair();
+	Expect(q[0] == 6 && q[1] == 7 && !InRegisters(ctx, q), "pair on the stack");
+	uintptr_t *z = args.NextInt();
+	Expect(*z == 8 && z == &ctx->gpr[5], "integer after a pair on the stack");
+
+	q[1] += 1000;
+	*z += 1000;
+	return Detour_Ignored;
+}
+
+static DetourResult IntDoubleArgsPre(DetourContext *ctx, void *param)
+{
+	static const DetourArgClass classes[2] = {ArgClass_Integer, ArgClass_SSE};
+	DetourArgs args(ctx);
+	void *parts[2];
+
+	Expect(args.NextStruct(sizeof(IntDouble), classes, parts), "mixed structure in registers");
+	Expect(*reinterpret_cast<long *>(parts[0]) == 1 && *reinterpret_cast<double *>(parts[1]) == 2,
+		"mixed structure in registers");
+	for (int i = 3; i <= 9; i++)
+		Expect(*args.NextDouble() == i, "double after a mixed structure");
+
+	/* The structure needs an xmm register, and there are none left */
+	Expect(!args.NextStruct(sizeof(IntDouble), classes, parts), "mixed structure on the stack");
+	IntDouble *s = reinterpret_cast<IntDouble *>(parts[0]);
+	Expect(s->i == 10 && s->d == 11, "mixed structure on the stack");
+	uintptr_t *z = args.NextInt();
+	Expect(*z == 12 && z == &ctx->gpr[1], "integer after a mixed structure");
+
+	s->d += 1000;
+	*z += 1000;
+	return Detour_Ignored;
+}
+
+static DetourResult DoublePairArgsPre(DetourContext *ctx, void *param)
+{
+	static const DetourArgClass classes[2] = {ArgClass_SSE, ArgClass_SSE};
+	DetourArgs args(ctx);
+	void *parts[2];
+
+	for (int i = 0; i < 5; i++)
+	{
+		Expect(args.NextStruct(sizeof(DoublePair), classes, parts) == (i < 4), "double pair placement");
+		Expect(*reinterpret_cast<double *>(parts[0]) == 2 * i + 1 &&
+			*reinterpret_cast<double *>(parts[1]) == 2 * i + 2, "double pair");
+	}
+
+	*reinterpret_cast<double *>(parts[1]) += 1000;
+	return Detour_Ignored;
+}
+
+static DetourResult BigArgsPre(DetourContext *ctx, void *param)
+{
+	DetourArgs args(ctx);
+	void *parts[2];
+
+	Expect(*args.NextInt() == 1, "integer before a large structure");
+	Expect(!args.NextStruct(sizeof(Big), NULL, parts), "large structure placement");
+	Big *b = reinterpret_cast<Big *>(parts[0]);
+	Expect(b->a == 2 && b->b == 3 && b->c == 4, "large structure");
+	Expect(*args.NextInt() == 5, "integer after a large structure");
+
+	b->c += 1000;
+	return Detour_Ignored;
+}
+
+static DetourResult MemoryReturnPre(DetourContext *ctx, void *param)
+{
+	DetourArgs args(ctx, true);
+
+	Expect(*args.NextInt() == 3 && *args.NextInt() == 4, "arguments after a return buffer");
+
+	Big *ret = reinterpret_cast<Big *>(args.GetReturnBuffer());
+	ret->a = 7;
+	ret->b = 8;
+	ret->c = 9;
+	ctx->ret.gpr[0] = reinterpret_cast<uintptr_t>(ret);
+	return Detour_Supercede;
+}
+
+static DetourResult AlignedArgsPre(DetourContext *ctx, void *param)
+{
+	static const DetourArgClass classes[2] = {ArgClass_Integer, ArgClass_Integer};
+	DetourArgs args(ctx);
+	void *parts[2];
+
+	for (uintptr_t i = 1; i <= 7; i++)
+		Expect(*args.NextInt() == i, "integer before an aligned structure");
+
+	Expect(!args.NextStruct(sizeof(Aligned), classes, parts, 16), "aligned structure placement");
+	Expect(reinterpret_cast<uintptr_t>(parts[0]) % 16 == 0 && parts[0] == &ctx->stack[2] &&
+		reinterpret_cast<Aligned *>(parts[0])->v == 8, "aligned structure");
+
+	uintptr_t *v = args.NextPair(16);
+	Expect(v == &ctx->stack[4] && v[0] == 9 && v[1] == 5, "aligned __int128");
+
+	uintptr_t *h = args.NextInt();
+	Expect(*h == 10 && h == &ctx->stack[6], "integer after aligned arguments");
+
+	*h += 1000;
+	return Detour_Ignored;
+}
+
+static bool Hook(void *function, DetourCallback pre, const char *name)
+{
+	CDetourDispatcher *dispatcher = CDetourDispatcher::Attach(function);
+	if (!dispatcher || !dispatcher->AddHook(pre, NULL))
+	{
+		printf("Failed to hook %s\n", name);
+		return false;
+	}
+
+	return true;
+}
+
+static bool Check(bool passed, const char *name)
+{
+	if (!passed || g_Failure)
+	{
+		printf("%s: wrong %s\n", name, g_Failure ? g_Failure : "result");
+		return false;
+	}
+
+	return true;
+}
+
+int main()
+{
+	long (*volatile intArgs)(long, long, long, long, long, long, long, long) = IntArgs;
+	double (*volatile sseArgs)(double, double, double, double, double, double, double, double,
+		double, double) = SSEArgs;
+	double (*volatile mixedArgs)(int, double, long, float, long, double, long, float, long, double,
+		long, double, double, double, double, double, long) = MixedArgs;
+	long (*volatile pairArgs)(IntPair, long, long, long, IntPair, long) = PairArgs;
+	double (*volatile intDoubleArgs)(IntDouble, double, double, double, double, double, double,
+		double, IntDouble, long) = IntDoubleArgs;
+	double (*volatile doublePairArgs)(DoublePair, DoublePair, DoublePair, DoublePair, DoublePair) =
+		DoublePairArgs;
+	long (*volatile bigArgs)(long, Big, long) = BigArgs;
+	Big (*volatile memoryReturn)(long, long) = MemoryReturn;
+	long (*volatile alignedArgs)(long, long, long, long, long, long, long, Aligned, __int128, long) =
+		AlignedArgs;
+
+	auto callMixed = [&](size_t n) {
+		double acc = 0;
+		for (size_t i = 0; i < n; i++)
+			acc += mixedArgs(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+
+		volatile double sink = acc;
+		(void)sink;
+	};
+
+	BenchReport("argbench", "call_mixed", BenchMin(callMixed, kCallIterations), kCallIterations);
+
+	/* Each sum is that of the squares of the arguments, plus what the hook added */
+	if (!Hook((void *)IntArgs, IntArgsPre, "IntArgs") ||
+	    !Check(intArgs(1, 2, 3, 4, 5, 6, 7, 8) == 204 + 8 * 1000, "IntArgs"))
+	{
+		return 1;
+	}
+
+	if (!Hook((void *)SSEArgs, SSEArgsPre, "SSEArgs") ||
+	    !Check(sseArgs(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 385 + 10 * 1000, "SSEArgs"))
+	{
+		return 1;
+	}
+
+	CDetourDispatcher *mixed = CDetourDispatcher::Attach((void *)MixedArgs);
+	int mixedHook = mixed ? mixed->AddHook(MixedArgsPre, NULL) : 0;
+	if (!mixedHook)
+	{
+		printf("Failed to hook MixedArgs\n");
+		return 1;
+	}
+
+	if (!Check(mixedArgs(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17) == 1785 + 17 * 1000,
+	           "MixedArgs"))
+	{
+		return 1;
+	}
+
+	IntPair p = {1, 2}, q = {6, 7};
+	if (!Hook((void *)PairArgs, PairArgsPre, "PairArgs") ||
+	    !Check(pairArgs(p, 3, 4, 5, q, 8) == 204 + 7 * 1000 + 8 * 1000, "PairArgs"))
+	{
+		return 1;
+	}
+
+	IntDouble t = {1, 2}, s = {10, 11};
+	if (!Hook((void *)IntDoubleArgs, IntDoubleArgsPre, "IntDoubleArgs") ||
+	    !Check(intDoubleArgs(t, 3, 4, 5, 6, 7, 8, 9, s, 12) == 650 + 11 * 1000 + 12 * 1000, "IntDoubleArgs"))
+	{
+		return 1;
+	}
+
+	DoublePair d[5] = {{1, 2}, {3, 4}, {5, 6}, {7, 8}, {9, 10}};
+	if (!Hook((void *)DoublePairArgs, DoublePairArgsPre, "DoublePairArgs") ||
+	    !Check(doublePairArgs(d[0], d[1], d[2], d[3], d[4]) == 385 + 10 * 1000, "DoublePairArgs"))
+	{
+		return 1;
+	}
+
+	Big b = {2, 3, 4};
+	if (!Hook((void *)BigArgs, BigArgsPre, "BigArgs") || !Check(bigArgs(1, b, 5) == 55 + 4 * 1000, "BigArgs"))
+		return 1;
+
+	if (!Hook((void *)MemoryReturn, MemoryReturnPre, "MemoryReturn"))
+		return 1;
+
+	Big ret = memoryReturn(3, 4);
+	if (!Check(ret.a == 7 && ret.b == 8 && ret.c == 9, "MemoryReturn"))
+		return 1;
+
+	Aligned a = {8};
+	__int128 v = (__int128(5) << 64) | 9;
+	if (!Hook((void *)AlignedArgs, AlignedArgsPre, "AlignedArgs") ||
+	    !Check(alignedArgs(1, 2, 3, 4, 5, 6, 7, a, v, 10) == 385 + 10 * 1000, "AlignedArgs"))
+	{
+		return 1;
+	}
+
+	/* What reading every argument costs, compared with call_mixed */
+	double sum = 0;
+	mixed->RemoveHook(mixedHook);
+	mixed->AddHook(MixedArgsRead, NULL, &sum);
+
+	BenchReport("argbench", "read_mixed", BenchMin(callMixed, kCallIterations), kCallIterations);
+	if (!Check(sum == 17 * 18 / 2, "MixedArgs"))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * argtarget - Functions with every kind of argument passing for argbench to hook
+ *
+ * Each one weighs its arguments differently, so an argument that is read from or written to the
+ * wrong place changes the result.
+ */
+
+#include "argtarget.h"
+
+extern "C" long IntArgs(long a, long b, long c, long d, long e, long f, long g, long h)
+{
+	return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h;
+}
+
+extern "C" double SSEArgs(double a, double b, double c, double d, double e, double f, double g,
+	double h, double i, double j)
+{
+	return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i + 10 * j;
+}
+
+extern "C" double MixedArgs(int a, double b, long c, float d, long e, double f, long g, float h,
+	long i, double j, long k, double l, double m, double n, double o, double p, long q)
+{
+	return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i + 10 * j + 11 * k +
+		12 * l + 13 * m + 14 * n + 15 * o + 16 * p + 17 * q;
+}
+
+extern "C" long PairArgs(IntPair p, long a, long b, long c, IntPair q, long z)
+{
+	return p.a + 2 * p.b + 3 * a + 4 * b + 5 * c + 6 * q.a + 7 * q.b + 8 * z;
+}
+
+extern "C" double IntDoubleArgs(IntDouble t, double a, double b, double c, double d, double e,
+	double f, double g, IntDouble s, long z)
+{
+	return t.i + 2 * t.d + 3 * a + 4 * b + 5 * c + 6 * d + 7 * e + 8 * f + 9 * g + 10 * s.i +
+		11 * s.d + 12 * z;
+}
+
+extern "C" double DoublePairArgs(DoublePair a, DoublePair b, DoublePair c, DoublePair d, DoublePair e)
+{
+	return a.a + 2 * a.b + 3 * b.a + 4 * b.b + 5 * c.a + 6 * c.b + 7 * d.a + 8 * d.b + 9 * e.a +
+		10 * e.b;
+}
+
+extern "C" long BigArgs(long a, Big b, long c)
+{
+	return a + 2 * b.a + 3 * b.b + 4 * b.c + 5 * c;
+}
+
+extern "C" Big MemoryReturn(long a, long b)
+{
+	Big ret = {a, b, a + b};
+	return ret;
+}
+
+extern "C" long AlignedArgs(long a, long b, long c, long d, long e, long f, long g, Aligned s,
+	__int128 v, long h)
+{
+	return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * long(s.v) + 9 * long(v) + 10 * h;
+}
@@ -0,0 +1,70 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_SRCDS_OSX_ARGTARGET_H_
+#define _INCLUDE_SRCDS_OSX_ARGTARGET_H_
+
+/*
+ * Functions for argbench to hook. They are built separately so the compiler can't see how they
+ * are called, and has to pass their arguments exactly as the ABI says.
+ */
+
+struct IntPair			/* INTEGER, INTEGER */
+{
+	long a, b;
+};
+
+struct IntDouble		/* INTEGER, SSE */
+{
+	long i;
+	double d;
+};
+
+struct DoublePair		/* SSE, SSE */
+{
+	double a, b;
+};
+
+struct Big				/* Passed in memory */
+{
+	long a, b, c;
+};
+
+struct Aligned			/* INTEGER, INTEGER, 16-byte aligned on the stack */
+{
+	__int128 v;
+};
+
+extern "C" long IntArgs(long a, long b, long c, long d, long e, long f, long g, long h);
+extern "C" double SSEArgs(double a, double b, double c, double d, double e, double f, double g,
+	double h, double i, double j);
+extern "C" double MixedArgs(int a, double b, long c, float d, long e, double f, long g, float h,
+	long i, double j, long k, double l, double m, double n, double o, double p, long q);
+extern "C" long PairArgs(IntPair p, long a, long b, long c, IntPair q, long z);
+extern "C" double IntDoubleArgs(IntDouble t, double a, double b, double c, double d, double e,
+	double f, double g, IntDouble s, long z);
+extern "C" double DoublePairArgs(DoublePair a, DoublePair b, DoublePair c, DoublePair d, DoublePair e);
+extern "C" long BigArgs(long a, Big b, long c);
+extern "C" Big MemoryReturn(long a, long b);
+extern "C" long AlignedArgs(long a, long b, long c, long d, long e, long f, long g, Aligned s,
+	__int128 v, long h);
+
+#endif // _INCLUDE_SRCDS_OSX_ARGTARGET_H_
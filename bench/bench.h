@@ -0,0 +1,72 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef _INCLUDE_SRCDS_OSX_BENCH_H_
+#define _INCLUDE_SRCDS_OSX_BENCH_H_
+
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Shared timing and reporting for the benchmarks in this directory.
+ *
+ * Results are printed one JSON object per line so they can be collected and compared
+ * between revisions, e.g. bench/jmpbench > before.json
+ */
+
+static inline double BenchNow()
+{
+	using namespace std::chrono;
+	return duration<double, std::nano>(steady_clock::now().time_since_epoch()).count();
+}
+
+/* Runs fn(iterations) a few times and returns the fastest run in ns per iteration */
+template <typename F>
+double BenchMin(F fn, size_t iterations, int runs = 5)
+{
+	double best = 0.0;
+
+	/* Warm up caches and branch predictors first */
+	fn(iterations / 10 + 1);
+
+	for (int i = 0; i < runs; i++)
+	{
+		double start = BenchNow();
+		fn(iterations);
+		double elapsed = (BenchNow() - start) / iterations;
+
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	return best;
+}
+
+static inline void BenchReport(const char *suite, const char *name, double nsPerOp, size_t iterations)
+{
+	printf("{\"suite\": \"%s\", \"case\": \"%s\", \"ns_per_op\": %.3f, \"iterations\": %zu}\n",
+		suite, name, nsPerOp, iterations);
+	fflush(stdout);
+}
+
+#endif // _INCLUDE_SRCDS_OSX_BENCH_H_
@@ -0,0 +1,279 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * detourbench - What detours cost to install, enable and call through
+ *
+ * Each synthetic function below starts with a different kind of prologue, so the trampoline has to
+ * relocate a different kind of instruction. Every case is measured with a plain CDetour, and the
+ * dispatcher is measured with no hooks and with 1 and N of them.
+ */
+
+#include "CDetour/detours.h"
+#include "CDetour/dispatcher.h"
+#include "bench.h"
+
+#if !defined(__x86_64__)
+#error detourbench is only meaningful on x86-64
+#endif
+
+typedef int (*HotFn)(int);
+
+static const size_t kCallIterations = 10000000;
+static const size_t kInstallIterations = 2000;
+static const size_t kDispatchHooks = 8;
+
+#if defined(__APPLE__)
+#define ASM_NAME(name) "_" #name
+#else
+#define ASM_NAME(name) #name
+#endif
+
+/* Each returns x + 1, and has int3 padding in front so that live mode can hot patch it */
+#define SYNTHETIC_FUNCTION(name, body) \
+	".text\n" \
+	".p2align 4, 0xcc\n" \
+	".fill 8, 1, 0xcc\n" \
+	".globl " ASM_NAME(name) "\n" \
+	ASM_NAME(name) ":\n" \
+	body
+
+extern "C"
+{
+	int BenchOne = 1;
+
+	int Prologue_Frame(int x);
+	int Prologue_RipRelative(int x);
+	int Prologue_ShortJump(int x);
+	int Prologue_Pushes(int x);
+}
+
+asm(
+	SYNTHETIC_FUNCTION(Prologue_Frame,
+		"push %rbp\n"
+		"mov %rsp, %rbp\n"
+		"lea 1(%rdi), %eax\n"
+		"pop %rbp\n"
+		"ret\n")
+
+	SYNTHETIC_FUNCTION(Prologue_RipRelative,
+		"mov " ASM_NAME(BenchOne) "(%rip), %eax\n"
+		"add %edi, %eax\n"
+		"ret\n")
+
+	/* The jns lands in the relocated bytes, and the xor is never run */
+	SYNTHETIC_FUNCTION(Prologue_ShortJump,
+		"test %edi, %edi\n"
+		"jns 1f\n"
+		"xor %edi, %edi\n"
+		"1:\n"
+		"lea 1(%rdi), %eax\n"
+		"ret\n")
+
+	SYNTHETIC_FUNCTION(Prologue_Pushes,
+		"push %rbx\n"
+		"push %r12\n"
+		"mov %edi, %eax\n"
+		"inc %eax\n"
+		"pop %r12\n"
+		"pop %rbx\n"
+		"ret\n")
+);
+
+struct Prologue
+{
+	const char *name;
+	HotFn function;
+};
+
+static const Prologue kPrologues[] =
+{
+	{"frame", Prologue_Frame},
+	{"rip_relative", Prologue_RipRelative},
+	{"short_jump", Prologue_ShortJump},
+	{"pushes", Prologue_Pushes},
+};
+
+static const size_t kPrologueCount = sizeof(kPrologues) / sizeof(kPrologues[0]);
+
+DETOUR_DECL_STATIC1(PassThroughHook, int, int, x)
+{
+	return DETOUR_STATIC_CALL(PassThroughHook)(x);
+}
+
+static DetourResult IgnoreHook(DetourContext *ctx, void *param)
+{
+	return Detour_Ignored;
+}
+
+static double MeasureCalls(HotFn fn)
+{
+	return BenchMin([fn](size_t n) {
+		int acc = 0;
+		for (size_t i = 0; i < n; i++)
+			acc = fn(acc);
+
+		volatile int sink = acc;
+		(void)sink;
+	}, kCallIterations);
+}
+
+static void Report(const char *what, const char *prologue, double nsPerOp, size_t iterations)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s_%s", what, prologue);
+	BenchReport("detourbench", name, nsPerOp, iterations);
+}
+
+static bool BenchPrologue(const Prologue &prologue)
+{
+	/* Called through a volatile pointer so that nothing gets inlined */
+	HotFn volatile fn = prologue.function;
+	void *addr = (void *)prologue.function;
+
+	Report("call_direct", prologue.name, MeasureCalls(fn), kCallIterations);
+
+	/* Creating the trampoline, without ever patching the function */
+	bool failed = false;
+	double install = BenchMin([addr, &failed](size_t n) {
+		for (size_t i = 0; i < n; i++)
+		{
+			CDetour *detour = DETOUR_CREATE_STATIC(PassThroughHook, addr);
+			if (!detour)
+			{
+				failed = true;
+				return;
+			}
+			detour->Destroy();
+		}
+	}, kInstallIterations);
+
+	if (failed)
+	{
+		printf("Failed to detour %s\n", prologue.name);
+		return false;
+	}
+	Report("install", prologue.name, install, kInstallIterations);
+
+	CDetour *detour = DETOUR_CREATE_STATIC(PassThroughHook, addr);
+	if (!detour)
+	{
+		printf("Failed to detour %s\n", prologue.name);
+		return false;
+	}
+
+	double toggle = BenchMin([detour](size_t n) {
+		for (size_t i = 0; i < n; i++)
+		{
+			detour->EnableDetour();
+			detour->DisableDetour();
+		}
+	}, kInstallIterations);
+	Report("enable_disable", prologue.name, toggle, kInstallIterations);
+
+	detour->SetLiveMode(true);
+	toggle = BenchMin([detour](size_t n) {
+		for (size_t i = 0; i < n; i++)
+		{
+			detour->EnableDetour();
+			detour->DisableDetour();
+		}
+	}, kInstallIterations);
+	Report("enable_disable_live", prologue.name, toggle, kInstallIterations);
+	detour->SetLiveMode(false);
+
+	detour->EnableDetour();
+	if (fn(1) != 2)
+	{
+		printf("Detoured %s returned the wrong value\n", prologue.name);
+		return false;
+	}
+	Report("call_cdetour", prologue.name, MeasureCalls(fn), kCallIterations);
+	detour->DisableDetour();
+	detour->Destroy();
+
+	return true;
+}
+
+static bool BenchDispatcher()
+{
+	HotFn volatile fn = Prologue_Frame;
+
+	CDetourDispatcher *dispatcher = CDetourDispatcher::Attach((void *)Prologue_Frame);
+	if (!dispatcher)
+	{
+		printf("Failed to attach a dispatcher\n");
+		return false;
+	}
+
+	BenchReport("detourbench", "dispatch_0", MeasureCalls(fn), kCallIterations);
+
+	int ids[kDispatchHooks];
+	char name[64];
+
+	for (size_t i = 0; i < kDispatchHooks; i++)
+	{
+		ids[i] = dispatcher->AddHook(IgnoreHook, NULL);
+		if (!ids[i])
+		{
+			printf("Failed to add a dispatcher hook\n");
+			return false;
+		}
+
+		if (i == 0 || i + 1 == kDispatchHooks)
+		{
+			snprintf(name, sizeof(name), "dispatch_%zu_pre", i + 1);
+			BenchReport("detourbench", name, MeasureCalls(fn), kCallIterations);
+		}
+	}
+
+	for (size_t i = 0; i < kDispatchHooks; i++)
+		dispatcher->RemoveHook(ids[i]);
+
+	/* Post hooks have the original called in place of its caller */
+	ids[0] = dispatcher->AddHook(NULL, IgnoreHook);
+	BenchReport("detourbench", "dispatch_1_post", MeasureCalls(fn), kCallIterations);
+
+	if (fn(1) != 2)
+	{
+		printf("Dispatched function returned the wrong value\n");
+		return false;
+	}
+
+	dispatcher->RemoveHook(ids[0]);
+	dispatcher->Destroy();
+
+	return true;
+}
+
+int main()
+{
+	for (size_t i = 0; i < kPrologueCount; i++)
+	{
+		if (!BenchPrologue(kPrologues[i]))
+			return 1;
+	}
+
+	if (!BenchDispatcher())
+		return 1;
+
+	return 0;
+}
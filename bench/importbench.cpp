@@ -0,0 +1,167 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * importbench - Hooking a library's imports, and the per-call cost of a hooked import
+ *
+ * importtarget is a small shared library that calls one function defined here and takes the
+ * address of another. Both imports are hooked, checked to reach their callbacks, and checked to be
+ * back to the real functions once the hooks are disabled and destroyed. Calls made by this
+ * executable itself must never be redirected.
+ */
+
+#include "ImportHook.h"
+#include "bench.h"
+#include <dlfcn.h>
+
+typedef int (*ImportFn)(int);
+
+extern "C" int CallImport(int x);
+extern "C" ImportFn GetImport();
+
+static const size_t kCallIterations = 10000000;
+
+static ImportFn g_CalledOriginal = NULL;
+static ImportFn g_AddressedOriginal = NULL;
+
+extern "C" __attribute__((noinline)) int CalledImport(int x)
+{
+	asm volatile("");
+	return x + 1;
+}
+
+extern "C" __attribute__((noinline)) int AddressedImport(int x)
+{
+	asm volatile("");
+	return x + 2;
+}
+
+static int CalledCallback(int x)
+{
+	return g_CalledOriginal(x) + 100;
+}
+
+static int AddressedCallback(int x)
+{
+	return g_AddressedOriginal(x) + 100;
+}
+
+static double MeasureCalls()
+{
+	return BenchMin([](size_t n) {
+		int acc = 0;
+		for (size_t i = 0; i < n; i++)
+			acc = CallImport(acc) & 0xFF;
+
+		volatile int sink = acc;
+		(void)sink;
+	}, kCallIterations);
+}
+
+static bool Check(bool hooked, const char *when)
+{
+	if (CallImport(1) != (hooked ? 102 : 2))
+	{
+		printf("Call through the JUMP_SLOT went to the wrong function %s\n", when);
+		return false;
+	}
+
+	ImportFn addressed = GetImport();
+	if (addressed != (hooked ? AddressedCallback : AddressedImport) || addressed(1) != (hooked ? 103 : 3))
+	{
+		printf("Address from the GLOB_DAT is the wrong function %s\n", when);
+		return false;
+	}
+
+	if (CalledImport(1) != 2 || AddressedImport(1) != 3)
+	{
+		printf("Call from the executable was redirected %s\n", when);
+		return false;
+	}
+
+	return true;
+}
+
+static ImportHook *CreateHook(uintptr_t base, const char *symbol, void *callback, ImportFn *original, void *real)
+{
+	ImportHook *hook = ImportHook::Create(base, symbol, callback, (void **)original);
+	if (!hook)
+	{
+		printf("Failed to hook %s in importtarget\n", symbol);
+		return NULL;
+	}
+
+	if (hook->GetSlotCount() != 1 || (void *)*original != real)
+	{
+		printf("Found %zu pointers to %s, expected 1\n", hook->GetSlotCount(), symbol);
+		hook->Destroy();
+		return NULL;
+	}
+
+	return hook;
+}
+
+int main()
+{
+	Dl_info info;
+
+	if (!dladdr((void *)CallImport, &info) || !info.dli_fbase)
+	{
+		printf("Failed to find importtarget\n");
+		return 1;
+	}
+
+	if (!Check(false, "before hooking"))
+		return 1;
+
+	BenchReport("importbench", "call_import", MeasureCalls(), kCallIterations);
+
+	uintptr_t base = uintptr_t(info.dli_fbase);
+	ImportHook *called = CreateHook(base, "CalledImport", (void *)CalledCallback, &g_CalledOriginal,
+	                                (void *)CalledImport);
+	ImportHook *addressed = CreateHook(base, "AddressedImport", (void *)AddressedCallback,
+	                                   &g_AddressedOriginal, (void *)AddressedImport);
+	if (!called || !addressed)
+		return 1;
+
+	if (!Check(false, "before enabling") || !called->Enable() || !addressed->Enable() ||
+	    !Check(true, "while enabled"))
+	{
+		return 1;
+	}
+
+	BenchReport("importbench", "call_hooked", MeasureCalls(), kCallIterations);
+
+	called->Disable();
+	addressed->Disable();
+	if (!Check(false, "after disabling") || !called->Enable() || !addressed->Enable() ||
+	    !Check(true, "after enabling again"))
+	{
+		return 1;
+	}
+
+	called->Destroy();
+	addressed->Destroy();
+	if (!Check(false, "after destroying"))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * importtarget - Library for importbench to hook the imports of
+ *
+ * Both functions are defined by importbench itself. CalledImport is only called, which goes
+ * through the PLT (a JUMP_SLOT relocation, or a lazy pointer on Mach-O). AddressedImport only has
+ * its address taken, which goes through the GOT (GLOB_DAT, or a non-lazy pointer). They are kept
+ * apart because the linker sends calls through the GOT entry once a function has one.
+ */
+
+typedef int (*ImportFn)(int);
+
+extern "C" int CalledImport(int x);
+extern "C" int AddressedImport(int x);
+
+extern "C" int CallImport(int x)
+{
+	return CalledImport(x);
+}
+
+extern "C" ImportFn GetImport()
+{
+	return &AddressedImport;
+}
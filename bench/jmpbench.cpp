@@ -0,0 +1,161 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * jmpbench - Per-call cost of the jump encodings a detour gate can use
+ *
+ * Each encoding is placed in front of the same small function and called through a couple of
+ * stack frames, so that return mispredictions caused by the jump show up in the callers as well.
+ * The full detour case goes through a CDetour with a callback that calls the trampoline.
+ */
+
+#include "CDetour/detours.h"
+#include "bench.h"
+
+#if !defined(__x86_64__)
+#error jmpbench is only meaningful on x86-64
+#endif
+
+typedef int (*HotFn)(int);
+
+static const size_t kIterations = 20000000;
+static const size_t kStubSize = 32;
+
+extern "C" __attribute__((noinline)) int HotFunction(int x)
+{
+	asm volatile("");
+	return x + 1;
+}
+
+extern "C" __attribute__((noinline)) int DetouredFunction(int x)
+{
+	asm volatile("");
+	return x + 1;
+}
+
+DETOUR_DECL_STATIC1(DetouredHook, int, int, x)
+{
+	return DETOUR_STATIC_CALL(DetouredHook)(x);
+}
+
+__attribute__((noinline)) static int CallLeaf(HotFn fn, int x)
+{
+	return fn(x) ^ 1;
+}
+
+__attribute__((noinline)) static int CallMid(HotFn fn, int x)
+{
+	return CallLeaf(fn, x) + 1;
+}
+
+static double Measure(HotFn fn)
+{
+	return BenchMin([fn](size_t n) {
+		int acc = 0;
+		for (size_t i = 0; i < n; i++)
+			acc = CallMid(fn, acc);
+
+		volatile int sink = acc;
+		(void)sink;
+	}, kIterations);
+}
+
+/* What PatchAbsJump64 and X64_Jump_Abs used to emit */
+static size_t WritePushRetJump(unsigned char *buffer, void *callback)
+{
+	size_t i = 0;
+
+	buffer[i++] = IA32_PUSH_IMM32;
+	*(int32_t *)(&buffer[i]) = int32_t(int64_t(callback));
+	i += 4;
+	buffer[i++] = IA32_MOV_RM_IMM32;
+	buffer[i++] = ia32_modrm(MOD_DISP8, 0, REG_SIB);
+	buffer[i++] = ia32_sib(NOSCALE, REG_NOIDX, REG_ESP);
+	buffer[i++] = 0x04;
+	*(int32_t *)(&buffer[i]) = int32_t(int64_t(callback) >> 32);
+	i += 4;
+	buffer[i++] = IA32_RET;
+
+	return i;
+}
+
+static size_t WriteRel32(unsigned char *buffer, void *callback)
+{
+	return WriteRelJump32(buffer, buffer, callback);
+}
+
+struct JumpEncoding
+{
+	const char *name;
+	size_t (*write)(unsigned char *buffer, void *callback);
+};
+
+static const JumpEncoding kEncodings[] =
+{
+	{"rel32", WriteRel32},
+	{"jmp_rip", WriteAbsJump64},
+	{"mov_r11", WriteAbsJumpR11},
+	{"push_ret", WritePushRetJump},
+};
+
+static const size_t kEncodingCount = sizeof(kEncodings) / sizeof(kEncodings[0]);
+
+int main()
+{
+	/* The stubs are written in place, so they need a single mapping */
+	CPageAlloc alloc(16, false);
+
+	unsigned char *stubs = (unsigned char *)alloc.AllocNear(kStubSize * kEncodingCount, (void *)HotFunction);
+	if (!stubs)
+	{
+		printf("Failed to allocate jump stubs near the benchmark function\n");
+		return 1;
+	}
+
+	alloc.SetRW(stubs);
+	for (size_t i = 0; i < kEncodingCount; i++)
+		kEncodings[i].write(stubs + i * kStubSize, (void *)HotFunction);
+	alloc.SetRE(stubs);
+
+	BenchReport("jmpbench", "direct", Measure(HotFunction), kIterations);
+
+	for (size_t i = 0; i < kEncodingCount; i++)
+	{
+		HotFn fn = (HotFn)(stubs + i * kStubSize);
+		BenchReport("jmpbench", kEncodings[i].name, Measure(fn), kIterations);
+	}
+
+	CDetour *detour = DETOUR_CREATE_STATIC(DetouredHook, (void *)DetouredFunction);
+	if (!detour)
+	{
+		printf("Failed to detour the benchmark function\n");
+		return 1;
+	}
+
+	detour->EnableDetour();
+	BenchReport("jmpbench", "cdetour", Measure(DetouredFunction), kIterations);
+	detour->Destroy();
+
+	alloc.Free(stubs);
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * profbench - Per-call overhead of profiling a function
+ *
+ * The same small function is called directly, through a plain CDetour and through a profiler
+ * probe. The probe's cost is what a profiled function pays on every call, two TSC reads included,
+ * so the cost of just those reads is measured as well.
+ */
+
+#include "CDetour/detours.h"
+#include "CDetour/profiler.h"
+#include "bench.h"
+#include <stdint.h>
+
+typedef int (*HotFn)(int);
+
+static const size_t kIterations = 10000000;
+
+extern "C" __attribute__((noinline)) int PlainFunction(int x)
+{
+	asm volatile("");
+	return x + 1;
+}
+
+extern "C" __attribute__((noinline)) int DetouredFunction(int x)
+{
+	asm volatile("");
+	return x + 1;
+}
+
+extern "C" __attribute__((noinline)) int ProfiledFunction(int x)
+{
+	asm volatile("");
+	return x + 1;
+}
+
+DETOUR_DECL_STATIC1(DetouredHook, int, int, x)
+{
+	return DETOUR_STATIC_CALL(DetouredHook)(x);
+}
+
+static inline uint64_t ReadTSC()
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t(hi) << 32) | lo;
+}
+
+static double Measure(HotFn fn)
+{
+	return BenchMin([fn](size_t n) {
+		int acc = 0;
+		for (size_t i = 0; i < n; i++)
+			acc = fn(acc);
+
+		volatile int sink = acc;
+		(void)sink;
+	}, kIterations);
+}
+
+int main()
+{
+	/* The floor for any probe that times calls */
+	double tscPair = BenchMin([](size_t n) {
+		uint64_t acc = 0;
+		for (size_t i = 0; i < n; i++)
+			acc += ReadTSC() - ReadTSC();
+
+		volatile uint64_t sink = acc;
+		(void)sink;
+	}, kIterations);
+	BenchReport("profbench", "tsc_pair", tscPair, kIterations);
+
+	/* Called through a volatile pointer so that nothing gets inlined */
+	HotFn volatile fn = PlainFunction;
+	BenchReport("profbench", "direct", Measure(fn), kIterations);
+
+	CDetour *detour = DETOUR_CREATE_STATIC(DetouredHook, (void *)DetouredFunction);
+	if (!detour)
+	{
+		printf("Failed to detour the benchmark function\n");
+		return 1;
+	}
+
+	detour->EnableDetour();
+	fn = DetouredFunction;
+	BenchReport("profbench", "cdetour", Measure(fn), kIterations);
+	detour->DisableDetour();
+	detour->Destroy();
+
+	int probe = CProfiler::Add("ProfiledFunction", (void *)ProfiledFunction);
+	if (probe < 0)
+	{
+		printf("Failed to profile the benchmark function\n");
+		return 1;
+	}
+
+	fn = ProfiledFunction;
+	BenchReport("profbench", "profiled", Measure(fn), kIterations);
+
+	ProfileStats stats;
+	if (!CProfiler::GetStats(probe, stats) || !stats.calls)
+	{
+		printf("Profiler did not count any calls\n");
+		return 1;
+	}
+
+	CProfiler::RemoveAll();
+
+	return 0;
+}
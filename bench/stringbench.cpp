@@ -0,0 +1,103 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * stringbench - Throughput of constructing, appending to and assigning AStrings
+ *
+ * Library names, symbol names and profiler labels are all short strings built with a few
+ * appends, the way GameLib::Load builds "lib" + name + "_srv" LIBEXT. The cases below repeat
+ * those patterns with names that fit inline and with names that need the heap.
+ */
+
+#include "am-string.h"
+#include "bench.h"
+
+using namespace ke;
+
+static const size_t kIterations = 5000000;
+
+static const char kShortName[] = "engine";
+static const char kLongName[] = "csgo/bin/osx64/matchmaking_ds_client";
+
+static double MeasureConstruct(const char *name)
+{
+	return BenchMin([name](size_t n) {
+		for (size_t i = 0; i < n; i++)
+		{
+			AString str(name);
+			asm volatile("" : : "r"(str.chars()) : "memory");
+		}
+	}, kIterations);
+}
+
+static double MeasureAppend(const char *name)
+{
+	return BenchMin([name](size_t n) {
+		for (size_t i = 0; i < n; i++)
+		{
+			AString str;
+			str = "lib";
+			str.append(name);
+			str.append("_srv.dylib");
+			asm volatile("" : : "r"(str.chars()) : "memory");
+		}
+	}, kIterations);
+}
+
+static double MeasureAssign(const char *name)
+{
+	AString str;
+
+	return BenchMin([name, &str](size_t n) {
+		for (size_t i = 0; i < n; i++)
+		{
+			str = name;
+			asm volatile("" : : "r"(str.chars()) : "memory");
+		}
+	}, kIterations);
+}
+
+static double MeasureCopy(const char *name)
+{
+	AString source(name);
+
+	return BenchMin([&source](size_t n) {
+		for (size_t i = 0; i < n; i++)
+		{
+			AString copy(source);
+			asm volatile("" : : "r"(copy.chars()) : "memory");
+		}
+	}, kIterations);
+}
+
+int main()
+{
+	BenchReport("stringbench", "construct_short", MeasureConstruct(kShortName), kIterations);
+	BenchReport("stringbench", "construct_long", MeasureConstruct(kLongName), kIterations);
+	BenchReport("stringbench", "append_short", MeasureAppend(kShortName), kIterations);
+	BenchReport("stringbench", "append_long", MeasureAppend(kLongName), kIterations);
+	BenchReport("stringbench", "assign_short", MeasureAssign(kShortName), kIterations);
+	BenchReport("stringbench", "assign_long", MeasureAssign(kLongName), kIterations);
+	BenchReport("stringbench", "copy_short", MeasureCopy(kShortName), kIterations);
+	BenchReport("stringbench", "copy_long", MeasureCopy(kLongName), kIterations);
+
+	return 0;
+}
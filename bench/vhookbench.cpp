@@ -0,0 +1,157 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * vhookbench - Per-call cost of hooking a virtual function, generated at build time or at run time
+ *
+ * The same vtable entry is hooked with a StaticHook, whose dispatch the compiler generates, and
+ * with a dispatcher attached to the entry, which goes through a generated entry stub. Both are
+ * measured with no hooks, one pre hook and one post hook.
+ */
+
+#include "CDetour/statichook.h"
+#include "CDetour/vtablehook.h"
+#include "bench.h"
+
+#if !defined(__x86_64__)
+#error vhookbench is only meaningful on x86-64
+#endif
+
+static const size_t kCallIterations = 10000000;
+
+class BenchObject
+{
+public:
+	virtual ~BenchObject()
+	{
+	}
+
+	virtual int Work(int x, float scale)
+	{
+		asm volatile("");
+		return x + int(scale);
+	}
+};
+
+static const int kWorkIndex = 2;
+
+STATICHOOK_DECL(WorkHook, int (BenchObject::*)(int, float));
+
+static DetourResult StaticIgnore(BenchObject *self, StaticHookReturn<int> *ret, int &x, float &scale)
+{
+	asm volatile("");
+	return Detour_Ignored;
+}
+
+static DetourResult DispatchIgnore(DetourContext *ctx, void *param)
+{
+	asm volatile("");
+	return Detour_Ignored;
+}
+
+static double MeasureCalls(BenchObject *volatile object)
+{
+	return BenchMin([object](size_t n) {
+		int acc = 0;
+		for (size_t i = 0; i < n; i++)
+			acc = object->Work(acc, 1.0f);
+
+		volatile int sink = acc;
+		(void)sink;
+	}, kCallIterations);
+}
+
+static bool Check(BenchObject *object, const char *name)
+{
+	if (object->Work(1, 1.0f) != 2)
+	{
+		printf("%s returned the wrong value\n", name);
+		return false;
+	}
+
+	return true;
+}
+
+static bool BenchStatic(BenchObject *object, void **vtable)
+{
+	CVTableHook *hook = CVTableHook::CreateSlotHook(vtable, kWorkIndex, WorkHook::GetCallback(),
+	                                                WorkHook::GetTrampoline());
+	if (!hook || !hook->Enable())
+	{
+		printf("Failed to hook the vtable entry\n");
+		return false;
+	}
+
+	BenchReport("vhookbench", "static_0", MeasureCalls(object), kCallIterations);
+
+	WorkHook::AddHook(StaticIgnore, NULL);
+	BenchReport("vhookbench", "static_1_pre", MeasureCalls(object), kCallIterations);
+	WorkHook::RemoveHook(StaticIgnore, NULL);
+
+	WorkHook::AddHook(NULL, StaticIgnore);
+	BenchReport("vhookbench", "static_1_post", MeasureCalls(object), kCallIterations);
+
+	bool ok = Check(object, "StaticHook");
+	WorkHook::RemoveHook(NULL, StaticIgnore);
+	hook->Destroy();
+
+	return ok;
+}
+
+static bool BenchDispatcher(BenchObject *object, void **vtable)
+{
+	CDetourDispatcher *dispatcher = CDetourDispatcher::AttachVTable(vtable, kWorkIndex);
+	if (!dispatcher)
+	{
+		printf("Failed to attach a dispatcher\n");
+		return false;
+	}
+
+	BenchReport("vhookbench", "dispatch_0", MeasureCalls(object), kCallIterations);
+
+	int id = dispatcher->AddHook(DispatchIgnore, NULL);
+	BenchReport("vhookbench", "dispatch_1_pre", MeasureCalls(object), kCallIterations);
+	dispatcher->RemoveHook(id);
+
+	id = dispatcher->AddHook(NULL, DispatchIgnore);
+	BenchReport("vhookbench", "dispatch_1_post", MeasureCalls(object), kCallIterations);
+
+	bool ok = Check(object, "Dispatcher");
+	dispatcher->RemoveHook(id);
+	dispatcher->Destroy();
+
+	return ok;
+}
+
+int main()
+{
+	BenchObject *object = new BenchObject;
+	void **vtable = *reinterpret_cast<void ***>(object);
+
+	BenchReport("vhookbench", "direct", MeasureCalls(object), kCallIterations);
+
+	if (!BenchStatic(object, vtable) || !BenchDispatcher(object, vtable))
+		return 1;
+
+	delete object;
+
+	return 0;
+}
@@ -22,6 +22,7 @@
 #include "hacks.h"
 #include "mm_util.h"
 #include "CDetour/detours.h"
+#include "CDetour/registry.h"
 #include "osw/SteamTypes.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,6 +39,7 @@
 
 #include "platform.h"
 #include "HSGameLib.h"
+#include "LibrarySearch.h"
 
 /* Define things from 10.6 SDK for older SDKs */
 #ifndef MAC_OS_X_VERSION_10_6
@@ -93,18 +95,6 @@ static void **g_pShaderShadowDx8;
 static void **g_pHWConfig;
 #endif
 
-CDetour *detSysLoadModules = NULL;
-CDetour *detGetAppId = NULL;
-CDetour *detSetAppId = NULL;
-CDetour *detLoadModule = NULL;
-CDetour *detFsLoadModule = NULL;
-CDetour *detSteamLoadModule = NULL;
-CDetour *detSetShaderApi = NULL;
-CDetour *detDebugString = NULL;
-CDetour *detDepotSetup = NULL;
-CDetour *detDepotMount = NULL;
-CDetour *detSdlInit = NULL;
-
 struct AppSystemInfo_t
 {
 	const char *m_pModuleName;
@@ -402,7 +392,7 @@ DETOUR_DECL_MEMBER1(CMaterialSystem_SetShaderAPI, void, const char *, pModuleNam
 	if (!g_EmptyShader)
 	{
 		printf("Failed to load shader API from %s\n", pModuleName);
-		detSetShaderApi->Destroy();
+		CDetourRegistry::Remove(GET_MEMBER_TRAMPOLINE(CMaterialSystem_SetShaderAPI));
 		return;
 	}
 
@@ -412,7 +402,7 @@ DETOUR_DECL_MEMBER1(CMaterialSystem_SetShaderAPI, void, const char *, pModuleNam
 		printf("Failed to get shader factory from %s\n", pModuleName);
 		dlclose(g_EmptyShader);
 		g_EmptyShader = NULL;
-		detSetShaderApi->Destroy();
+		CDetourRegistry::Remove(GET_MEMBER_TRAMPOLINE(CMaterialSystem_SetShaderAPI));
 		return;
 	}
 
@@ -430,18 +420,25 @@ DETOUR_DECL_MEMBER1(CMaterialSystem_SetShaderAPI, void, const char *, pModuleNam
 #endif
 
 	/* We can get rid of this now */
-	detSetShaderApi->Destroy();
+	CDetourRegistry::Remove(GET_MEMBER_TRAMPOLINE(CMaterialSystem_SetShaderAPI));
 }
 
 #endif // ENGINE_L4D || ENGINE_CSGO
 
+/* Gives the engine the full path of a library in the search path, saving the loader a search */
+static inline const char *ResolveModuleName(const char *pModuleName)
+{
+	const char *path = LibrarySearch::Resolve(pModuleName);
+	return path ? path : pModuleName;
+}
+
 #if defined(ENGINE_OBV) || defined(ENGINE_OBV_SDL) || defined(ENGINE_GMOD) || defined(ENGINE_L4D2) || defined(ENGINE_ND)
 DETOUR_DECL_STATIC2(Sys_FsLoadModule, void *, const char *, pModuleName, int, flags)
 {
 	if (strstr(pModuleName, "chromehtml"))
 		return NULL;
 	else
-		return DETOUR_STATIC_CALL(Sys_FsLoadModule)(pModuleName, flags);
+		return DETOUR_STATIC_CALL(Sys_FsLoadModule)(ResolveModuleName(pModuleName), flags);
 }
 #endif
 
@@ -465,10 +462,11 @@ DETOUR_DECL_STATIC1(Sys_LoadModule, void *, const char *, pModuleName)
 	if (char *libName = strstr(pModuleName, "matchmaking_ds.dylib"))
 	{
 		strcpy(libName, "matchmaking.dylib");
-		return DETOUR_STATIC_CALL(Sys_LoadModule)(pModuleName);
+		return DETOUR_STATIC_CALL(Sys_LoadModule)(ResolveModuleName(pModuleName));
 	}
 #endif
 
+	pModuleName = ResolveModuleName(pModuleName);
 	handle = DETOUR_STATIC_CALL(Sys_LoadModule)(pModuleName);
 
 	/* We need to install a detour in the materialsystem library, ugh */
@@ -476,7 +474,6 @@ DETOUR_DECL_STATIC1(Sys_LoadModule, void *, const char *, pModuleName)
 	{
 		Dl_info info;
 		void *materialFactory = dlsym(handle, "CreateInterface");
-		void *setShaderApi = NULL;
 
 		if (!materialFactory)
 		{
@@ -532,17 +529,15 @@ DETOUR_DECL_STATIC1(Sys_LoadModule, void *, const char *, pModuleName)
 
 		void ***vptr = (void ***)matsys.GetFactory()("VMaterialSystem080", NULL);
 		void **vtable = *vptr;
-		setShaderApi = vtable[10]; // IMaterialSystem::SetShaderAPI
 
-		detSetShaderApi = DETOUR_CREATE_MEMBER(CMaterialSystem_SetShaderAPI, setShaderApi);
-		if (!detSetShaderApi)
+		/* The engine only calls it through the interface, so swapping the vtable entry is enough */
+		DetourSpec shaderApi = DETOUR_SPEC_VTABLE(CMaterialSystem_SetShaderAPI, "CMaterialSystem::SetShaderAPI",
+		                                          vtable, 10, true); // IMaterialSystem::SetShaderAPI
+		if (!CDetourRegistry::Install(&shaderApi, 1))
 		{
-			printf("Failed to create detour for CMaterialSystem::SetShaderAPI\n");
 			return NULL;
 		}
 
-		detSetShaderApi->EnableDetour();
-
 		// g_pShaderAPI: CShaderDeviceBase::GetWindowSize
 		{
 			const char sig[] = "\x55\x48\x89\xE5\x48\x8B\x3D\x2A\x2A\x2A\x2A\x48\x8B\x07\x48\x8B\x80\xA8\x00\x00\x00";
@@ -671,24 +666,22 @@ DETOUR_DECL_STATIC1(Sys_LoadModule, void *, const char *, pModuleName)
 
 		return handle;
 #else
-		setShaderApi = SymbolAddr<void *>(info.dli_fbase, material_syms, 0);
+		void *setShaderApi = SymbolAddr<void *>(info.dli_fbase, material_syms, 0);
 
-		detSetShaderApi = DETOUR_CREATE_MEMBER(CMaterialSystem_SetShaderAPI, setShaderApi);
-		if (!detSetShaderApi)
+		DetourSpec shaderApi = DETOUR_SPEC_MEMBER(CMaterialSystem_SetShaderAPI, "CMaterialSystem::SetShaderAPI",
+		                                          setShaderApi, true, NULL);
+		if (!CDetourRegistry::Install(&shaderApi, 1))
 		{
-			printf("Failed to create detour for CMaterialSystem::SetShaderAPI\n");
 			return NULL;
 		}
 
-		detSetShaderApi->EnableDetour();
-
 		return handle;
 #endif
 	}
 
 #endif
 
-	return DETOUR_STATIC_CALL(Sys_LoadModule)(pModuleName);
+	return DETOUR_STATIC_CALL(Sys_LoadModule)(ResolveModuleName(pModuleName));
 }
 
 DETOUR_DECL_STATIC1(Plat_DebugString, void, const char *, str)
@@ -701,7 +694,7 @@ DETOUR_DECL_STATIC2(Sys_SteamLoadModule, void *, const char *, pModuleName, int,
 	if (strstr(pModuleName, "steamservice"))
 		return NULL;
 	else
-		return DETOUR_STATIC_CALL(Sys_SteamLoadModule)(pModuleName, flags);
+		return DETOUR_STATIC_CALL(Sys_SteamLoadModule)(ResolveModuleName(pModuleName), flags);
 }
 
 #if defined(ENGINE_GMOD)
@@ -764,45 +757,24 @@ DETOUR_DECL_MEMBER0(CSDLMgr_Init, int)
 
 bool BlockSteamService()
 {
-	void *steamclient = dlopen("steamclient.dylib", RTLD_LAZY);
-	if (!steamclient)
+	GameLib steamclient("steamclient");
+	if (!steamclient.IsLoaded())
 	{
-		printf("Failed to get handle for steamclient.dylib (%s)\n", dlerror());
+		printf("Failed to get handle for steamclient.dylib\n");
 		return false;
 	}
 	
-	void *steamclientFactory = dlsym(steamclient, "CreateInterface");
-	if (!steamclientFactory)
-	{
-		printf("Failed to find steamclient CreateInterface (%s)\n", dlerror());
-		dlclose(steamclient);
-		return false;
-	}
-	
-	Dl_info info;
-	if (!dladdr(steamclientFactory, &info) || !info.dli_fbase || !info.dli_fname)
+	if (!steamclient.GetBase())
 	{
 		printf("Failed to get base address of steamclient.dylib\n");
-		dlclose(steamclient);
 		return false;
 	}
 	
-	void *steamLoadModule = SymbolAddr<void *>(info.dli_fbase, steamclient_syms, 0);
-	detSteamLoadModule = DETOUR_CREATE_STATIC(Sys_SteamLoadModule, steamLoadModule);
-	
-	if (detSteamLoadModule)
-	{
-		detSteamLoadModule->EnableDetour();
-	}
-	else
-	{
-		printf("Failed to create detour for steamclient`Sys_LoadModule!\n");
-		dlclose(steamclient);
-		return false;
-	}
+	void *steamLoadModule = SymbolAddr<void *>((void *)steamclient.GetBase(), steamclient_syms, 0);
+	DetourSpec steamSpec = DETOUR_SPEC_STATIC(Sys_SteamLoadModule, "steamclient`Sys_LoadModule",
+	                                          steamLoadModule, true, NULL);
 	
-	dlclose(steamclient);
-	return true;
+	return CDetourRegistry::Install(&steamSpec, 1);
 }
 
 #if defined(ENGINE_CSGO)
@@ -817,25 +789,14 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 		//loadModule = fs.ResolveHiddenSymbol("_Z14Sys_LoadModulePKc");
 		const char sig[] = "\x55\x48\x89\xE5\x41\x57\x41\x56\x41\x54\x53\x48\x81\xEC\x10\x08\x00\x00";
 		loadModule = fs.FindPattern(sig, sizeof(sig) - 1);
-		if (!loadModule)
+
+		/* Fails with a message if the signature wasn't found */
+		DetourSpec fsSpec = DETOUR_SPEC_STATIC(Sys_LoadModule, "filesystem_stdio`Sys_LoadModule",
+		                                       loadModule, true, NULL);
+		if (!CDetourRegistry::Install(&fsSpec, 1))
 		{
-			printf("Failed to find signature for filesystem_stdio.dylib\n");
-			printf("_Z14Sys_LoadModulePKc");
 			return 0;
 		}
-		if (loadModule)
-		{
-			detFsLoadModule = DETOUR_CREATE_STATIC(Sys_LoadModule, loadModule);
-			if (detFsLoadModule)
-			{
-				detFsLoadModule->EnableDetour();
-			}
-			else
-			{
-				printf("Failed to create detour for filesystem_stdio`Sys_LoadModule!\n");
-				return 0;
-			}
-		}
 	}
 	else
 	{
@@ -887,8 +848,7 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 	void *launcherMain;
 	void *pCocoaMgr;
 #if !defined(ENGINE_INS) && !defined(ENGINE_DOI)
-	void *engine;
-	void *engineFactory;
+	GameLib engine;
 	void **engineCocoa;
 #endif
 	int ret;
@@ -932,15 +892,10 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 	CreateSDLMgr = SymbolAddr<CreateSDLMgr_t>(info.dli_fbase, launcher_syms, 1);
 	sdlInit = SymbolAddr<void *>(info.dli_fbase, launcher_syms, 2);
 
-	detSdlInit = DETOUR_CREATE_MEMBER(CSDLMgr_Init, sdlInit);
+	DetourSpec sdlSpec = DETOUR_SPEC_MEMBER(CSDLMgr_Init, "CSDLMgr::Init", sdlInit, true, NULL);
 	
-	if (detSdlInit)
+	if (!CDetourRegistry::Install(&sdlSpec, 1))
 	{
-		detSdlInit->EnableDetour();
-	}
-	else
-	{
-		printf("Failed to create detour for CSDLMgr::Init!\n");
 		dlclose(g_Launcher);
 		g_Launcher = NULL;
 		return false;
@@ -970,14 +925,6 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 		if (dladdr(factory, &info) && info.dli_fbase && info.dli_fname)
 		{
 			loadModule = SymbolAddr<void *>(info.dli_fbase, fsstdio_syms, 0);
-			if (loadModule != info.dli_fbase)
-			{
-				detFsLoadModule = DETOUR_CREATE_STATIC(Sys_FsLoadModule, loadModule);
-				if (detFsLoadModule)
-				{
-					detFsLoadModule->EnableDetour();
-				}
-			}
 
 #if defined(ENGINE_GMOD)
 			void *depotSetup, *depotMount;
@@ -986,37 +933,28 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 			g_LoadDepots = SymbolAddr<DepotLoad>(info.dli_fbase, fsstdio_syms, 3);
 			depotMount = SymbolAddr<void *>(info.dli_fbase, fsstdio_syms, 4);
 			g_FillDepotList = SymbolAddr<FillDepotList>(info.dli_fbase, fsstdio_syms, 5);
+#endif
 
-			detDepotSetup = DETOUR_CREATE_MEMBER(GameDepotSys_Setup, depotSetup);
-
-			if (detDepotSetup)
-			{
-				detDepotSetup->EnableDetour();
-			}
-			else
+			DetourSpec detours[] =
 			{
-				printf("Failed to create detour for GameDepot::System::Setup!\n");
-				dlclose(fs);
-				return false;
-			}
-
-			detDepotMount = DETOUR_CREATE_MEMBER(GameDepotSys_Mount, depotMount);
+				/* A symbol that wasn't found resolves to the image base */
+				DETOUR_SPEC_STATIC(Sys_FsLoadModule, "Sys_LoadModule in filesystem_stdio",
+				                   loadModule != info.dli_fbase ? loadModule : NULL, false, NULL),
+#if defined(ENGINE_GMOD)
+				DETOUR_SPEC_MEMBER(GameDepotSys_Setup, "GameDepot::System::Setup", depotSetup, true, NULL),
+				DETOUR_SPEC_MEMBER(GameDepotSys_Mount, "GameDepot::System::Mount", depotMount, true, NULL),
+#endif
+			};
 
-			if (detDepotMount)
+			if (!CDetourRegistry::Install(detours, sizeof(detours) / sizeof(detours[0])))
 			{
-				detDepotMount->EnableDetour();
-			}
-			else
-			{
-				printf("Failed to create detour for GameDepot::System::Mount!\n");
+				printf("Failed to enable detours for filesystem_stdio.dylib\n");
 				dlclose(fs);
 				return false;
 			}
-#endif
 		}
 	}
-
-	if (!detFsLoadModule)
+	else
 	{
 		printf("Warning: Unable to detour Sys_LoadModule in filesystem_stdio\n");
 	}
@@ -1043,10 +981,17 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 	else
 	{
 		// Prevent a crash on exit
-		SetMemPatchable(badLib, 36);
-		strcpy(badLib, "libvstdlib.dylib");
-		strcpy(badLib + sizeof(lib), "VEngineCvar007");
-		SetMemExec(badLib, 36);	// These strings are actually in executable memory
+		const char goodLib[] = "libvstdlib.dylib";
+		const char goodIface[] = "VEngineCvar007";
+
+		// These strings are actually in executable memory
+		CPatchTransaction txn;
+		txn.AddPatch(badLib, goodLib, sizeof(goodLib));
+		txn.AddPatch(badLib + sizeof(lib), goodIface, sizeof(goodIface));
+		if (!txn.Commit())
+		{
+			printf("Warning: Unable to replace bad library, bin/vscript.dylib. Server may crash on exit\n");
+		}
 	}
 #endif
 
@@ -1061,36 +1006,26 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 
 #if !defined(ENGINE_INS) && !defined(ENGINE_DOI)
 	/* Engine should already be loaded at this point by the original function */
-	engine = dlopen("engine.dylib", RTLD_NOLOAD);
-	if (!engine)
-	{
-		printf("Failed to get existing handle for engine.dylib (%s)\n", dlerror());
-		return false;
-	}
-
-	engineFactory = dlsym(engine, "CreateInterface");
-	if (!engineFactory)
+	if (!engine.Find("engine"))
 	{
-		printf("Failed to find CreateInterface (%s)\n", dlerror());
-		dlclose(engine);
+		printf("Failed to get existing handle for engine.dylib\n");
 		return false;
 	}
 
-	if (!dladdr(engineFactory, &info) || !info.dli_fbase || !info.dli_fname)
+	if (!engine.GetBase())
 	{
 		printf("Failed to get base address of engine.dylib\n");
-		dlclose(engine);
 		return false;
 	}
 
-	engineCocoa = SymbolAddr<void **>(info.dli_fbase, engine_syms, 0);
+	engineCocoa = SymbolAddr<void **>((void *)engine.GetBase(), engine_syms, 0);
 
 	/* Prevent crash in engine function which expects this interface */
 	*engineCocoa = pCocoaMgr;
 
 #if defined(ENGINE_PORTAL2)
 	/* Horrible fix for crash on exit */
-	unsigned char *quit = SymbolAddr<unsigned char *>(info.dli_fbase, engine_syms, 1);
+	unsigned char *quit = SymbolAddr<unsigned char *>((void *)engine.GetBase(), engine_syms, 1);
 	SetMemPatchable(quit, 32);
 	quit += 12;
 	quit[0] = 0xEB;
@@ -1111,8 +1046,6 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 	};
 	AppSysGroup_AddSystems(appsys, sys_after);
 #endif
-
-	dlclose(engine);
 #endif // !defined(ENGINE_INS) && !defined(ENGINE_DOI)
 	
 	if (!BlockSteamService())
@@ -1134,21 +1067,28 @@ DETOUR_DECL_MEMBER1(CSys_LoadModules, int, void *, appsys)
 
 #endif
 
+#if !defined(ENGINE_CSGO)
+static void *ResolveDebugString(void *param)
+{
+	GameLib tier0;
+	if (!tier0.Find("tier0"))
+	{
+		return NULL;
+	}
+
+	return tier0.ResolveSymbol<void *>("Plat_DebugString");
+}
+#endif
+
 bool DoDedicatedHacks(void *entryPoint)
 {
 #if defined(ENGINE_CSGO)
-	/* Detour CSys::LoadModules() */
-	detSysLoadModules = DETOUR_CREATE_MEMBER(CSys_LoadModules, dedicated_syms_[0].address);
-	if (!detSysLoadModules)
+	DetourSpec detours[] =
 	{
-		printf("Failed to create detour for CSys::LoadModules\n");
-		return false;
-	}
-	detSysLoadModules->EnableDetour();
-	return true;
+		DETOUR_SPEC_MEMBER(CSys_LoadModules, "CSys::LoadModules", dedicated_syms_[0].address, true, NULL),
+	};
 #else
 
-	void *tier0, *dbgString;
 	Dl_info info;
 	void *sysLoad, *loadModule;
 #if !defined(ENGINE_OBV) && !defined(ENGINE_OBV_SDL) && !defined(ENGINE_GMOD)
@@ -1184,130 +1124,51 @@ bool DoDedicatedHacks(void *entryPoint)
 	strncpy(exeName, *_NSGetArgv()[0], 256);
 #endif
 
-	/* Detour CSys::LoadModules() */
-	detSysLoadModules = DETOUR_CREATE_MEMBER(CSys_LoadModules, sysLoad);
-	if (!detSysLoadModules)
+	DetourSpec detours[] =
 	{
-		printf("Failed to create detour for CSys::LoadModules\n");
-		return false;
-	}
-
 #if defined(ENGINE_GMOD) || defined(ENGINE_L4D2) || defined(ENGINE_ND) || defined(ENGINE_OBV_SDL)
-	detLoadModule = DETOUR_CREATE_STATIC(Sys_FsLoadModule, loadModule);
+		DETOUR_SPEC_STATIC(Sys_FsLoadModule, "Sys_LoadModule", loadModule, true, NULL),
 #else
-	detLoadModule = DETOUR_CREATE_STATIC(Sys_LoadModule, loadModule);
+		DETOUR_SPEC_STATIC(Sys_LoadModule, "Sys_LoadModule", loadModule, true, NULL),
+#endif
+		DETOUR_SPEC_MEMBER(CSys_LoadModules, "CSys::LoadModules", sysLoad, true, NULL),
+		/* Failing to find Plat_DebugString is non-fatal */
+		DETOUR_SPEC_STATIC_LAZY(Plat_DebugString, "Plat_DebugString", ResolveDebugString, NULL, false, NULL),
+	};
 #endif
-	if (!detLoadModule)
-	{
-		printf("Failed to create detour for Sys_LoadModule\n");
-		return false;
-	}
-
-	detLoadModule->EnableDetour();
-
-	detSysLoadModules->EnableDetour();
 
-	/* Failing to find Plat_DebugString is non-fatal */
-	tier0 = dlopen("libtier0.dylib", RTLD_NOLOAD);
-	if (tier0)
+	if (!CDetourRegistry::Install(detours, sizeof(detours) / sizeof(detours[0])))
 	{
-		dbgString = dlsym(tier0, "Plat_DebugString");
-		detDebugString = DETOUR_CREATE_STATIC(Plat_DebugString, dbgString);
-
-		if (detDebugString)
-		{
-			detDebugString->EnableDetour();
-		}
-
-		dlclose(tier0);
+		printf("Failed to enable detours for dedicated.dylib\n");
+		return false;
 	}
 
 	return true;
-
-#endif
 }
 
 void RemoveDedicatedDetours()
 {
-	if (detDebugString)
-	{
-		detDebugString->Destroy();
-	}
-
-	if (detSysLoadModules)
-	{
-		detSysLoadModules->Destroy();
-	}
-	
-#if defined(ENGINE_INS) || defined(ENGINE_DOI)
-	if (detSdlInit)
-	{
-		detSdlInit->Destroy();
-	}
-#endif
-
-#if defined(ENGINE_OBV) || defined(ENGINE_OBV_SDL) || defined(ENGINE_GMOD)
-	if (detFsLoadModule)
-	{
-		detFsLoadModule->Destroy();
-	}
-#endif
-
-	if (detSteamLoadModule)
-	{
-		detSteamLoadModule->Destroy();
-	}
-
-	if (detLoadModule)
-	{
-		detLoadModule->Destroy();
-	}
-
-#if defined(ENGINE_GMOD)
-	if (detDepotSetup)
-	{
-		detDepotSetup->Destroy();
-	}
-
-	if (detDepotMount)
-	{
-		detDepotMount->Destroy();
-	}
-#endif
+	CDetourRegistry::RemoveAll();
 }
 
 #if defined(ENGINE_L4D)
 bool BuildCmdLine(int argc, char **argv)
 {
-	Dl_info info;
-	void *tier0 = NULL;
-	void *msg = NULL;
+	GameLib tier0;
 
-	tier0 = dlopen("libtier0.dylib", RTLD_NOLOAD);
-	if (!tier0)
+	if (!tier0.Find("tier0"))
 	{
-		printf("Failed to get existing handle for libtier0.dylib (%s)\n", dlerror());
+		printf("Failed to get existing handle for libtier0.dylib\n");
 		return false;
 	}
 
-	msg = dlsym(tier0, "Msg");
-	if (!msg)
-	{
-		printf("Failed to find Msg (%s)\n", dlerror());
-		dlclose(tier0);
-		return false;
-	}
-
-	if (!dladdr(msg, &info) || !info.dli_fbase || !info.dli_fname)
+	if (!tier0.GetBase())
 	{
 		printf("Failed to get base address of libtier0.dylib\n");
-		dlclose(tier0);
 		return false;
 	}
 
-	dlclose(tier0);
-
-	char *cmdline = SymbolAddr<char *>(info.dli_fbase, tier0_syms, 0);
+	char *cmdline = SymbolAddr<char *>((void *)tier0.GetBase(), tier0_syms, 0);
 	const int maxCmdLine = 512;
 	int len = 0;
 
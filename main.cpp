@@ -31,6 +31,9 @@
 
 #include "platform.h"
 #include "hacks.h"
+#include "LibrarySearch.h"
+#include "ModuleRegistry.h"
+#include "Profiling.h"
 #include "mm_util.h"
 #include "cocoa_helpers.h"
 
@@ -81,13 +84,17 @@ void crash_handler(int sig, siginfo_t *info, void *context)
 int main(int argc, char **argv)
 {
 	bool shouldHandleCrash = false;
+	const char *profileSpecs = NULL;
 
 	for (int i = 0; i < argc; i++)
 	{
 		if (strcmp(argv[i], "-nobreakpad") == 0)
 		{
 			shouldHandleCrash = true;
-			break;
+		}
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+		{
+			profileSpecs = argv[++i];
 		}
 	}
 
@@ -137,6 +144,9 @@ int main(int argc, char **argv)
 		printf("Failed to set library path!\n");
 		return -1;
 	}
+
+	/* List the search path once so that libraries can be opened by their full path */
+	LibrarySearch::SetPath(libPath);
 	
 #if defined(PLATFORM_X64)
 	/* Initialize symbol offsets for various libraries that we will be using */
@@ -167,6 +177,12 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	/* Profiling is optional, so a bad spec file is only reported */
+	if (profileSpecs)
+	{
+		InitProfiling(profileSpecs);
+	}
+
 	/*
 	 * Prevent problem where files can't be found when executable path contains spaces.
 	 * We need to put quotation marks around it if necessary.
@@ -201,8 +217,15 @@ int main(int argc, char **argv)
 
 	int result = DedicatedMain(argc, argv);
 
+	LibrarySearch::PrintStats();
+
+	ShutdownProfiling();
+
 	RemoveDedicatedDetours();
 
+	/* Drop the registry's handles so that the libraries can unload with dedicated.dylib */
+	ModuleRegistry::ReleaseUnused();
+
 	/* Unload launcher.dylib */
 	if (g_Launcher)
 	{
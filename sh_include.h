@@ -41,6 +41,11 @@
 #define SH_SYS	SH_SYS_APPLE
 #define SH_XP	SH_XP_POSIX
 #define SH_COMP	SH_COMP_GCC
+#elif defined(__linux__)
+// Only for tools and benchmarks, the wrapper itself is Mac only
+#define SH_SYS	SH_SYS_LINUX
+#define SH_XP	SH_XP_POSIX
+#define SH_COMP	SH_COMP_GCC
 #else
 #error Unsupported platform
 #endif
@@ -85,8 +90,7 @@ inline void IA32_Mov_ESP_Disp8_Reg(JitWriter *jit, jit_int8_t disp8, jit_uint8_t
 
 inline void IA32_Write_Jump32_Abs(JitWriter *jit, jitoffs_t jmp, void *target)
 {
-	jit_int32_t disp = jit_int32_t(intptr_t(target) - (intptr_t(jit->GetData()) + jmp + 4));
-	jit->rewrite(jmp, disp);
+	jit->rewrite_rel32(jmp, target);
 }
 
 inline void IA32_Write_Jump32(JitWriter *jit, jitoffs_t jmp, jitoffs_t target)
@@ -102,6 +106,25 @@ inline void IA32_Send_Jump32_Here(JitWriter *jit, jitoffs_t jmp)
 }
 
 /* 64-bit registers */
+#ifdef __linux__
+// glibc's <sys/ucontext.h> (pulled in by <signal.h>) uses these names for its gregs indices
+#undef REG_RAX
+#undef REG_RCX
+#undef REG_RDX
+#undef REG_RBX
+#undef REG_RSP
+#undef REG_RBP
+#undef REG_RSI
+#undef REG_RDI
+#undef REG_R8
+#undef REG_R9
+#undef REG_R10
+#undef REG_R11
+#undef REG_R12
+#undef REG_R13
+#undef REG_R14
+#undef REG_R15
+#endif
 #define REG_RAX REG_EAX
 #define REG_RCX REG_ECX
 #define REG_RDX REG_EDX
@@ -139,28 +162,44 @@ inline void X64_Push_Imm64(JitWriter *jit, jit_int64_t val)
 		IA32_Mov_ESP_Disp8_Imm32(jit, 4, (val >> 32));
 }
 
-// Jump to absolute 64-bit address using multiple instructions.
-//
-// Jumping to address 0xF00DF00DF00DF00D:
-// push 0xF00DF00D
-// mov [rsp+4], 0xF00DF00D
-// ret
-inline void X64_Jump_Abs(JitWriter *jit, void *dest)
-{
-	X64_Push_Imm64(jit, jit_int64_t(dest));
-	IA32_Return(jit);
-}
-
 inline jitoffs_t X64_Mov_Reg_Imm64(JitWriter *jit, jit_uint8_t dest, jit_int64_t num)
 {
 	jitoffs_t offs;
 	X64_Emit_Rex(jit, true, 0, 0, dest);
-	jit->write_ubyte(IA32_MOV_REG_IMM+dest);
+	jit->write_ubyte(IA32_MOV_REG_IMM+(dest & 7));
 	offs = jit->get_outputpos();
 	jit->write_int64(num);
 	return offs;
 }
 
+// Jump to absolute 64-bit address stored right after the jump.
+// Unlike push/ret, this doesn't throw off return prediction for the rest of the call stack.
+//
+// Jumping to address 0xF00DF00DF00DF00D:
+// jmp [rip+0]
+// dq 0xF00DF00DF00DF00D
+inline void X64_Jump_Abs(JitWriter *jit, void *dest)
+{
+	jit->write_ubyte(IA32_JMP_RM);
+	jit->write_ubyte(ia32_modrm(MOD_MEM_REG, 4, REG_EBP));
+	jit->write_int32(0);
+	jit->write_uint64(jit_uint64_t(dest));
+}
+
+// Jump to absolute 64-bit address through r11, which is one byte shorter and doesn't load
+// from the code page. Only for function entry, where r11 is scratch in every x64 calling convention.
+//
+// Jumping to address 0xF00DF00DF00DF00D:
+// mov r11, 0xF00DF00DF00DF00D
+// jmp r11
+inline void X64_Jump_Abs_R11(JitWriter *jit, void *dest)
+{
+	X64_Mov_Reg_Imm64(jit, REG_R11, jit_int64_t(dest));
+	X64_Emit_Rex(jit, false, 0, 0, REG_R11);
+	jit->write_ubyte(IA32_JMP_RM);
+	jit->write_ubyte(ia32_modrm(MOD_REG, 4, REG_R11 & 7));
+}
+
 inline jitoffs_t IA32_Mov_Reg_Imm32(JitWriter *jit, jit_uint8_t dest, jit_int32_t num)
 {
 	jitoffs_t offs;
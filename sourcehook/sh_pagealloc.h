@@ -3,12 +3,19 @@
 
 #include "sh_list.h"
 #include "sh_memory.h"
+#include "am-vector.h"
 
 # if SH_XP == SH_XP_WINAPI
 #		include <windows.h>
 # elif SH_XP == SH_XP_POSIX
 #		include <sys/mman.h>
+#		include <fcntl.h>
+#		include <stdio.h>
 #		include <unistd.h>
+#		include <pthread.h>
+#		if !defined MAP_ANONYMOUS
+#			define MAP_ANONYMOUS MAP_ANON
+#		endif
 # else
 #		error Unsupported OS/Compiler
 # endif
@@ -30,113 +37,87 @@ namespace SourceHook
 	IMPORTANT: the memory that Alloc() returns is not a in a defined state!
 	It could be in read+exec OR read+write mode.
 	-> call SetRE() or SetRW() before using allocated memory!
+
+	On POSIX, regions are backed by a shared memory object that is mapped twice: once read+exec at
+	the address Alloc() returns, and once read+write elsewhere. Code is written through the address
+	GetWritable() returns and run from the other one, so neither view ever changes protection and
+	SetRE()/SetRW() do nothing. If the object can't be created or mapped executable, the region is
+	a single anonymous mapping whose protection is switched as before, and GetWritable() returns the
+	address it is given.
+
+	Small blocks are carved out of slabs, regions of SlabSize bytes split into blocks of a single
+	power of two size and tracked with a bitmap. Larger and isolated allocations get a region of their
+	own. Regions are kept sorted by address so finding the one that owns a pointer is a binary search.
+
+	Every public method takes a lock, since code can be generated on more than one thread at once,
+	e.g. the profiler's monitor thread adding probes while the main thread installs detours.
 	*/
 	class CPageAlloc
 	{
-		struct AllocationUnit
-		{
-			size_t begin_offset;
-			size_t size;
-
-			AllocationUnit(size_t p_offs, size_t p_size) : begin_offset(p_offs), size(p_size)
-			{
-			}
+		// Slabs hold blocks of MinBlockSize << sizeClass bytes, up to MaxBlockSize
+		static const size_t SlabSize = 0x10000;
+		static const size_t MinBlockSize = 16;
+		static const size_t MaxBlockSize = SlabSize / 8;
+		static const int ClassCount = 10;
 
-			bool operator < (const AllocationUnit &other) const
-			{
-				return begin_offset < other.begin_offset;
-			}
-		};
-
-		typedef List<AllocationUnit> AUList;
-		struct AllocatedRegion
+		struct Region
 		{
 			void *startPtr;
+			void *writePtr;					// read+write view of the region, startPtr unless dual mapped
 			size_t size;
-			bool isolated;					// may contain only one AU
-			size_t minAlignment;
-			AUList allocUnits;
 			bool isRE;						// true: RE, otherwise: RW
-
-			void CheckGap(size_t gap_begin, size_t gap_end, size_t reqsize,
-				size_t &smallestgap_pos, size_t &smallestgap_size, size_t &outAlignBytes)
+			bool dualMapped;
+
+			// Slabs only, other regions hold a single allocation
+			int sizeClass;					// -1 if not a slab
+			size_t blockShift;
+			size_t blockCount;
+			size_t freeCount;
+			size_t hint;					// bitmap word to look at first
+			uint64_t *bitmap;				// set bits are blocks in use
+			Region *prev;					// slabs of the same class with free blocks
+			Region *next;
+
+			void *AllocBlock()
 			{
-				size_t gapsize = gap_end - gap_begin;
-				// How many bytes do we actually need here?
-				//   = requested size + alignment bytes
-				size_t neededSize = reqsize;
-				size_t alignBytes = minAlignment - ((reinterpret_cast<intptr_t>(startPtr) + gap_begin) % minAlignment);
-
-				alignBytes %= minAlignment;
-				neededSize += alignBytes;
+				size_t words = (blockCount + 63) / 64;
 
-				if (gapsize >= neededSize)
+				for (size_t n = 0; n < words; n++)
 				{
-					if (gapsize < smallestgap_size)
-					{
-						smallestgap_size = gapsize;
-						smallestgap_pos = gap_begin;
-						outAlignBytes = alignBytes;
-					}
-				}
-			}
+					size_t word = (hint + n) % words;
+					uint64_t freeBits = ~bitmap[word];
 
-			bool TryAlloc(size_t reqsize, void * &outAddr)
-			{
-				// Check for isolated
-				if (isolated && !allocUnits.empty())
-					return false;
+					if (blockCount - word * 64 < 64)
+						freeBits &= (uint64_t(1) << (blockCount - word * 64)) - 1;
 
-				// Find the smallest gap where req fits
-				size_t lastend = 0;
-				size_t smallestgap_pos = size + 1;
-				size_t smallestgap_size = size + 1;
-				size_t alignmentbytes = 0;
+					if (freeBits)
+					{
+						size_t bit = LowestBit(freeBits);
+						bitmap[word] |= uint64_t(1) << bit;
+						freeCount--;
+						hint = word;
 
-				for (AUList::iterator iter = allocUnits.begin(); iter != allocUnits.end(); ++iter)
-				{
-					CheckGap(lastend, iter->begin_offset, reqsize, smallestgap_pos, smallestgap_size, alignmentbytes);
-					lastend = iter->begin_offset + iter->size;
+						return reinterpret_cast<char*>(startPtr) + ((word * 64 + bit) << blockShift);
+					}
 				}
 
-				CheckGap(lastend, size, reqsize, smallestgap_pos, smallestgap_size, alignmentbytes);
-
-				if (smallestgap_pos < size)
-				{
-					outAddr = reinterpret_cast<void*>(reinterpret_cast<char*>(startPtr) + smallestgap_pos + alignmentbytes);
-					allocUnits.push_sorted( AllocationUnit(smallestgap_pos, reqsize + alignmentbytes) );
-					return true;
-				}
-				else
-				{
-					return false;
-				}
+				return NULL;
 			}
 
-			bool TryFree(void *addr)
+			bool FreeBlock(void *addr)
 			{
-				if (addr < startPtr || addr >= reinterpret_cast<void*>(reinterpret_cast<char*>(startPtr) + size))
-					return false;
-
-				intptr_t start = reinterpret_cast<intptr_t>(startPtr);
+				size_t offset = reinterpret_cast<char*>(addr) - reinterpret_cast<char*>(startPtr);
+				size_t block = offset >> blockShift;
+				uint64_t mask = uint64_t(1) << (block % 64);
 
-				for (AUList::iterator iter = allocUnits.begin(); iter != allocUnits.end(); ++iter)
-				{
-					size_t AUBegin = start + iter->begin_offset;
-					void *alignedAUBegin = reinterpret_cast<void*>(
-						AUBegin + ((minAlignment - AUBegin % minAlignment) % minAlignment)
-						);
+				if ((offset & ((size_t(1) << blockShift) - 1)) || !(bitmap[block / 64] & mask))
+					return false;
 
-					if (addr == alignedAUBegin)
-					{
-						DebugCleanMemory(reinterpret_cast<unsigned char*>(startPtr) + iter->begin_offset,
-							iter->size);
-						allocUnits.erase(iter);
-						return true;
-					}
-				}
+				DebugCleanMemory(reinterpret_cast<unsigned char*>(addr), size_t(1) << blockShift);
+				bitmap[block / 64] &= ~mask;
+				freeCount++;
 
-				return false;
+				return true;
 			}
 
 			void DebugCleanMemory(unsigned char* start, size_t size)
@@ -147,6 +128,7 @@ namespace SourceHook
 					SetRW();
 				}
 
+				start = reinterpret_cast<unsigned char*>(GetWritable(start));
 				unsigned char* end = start + size;
 				for (unsigned char* p = start; p != end; ++p)
 				{
@@ -164,9 +146,21 @@ namespace SourceHook
 				return addr >= startPtr && addr < reinterpret_cast<void*>(reinterpret_cast<char*>(startPtr) + size);
 			}
 
+			bool IsNear(const void *addr)
+			{
+				return CPageAlloc::IsNear(startPtr, size, addr);
+			}
+
+			void *GetWritable(void *addr)
+			{
+				return reinterpret_cast<char*>(writePtr) + (reinterpret_cast<char*>(addr) - reinterpret_cast<char*>(startPtr));
+			}
+
 			void FreeRegion()
 			{
 #if SH_XP == SH_XP_POSIX
+				if (dualMapped)
+					munmap(writePtr, size);
 				munmap(startPtr, size);
 #elif SH_XP == SH_XP_WINAPI
 				VirtualFree(startPtr, 0, MEM_RELEASE);
@@ -175,148 +169,474 @@ namespace SourceHook
 
 			void SetRE()
 			{
-				SetMemAccess(startPtr, size, SH_MEM_READ | SH_MEM_EXEC);
+				if (!dualMapped)
+					SetMemAccess(startPtr, size, SH_MEM_READ | SH_MEM_EXEC);
 				isRE = true;
 			}
 
 			void SetRW()
 			{
-				SetMemAccess(startPtr, size, SH_MEM_READ | SH_MEM_WRITE);
+				if (!dualMapped)
+					SetMemAccess(startPtr, size, SH_MEM_READ | SH_MEM_WRITE);
 				isRE = false;
 			}
 		};
 
-		typedef List<AllocatedRegion> ARList;
-
 		size_t m_MinAlignment;
 		size_t m_PageSize;
-		ARList m_Regions;
+		bool m_DualMap;
+
+		// Every region, sorted by startPtr
+		ke::Vector<Region*> m_Regions;
+
+		// Region records and slab bitmaps, kept together and freed all at once with the allocator
+		ke::NodePool m_Nodes;
+
+		// Slabs with free blocks by class, and how many of those are entirely free
+		Region *m_Partial[ClassCount];
+		size_t m_EmptySlabs[ClassCount];
+
+#if SH_XP == SH_XP_POSIX
+		pthread_mutex_t m_Lock;
+#elif SH_XP == SH_XP_WINAPI
+		CRITICAL_SECTION m_Lock;
+#endif
 
-		bool AddRegion(size_t minSize, bool isolated)
+		// Holds m_Lock for as long as it is in scope
+		class AutoLock
 		{
-			AllocatedRegion newRegion;
-			newRegion.startPtr = 0;
-			newRegion.isolated = isolated;
-			newRegion.minAlignment = m_MinAlignment;
+			CPageAlloc *m_Alloc;
+		public:
+			AutoLock(CPageAlloc *alloc) : m_Alloc(alloc)
+			{
+#if SH_XP == SH_XP_POSIX
+				pthread_mutex_lock(&m_Alloc->m_Lock);
+#elif SH_XP == SH_XP_WINAPI
+				EnterCriticalSection(&m_Alloc->m_Lock);
+#endif
+			}
 
-			// Compute real size -> align up to m_PageSize boundary
+			~AutoLock()
+			{
+#if SH_XP == SH_XP_POSIX
+				pthread_mutex_unlock(&m_Alloc->m_Lock);
+#elif SH_XP == SH_XP_WINAPI
+				LeaveCriticalSection(&m_Alloc->m_Lock);
+#endif
+			}
+		};
 
-			newRegion.size = minSize - (minSize % m_PageSize);
-			if (newRegion.size < minSize)
-				newRegion.size += m_PageSize;
+		// How far near memory may be from the address it is near to, leaving some room for the
+		// code around that address to still reach it with a 32-bit displacement
+		static const size_t NearRange = 0x7FF00000;
+
+		// Distance between the hints tried when mapping near memory
+		static const size_t NearStep = 0x100000;
+
+		static size_t LowestBit(uint64_t value)
+		{
+#if SH_COMP == SH_COMP_GCC
+			return __builtin_ctzll(value);
+#else
+			size_t bit = 0;
+			while (!(value & 1))
+			{
+				value >>= 1;
+				bit++;
+			}
+			return bit;
+#endif
+		}
+
+		static bool IsNear(const void *start, size_t size, const void *addr)
+		{
+			intptr_t begin = reinterpret_cast<intptr_t>(start) - reinterpret_cast<intptr_t>(addr);
+			intptr_t end = begin + static_cast<intptr_t>(size);
+
+			return begin > -static_cast<intptr_t>(NearRange) && end < static_cast<intptr_t>(NearRange);
+		}
 
 #if SH_XP == SH_XP_POSIX
-# if !defined MAP_ANONYMOUS
-#  define MAP_ANONYMOUS MAP_ANON
+		// Creates an unnamed shared memory object of the given size, or returns -1
+		static int CreateBacking(size_t size)
+		{
+			int fd;
+# if defined __linux__ && defined MFD_CLOEXEC
+			fd = memfd_create("sh_pagealloc", MFD_CLOEXEC);
+# else
+			static unsigned int counter = 0;
+			char name[32];
+
+			// The name is only needed until the object is open
+			snprintf(name, sizeof(name), "/sh_pagealloc.%d.%u", static_cast<int>(getpid()), counter++);
+			fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd != -1)
+				shm_unlink(name);
 # endif
-			newRegion.startPtr = mmap(0, newRegion.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (fd == -1)
+				return -1;
+
+			if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+			{
+				close(fd);
+				return -1;
+			}
+
+			return fd;
+		}
+
+		// Maps the region read+exec from the backing object if there is one, otherwise anonymous read+write
+		static void *MapView(void *hint, size_t size, int fd)
+		{
+			void *ptr;
+			if (fd != -1)
+				ptr = mmap(hint, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+			else
+				ptr = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+			return ptr == MAP_FAILED ? NULL : ptr;
+		}
+#endif
+
+		void *TryMapAt(uintptr_t hint, size_t size, const void *nearTo, int fd)
+		{
+			void *ptr;
+#if SH_XP == SH_XP_POSIX
+			// Without MAP_FIXED the hint is only used if it is free, so nothing gets replaced
+			ptr = MapView(reinterpret_cast<void*>(hint), size, fd);
+			if (!ptr)
+				return NULL;
+
+			if (!IsNear(ptr, size, nearTo))
+			{
+				munmap(ptr, size);
+				return NULL;
+			}
 #elif SH_XP == SH_XP_WINAPI
-			newRegion.startPtr = VirtualAlloc(NULL, newRegion.size, MEM_COMMIT, PAGE_READWRITE);
+			// Fails instead of picking another address if the hint is taken
+			ptr = VirtualAlloc(reinterpret_cast<void*>(hint), size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
 #endif
+			return ptr;
+		}
+
+		// Probes for free address space below and above nearTo, closest first
+		void *MapNear(size_t size, const void *nearTo, int fd)
+		{
+			uintptr_t base = reinterpret_cast<uintptr_t>(nearTo) & ~(NearStep - 1);
 
-			if (newRegion.startPtr)
+			for (uintptr_t dist = NearStep; dist + size < NearRange; dist += NearStep)
 			{
-				newRegion.SetRW();
-				m_Regions.push_back(newRegion);
-				return true;
+				void *ptr;
+
+				if (base > dist && (ptr = TryMapAt(base - dist, size, nearTo, fd)) != NULL)
+					return ptr;
+
+				if (base + dist > base && (ptr = TryMapAt(base + dist, size, nearTo, fd)) != NULL)
+					return ptr;
 			}
-			else
+
+			return NULL;
+		}
+
+		// Index of the first region starting above addr
+		size_t UpperBound(const void *addr)
+		{
+			size_t low = 0, high = m_Regions.length();
+
+			while (low < high)
 			{
-				return false;
+				size_t mid = (low + high) / 2;
+				if (m_Regions[mid]->startPtr <= addr)
+					low = mid + 1;
+				else
+					high = mid;
 			}
 
+			return low;
 		}
 
-		void *AllocPriv(size_t size, bool isolated)
+		Region *FindRegion(void *addr)
 		{
-			void *addr;
+			size_t pos = UpperBound(addr);
+			if (pos == 0 || !m_Regions[pos - 1]->Contains(addr))
+				return NULL;
+
+			return m_Regions[pos - 1];
+		}
 
-			if (!isolated)
+		Region *AddRegion(size_t minSize, int sizeClass, const void *nearTo)
+		{
+			Region newRegion;
+			memset(&newRegion, 0, sizeof(newRegion));
+			newRegion.sizeClass = sizeClass;
+
+			// Compute real size -> align up to m_PageSize boundary
+
+			newRegion.size = minSize - (minSize % m_PageSize);
+			if (newRegion.size < minSize)
+				newRegion.size += m_PageSize;
+
+			if (sizeClass >= 0)
+			{
+				newRegion.blockShift = 4 + sizeClass;
+				newRegion.blockCount = newRegion.size >> newRegion.blockShift;
+				newRegion.freeCount = newRegion.blockCount;
+				size_t bitmapSize = (newRegion.blockCount + 63) / 64 * sizeof(uint64_t);
+				newRegion.bitmap = reinterpret_cast<uint64_t*>(m_Nodes.allocate(bitmapSize));
+				if (!newRegion.bitmap)
+					return NULL;
+				memset(newRegion.bitmap, 0, bitmapSize);
+			}
+
+			if (!m_Regions.ensure(m_Regions.length() + 1))
+			{
+				m_Nodes.release(newRegion.bitmap);
+				return NULL;
+			}
+
+#if SH_XP == SH_XP_POSIX
+			int fd = m_DualMap ? CreateBacking(newRegion.size) : -1;
+			if (fd != -1)
 			{
-				for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
+				newRegion.startPtr = nearTo ? MapNear(newRegion.size, nearTo, fd) : MapView(NULL, newRegion.size, fd);
+				if (newRegion.startPtr)
 				{
-					if (iter->TryAlloc(size, addr))
-						return addr;
+					newRegion.writePtr = mmap(NULL, newRegion.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+					if (newRegion.writePtr == MAP_FAILED)
+					{
+						munmap(newRegion.startPtr, newRegion.size);
+						newRegion.startPtr = NULL;
+					}
 				}
+				close(fd);
+
+				// Executable shared mappings may be refused, so don't try again
+				if (newRegion.startPtr)
+					newRegion.dualMapped = true;
+				else if (!nearTo)
+					m_DualMap = false;
 			}
 
-			if (!AddRegion(size, isolated))
+			if (!newRegion.startPtr)
+			{
+				newRegion.startPtr = nearTo ? MapNear(newRegion.size, nearTo, -1) : MapView(NULL, newRegion.size, -1);
+				newRegion.writePtr = newRegion.startPtr;
+			}
+#elif SH_XP == SH_XP_WINAPI
+			if (nearTo)
+				newRegion.startPtr = MapNear(newRegion.size, nearTo, -1);
+			else
+				newRegion.startPtr = VirtualAlloc(NULL, newRegion.size, MEM_COMMIT, PAGE_READWRITE);
+			newRegion.writePtr = newRegion.startPtr;
+#endif
+
+			Region *region = newRegion.startPtr ? reinterpret_cast<Region*>(m_Nodes.allocate(sizeof(Region))) : NULL;
+			if (!region)
+			{
+				if (newRegion.startPtr)
+					newRegion.FreeRegion();
+				m_Nodes.release(newRegion.bitmap);
 				return NULL;
+			}
+
+			*region = newRegion;
+			region->SetRW();
+
+			// Room was made above
+			m_Regions.insert(UpperBound(region->startPtr), region);
 
-			bool tmp = m_Regions.back().TryAlloc(size, addr);
-			SH_ASSERT(tmp, ("TryAlloc fails after AddRegion"));
-			return tmp ? addr : NULL;
+			return region;
+		}
+
+		void RemoveRegion(Region *region)
+		{
+			m_Regions.remove(UpperBound(region->startPtr) - 1);
+
+			region->FreeRegion();
+			m_Nodes.release(region->bitmap);
+			m_Nodes.release(region);
+		}
+
+		void LinkPartial(Region *slab)
+		{
+			slab->prev = NULL;
+			slab->next = m_Partial[slab->sizeClass];
+			if (slab->next)
+				slab->next->prev = slab;
+			m_Partial[slab->sizeClass] = slab;
+		}
+
+		void UnlinkPartial(Region *slab)
+		{
+			if (slab->prev)
+				slab->prev->next = slab->next;
+			else
+				m_Partial[slab->sizeClass] = slab->next;
+			if (slab->next)
+				slab->next->prev = slab->prev;
+			slab->prev = slab->next = NULL;
+		}
+
+		// Smallest class whose blocks fit size, or -1 if it needs a region of its own
+		int GetSizeClass(size_t size)
+		{
+			if (size < m_MinAlignment)
+				size = m_MinAlignment;
+
+			int sizeClass = 0;
+			while ((MinBlockSize << sizeClass) < size)
+				sizeClass++;
+
+			return (MinBlockSize << sizeClass) <= MaxBlockSize ? sizeClass : -1;
+		}
+
+		void *AllocPriv(size_t size, bool isolated, const void *nearTo = NULL)
+		{
+			int sizeClass = isolated ? -1 : GetSizeClass(size);
+
+			if (sizeClass < 0)
+			{
+				Region *region = AddRegion(size ? size : 1, -1, nearTo);
+				return region ? region->startPtr : NULL;
+			}
+
+			Region *slab = m_Partial[sizeClass];
+			while (slab && nearTo && !slab->IsNear(nearTo))
+				slab = slab->next;
+
+			if (!slab)
+			{
+				slab = AddRegion(SlabSize, sizeClass, nearTo);
+				if (!slab)
+					return NULL;
+
+				LinkPartial(slab);
+				m_EmptySlabs[sizeClass]++;
+			}
+
+			if (slab->freeCount == slab->blockCount)
+				m_EmptySlabs[sizeClass]--;
+
+			void *addr = slab->AllocBlock();
+			SH_ASSERT(addr, ("AllocBlock fails on a slab with free blocks"));
+
+			if (!slab->freeCount)
+				UnlinkPartial(slab);
+
+			return addr;
 		}
 
 	public:
-		CPageAlloc(size_t minAlignment = 4 /* power of 2 */ ) : m_MinAlignment(minAlignment)
+		CPageAlloc(size_t minAlignment = 4 /* power of 2 */, bool dualMap = true) : m_MinAlignment(minAlignment),
+			m_DualMap(SH_XP == SH_XP_POSIX && dualMap)
 		{
 #if SH_XP == SH_XP_POSIX
 			m_PageSize = sysconf(_SC_PAGESIZE);
+			pthread_mutex_init(&m_Lock, NULL);
 #elif SH_XP == SH_XP_WINAPI
 			SYSTEM_INFO sysInfo;
 			GetSystemInfo(&sysInfo);
 			m_PageSize = sysInfo.dwPageSize;
+			InitializeCriticalSection(&m_Lock);
 #endif
+			for (int i = 0; i < ClassCount; i++)
+			{
+				m_Partial[i] = NULL;
+				m_EmptySlabs[i] = 0;
+			}
 		}
 
 		~CPageAlloc()
 		{
-			// Free all regions
-			for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
-			{
-				iter->FreeRegion();
-			}
+			// Unmap all regions, their records and bitmaps go with m_Nodes
+			for (size_t i = 0; i < m_Regions.length(); i++)
+				m_Regions[i]->FreeRegion();
+
+#if SH_XP == SH_XP_POSIX
+			pthread_mutex_destroy(&m_Lock);
+#elif SH_XP == SH_XP_WINAPI
+			DeleteCriticalSection(&m_Lock);
+#endif
 		}
 
 		void *Alloc(size_t size)
 		{
+			AutoLock lock(this);
 			return AllocPriv(size, false);
 		}
 
 		void *AllocIsolated(size_t size)
 		{
+			AutoLock lock(this);
 			return AllocPriv(size, true);
 		}
 
+		// Allocates memory that can be reached from nearTo with a 32-bit displacement, and that can reach it.
+		// Returns NULL if there is no free address space close enough.
+		void *AllocNear(size_t size, const void *nearTo)
+		{
+			AutoLock lock(this);
+			return AllocPriv(size, false, nearTo);
+		}
+
 		void Free(void *ptr)
 		{
-			for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
+			AutoLock lock(this);
+			Region *region = FindRegion(ptr);
+			if (!region)
+				return;
+
+			if (region->sizeClass < 0)
 			{
-				if (iter->TryFree(ptr))
+				if (ptr == region->startPtr)
+					RemoveRegion(region);
+				return;
+			}
+
+			bool wasFull = !region->freeCount;
+			if (!region->FreeBlock(ptr))
+				return;
+
+			if (wasFull)
+				LinkPartial(region);
+
+			// Keep one empty slab per class around, so a buffer that keeps growing doesn't map and unmap a slab each time
+			if (region->freeCount == region->blockCount)
+			{
+				if (m_EmptySlabs[region->sizeClass])
 				{
-					if (iter->allocUnits.empty())
-					{
-						iter->FreeRegion();
-						m_Regions.erase(iter);
-					}
-					break;
+					UnlinkPartial(region);
+					RemoveRegion(region);
+				}
+				else
+				{
+					m_EmptySlabs[region->sizeClass]++;
 				}
 			}
 		}
 
 		void SetRE(void *ptr)
 		{
-			for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
-			{
-				if (iter->Contains(ptr))
-				{
-					iter->SetRE();
-					break;
-				}
-			}
+			AutoLock lock(this);
+			Region *region = FindRegion(ptr);
+			if (region)
+				region->SetRE();
 		}
 
 		void SetRW(void *ptr)
 		{
-			for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
-			{
-				if (iter->Contains(ptr))
-				{
-					iter->SetRW();
-					break;
-				}
-			}
+			AutoLock lock(this);
+			Region *region = FindRegion(ptr);
+			if (region)
+				region->SetRW();
+		}
+
+		// Returns where code at ptr can be written, which is ptr itself unless the region is dual mapped
+		void *GetWritable(void *ptr)
+		{
+			AutoLock lock(this);
+			Region *region = FindRegion(ptr);
+			return region ? region->GetWritable(ptr) : ptr;
 		}
 
 		size_t GetPageSize()
@@ -327,4 +647,3 @@ namespace SourceHook
 }
 
 #endif
-
@@ -11,6 +11,8 @@
 /*
  * Original file: http://hg.alliedmods.net/mmsource-central/file/eeea4ed7c45d/core/sourcehook/sourcehook_hookmangen.h
  * Changes: Moved most of GenBuffer::push() to new function GenBuffer::alloc().
+ *          GenBuffer writes through the allocator's writable view of the buffer.
+ *          GenBuffer emits into a heap buffer and copies it to code memory once, when it is placed.
  */
 
 #ifndef __SOURCEHOOK_HOOKMANGEN_H__
@@ -48,12 +50,79 @@ namespace SourceHook
 		{
 			static CPageAlloc ms_Allocator;
 
-			unsigned char *m_pData;
+			// A rel32 field to resolve once the code's address is known
+			struct Fixup
+			{
+				jitoffs_t offset;
+				const void *target;
+			};
+
+			unsigned char *m_pData;			// NULL until the code is placed in code memory
+			unsigned char *m_pWrite;		// heap scratch buffer until then, m_pData's writable view after, see CPageAlloc::GetWritable()
 			jitoffs_t m_Size;
 			jitoffs_t m_AllocatedSize;
+			const void *m_pNear;
+			Fixup *m_pFixups;
+			unsigned int m_FixupCount;
+			unsigned int m_FixupSize;
+
+			unsigned char *AllocCode(jitoffs_t size)
+			{
+				unsigned char *code = NULL;
+				if (m_pNear)
+					code = reinterpret_cast<unsigned char*>(ms_Allocator.AllocNear(size, m_pNear));
+				if (!code)
+					code = reinterpret_cast<unsigned char*>(ms_Allocator.Alloc(size));
+				if (!code)
+				{
+					SH_ASSERT(0, ("bad_alloc: couldn't allocate 0x%08X bytes of memory\n", size));
+					return NULL;
+				}
+				ms_Allocator.SetRW(code);
+				return code;
+			}
+
+			// Moves the code to code memory with room for size bytes, which is only done once unless
+			// more is emitted after it has been placed
+			bool Place(jitoffs_t size)
+			{
+				unsigned char *code = AllocCode(size);
+				if (!code)
+					return false;
+
+				unsigned char *write = reinterpret_cast<unsigned char*>(ms_Allocator.GetWritable(code));
+				memcpy((void*)write, (const void*)m_pWrite, m_Size);
+
+				if (m_pData)
+				{
+					ms_Allocator.Free(reinterpret_cast<void*>(m_pData));
+				}
+				else
+				{
+					free(m_pWrite);
+
+					for (unsigned int i = 0; i < m_FixupCount; i++)
+					{
+						const Fixup &fixup = m_pFixups[i];
+						jit_int32_t disp = jit_int32_t(intptr_t(fixup.target) - intptr_t(code + fixup.offset + 4));
+						memcpy((void*)(write + fixup.offset), (const void*)&disp, sizeof(disp));
+					}
+
+					free(m_pFixups);
+					m_pFixups = NULL;
+					m_FixupCount = 0;
+					m_FixupSize = 0;
+				}
+
+				m_pData = code;
+				m_pWrite = write;
+				m_AllocatedSize = size;
+				return true;
+			}
 
 		public:
-			GenBuffer() : m_pData(NULL), m_Size(0), m_AllocatedSize(0)
+			GenBuffer() : m_pData(NULL), m_pWrite(NULL), m_Size(0), m_AllocatedSize(0), m_pNear(NULL),
+				m_pFixups(NULL), m_FixupCount(0), m_FixupSize(0)
 			{
 			}
 			~GenBuffer()
@@ -64,10 +133,19 @@ namespace SourceHook
 			{
 				return m_Size;
 			}
+			// Places the code in code memory the first time it is called, so call it once
+			// everything has been emitted. Returns NULL if nothing has been.
 			unsigned char *GetData()
 			{
+				if (!m_pData && m_Size && !Place(m_Size))
+					return NULL;
 				return m_pData;
 			}
+			// Address to write emitted code to directly. Addresses inside the code are still based on GetData().
+			unsigned char *GetWritableData()
+			{
+				return GetData() ? m_pWrite : NULL;
+			}
 			
 			jitoffs_t alloc(jitoffs_t size)
 			{
@@ -75,32 +153,46 @@ namespace SourceHook
 				jitoffs_t newSize = m_Size + size;
 				if (newSize > m_AllocatedSize)
 				{
-					m_AllocatedSize = newSize > m_AllocatedSize*2 ? newSize : m_AllocatedSize*2;
-					if (m_AllocatedSize < 64)
-						m_AllocatedSize = 64;
-					
-					unsigned char *newBuf;
-					newBuf = reinterpret_cast<unsigned char*>(ms_Allocator.Alloc(m_AllocatedSize));
-					ms_Allocator.SetRW(newBuf);
-					if (!newBuf)
+					jitoffs_t allocSize = newSize > m_AllocatedSize*2 ? newSize : m_AllocatedSize*2;
+					if (allocSize < 64)
+						allocSize = 64;
+
+					if (m_pData)
 					{
-						SH_ASSERT(0, ("bad_alloc: couldn't allocate 0x%08X bytes of memory\n", m_AllocatedSize));
-						return 0;
+						// Already placed, so the code has to move
+						if (!Place(allocSize))
+							return 0;
 					}
-					memset((void*)newBuf, 0xCC, m_AllocatedSize);			// :TODO: remove this !
-					memcpy((void*)newBuf, (const void*)m_pData, m_Size);
-					if (m_pData)
+					else
 					{
-						ms_Allocator.SetRE(reinterpret_cast<void*>(m_pData));
-						ms_Allocator.SetRW(newBuf);
-						ms_Allocator.Free(reinterpret_cast<void*>(m_pData));
+						unsigned char *scratch = reinterpret_cast<unsigned char*>(realloc(m_pWrite, allocSize));
+						if (!scratch)
+						{
+							SH_ASSERT(0, ("bad_alloc: couldn't allocate 0x%08X bytes of memory\n", allocSize));
+							return 0;
+						}
+						m_pWrite = scratch;
+						m_AllocatedSize = allocSize;
 					}
-					m_pData = newBuf;
 				}
 				m_Size = newSize;
 				return start;
 			}
 
+			// Prefers memory within 32-bit displacement range of addr from now on
+			void SetNear(const void *addr)
+			{
+				m_pNear = addr;
+			}
+
+			// Places the code with room for size more bytes, so that it can be emitted without the buffer moving.
+			// For code that has to know its final address while it is generated.
+			void reserve(jitoffs_t size)
+			{
+				if (!m_pData || m_Size + size > m_AllocatedSize)
+					Place(m_Size + size);
+			}
+
 			template <class PT> void push(PT what)
 			{
 				push((const unsigned char *)&what, sizeof(PT));
@@ -109,7 +201,7 @@ namespace SourceHook
 			void push(const unsigned char *data, jitoffs_t size)
 			{
 				jitoffs_t start = alloc(size);
-				memcpy((void*)(m_pData + start), (const void*)data, size);
+				memcpy((void*)(m_pWrite + start), (const void*)data, size);
 			}
 
 			template <class PT> void rewrite(jitoffs_t offset, PT what)
@@ -121,21 +213,56 @@ namespace SourceHook
 			{
 				SH_ASSERT(offset + size <= m_AllocatedSize, ("rewrite too far"));
 
-				memcpy((void*)(m_pData + offset), (const void*)data, size);
+				memcpy((void*)(m_pWrite + offset), (const void*)data, size);
+			}
+
+			// Points the rel32 field at offset to target, once the code's address is known
+			void rewrite_rel32(jitoffs_t offset, const void *target)
+			{
+				if (m_pData)
+				{
+					rewrite(offset, jit_int32_t(intptr_t(target) - intptr_t(m_pData + offset + 4)));
+					return;
+				}
+
+				if (m_FixupCount == m_FixupSize)
+				{
+					unsigned int size = m_FixupSize ? m_FixupSize * 2 : 8;
+					Fixup *fixups = reinterpret_cast<Fixup*>(realloc(m_pFixups, size * sizeof(Fixup)));
+					if (!fixups)
+					{
+						SH_ASSERT(0, ("bad_alloc: couldn't allocate %u fixups\n", size));
+						return;
+					}
+					m_pFixups = fixups;
+					m_FixupSize = size;
+				}
+
+				m_pFixups[m_FixupCount].offset = offset;
+				m_pFixups[m_FixupCount].target = target;
+				m_FixupCount++;
 			}
 
 			void clear()
 			{
 				if (m_pData)
 					ms_Allocator.Free(reinterpret_cast<void*>(m_pData));
+				else
+					free(m_pWrite);
+				free(m_pFixups);
 				m_pData = NULL;
+				m_pWrite = NULL;
 				m_Size = 0;
 				m_AllocatedSize = 0;
+				m_pFixups = NULL;
+				m_FixupCount = 0;
+				m_FixupSize = 0;
 			}
 
 			void SetRE()
 			{
-				ms_Allocator.SetRE(reinterpret_cast<void*>(m_pData));
+				if (GetData())
+					ms_Allocator.SetRE(reinterpret_cast<void*>(m_pData));
 			}
 
 			operator void *()
@@ -0,0 +1,137 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * imgindex - Builds the disassembly index for one or more libraries ahead of time
+ *
+ * Usage: imgindex [-j threads] [-o cachedir] [-f] <library> [library ...]
+ *
+ * Libraries are given without their extension, the same way the server loads them
+ * (e.g. bin/engine or csgo/bin/server). Indexes that are already up to date are left alone
+ * unless -f is given.
+ */
+
+#include "ImageIndex.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static double GetTime()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void Usage()
+{
+	printf("Usage: imgindex [-j threads] [-o cachedir] [-f] <library> [library ...]\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int threads = 0;
+	const char *cacheDir = ".";
+	bool force = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:o:fh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'o':
+			cacheDir = optarg;
+			break;
+		case 'f':
+			force = true;
+			break;
+		default:
+			Usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		Usage();
+		return 1;
+	}
+
+	int failed = 0;
+
+	for (int i = optind; i < argc; i++)
+	{
+		char path[PATH_MAX];
+		HSGameLib lib(argv[i]);
+		ImageIndex index;
+
+		if (!lib.IsLoaded() || !lib.GetBase())
+		{
+			printf("Failed to load %s\n", argv[i]);
+			failed++;
+			continue;
+		}
+
+		if (!ImageIndex::GetCachePath(lib, cacheDir, path, sizeof(path)))
+		{
+			printf("Cache path for %s is too long\n", argv[i]);
+			failed++;
+			continue;
+		}
+
+		if (!force && index.Load(lib, path))
+		{
+			printf("%s: up to date (%zu instructions, %zu xrefs)\n", path,
+			       index.GetInstructionCount(), index.GetXrefCount());
+			continue;
+		}
+
+		double start = GetTime();
+
+		if (!index.Build(lib, threads))
+		{
+			printf("Failed to disassemble %s\n", lib.GetName().chars());
+			failed++;
+			continue;
+		}
+
+		double elapsed = GetTime() - start;
+
+		if (!index.Save(path))
+		{
+			printf("Failed to write %s\n", path);
+			failed++;
+			continue;
+		}
+
+		printf("%s: %zu instructions, %zu xrefs in %.2f s\n", path,
+		       index.GetInstructionCount(), index.GetXrefCount(), elapsed);
+	}
+
+	return failed ? 1 : 0;
+}
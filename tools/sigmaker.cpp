@@ -0,0 +1,313 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * Source Dedicated Server Wrapper for Mac OS X
+ * Copyright (C) 2011 Scott "DS" Ehlert.  All rights reserved.
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * sigmaker - Generates the shortest unique signature for a function
+ *
+ * Usage: sigmaker [-l index] [-m maxlen] <library> <symbol | 0xoffset>
+ *
+ * The function is decoded forward and relative branch targets, RIP-relative displacements and
+ * absolute addresses inside the library are replaced with wildcards, since those change between
+ * builds. Instructions are added until the pattern only matches once in the same memory that
+ * HSGameLib::FindPattern searches, and the result is then trimmed to the shortest unique prefix.
+ *
+ * With -l, the signature is extended to cover the given RIP-relative reference (counting from 0)
+ * so that it can be used to locate a global, and its offset within the signature is printed.
+ */
+
+#include "HSGameLib.h"
+#include "libudis86/udis86.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+// Wildcarded reference found in the signature
+struct SigRef
+{
+	size_t offset;		// Offset of the displacement within the signature
+	uintptr_t target;
+	bool data;			// RIP-relative or absolute data reference rather than a branch
+};
+
+static void Usage()
+{
+	printf("Usage: sigmaker [-l index] [-m maxlen] <library> <symbol | 0xoffset>\n");
+}
+
+// Number of immediate bytes at the end of the current instruction
+static size_t GetImmediateSize(ud_t *ud)
+{
+	const ud_operand_t *op;
+	size_t size = 0;
+
+	for (unsigned int i = 0; (op = ud_insn_opr(ud, i)) != NULL; i++)
+	{
+		if (op->type == UD_OP_IMM)
+			size += op->size / 8;
+	}
+
+	return size;
+}
+
+// Appends the current instruction to the signature, wildcarding anything that refers to an address
+static void AppendInstruction(ud_t *ud, uintptr_t base, size_t imageSize, std::vector<char> &sig,
+                              std::vector<SigRef> &refs)
+{
+	const uint8_t *bytes = ud_insn_ptr(ud);
+	size_t len = ud_insn_len(ud);
+	size_t start = sig.size();
+	size_t immSize = GetImmediateSize(ud);
+	uintptr_t next = ud_insn_off(ud) + len;
+	const ud_operand_t *op;
+
+	sig.insert(sig.end(), bytes, bytes + len);
+
+	for (unsigned int i = 0; (op = ud_insn_opr(ud, i)) != NULL; i++)
+	{
+		SigRef ref;
+
+		if (op->type == UD_OP_JIMM && op->size == 32)
+		{
+			ref.offset = start + len - 4;
+			ref.target = next + op->lval.sdword;
+			ref.data = false;
+		}
+		else if (op->type == UD_OP_MEM && op->base == UD_R_RIP && op->offset == 32)
+		{
+			ref.offset = start + len - immSize - 4;
+			ref.target = next + op->lval.sdword;
+			ref.data = true;
+		}
+		else if (op->type == UD_OP_MEM && op->base == UD_NONE && op->index == UD_NONE &&
+		         op->offset == 32)
+		{
+			ref.offset = start + len - immSize - 4;
+			ref.target = uintptr_t(intptr_t(op->lval.sdword));
+			ref.data = true;
+
+			// Absolute addresses are only relocated if they point into the library
+			if (ref.target < base || ref.target >= base + imageSize)
+				continue;
+		}
+#if !defined(PLATFORM_X64)
+		else if (op->type == UD_OP_IMM && op->size == 32 && op->lval.udword >= base &&
+		         op->lval.udword < base + imageSize)
+		{
+			ref.offset = start + len - 4;
+			ref.target = op->lval.udword;
+			ref.data = true;
+		}
+#endif
+		else
+		{
+			continue;
+		}
+
+		memset(&sig[ref.offset], '\x2A', 4);
+		refs.push_back(ref);
+	}
+}
+
+static void PrintSignature(const std::vector<char> &sig, size_t len)
+{
+	printf("\"");
+	for (size_t i = 0; i < len; i++)
+		printf("\\x%02X", (unsigned char)sig[i]);
+	printf("\"\n");
+}
+
+int main(int argc, char **argv)
+{
+	int locator = -1;
+	size_t maxLen = 256;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:m:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l':
+			locator = atoi(optarg);
+			break;
+		case 'm':
+			maxLen = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			Usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		Usage();
+		return 1;
+	}
+
+	const char *libName = argv[optind];
+	const char *funcName = argv[optind + 1];
+
+	HSGameLib lib(libName);
+	if (!lib.IsLoaded() || !lib.GetBase())
+	{
+		printf("Failed to load %s\n", libName);
+		return 1;
+	}
+
+	uintptr_t base = lib.GetBase();
+	size_t imageSize = lib.GetImageSize();
+	uintptr_t func;
+
+	if (strncmp(funcName, "0x", 2) == 0)
+	{
+		func = base + strtoull(funcName, NULL, 16);
+	}
+	else
+	{
+		SymbolInfo info;
+		const char *names[] = { funcName, nullptr };
+
+		memset(&info, 0, sizeof(info));
+		lib.ResolveHiddenSymbols(&info, names);
+		func = (uintptr_t)info.address;
+	}
+
+	if (!func || func < base || func >= base + imageSize)
+	{
+		printf("Failed to find %s in %s\n", funcName, lib.GetName().chars());
+		return 1;
+	}
+
+	ud_t ud;
+	ud_init(&ud);
+#if defined(PLATFORM_X64)
+	ud_set_mode(&ud, 64);
+#else
+	ud_set_mode(&ud, 32);
+#endif
+	ud_set_syntax(&ud, NULL);
+	ud_set_input_buffer(&ud, (const uint8_t *)func, base + imageSize - func);
+	ud_set_pc(&ud, func);
+
+	std::vector<char> sig;
+	std::vector<SigRef> refs;
+	size_t matches = 0;
+	size_t locatorEnd = 0;
+
+	// Grow the signature an instruction at a time until it is unique
+	while (sig.size() < maxLen && ud_disassemble(&ud))
+	{
+		if (ud_insn_mnemonic(&ud) == UD_Iinvalid)
+			break;
+
+		AppendInstruction(&ud, base, imageSize, sig, refs);
+
+		if (locator >= 0 && !locatorEnd)
+		{
+			int dataRefs = 0;
+			for (size_t i = 0; i < refs.size(); i++)
+			{
+				if (refs[i].data && dataRefs++ == locator)
+				{
+					locatorEnd = refs[i].offset + 4;
+					break;
+				}
+			}
+
+			if (!locatorEnd)
+				continue;
+		}
+
+		// Trailing wildcards never help make a signature unique
+		size_t len = sig.size();
+		while (len > 0 && sig[len - 1] == '\x2A')
+			len--;
+
+		if (len > 0 && (matches = lib.CountPattern(&sig[0], len, 2)) == 1)
+			break;
+	}
+
+	if (locator >= 0 && !locatorEnd)
+	{
+		printf("Function does not have RIP-relative reference #%d within %zu bytes\n", locator, maxLen);
+		return 1;
+	}
+
+	if (matches != 1)
+	{
+		printf("Failed to find a unique signature within %zu bytes\n", sig.size());
+		return 1;
+	}
+
+	// Then trim it back down to the shortest prefix that is still unique
+	size_t len = sig.size();
+	while (len > 1 && len - 1 >= locatorEnd)
+	{
+		size_t shorter = len - 1;
+		while (shorter > 0 && sig[shorter - 1] == '\x2A')
+			shorter--;
+
+		if (shorter < locatorEnd || shorter == 0 || lib.CountPattern(&sig[0], shorter, 2) != 1)
+			break;
+
+		len = shorter;
+	}
+
+	if (len < locatorEnd)
+		len = locatorEnd;
+
+	printf("%s+0x%lx (%zu bytes)\n\n", lib.GetName().chars(), (unsigned long)(func - base), len);
+
+	printf("Signature:\n\t");
+	PrintSignature(sig, len);
+
+#if defined(PLATFORM_MACOSX)
+	printf("\nGamedata:\n\t\"%s\"\t\t", sizeof(void *) == 8 ? "mac64" : "mac");
+#else
+	printf("\nGamedata:\n\t\"%s\"\t\t", sizeof(void *) == 8 ? "linux64" : "linux");
+#endif
+	PrintSignature(sig, len);
+
+	bool header = false;
+	int dataRefs = 0;
+	for (size_t i = 0; i < refs.size(); i++)
+	{
+		if (refs[i].offset + 4 > len)
+			break;
+
+		if (!refs[i].data)
+			continue;
+
+		if (!header)
+		{
+			printf("\nLocators:\n");
+			header = true;
+		}
+
+		printf("\t#%d: const int offset = %zu;\t// -> %s+0x%lx\n", dataRefs++, refs[i].offset,
+		       lib.GetName().chars(), (unsigned long)(refs[i].target - base));
+	}
+
+	return 0;
+}